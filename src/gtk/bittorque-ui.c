@@ -97,6 +97,34 @@ torrents_view_selection_func (GtkTreeSelection *selection G_GNUC_UNUSED,
 	return TRUE;
 }
 
+/* keeps a copy of the .torrent file so that it is restored at the next startup */
+static void
+bittorque_add_to_session (BtTorrent *torrent, const gchar *filename)
+{
+	GError *error = NULL;
+	gchar *contents = NULL, *name, *copy;
+	gsize len;
+
+	if (g_mkdir_with_parents (bittorque.session_dir, 0700) != 0) {
+		g_message (_("Error creating %s"), bittorque.session_dir);
+		return;
+	}
+
+	name = g_strconcat (bt_torrent_get_infohash_string (torrent), ".torrent", NULL);
+	copy = g_build_filename (bittorque.session_dir, name, NULL);
+
+	if (!g_file_test (copy, G_FILE_TEST_EXISTS)
+		&& (!g_file_get_contents (filename, &contents, &len, &error)
+		    || !g_file_set_contents (copy, contents, len, &error))) {
+		g_message (_("Error saving torrent: %s"), error->message);
+		g_clear_error (&error);
+	}
+
+	g_free (contents);
+	g_free (name);
+	g_free (copy);
+}
+
 void
 bittorque_open_torrent ()
 {
@@ -127,8 +155,18 @@ bittorque_open_torrent ()
 		filename = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER (chooser));
 		
 		torrent = bt_torrent_new (bittorque.manager, filename, &error);
+
+		if (torrent == NULL) {
+			g_warning ("could not open torrent: %s", error->message);
+			g_clear_error (&error);
+			g_free (filename);
+			gtk_widget_destroy (chooser);
+			return;
+		}
 		
 		bt_manager_add_torrent (bittorque.manager, torrent);
+
+		bittorque_add_to_session (torrent, filename);
 		
 		gtk_list_store_append (bittorque.torrents_list, &iter);
 		
@@ -34,6 +34,7 @@
 
 static gchar *bittorque_private_dir = NULL;
 static guint  bittorque_local_port = 6881;
+static gint   bittorque_network_threads = 0;
 
 static const GOptionEntry bittorque_option_entries[] = {
 	{"private-directory", 0, 0,
@@ -48,6 +49,12 @@ static const GOptionEntry bittorque_option_entries[] = {
 	 N_("Use this as the default port for incoming connections"),
 	 NULL},
 
+	{"network-threads", 0, 0,
+	 G_OPTION_ARG_INT,
+	 &bittorque_network_threads,
+	 N_("Run peer connections on this many threads, or 0 to run them with the interface"),
+	 N_("N")},
+
 	{NULL, 0, 0, 0, NULL, NULL, NULL}
 };
 
@@ -181,6 +188,42 @@ bittorque_open_config_file (gchar **filename)
 	return config;
 }
 
+static void
+bittorque_restore_session ()
+{
+	BtManagerRestoreStats stats;
+	GError *error = NULL;
+	GList *torrents, *i;
+	GtkTreeIter iter;
+
+	if (bittorque_private_dir != NULL)
+		bittorque.session_dir = g_build_filename (bittorque_private_dir, "torrents", NULL);
+	else
+		bittorque.session_dir = g_build_filename (g_get_user_config_dir (), "bittorque", "torrents", NULL);
+
+	bittorque.resume_file = g_build_filename (bittorque.session_dir, "resume", NULL);
+
+	if (!g_file_test (bittorque.session_dir, G_FILE_TEST_IS_DIR))
+		return;
+
+	if (!bt_manager_restore_session (bittorque.manager, bittorque.session_dir, bittorque.resume_file, &stats, &error)) {
+		g_message (_("Error restoring torrents: %s"), error->message);
+		g_clear_error (&error);
+		return;
+	}
+
+	g_message (_("Restored %u torrents in %.2f seconds"), stats.added, stats.total_time);
+
+	torrents = bt_manager_get_torrents (bittorque.manager);
+
+	for (i = torrents; i != NULL; i = i->next) {
+		gtk_list_store_append (bittorque.torrents_list, &iter);
+		gtk_list_store_set (bittorque.torrents_list, &iter, 0, i->data, -1);
+	}
+
+	g_list_free (torrents);
+}
+
 static GtkBuilder *
 bittorque_open_ui ()
 {
@@ -320,12 +363,24 @@ main (int argc, char *argv[])
 
 //	g_object_unref (builder);
 
-	bittorque.manager = g_object_new (BT_TYPE_MANAGER, "port", bittorque_local_port, NULL);
+	bittorque.manager = g_object_new (BT_TYPE_MANAGER,
+	                                  "port", bittorque_local_port,
+	                                  "shards", (guint) CLAMP (bittorque_network_threads, 0, 64),
+	                                  NULL);
 
 	if (!bt_manager_start_accepting (bittorque.manager, &error)) {
 		g_warning ("could not start listening on port");
+		g_clear_error (&error);
 	}
 
+	/* the DHT fills up from the nodes our peers tell us about */
+	if (!bt_manager_start_dht (bittorque.manager, &error)) {
+		g_warning ("could not start the DHT: %s", error->message);
+		g_clear_error (&error);
+	}
+
+	bittorque_restore_session ();
+
 	bittorque.status_icon = gtk_status_icon_new ();
 
 	gtk_status_icon_set_from_icon_name (bittorque.status_icon, "bittorque"); /*bittorque_icon_from_size (gtk_status_icon_get_size (bittorque.status_icon), NULL));*/
@@ -338,6 +393,12 @@ main (int argc, char *argv[])
 
 	gtk_main ();
 
+	if (g_file_test (bittorque.session_dir, G_FILE_TEST_IS_DIR)
+		&& !bt_manager_save_resume_data (bittorque.manager, bittorque.resume_file, &error)) {
+		g_message (_("Error saving resume data: %s"), error->message);
+		g_clear_error (&error);
+	}
+
 	gtk_list_store_clear (bittorque.torrents_list);
 
 	g_object_unref (bittorque.manager);
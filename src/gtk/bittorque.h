@@ -56,6 +56,11 @@ typedef struct {
 
 	gchar         *config_file;
 
+	/* copies of the open .torrent files, restored at startup */
+	gchar         *session_dir;
+
+	gchar         *resume_file;
+
 	GKeyFile      *default_config;
 } BittorqueApp;
 
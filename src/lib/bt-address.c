@@ -0,0 +1,217 @@
+/**
+ * bt-address.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "bt-address.h"
+
+/**
+ * bt_address_set_bytes:
+ * @address: the address to set
+ * @bytes: 4 or 16 bytes of address in network order
+ * @length: the number of bytes
+ * @port: the port, in host order
+ *
+ * Sets an address from raw bytes, as in the compact peer lists of trackers.
+ */
+void
+bt_address_set_bytes (BtAddress *address, const gchar *bytes, guint length, guint16 port)
+{
+	g_return_if_fail (address != NULL);
+	g_return_if_fail (length == 4 || length == 16);
+
+	memset (address, 0, sizeof (BtAddress));
+	memcpy (address->bytes, bytes, length);
+	address->length = length;
+	address->port = port;
+}
+
+/**
+ * bt_address_set_inetaddr:
+ * @address: the address to set
+ * @inetaddr: a #GInetAddr
+ *
+ * Sets an address from a #GInetAddr.
+ */
+void
+bt_address_set_inetaddr (BtAddress *address, const GInetAddr *inetaddr)
+{
+	g_return_if_fail (address != NULL);
+	g_return_if_fail (inetaddr != NULL);
+
+	memset (address, 0, sizeof (BtAddress));
+	address->length = gnet_inetaddr_get_length (inetaddr) == 4 ? 4 : 16;
+	address->port = gnet_inetaddr_get_port (inetaddr);
+	gnet_inetaddr_get_bytes (inetaddr, (gchar *) address->bytes);
+}
+
+/**
+ * bt_address_to_inetaddr:
+ * @address: the address
+ *
+ * Returns: a new #GInetAddr for the address, to be unreferenced with
+ *   gnet_inetaddr_unref ()
+ */
+GInetAddr *
+bt_address_to_inetaddr (const BtAddress *address)
+{
+	GInetAddr *inetaddr;
+
+	g_return_val_if_fail (address != NULL, NULL);
+	g_return_val_if_fail (address->length != 0, NULL);
+
+	inetaddr = gnet_inetaddr_new_bytes ((const gchar *) address->bytes, address->length);
+	gnet_inetaddr_set_port (inetaddr, address->port);
+
+	return inetaddr;
+}
+
+/**
+ * bt_address_to_sockaddr:
+ * @address: the address
+ * @sa: the socket address to fill in
+ *
+ * Returns: the length of the socket address
+ */
+gsize
+bt_address_to_sockaddr (const BtAddress *address, struct sockaddr_storage *sa)
+{
+	g_return_val_if_fail (address != NULL, 0);
+	g_return_val_if_fail (sa != NULL, 0);
+
+	memset (sa, 0, sizeof (struct sockaddr_storage));
+
+	if (address->length == 4) {
+		struct sockaddr_in *sin = (struct sockaddr_in *) sa;
+
+		sin->sin_family = AF_INET;
+		sin->sin_port = g_htons (address->port);
+		memcpy (&sin->sin_addr, address->bytes, 4);
+
+		return sizeof (struct sockaddr_in);
+	} else {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) sa;
+
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = g_htons (address->port);
+		memcpy (&sin6->sin6_addr, address->bytes, 16);
+
+		return sizeof (struct sockaddr_in6);
+	}
+}
+
+/**
+ * bt_address_set_sockaddr:
+ * @address: the address to set
+ * @sa: an IPv4 or IPv6 socket address, like one from recvfrom ()
+ *
+ * Sets an address from a socket address.
+ *
+ * Returns: FALSE if the socket address is of another family
+ */
+gboolean
+bt_address_set_sockaddr (BtAddress *address, const struct sockaddr_storage *sa)
+{
+	g_return_val_if_fail (address != NULL, FALSE);
+	g_return_val_if_fail (sa != NULL, FALSE);
+
+	if (sa->ss_family == AF_INET) {
+		const struct sockaddr_in *sin = (const struct sockaddr_in *) sa;
+
+		bt_address_set_bytes (address, (const gchar *) &sin->sin_addr, 4, g_ntohs (sin->sin_port));
+		return TRUE;
+	}
+
+	if (sa->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) sa;
+
+		bt_address_set_bytes (address, (const gchar *) &sin6->sin6_addr, 16, g_ntohs (sin6->sin6_port));
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * bt_address_to_string:
+ * @address: the address
+ *
+ * Formats an address and its port numerically, like 192.0.2.1:6881 or
+ * [2001:db8:0:0:0:0:0:1]:6881. This never asks a resolver.
+ *
+ * Returns: a newly-allocated string
+ */
+gchar *
+bt_address_to_string (const BtAddress *address)
+{
+	const guint8 *b;
+
+	g_return_val_if_fail (address != NULL, NULL);
+
+	b = address->bytes;
+
+	if (address->length == 4)
+		return g_strdup_printf ("%u.%u.%u.%u:%u", b[0], b[1], b[2], b[3], address->port);
+
+	return g_strdup_printf ("[%x:%x:%x:%x:%x:%x:%x:%x]:%u",
+	                        b[0] << 8 | b[1], b[2] << 8 | b[3], b[4] << 8 | b[5], b[6] << 8 | b[7],
+	                        b[8] << 8 | b[9], b[10] << 8 | b[11], b[12] << 8 | b[13], b[14] << 8 | b[15],
+	                        address->port);
+}
+
+/**
+ * bt_address_hash:
+ * @address: a #BtAddress
+ *
+ * Hashes an address and port, for hash tables keyed by #BtAddress.
+ *
+ * Returns: the hash
+ */
+guint
+bt_address_hash (gconstpointer address)
+{
+	const BtAddress *a = (const BtAddress *) address;
+	guint hash = a->port;
+	guint i;
+
+	for (i = 0; i < a->length; i++)
+		hash = hash * 31 + a->bytes[i];
+
+	return hash;
+}
+
+/**
+ * bt_address_equal:
+ * @a: a #BtAddress
+ * @b: another #BtAddress
+ *
+ * Returns: whether the addresses and ports are the same
+ */
+gboolean
+bt_address_equal (gconstpointer a, gconstpointer b)
+{
+	const BtAddress *x = (const BtAddress *) a;
+	const BtAddress *y = (const BtAddress *) b;
+
+	return x->port == y->port && x->length == y->length && memcmp (x->bytes, y->bytes, x->length) == 0;
+}
@@ -0,0 +1,65 @@
+/**
+ * bt-address.h
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __BT_ADDRESS_H__
+#define __BT_ADDRESS_H__
+
+#include <glib.h>
+#include <gnet.h>
+
+G_BEGIN_DECLS
+
+struct sockaddr_storage;
+
+/**
+ * BtAddress:
+ * @bytes: the address in network order; only the first @length bytes are used
+ * @port: the port, in host order
+ * @length: 4 for IPv4, 16 for IPv6, or 0 for no address
+ *
+ * An IP address and port, kept inline where a #GInetAddr would take a
+ * separate allocation with a whole socket address in it. It can be copied
+ * by value.
+ */
+typedef struct {
+	guint8  bytes[16];
+	guint16 port;
+	guint8  length;
+} BtAddress;
+
+void       bt_address_set_bytes (BtAddress *address, const gchar *bytes, guint length, guint16 port);
+
+void       bt_address_set_inetaddr (BtAddress *address, const GInetAddr *inetaddr);
+
+GInetAddr *bt_address_to_inetaddr (const BtAddress *address);
+
+gsize      bt_address_to_sockaddr (const BtAddress *address, struct sockaddr_storage *sa);
+
+gboolean   bt_address_set_sockaddr (BtAddress *address, const struct sockaddr_storage *sa);
+
+gchar     *bt_address_to_string (const BtAddress *address);
+
+guint      bt_address_hash (gconstpointer address);
+
+gboolean   bt_address_equal (gconstpointer a, gconstpointer b);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,436 @@
+/**
+ * bt-bencode-parser.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#include "bt-bencode.h"
+#include "bt-bencode-parser.h"
+
+/* error text for encoding problems */
+#define BT_BENCODE_ERROR_TEXT "syntax error in bencoded dict: %s"
+
+/* what each open container on the stack is waiting for */
+#define BT_BENCODE_PARSER_LIST       'l'
+#define BT_BENCODE_PARSER_DICT_KEY   'd'
+#define BT_BENCODE_PARSER_DICT_VALUE 'v'
+
+typedef enum {
+	BT_BENCODE_PARSER_STATE_VALUE,
+	BT_BENCODE_PARSER_STATE_INT,
+	BT_BENCODE_PARSER_STATE_STRING_LENGTH,
+	BT_BENCODE_PARSER_STATE_STRING,
+	BT_BENCODE_PARSER_STATE_DONE,
+	BT_BENCODE_PARSER_STATE_ERROR
+} BtBencodeParserState;
+
+struct _BtBencodeParseContext {
+	const BtBencodeParser *parser;
+	gpointer               user_data;
+
+	guint                  max_depth;
+	gsize                  max_size;
+
+	BtBencodeParserState   state;
+
+	/* one byte per open list or dictionary, innermost last */
+	GByteArray            *stack;
+
+	/* number of bytes consumed so far, and where the element being parsed started */
+	gsize                  offset;
+	gsize                  element_offset;
+
+	/* integer or string length being parsed */
+	guint64                number;
+	guint                  digits;
+	gboolean               negative;
+
+	/* string being parsed, only buffered if it is split between chunks */
+	gboolean               is_key;
+	gsize                  remaining;
+	GString               *buffer;
+};
+
+/**
+ * bt_bencode_parse_context_new:
+ * @parser: the callbacks to call
+ * @max_depth: how deeply lists and dictionaries may be nested, or 0 for %BT_BENCODE_PARSER_DEFAULT_MAX_DEPTH
+ * @max_size: the most bytes a single value may span, or 0 for no limit
+ * @user_data: data to pass to the callbacks
+ *
+ * Creates a context to parse one BEncoded value with. The input can be fed to
+ * it in chunks of any size through bt_bencode_parse_context_parse(), so nothing
+ * needs to be buffered up front, and nesting is tracked on an explicit stack so
+ * deeply nested input cannot overflow the C stack.
+ *
+ * Returns: a new parse context
+ */
+BtBencodeParseContext *
+bt_bencode_parse_context_new (const BtBencodeParser *parser, guint max_depth, gsize max_size, gpointer user_data)
+{
+	BtBencodeParseContext *context;
+
+	g_return_val_if_fail (parser != NULL, NULL);
+
+	context = g_slice_new0 (BtBencodeParseContext);
+	context->parser = parser;
+	context->user_data = user_data;
+	context->max_depth = max_depth > 0 ? max_depth : BT_BENCODE_PARSER_DEFAULT_MAX_DEPTH;
+	context->max_size = max_size;
+	context->state = BT_BENCODE_PARSER_STATE_VALUE;
+	context->stack = g_byte_array_new ();
+	context->buffer = g_string_new (NULL);
+
+	return context;
+}
+
+/**
+ * bt_bencode_parse_context_free:
+ * @context: the parse context
+ *
+ * Frees the parse context.
+ */
+void
+bt_bencode_parse_context_free (BtBencodeParseContext *context)
+{
+	g_return_if_fail (context != NULL);
+
+	g_byte_array_free (context->stack, TRUE);
+	g_string_free (context->buffer, TRUE);
+
+	g_slice_free (BtBencodeParseContext, context);
+}
+
+static gboolean
+bt_bencode_parse_context_fail (BtBencodeParseContext *context, gint code, const gchar *reason, GError **error)
+{
+	context->state = BT_BENCODE_PARSER_STATE_ERROR;
+	g_set_error (error, BT_BENCODE_ERROR, code, BT_BENCODE_ERROR_TEXT, reason);
+	return FALSE;
+}
+
+/* a value was completed, so work out what comes next */
+static void
+bt_bencode_parse_context_value_done (BtBencodeParseContext *context)
+{
+	guint8 *top;
+
+	context->state = BT_BENCODE_PARSER_STATE_VALUE;
+
+	if (context->stack->len == 0) {
+		context->state = BT_BENCODE_PARSER_STATE_DONE;
+		return;
+	}
+
+	top = &context->stack->data[context->stack->len - 1];
+
+	if (*top == BT_BENCODE_PARSER_DICT_KEY)
+		*top = BT_BENCODE_PARSER_DICT_VALUE;
+	else if (*top == BT_BENCODE_PARSER_DICT_VALUE)
+		*top = BT_BENCODE_PARSER_DICT_KEY;
+}
+
+static void
+bt_bencode_parse_context_emit_string (BtBencodeParseContext *context, const gchar *str, gsize len, GError **error)
+{
+	if (context->is_key) {
+		if (context->parser->key)
+			context->parser->key (context, str, len, context->user_data, error);
+	} else {
+		if (context->parser->string)
+			context->parser->string (context, str, len, context->user_data, error);
+	}
+}
+
+/**
+ * bt_bencode_parse_context_parse:
+ * @context: the parse context
+ * @text: the next chunk of input
+ * @len: the length of the chunk
+ * @consumed: return location for the number of bytes used, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Parses the next chunk of BEncoded input, calling the callbacks as elements are
+ * found. Parsing stops at the end of the value; if @consumed is given it is set
+ * to the number of bytes of @text that belonged to the value, so anything that
+ * follows it (like the payload of a peer message) can be handled by the caller.
+ * Without @consumed, trailing input is an error.
+ *
+ * Returns: %FALSE if an error occurred, in which case the context can't be used anymore
+ */
+gboolean
+bt_bencode_parse_context_parse (BtBencodeParseContext *context, const gchar *text, gsize len, gsize *consumed, GError **error)
+{
+	const gchar *p, *end;
+	GError *tmp_error = NULL;
+	gsize limit;
+
+	g_return_val_if_fail (context != NULL, FALSE);
+	g_return_val_if_fail (text != NULL || len == 0, FALSE);
+	g_return_val_if_fail (context->state != BT_BENCODE_PARSER_STATE_ERROR, FALSE);
+
+	/* never look further than the size limit allows */
+	limit = len;
+
+	if (context->max_size > 0 && context->max_size - context->offset < len)
+		limit = context->max_size - context->offset;
+
+	p = text;
+	end = text + limit;
+
+	while (p < end && context->state != BT_BENCODE_PARSER_STATE_DONE) {
+		switch (context->state) {
+		case BT_BENCODE_PARSER_STATE_VALUE: {
+			guint8 top = context->stack->len > 0 ? context->stack->data[context->stack->len - 1] : 0;
+
+			context->element_offset = context->offset + (p - text);
+
+			if (*p == 'e' && (top == BT_BENCODE_PARSER_LIST || top == BT_BENCODE_PARSER_DICT_KEY)) {
+
+				/* the innermost list or dictionary is finished */
+				g_byte_array_set_size (context->stack, context->stack->len - 1);
+				p++;
+
+				if (context->parser->end)
+					context->parser->end (context, context->user_data, &tmp_error);
+
+				bt_bencode_parse_context_value_done (context);
+
+			} else if (top == BT_BENCODE_PARSER_DICT_KEY && !g_ascii_isdigit (*p)) {
+
+				return bt_bencode_parse_context_fail (context, BT_BENCODE_ERROR_INVALID, "key must be string", error);
+
+			} else if (*p == 'i') {
+
+				/* integers are encoded like this: 'i12345e' */
+				context->state = BT_BENCODE_PARSER_STATE_INT;
+				context->number = 0;
+				context->digits = 0;
+				context->negative = FALSE;
+				p++;
+
+			} else if (g_ascii_isdigit (*p)) {
+
+				/* strings are encoded like this: '15:abcdefghijklmno' */
+				context->state = BT_BENCODE_PARSER_STATE_STRING_LENGTH;
+				context->is_key = top == BT_BENCODE_PARSER_DICT_KEY;
+				context->number = 0;
+				context->digits = 0;
+
+			} else if (*p == 'd' || *p == 'l') {
+
+				/* dictionaries are like so: 'd(bencodedkey)(bencodedval)(key)(val)...e'
+				 * ...and lists are like this: 'l(bencodeditem)(item)(item)...e' */
+				guint8 type = *p == 'd' ? BT_BENCODE_PARSER_DICT_KEY : BT_BENCODE_PARSER_LIST;
+
+				if (context->stack->len >= context->max_depth)
+					return bt_bencode_parse_context_fail (context, BT_BENCODE_ERROR_LIMIT, "nested too deeply", error);
+
+				g_byte_array_append (context->stack, &type, 1);
+				p++;
+
+				if (type == BT_BENCODE_PARSER_DICT_KEY) {
+					if (context->parser->start_dict)
+						context->parser->start_dict (context, context->user_data, &tmp_error);
+				} else {
+					if (context->parser->start_list)
+						context->parser->start_list (context, context->user_data, &tmp_error);
+				}
+
+			} else {
+				return bt_bencode_parse_context_fail (context, BT_BENCODE_ERROR_INVALID, "unknown element", error);
+			}
+
+			break;
+		}
+
+		case BT_BENCODE_PARSER_STATE_INT:
+			if (g_ascii_isdigit (*p)) {
+				guint64 limit = (guint64) G_MAXINT64 + (context->negative ? 1 : 0);
+
+				/* checked before multiplying, which could wrap around */
+				if (context->number > (limit - (*p - '0')) / 10)
+					return bt_bencode_parse_context_fail (context, BT_BENCODE_ERROR_INVALID, "invalid integer", error);
+
+				context->number = context->number * 10 + (*p - '0');
+				context->digits++;
+			} else if (*p == '-' && context->digits == 0 && !context->negative) {
+				context->negative = TRUE;
+			} else if (*p == 'e' && context->digits > 0) {
+				gint64 value = context->negative ? (gint64) -context->number : (gint64) context->number;
+
+				if (context->parser->integer)
+					context->parser->integer (context, value, context->user_data, &tmp_error);
+
+				bt_bencode_parse_context_value_done (context);
+			} else {
+				return bt_bencode_parse_context_fail (context, BT_BENCODE_ERROR_INVALID, "invalid integer", error);
+			}
+
+			p++;
+			break;
+
+		case BT_BENCODE_PARSER_STATE_STRING_LENGTH:
+			if (g_ascii_isdigit (*p)) {
+				if (context->number > ((guint64) G_MAXINT64 - (*p - '0')) / 10)
+					return bt_bencode_parse_context_fail (context, BT_BENCODE_ERROR_INVALID, "invalid string", error);
+
+				context->number = context->number * 10 + (*p - '0');
+				context->digits++;
+
+				p++;
+				break;
+			}
+
+			if (*p != ':' || context->digits == 0)
+				return bt_bencode_parse_context_fail (context, BT_BENCODE_ERROR_INVALID, "invalid string", error);
+
+			p++;
+
+			if (context->max_size > 0 && context->number > context->max_size)
+				return bt_bencode_parse_context_fail (context, BT_BENCODE_ERROR_LIMIT, "too large", error);
+
+			if (context->number <= (guint64) (end - p)) {
+				/* the whole string is in this chunk, so it's passed on without copying */
+				const gchar *str = p;
+
+				p += context->number;
+				bt_bencode_parse_context_emit_string (context, str, context->number, &tmp_error);
+				bt_bencode_parse_context_value_done (context);
+			} else {
+				context->state = BT_BENCODE_PARSER_STATE_STRING;
+				context->remaining = context->number;
+				g_string_truncate (context->buffer, 0);
+			}
+
+			break;
+
+		case BT_BENCODE_PARSER_STATE_STRING: {
+			gsize n = MIN (context->remaining, (gsize) (end - p));
+
+			g_string_append_len (context->buffer, p, n);
+			context->remaining -= n;
+			p += n;
+
+			if (context->remaining == 0) {
+				bt_bencode_parse_context_emit_string (context, context->buffer->str, context->buffer->len, &tmp_error);
+				bt_bencode_parse_context_value_done (context);
+			}
+
+			break;
+		}
+
+		default:
+			g_assert_not_reached ();
+		}
+
+		if (tmp_error != NULL) {
+			context->state = BT_BENCODE_PARSER_STATE_ERROR;
+			g_propagate_error (error, tmp_error);
+			return FALSE;
+		}
+	}
+
+	context->offset += p - text;
+
+	if (context->state != BT_BENCODE_PARSER_STATE_DONE) {
+		if (limit < len)
+			return bt_bencode_parse_context_fail (context, BT_BENCODE_ERROR_LIMIT, "too large", error);
+
+		if (consumed)
+			*consumed = len;
+
+		return TRUE;
+	}
+
+	if (consumed)
+		*consumed = p - text;
+	else if (p != text + len)
+		return bt_bencode_parse_context_fail (context, BT_BENCODE_ERROR_INVALID, "leftover or not enough characters", error);
+
+	return TRUE;
+}
+
+/**
+ * bt_bencode_parse_context_end_parse:
+ * @context: the parse context
+ * @error: return location for a #GError, or %NULL
+ *
+ * Signals that there is no more input.
+ *
+ * Returns: %TRUE if a complete value was parsed
+ */
+gboolean
+bt_bencode_parse_context_end_parse (BtBencodeParseContext *context, GError **error)
+{
+	g_return_val_if_fail (context != NULL, FALSE);
+	g_return_val_if_fail (context->state != BT_BENCODE_PARSER_STATE_ERROR, FALSE);
+
+	if (context->state != BT_BENCODE_PARSER_STATE_DONE)
+		return bt_bencode_parse_context_fail (context, BT_BENCODE_ERROR_INVALID, "unexpected EOF", error);
+
+	return TRUE;
+}
+
+/**
+ * bt_bencode_parse_context_is_complete:
+ * @context: the parse context
+ *
+ * Returns: whether a complete value has been parsed
+ */
+gboolean
+bt_bencode_parse_context_is_complete (BtBencodeParseContext *context)
+{
+	g_return_val_if_fail (context != NULL, FALSE);
+
+	return context->state == BT_BENCODE_PARSER_STATE_DONE;
+}
+
+/**
+ * bt_bencode_parse_context_get_offset:
+ * @context: the parse context
+ *
+ * Gets the position in the input of the element being reported, counted from
+ * the start of the first chunk. In the @end callback this is the position of
+ * the closing 'e'. Only meaningful from within a callback.
+ *
+ * Returns: the offset of the element
+ */
+gsize
+bt_bencode_parse_context_get_offset (BtBencodeParseContext *context)
+{
+	g_return_val_if_fail (context != NULL, 0);
+
+	return context->element_offset;
+}
+
+/**
+ * bt_bencode_parse_context_get_depth:
+ * @context: the parse context
+ *
+ * Returns: the number of lists and dictionaries that are currently open
+ */
+guint
+bt_bencode_parse_context_get_depth (BtBencodeParseContext *context)
+{
+	g_return_val_if_fail (context != NULL, 0);
+
+	return context->stack->len;
+}
@@ -0,0 +1,80 @@
+/**
+ * bt-bencode-parser.h
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __BT_BENCODE_PARSER_H__
+#define __BT_BENCODE_PARSER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * BT_BENCODE_PARSER_DEFAULT_MAX_DEPTH:
+ *
+ * How deeply lists and dictionaries may be nested unless told otherwise. Nothing
+ * BitTorrent sends comes anywhere near this.
+ */
+#define BT_BENCODE_PARSER_DEFAULT_MAX_DEPTH 64
+
+typedef struct _BtBencodeParseContext BtBencodeParseContext;
+
+/**
+ * BtBencodeParser:
+ * @start_dict: called when a dictionary starts
+ * @start_list: called when a list starts
+ * @end: called when the innermost open dictionary or list ends
+ * @key: called for each key of a dictionary, before its value
+ * @string: called for each string that is not a dictionary key
+ * @integer: called for each integer
+ *
+ * Callbacks for the events a #BtBencodeParseContext reports while it parses,
+ * much like #GMarkupParser. Any of them may be %NULL. A callback can stop the
+ * parse by setting @error.
+ *
+ * The bytes passed to @key and @string are only valid during the call: they
+ * point either into the chunk being parsed or, for strings that were split
+ * between chunks, into a buffer owned by the context.
+ */
+typedef struct {
+	void (*start_dict) (BtBencodeParseContext *context, gpointer user_data, GError **error);
+	void (*start_list) (BtBencodeParseContext *context, gpointer user_data, GError **error);
+	void (*end)        (BtBencodeParseContext *context, gpointer user_data, GError **error);
+	void (*key)        (BtBencodeParseContext *context, const gchar *str, gsize len, gpointer user_data, GError **error);
+	void (*string)     (BtBencodeParseContext *context, const gchar *str, gsize len, gpointer user_data, GError **error);
+	void (*integer)    (BtBencodeParseContext *context, gint64 value, gpointer user_data, GError **error);
+} BtBencodeParser;
+
+BtBencodeParseContext *bt_bencode_parse_context_new (const BtBencodeParser *parser, guint max_depth, gsize max_size, gpointer user_data);
+
+void                   bt_bencode_parse_context_free (BtBencodeParseContext *context);
+
+gboolean               bt_bencode_parse_context_parse (BtBencodeParseContext *context, const gchar *text, gsize len, gsize *consumed, GError **error);
+
+gboolean               bt_bencode_parse_context_end_parse (BtBencodeParseContext *context, GError **error);
+
+gboolean               bt_bencode_parse_context_is_complete (BtBencodeParseContext *context);
+
+gsize                  bt_bencode_parse_context_get_offset (BtBencodeParseContext *context);
+
+guint                  bt_bencode_parse_context_get_depth (BtBencodeParseContext *context);
+
+G_END_DECLS
+
+#endif
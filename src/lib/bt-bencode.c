@@ -23,178 +23,595 @@
 #include <glib.h>
 
 #include "bt-bencode.h"
+#include "bt-bencode-parser.h"
 
-/* error text for encoding problems */
-#define BT_BENCODE_ERROR_TEXT "syntax error in bencoded dict: %s"
+/* smallest and largest chunk the arena grabs from the allocator at once */
+#define BT_BENCODE_ARENA_MIN_CHUNK 4096
+#define BT_BENCODE_ARENA_MAX_CHUNK (1024 * 1024)
 
-static GString *_bt_bencode_encode (BtBencode *data, GString **string);
+/* round up to the alignment required for gint64 and pointers */
+#define BT_BENCODE_ARENA_ALIGN(size) (((size) + 7) & ~((gsize) 7))
 
-static BtBencode *
-_bt_bencode_decode (const gchar *buf, const gchar **end, const gchar *max, GError **error)
+typedef struct _BtBencodeArenaChunk BtBencodeArenaChunk;
+
+struct _BtBencodeArenaChunk {
+	BtBencodeArenaChunk *next;
+	gsize                size;
+	gsize                used;
+};
+
+struct _BtBencodeArena {
+	/* the chunk currently being allocated from is always first */
+	BtBencodeArenaChunk *chunks;
+
+	/* size of the next chunk to allocate */
+	gsize                next_size;
+};
+
+/* a document owns the arena its tree was decoded into, see bt_bencode_decode */
+typedef struct {
+	BtBencodeArena *arena;
+	BtBencode       root;
+} BtBencodeDocument;
+
+/* a list or dictionary that is still being decoded */
+typedef struct {
+	BtBencodeType   type;
+
+	/* where its items or entries start in the decoder's scratch arrays */
+	guint           base;
+	gboolean        sorted;
+
+	/* where it starts in the input */
+	gsize           offset;
+
+	/* key of the dictionary value being decoded */
+	BtBencodeString key;
+} BtBencodeDecoderFrame;
+
+struct _BtBencodeDecoder {
+	BtBencodeArena        *arena;
+	BtBencodeParseContext *context;
+
+	/* strings are copied into the arena unless they point into a buffer that outlives the tree */
+	gboolean               copy_strings;
+	const gchar           *input;
+
+	/* the open lists and dictionaries, innermost last */
+	GArray                *frames;
+
+	/* items and entries of the open containers, copied into the arena in one
+	 * piece once a container is complete */
+	GArray                *items;
+	GArray                *entries;
+
+	BtBencode              root;
+};
+
+/* output of bt_bencode_write is collected in a buffer of this size before being passed on */
+#define BT_BENCODE_WRITER_BUFFER_SIZE 4096
+
+typedef struct {
+	BtBencodeWriteFunc func;
+	gpointer           user_data;
+	GError           **error;
+	gboolean           failed;
+
+	gsize              len;
+	gchar              buf[BT_BENCODE_WRITER_BUFFER_SIZE];
+} BtBencodeWriter;
+
+static BtBencodeArenaChunk *
+bt_bencode_arena_add_chunk (BtBencodeArena *arena, gsize size, gsize request)
 {
-	BtBencode   *data = NULL;
-	const gchar *tmp  = NULL;
+	BtBencodeArenaChunk *chunk;
+	gsize header = BT_BENCODE_ARENA_ALIGN (sizeof (BtBencodeArenaChunk));
 
-	if (end == NULL)
-		end = &tmp;
+	chunk = g_malloc (header + size);
+	chunk->size = size;
+	chunk->used = 0;
 
-	if (*buf == 'i') {
+	if (arena->chunks != NULL && size - request <= arena->chunks->size - arena->chunks->used) {
+		/* keep allocating from the current chunk if it has more room left */
+		chunk->next = arena->chunks->next;
+		arena->chunks->next = chunk;
+	} else {
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
 
-		/* integers are encoded like this: 'i12345e' */
-		gint64 i = g_ascii_strtoll (buf + 1, (char **) end, 10);
+	return chunk;
+}
 
-		if (*end == buf + 1 || **end != 'e' || *end >= max) {
-			g_set_error (error, BT_BENCODE_ERROR, BT_BENCODE_ERROR_INVALID, BT_BENCODE_ERROR_TEXT, "invalid integer");
-			return NULL;
-		}
+/**
+ * bt_bencode_arena_new:
+ * @size_hint: the expected number of bytes that will be allocated, or 0
+ *
+ * Creates a new arena to decode BEncoded data into. Every node is allocated from
+ * large chunks that are all released at once by bt_bencode_arena_free().
+ *
+ * Returns: the new arena
+ */
+BtBencodeArena *
+bt_bencode_arena_new (gsize size_hint)
+{
+	BtBencodeArena *arena;
 
-		(*end)++;
+	arena = g_slice_new0 (BtBencodeArena);
+	arena->next_size = CLAMP (BT_BENCODE_ARENA_ALIGN (size_hint), BT_BENCODE_ARENA_MIN_CHUNK, BT_BENCODE_ARENA_MAX_CHUNK);
 
-		data = g_slice_new0 (BtBencode);
-		data->type = BT_BENCODE_TYPE_INT;
-		data->value = i;
-		return data;
+	return arena;
+}
 
-	} else if (g_ascii_isdigit (*buf)) {
+/**
+ * bt_bencode_arena_free:
+ * @arena: the arena
+ *
+ * Frees the arena together with every #BtBencode that was decoded into it.
+ */
+void
+bt_bencode_arena_free (BtBencodeArena *arena)
+{
+	BtBencodeArenaChunk *chunk, *next;
 
-		/* strings are encoded like this: '15:abcdefghijklmno' */
-		gint len = strtol (buf, (gchar **) end, 10);
+	g_return_if_fail (arena != NULL);
 
-		if (*end + len + 1 >= max) {
-			g_set_error (error, BT_BENCODE_ERROR, BT_BENCODE_ERROR_INVALID, BT_BENCODE_ERROR_TEXT, "unexpected EOF");
-			return NULL;
-		}
+	for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		g_free (chunk);
+	}
+
+	g_slice_free (BtBencodeArena, arena);
+}
+
+/**
+ * bt_bencode_arena_alloc:
+ * @arena: the arena
+ * @size: the number of bytes to allocate
+ *
+ * Allocates memory from the arena. The memory is not initialized and cannot be
+ * freed on its own.
+ *
+ * Returns: a pointer to @size bytes, suitably aligned for any #BtBencode node
+ */
+gpointer
+bt_bencode_arena_alloc (BtBencodeArena *arena, gsize size)
+{
+	BtBencodeArenaChunk *chunk;
+	gpointer mem;
+
+	g_return_val_if_fail (arena != NULL, NULL);
 
-		if (**end != ':') {
-			g_set_error (error, BT_BENCODE_ERROR, BT_BENCODE_ERROR_INVALID, BT_BENCODE_ERROR_TEXT, "invalid string");
-			return NULL;
+	size = BT_BENCODE_ARENA_ALIGN (size);
+	chunk = arena->chunks;
+
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		if (size > arena->next_size / 4) {
+			/* big allocations get a chunk of their own */
+			chunk = bt_bencode_arena_add_chunk (arena, size, size);
+		} else {
+			chunk = bt_bencode_arena_add_chunk (arena, arena->next_size, size);
+			arena->next_size = MIN (arena->next_size * 2, BT_BENCODE_ARENA_MAX_CHUNK);
 		}
+	}
 
-		data = g_slice_new0 (BtBencode);
-		data->type = BT_BENCODE_TYPE_STRING;
-		data->string = g_string_new_len (*end + 1, len);
-		*end += len + 1;
-		return data;
+	mem = ((gchar *) chunk) + BT_BENCODE_ARENA_ALIGN (sizeof (BtBencodeArenaChunk)) + chunk->used;
+	chunk->used += size;
 
-	} else if (*buf == 'd') {
+	return mem;
+}
 
-		/* dictionaries are like so: 'd(bencodedkey)(bencodedval)(key)(val)...e' */
-		GTree *dict = g_tree_new_full ((GCompareDataFunc) strcmp, NULL, g_free, (GDestroyNotify) bt_bencode_destroy);
+/* orders keys as raw byte strings, which is how bencoded dictionaries are sorted */
+static gint
+bt_bencode_compare_keys (const gchar *a, gsize a_len, const gchar *b, gsize b_len)
+{
+	gint ret = memcmp (a, b, MIN (a_len, b_len));
 
-		*end = buf + 1;
+	if (ret != 0)
+		return ret;
 
-		while (**end != 'e') {
-			BtBencode *key, *val;
+	return a_len < b_len ? -1 : (a_len > b_len ? 1 : 0);
+}
 
-			key = _bt_bencode_decode (*end, end, max, error);
+static gint
+bt_bencode_compare_entries (const BtBencodeDictEntry *x, const BtBencodeDictEntry *y)
+{
+	return bt_bencode_compare_keys (x->key.str, x->key.len, y->key.str, y->key.len);
+}
 
-			if (key == NULL) {
-				g_assert (error == NULL || *error != NULL);
-				g_tree_destroy (dict);
-				return NULL;
-			}
+/* a stable merge sort, so that duplicate keys stay in input order wherever
+ * their strings happen to live */
+static void
+bt_bencode_merge_sort_entries (BtBencodeDictEntry *entries, BtBencodeDictEntry *scratch, guint len)
+{
+	guint half = len / 2, i = 0, j = half, n = 0;
 
-			if (key->type != BT_BENCODE_TYPE_STRING) {
-				g_set_error (error, BT_BENCODE_ERROR, BT_BENCODE_ERROR_INVALID, BT_BENCODE_ERROR_TEXT, "key must be string");
-				g_tree_destroy (dict);
-				return NULL;
-			}
+	if (len < 2)
+		return;
 
-			val = _bt_bencode_decode (*end, end, max, error);
+	bt_bencode_merge_sort_entries (entries, scratch, half);
+	bt_bencode_merge_sort_entries (entries + half, scratch, len - half);
 
-			if (val == NULL) {
-				g_assert (error == NULL || *error != NULL);
-				bt_bencode_destroy (key);
-				g_tree_destroy (dict);
-				return NULL;
-			}
+	while (i < half && j < len) {
+		if (bt_bencode_compare_entries (&entries[j], &entries[i]) < 0)
+			scratch[n++] = entries[j++];
+		else
+			scratch[n++] = entries[i++];
+	}
 
-			g_tree_insert (dict, g_strdup (key->string->str), val);
-			bt_bencode_destroy (key);
-		}
+	while (i < half)
+		scratch[n++] = entries[i++];
+
+	/* whatever is left of the second half is already in place */
+	memcpy (entries, scratch, n * sizeof (BtBencodeDictEntry));
+}
 
-		(*end)++;
+/* sorts the entries of a dict that wasn't encoded properly, keeping the last of any duplicates */
+static guint
+bt_bencode_decoder_sort_entries (BtBencodeDictEntry *entries, guint len)
+{
+	BtBencodeDictEntry *scratch;
+	guint i, n = 0;
 
-		data = g_slice_new0 (BtBencode);
-		data->type = BT_BENCODE_TYPE_DICT;
-		data->dict = dict;
-		return data;
+	scratch = g_new (BtBencodeDictEntry, len);
+	bt_bencode_merge_sort_entries (entries, scratch, len);
+	g_free (scratch);
 
-	} else if (*buf == 'l') {
+	for (i = 0; i < len; i++) {
+		if (n > 0 && bt_bencode_compare_entries (&entries[n - 1], &entries[i]) == 0)
+			n--;
 
-		/* ...and lists are like this: 'l(bencodeditem)(item)(item)...e' */
-		GSList *list = NULL;
+		entries[n++] = entries[i];
+	}
 
-		*end = buf + 1;
+	return n;
+}
 
-		while (**end != 'e') {
-			BtBencode *val = _bt_bencode_decode (*end, end, max, error);
+static BtBencodeString
+bt_bencode_decoder_string (BtBencodeDecoder *decoder, const gchar *str, gsize len)
+{
+	BtBencodeString string;
 
-			if (val == NULL) {
-				g_assert (error == NULL || *error != NULL);
-				g_slist_foreach (list, (GFunc) bt_bencode_destroy, NULL);
-				return NULL;
-			}
+	if (decoder->copy_strings && len > 0) {
+		gchar *copy = bt_bencode_arena_alloc (decoder->arena, len);
 
-			list = g_slist_prepend (list, val);
-		}
+		memcpy (copy, str, len);
+		str = copy;
+	}
 
-		list = g_slist_reverse (list);
+	string.str = str;
+	string.len = len;
 
-		(*end)++;
+	return string;
+}
 
-		data = g_slice_new0 (BtBencode);
-		data->type = BT_BENCODE_TYPE_LIST;
-		data->list = list;
-		return data;
+/* adds a complete value to the innermost open container, or makes it the root */
+static void
+bt_bencode_decoder_add_value (BtBencodeDecoder *decoder, const BtBencode *value)
+{
+	BtBencodeDecoderFrame *frame;
+	BtBencodeDictEntry entry;
+
+	if (decoder->frames->len == 0) {
+		decoder->root = *value;
+		return;
 	}
 
-	g_set_error (error, BT_BENCODE_ERROR, BT_BENCODE_ERROR_INVALID, BT_BENCODE_ERROR_TEXT, "unknown element or unexpected EOF");
-	return NULL;
+	frame = &g_array_index (decoder->frames, BtBencodeDecoderFrame, decoder->frames->len - 1);
+
+	if (frame->type == BT_BENCODE_TYPE_LIST) {
+		g_array_append_vals (decoder->items, value, 1);
+		return;
+	}
+
+	/* keys should arrive sorted, in which case building the dict is linear */
+	if (decoder->entries->len > frame->base) {
+		BtBencodeDictEntry *last = &g_array_index (decoder->entries, BtBencodeDictEntry, decoder->entries->len - 1);
+
+		if (bt_bencode_compare_keys (last->key.str, last->key.len, frame->key.str, frame->key.len) >= 0)
+			frame->sorted = FALSE;
+	}
+
+	entry.key = frame->key;
+	entry.value = *value;
+
+	g_array_append_val (decoder->entries, entry);
 }
 
-static gboolean
-_bt_bencode_encode_key_val (gchar *key, BtBencode *val, GString **string)
+static void
+bt_bencode_decoder_start (BtBencodeDecoder *decoder, BtBencodeType type)
 {
-	g_string_append_printf (*string, "%Zd:%s", strlen (key), key);
-	*string = _bt_bencode_encode (val, string);
-	return FALSE;
+	BtBencodeDecoderFrame frame;
+
+	frame.type = type;
+	frame.offset = bt_bencode_parse_context_get_offset (decoder->context);
+	frame.base = type == BT_BENCODE_TYPE_DICT ? decoder->entries->len : decoder->items->len;
+	frame.sorted = TRUE;
+	frame.key.str = NULL;
+	frame.key.len = 0;
+
+	g_array_append_val (decoder->frames, frame);
 }
 
-static GString *
-_bt_bencode_encode (BtBencode *data, GString **string)
+static void
+bt_bencode_decoder_on_start_dict (BtBencodeParseContext *context G_GNUC_UNUSED, gpointer data, GError **error G_GNUC_UNUSED)
 {
-	GString *str;
+	bt_bencode_decoder_start ((BtBencodeDecoder *) data, BT_BENCODE_TYPE_DICT);
+}
+
+static void
+bt_bencode_decoder_on_start_list (BtBencodeParseContext *context G_GNUC_UNUSED, gpointer data, GError **error G_GNUC_UNUSED)
+{
+	bt_bencode_decoder_start ((BtBencodeDecoder *) data, BT_BENCODE_TYPE_LIST);
+}
+
+static void
+bt_bencode_decoder_on_end (BtBencodeParseContext *context, gpointer data, GError **error G_GNUC_UNUSED)
+{
+	BtBencodeDecoder *decoder = (BtBencodeDecoder *) data;
+	BtBencodeDecoderFrame frame;
+	BtBencodeString raw;
+	BtBencode value;
+	guint len;
+
+	frame = g_array_index (decoder->frames, BtBencodeDecoderFrame, decoder->frames->len - 1);
+	g_array_set_size (decoder->frames, decoder->frames->len - 1);
+
+	/* the end offset is that of the closing 'e' */
+	raw.str = decoder->input ? decoder->input + frame.offset : NULL;
+	raw.len = bt_bencode_parse_context_get_offset (context) + 1 - frame.offset;
+
+	value.type = frame.type;
+
+	if (frame.type == BT_BENCODE_TYPE_DICT) {
+		len = decoder->entries->len - frame.base;
+
+		value.dict.entries = bt_bencode_arena_alloc (decoder->arena, len * sizeof (BtBencodeDictEntry));
+		memcpy (value.dict.entries, &g_array_index (decoder->entries, BtBencodeDictEntry, frame.base), len * sizeof (BtBencodeDictEntry));
+		g_array_set_size (decoder->entries, frame.base);
+
+		if (!frame.sorted)
+			len = bt_bencode_decoder_sort_entries (value.dict.entries, len);
 
-	if (string == NULL) {
-		string = &str;
-		*string = g_string_sized_new (100);
+		value.dict.len = len;
+		value.dict.raw = raw;
+	} else {
+		len = decoder->items->len - frame.base;
+
+		value.list.items = bt_bencode_arena_alloc (decoder->arena, len * sizeof (BtBencode));
+		value.list.len = len;
+		value.list.raw = raw;
+
+		memcpy (value.list.items, &g_array_index (decoder->items, BtBencode, frame.base), len * sizeof (BtBencode));
+		g_array_set_size (decoder->items, frame.base);
+	}
+
+	bt_bencode_decoder_add_value (decoder, &value);
+}
+
+static void
+bt_bencode_decoder_on_key (BtBencodeParseContext *context G_GNUC_UNUSED, const gchar *str, gsize len, gpointer data, GError **error G_GNUC_UNUSED)
+{
+	BtBencodeDecoder *decoder = (BtBencodeDecoder *) data;
+
+	g_array_index (decoder->frames, BtBencodeDecoderFrame, decoder->frames->len - 1).key = bt_bencode_decoder_string (decoder, str, len);
+}
+
+static void
+bt_bencode_decoder_on_string (BtBencodeParseContext *context G_GNUC_UNUSED, const gchar *str, gsize len, gpointer data, GError **error G_GNUC_UNUSED)
+{
+	BtBencodeDecoder *decoder = (BtBencodeDecoder *) data;
+	BtBencode value;
+
+	value.type = BT_BENCODE_TYPE_STRING;
+	value.string = bt_bencode_decoder_string (decoder, str, len);
+
+	bt_bencode_decoder_add_value (decoder, &value);
+}
+
+static void
+bt_bencode_decoder_on_integer (BtBencodeParseContext *context G_GNUC_UNUSED, gint64 integer, gpointer data, GError **error G_GNUC_UNUSED)
+{
+	BtBencode value;
+
+	value.type = BT_BENCODE_TYPE_INT;
+	value.value = integer;
+
+	bt_bencode_decoder_add_value ((BtBencodeDecoder *) data, &value);
+}
+
+static const BtBencodeParser bt_bencode_decoder_parser = {
+	bt_bencode_decoder_on_start_dict,
+	bt_bencode_decoder_on_start_list,
+	bt_bencode_decoder_on_end,
+	bt_bencode_decoder_on_key,
+	bt_bencode_decoder_on_string,
+	bt_bencode_decoder_on_integer
+};
+
+static BtBencodeDecoder *
+bt_bencode_decoder_new_full (BtBencodeArena *arena, guint max_depth, gsize max_size, gboolean copy_strings)
+{
+	BtBencodeDecoder *decoder;
+
+	decoder = g_slice_new0 (BtBencodeDecoder);
+	decoder->arena = arena;
+	decoder->copy_strings = copy_strings;
+	decoder->context = bt_bencode_parse_context_new (&bt_bencode_decoder_parser, max_depth, max_size, decoder);
+	decoder->frames = g_array_new (FALSE, FALSE, sizeof (BtBencodeDecoderFrame));
+	decoder->items = g_array_new (FALSE, FALSE, sizeof (BtBencode));
+	decoder->entries = g_array_new (FALSE, FALSE, sizeof (BtBencodeDictEntry));
+
+	return decoder;
+}
+
+/* decodes a buffer that outlives the tree, so strings can point right into it */
+static BtBencode *
+bt_bencode_decode_in_place (BtBencodeArena *arena, const gchar *buf, gsize len, GError **error)
+{
+	BtBencodeDecoder *decoder;
+	BtBencode *bencode = NULL;
+
+	decoder = bt_bencode_decoder_new_full (arena, 0, 0, FALSE);
+	decoder->input = buf;
+
+	if (bt_bencode_decoder_feed (decoder, buf, len, NULL, error))
+		bencode = bt_bencode_decoder_finish (decoder, error);
+
+	bt_bencode_decoder_free (decoder);
+
+	return bencode;
+}
+
+/* number of digits needed to print value in decimal */
+static gsize
+bt_bencode_digits (guint64 value)
+{
+	gsize digits = 1;
+
+	while (value >= 10) {
+		value /= 10;
+		digits++;
+	}
+
+	return digits;
+}
+
+/* prints value in decimal to buf, which must have room for bt_bencode_digits (value) bytes */
+static gsize
+bt_bencode_format_digits (gchar *buf, guint64 value)
+{
+	gsize len = bt_bencode_digits (value), i;
+
+	for (i = len; i > 0; i--) {
+		buf[i - 1] = '0' + (value % 10);
+		value /= 10;
 	}
 
+	return len;
+}
+
+static gsize
+bt_bencode_format_int (gchar *buf, gint64 value)
+{
+	if (value < 0) {
+		buf[0] = '-';
+		/* negate as unsigned so that G_MININT64 works too */
+		return 1 + bt_bencode_format_digits (buf + 1, -((guint64) value));
+	}
+
+	return bt_bencode_format_digits (buf, (guint64) value);
+}
+
+static gsize
+bt_bencode_string_size (gsize len)
+{
+	return bt_bencode_digits (len) + 1 + len;
+}
+
+static gsize
+bt_bencode_format_string (gchar *buf, const gchar *str, gsize len)
+{
+	gsize n = bt_bencode_format_digits (buf, len);
+
+	buf[n++] = ':';
+	memcpy (buf + n, str, len);
+
+	return n + len;
+}
+
+static void
+bt_bencode_writer_flush (BtBencodeWriter *writer)
+{
+	if (writer->len > 0 && !writer->failed)
+		writer->failed = !writer->func (writer->buf, writer->len, writer->user_data, writer->error);
+
+	writer->len = 0;
+}
+
+static void
+bt_bencode_writer_append (BtBencodeWriter *writer, const gchar *buf, gsize len)
+{
+	if (writer->failed)
+		return;
+
+	if (len > sizeof (writer->buf) / 2) {
+		/* large strings like piece hashes are passed on as they are */
+		bt_bencode_writer_flush (writer);
+
+		if (!writer->failed)
+			writer->failed = !writer->func (buf, len, writer->user_data, writer->error);
+		return;
+	}
+
+	if (writer->len + len > sizeof (writer->buf))
+		bt_bencode_writer_flush (writer);
+
+	memcpy (writer->buf + writer->len, buf, len);
+	writer->len += len;
+}
+
+static void
+bt_bencode_writer_append_c (BtBencodeWriter *writer, gchar c)
+{
+	if (writer->len == sizeof (writer->buf))
+		bt_bencode_writer_flush (writer);
+
+	writer->buf[writer->len++] = c;
+}
+
+static void
+bt_bencode_writer_append_string (BtBencodeWriter *writer, const gchar *str, gsize len)
+{
+	gchar prefix[24];
+	gsize n;
+
+	n = bt_bencode_format_digits (prefix, len);
+	prefix[n++] = ':';
+
+	bt_bencode_writer_append (writer, prefix, n);
+	bt_bencode_writer_append (writer, str, len);
+}
+
+static void
+_bt_bencode_write (BtBencodeWriter *writer, BtBencode *data)
+{
+	gchar buf[24];
+	guint i;
+
 	switch (data->type) {
 	case BT_BENCODE_TYPE_INT:
-		g_string_append_printf (*string, "i%" G_GINT64_MODIFIER "de", data->value);
+		bt_bencode_writer_append_c (writer, 'i');
+		bt_bencode_writer_append (writer, buf, bt_bencode_format_int (buf, data->value));
+		bt_bencode_writer_append_c (writer, 'e');
 		break;
 
 	case BT_BENCODE_TYPE_STRING:
-		g_string_append_printf (*string, "%Zd:", data->string->len);
-		*string = g_string_append_len (*string, data->string->str, data->string->len);
+		bt_bencode_writer_append_string (writer, data->string.str, data->string.len);
 		break;
 
 	case BT_BENCODE_TYPE_DICT:
-		*string = g_string_append_c (*string, 'd');
-		g_tree_foreach (data->dict, (GTraverseFunc) _bt_bencode_encode_key_val, (gpointer) string);
-		*string = g_string_append_c (*string, 'e');
+		bt_bencode_writer_append_c (writer, 'd');
+
+		for (i = 0; i < data->dict.len && !writer->failed; i++) {
+			BtBencodeDictEntry *entry = &data->dict.entries[i];
+
+			bt_bencode_writer_append_string (writer, entry->key.str, entry->key.len);
+			_bt_bencode_write (writer, &entry->value);
+		}
+
+		bt_bencode_writer_append_c (writer, 'e');
 		break;
 
 	case BT_BENCODE_TYPE_LIST:
-		*string = g_string_append_c (*string, 'l');
-		g_slist_foreach (data->list, (GFunc) _bt_bencode_encode, (gpointer) string);
-		*string = g_string_append_c (*string, 'e');
+		bt_bencode_writer_append_c (writer, 'l');
+
+		for (i = 0; i < data->list.len && !writer->failed; i++)
+			_bt_bencode_write (writer, bt_bencode_list_index (data, i));
+
+		bt_bencode_writer_append_c (writer, 'e');
 		break;
 	}
-
-	return *string;
 }
 
 /**
@@ -214,32 +631,42 @@ bt_bencode_error_quark ()
  * bt_bencode_destroy:
  * @data: the data to free
  *
- * Frees all resources associated with the bencoded data.
+ * Frees all resources associated with the bencoded data. @data must have been
+ * returned by bt_bencode_decode(); structures decoded with bt_bencode_decode_arena()
+ * are freed together with their arena.
  */
 void
 bt_bencode_destroy (BtBencode *data)
 {
-	g_return_if_fail (data != NULL);
+	BtBencodeDocument *document;
 
-	switch (data->type) {
-	case BT_BENCODE_TYPE_STRING:
-		g_string_free (data->string, TRUE);
-		break;
+	g_return_if_fail (data != NULL);
 
-	case BT_BENCODE_TYPE_LIST:
-		g_slist_foreach (data->list, (GFunc) bt_bencode_destroy, NULL);
-		g_slist_free (data->list);
-		break;
+	document = (BtBencodeDocument *) (((gchar *) data) - G_STRUCT_OFFSET (BtBencodeDocument, root));
 
-	case BT_BENCODE_TYPE_DICT:
-		g_tree_destroy (data->dict);
-		break;
+	bt_bencode_arena_free (document->arena);
+}
 
-	case BT_BENCODE_TYPE_INT:
-		break;
-	}
+/**
+ * bt_bencode_decode_arena:
+ * @arena: the arena to allocate the decoded structure from
+ * @buf: the buffer to decode
+ * @len: the length of the buffer
+ * @error: a return location for errors
+ *
+ * Decodes the given string into a #BtBencode structure without copying any of
+ * the strings in it: they point into @buf, which must therefore stay around for
+ * as long as the result is used. The result is freed along with @arena.
+ *
+ * Returns: the decoded BEncode structure
+ */
+BtBencode *
+bt_bencode_decode_arena (BtBencodeArena *arena, const gchar *buf, gsize len, GError **error)
+{
+	g_return_val_if_fail (arena != NULL, NULL);
+	g_return_val_if_fail (buf != NULL || len == 0, NULL);
 
-	g_slice_free (BtBencode, data);
+	return bt_bencode_decode_in_place (arena, buf, len, error);
 }
 
 /**
@@ -248,39 +675,355 @@ bt_bencode_destroy (BtBencode *data)
  * @len: the length of the buffer
  * @error: a return location for errors
  *
- * Decodes the given string into a #BtBencode structure.
+ * Decodes the given string into a #BtBencode structure that owns a copy of @buf,
+ * to be freed with bt_bencode_destroy(). Callers that can keep the buffer around
+ * should use bt_bencode_decode_arena() instead, which doesn't copy it.
  *
  * Returns: the decoded BEncode structure
  */
 BtBencode *
 bt_bencode_decode (const gchar *buf, gsize len, GError **error)
 {
+	BtBencodeArena *arena;
+	BtBencodeDocument *document;
 	BtBencode *bencode;
-	const gchar *end = NULL;
+	gchar *copy;
 
-	bencode = _bt_bencode_decode (buf, &end, buf + len, error);
+	arena = bt_bencode_arena_new (len);
 
-	if (!bencode)
-		return NULL;
+	copy = bt_bencode_arena_alloc (arena, len);
+	memcpy (copy, buf, len);
 
-	if (end != buf + len) {
-		g_set_error (error, BT_BENCODE_ERROR, BT_BENCODE_ERROR_INVALID, BT_BENCODE_ERROR_TEXT, "leftover or not enough characters");
+	if (!(bencode = bt_bencode_decode_in_place (arena, copy, len, error))) {
+		bt_bencode_arena_free (arena);
 		return NULL;
 	}
 
+	document = bt_bencode_arena_alloc (arena, sizeof (BtBencodeDocument));
+	document->arena = arena;
+	document->root = *bencode;
+
+	return &document->root;
+}
+
+/**
+ * bt_bencode_decoder_new:
+ * @arena: the arena to allocate the decoded structure from
+ * @max_depth: how deeply lists and dictionaries may be nested, or 0 for %BT_BENCODE_PARSER_DEFAULT_MAX_DEPTH
+ * @max_size: the most bytes the BEncoded data may span, or 0 for no limit
+ *
+ * Creates a decoder that builds a #BtBencode structure from input that arrives
+ * in chunks, like a tracker response coming in over the network. Strings are
+ * copied into @arena since the chunks don't need to stay around; the result is
+ * freed along with it.
+ *
+ * Returns: a new decoder
+ */
+BtBencodeDecoder *
+bt_bencode_decoder_new (BtBencodeArena *arena, guint max_depth, gsize max_size)
+{
+	g_return_val_if_fail (arena != NULL, NULL);
+
+	return bt_bencode_decoder_new_full (arena, max_depth, max_size, TRUE);
+}
+
+/**
+ * bt_bencode_decoder_free:
+ * @decoder: the decoder
+ *
+ * Frees the decoder. Anything it decoded stays in the arena.
+ */
+void
+bt_bencode_decoder_free (BtBencodeDecoder *decoder)
+{
+	g_return_if_fail (decoder != NULL);
+
+	bt_bencode_parse_context_free (decoder->context);
+
+	g_array_free (decoder->frames, TRUE);
+	g_array_free (decoder->items, TRUE);
+	g_array_free (decoder->entries, TRUE);
+
+	g_slice_free (BtBencodeDecoder, decoder);
+}
+
+/**
+ * bt_bencode_decoder_feed:
+ * @decoder: the decoder
+ * @buf: the next chunk of input
+ * @len: the length of the chunk
+ * @consumed: return location for the number of bytes used, or %NULL
+ * @error: a return location for errors
+ *
+ * Decodes the next chunk of input. See bt_bencode_parse_context_parse() for the
+ * meaning of @consumed.
+ *
+ * Returns: %FALSE if the input is invalid
+ */
+gboolean
+bt_bencode_decoder_feed (BtBencodeDecoder *decoder, const gchar *buf, gsize len, gsize *consumed, GError **error)
+{
+	g_return_val_if_fail (decoder != NULL, FALSE);
+
+	return bt_bencode_parse_context_parse (decoder->context, buf, len, consumed, error);
+}
+
+/**
+ * bt_bencode_decoder_is_complete:
+ * @decoder: the decoder
+ *
+ * Returns: whether a complete value has been decoded
+ */
+gboolean
+bt_bencode_decoder_is_complete (BtBencodeDecoder *decoder)
+{
+	g_return_val_if_fail (decoder != NULL, FALSE);
+
+	return bt_bencode_parse_context_is_complete (decoder->context);
+}
+
+/**
+ * bt_bencode_decoder_finish:
+ * @decoder: the decoder
+ * @error: a return location for errors
+ *
+ * Signals the end of the input and gets the decoded structure.
+ *
+ * Returns: the decoded BEncode structure, or %NULL if the input was incomplete
+ */
+BtBencode *
+bt_bencode_decoder_finish (BtBencodeDecoder *decoder, GError **error)
+{
+	BtBencode *bencode;
+
+	g_return_val_if_fail (decoder != NULL, NULL);
+
+	if (!bt_bencode_parse_context_end_parse (decoder->context, error))
+		return NULL;
+
+	bencode = bt_bencode_arena_alloc (decoder->arena, sizeof (BtBencode));
+	*bencode = decoder->root;
+
 	return bencode;
 }
 
+/**
+ * bt_bencode_encoded_size:
+ * @data: the structure to encode
+ *
+ * Works out how long the BEncoded form of @data is without encoding it, so the
+ * output can be put straight into a buffer of the right size, such as a peer
+ * message whose length has to be known up front.
+ *
+ * Returns: the size in bytes
+ */
+gsize
+bt_bencode_encoded_size (BtBencode *data)
+{
+	gsize size = 0;
+	guint i;
+
+	g_return_val_if_fail (data != NULL, 0);
+
+	switch (data->type) {
+	case BT_BENCODE_TYPE_INT:
+		if (data->value < 0)
+			size = 3 + bt_bencode_digits (-((guint64) data->value));
+		else
+			size = 2 + bt_bencode_digits (data->value);
+		break;
+
+	case BT_BENCODE_TYPE_STRING:
+		size = bt_bencode_string_size (data->string.len);
+		break;
+
+	case BT_BENCODE_TYPE_DICT:
+		size = 2;
+
+		for (i = 0; i < data->dict.len; i++)
+			size += bt_bencode_string_size (data->dict.entries[i].key.len) + bt_bencode_encoded_size (&data->dict.entries[i].value);
+		break;
+
+	case BT_BENCODE_TYPE_LIST:
+		size = 2;
+
+		for (i = 0; i < data->list.len; i++)
+			size += bt_bencode_encoded_size (bt_bencode_list_index (data, i));
+		break;
+	}
+
+	return size;
+}
+
+/**
+ * bt_bencode_encode_into:
+ * @data: the structure to encode
+ * @buf: the buffer to encode into, with room for bt_bencode_encoded_size() bytes
+ *
+ * Encodes the given #BtBencode structure into a buffer supplied by the caller.
+ *
+ * Returns: the number of bytes written
+ */
+gsize
+bt_bencode_encode_into (BtBencode *data, gchar *buf)
+{
+	gchar *p = buf;
+	guint i;
+
+	g_return_val_if_fail (data != NULL, 0);
+	g_return_val_if_fail (buf != NULL, 0);
+
+	switch (data->type) {
+	case BT_BENCODE_TYPE_INT:
+		*p++ = 'i';
+		p += bt_bencode_format_int (p, data->value);
+		*p++ = 'e';
+		break;
+
+	case BT_BENCODE_TYPE_STRING:
+		p += bt_bencode_format_string (p, data->string.str, data->string.len);
+		break;
+
+	case BT_BENCODE_TYPE_DICT:
+		*p++ = 'd';
+
+		for (i = 0; i < data->dict.len; i++) {
+			BtBencodeDictEntry *entry = &data->dict.entries[i];
+
+			p += bt_bencode_format_string (p, entry->key.str, entry->key.len);
+			p += bt_bencode_encode_into (&entry->value, p);
+		}
+
+		*p++ = 'e';
+		break;
+
+	case BT_BENCODE_TYPE_LIST:
+		*p++ = 'l';
+
+		for (i = 0; i < data->list.len; i++)
+			p += bt_bencode_encode_into (bt_bencode_list_index (data, i), p);
+
+		*p++ = 'e';
+		break;
+	}
+
+	return p - buf;
+}
+
 /**
  * bt_bencode_encode:
  * @data: the encoded structure
  *
- * Encodes the given #BtBencode structure into a GString
+ * Encodes the given #BtBencode structure into a GString, which is allocated at
+ * its final size in one go.
  *
  * Returns: a #GString with the BEncoded data
  */
 GString *
 bt_bencode_encode (BtBencode *data)
 {
-	return _bt_bencode_encode (data, NULL);
+	GString *string;
+	gsize size;
+
+	g_return_val_if_fail (data != NULL, NULL);
+
+	size = bt_bencode_encoded_size (data);
+
+	string = g_string_sized_new (size);
+	string->len = bt_bencode_encode_into (data, string->str);
+	string->str[string->len] = '\0';
+
+	return string;
+}
+
+/**
+ * bt_bencode_write:
+ * @data: the structure to encode
+ * @func: the function to pass the output to
+ * @user_data: data to pass to @func
+ * @error: a return location for errors
+ *
+ * Encodes the given #BtBencode structure piece by piece, handing the output to
+ * @func as it goes instead of building it in memory. Small elements are
+ * gathered into a buffer on the stack first, while long strings are passed on
+ * as they are, so this works well for writing to a peer's connection or to a
+ * file. Encoding stops as soon as @func fails.
+ *
+ * Returns: %FALSE if @func failed
+ */
+gboolean
+bt_bencode_write (BtBencode *data, BtBencodeWriteFunc func, gpointer user_data, GError **error)
+{
+	BtBencodeWriter writer;
+
+	g_return_val_if_fail (data != NULL, FALSE);
+	g_return_val_if_fail (func != NULL, FALSE);
+
+	writer.func = func;
+	writer.user_data = user_data;
+	writer.error = error;
+	writer.failed = FALSE;
+	writer.len = 0;
+
+	_bt_bencode_write (&writer, data);
+	bt_bencode_writer_flush (&writer);
+
+	return !writer.failed;
+}
+
+/**
+ * bt_bencode_lookup:
+ * @dict: the #BtBencode *dictionary* to look for an item in
+ * @key: the key to look up
+ *
+ * Finds the item with the given key in a BEncoded dictionary.
+ *
+ * Returns: the value associated with the key, or NULL if there is none
+ */
+BtBencode *
+bt_bencode_lookup (BtBencode *dict, const gchar *key)
+{
+	guint low, high;
+	gsize len;
+
+	g_return_val_if_fail (dict != NULL, NULL);
+	g_return_val_if_fail (dict->type == BT_BENCODE_TYPE_DICT, NULL);
+	g_return_val_if_fail (key != NULL, NULL);
+
+	len = strlen (key);
+
+	low = 0;
+	high = dict->dict.len;
+
+	while (low < high) {
+		guint mid = low + (high - low) / 2;
+		BtBencodeDictEntry *entry = &dict->dict.entries[mid];
+		gint cmp = bt_bencode_compare_keys (entry->key.str, entry->key.len, key, len);
+
+		if (cmp == 0)
+			return &entry->value;
+		else if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return NULL;
+}
+
+/**
+ * bt_bencode_dup_string:
+ * @string: a #BtBencode string
+ *
+ * Copies a BEncoded string into a nul-terminated C string.
+ *
+ * Returns: the newly allocated string, to be freed with g_free
+ */
+gchar *
+bt_bencode_dup_string (BtBencode *string)
+{
+	g_return_val_if_fail (string != NULL, NULL);
+	g_return_val_if_fail (string->type == BT_BENCODE_TYPE_STRING, NULL);
+
+	return g_strndup (string->string.str, string->string.len);
 }
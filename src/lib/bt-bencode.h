@@ -31,41 +31,31 @@
 #define BT_BENCODE_ERROR (bt_bencode_error_quark ())
 
 /**
- * bt_bencode_lookup:
- * @bencode: the #BtBencode *dictionary* to look for an item in
- * @name: the key to look up
- *
- * Convenience macro to find the item with the given key in a BEncoded dictionary.
- *
- * Returns: the value associated with the key, as another #BtBencode pointer
- */
-#define bt_bencode_lookup(bencode, name) ((BtBencode *) g_tree_lookup (((BtBencode *) bencode)->dict, name))
-
-/**
- * bt_bencode_slitem:
- * @list: a #GSList pointer
+ * bt_bencode_list_index:
+ * @bencode: a #BtBencode *list*
+ * @i: the index of the item
  *
  * Convenience macro for getting items in #BtBencode lists. For example:
  *
  * <informalexample><programlisting>
- * BtBEncode *bencoded;
- * GSList *i;
- * for (i = bencoded->list; i != NULL; i = i->next) {
- * 	BtBencode *item = bt_bencode_slitem (i);
+ * BtBencode *bencoded;
+ * guint i;
+ * for (i = 0; i < bencoded->list.len; i++) {
+ * 	BtBencode *item = bt_bencode_list_index (bencoded, i);
  * 	do something with item...
  * }
  * </programlisting></informalexample>
  *
  * Returns: the list element as a #BtBencode pointer
  */
-#define bt_bencode_slitem(list)    ((BtBencode *) ((list)->data))
+#define bt_bencode_list_index(bencode, i) (&(bencode)->list.items[(i)])
 
 G_BEGIN_DECLS
 
 /**
  * BtBencodeType:
  * @BT_BENCODE_TYPE_INT: indicates that the BEncoded integer can be accessed through value
- * @BT_BENCODE_TYPE_STRING: indicates that the BEncoded string can be accessed as a #GString through the string element
+ * @BT_BENCODE_TYPE_STRING: indicates that the BEncoded string can be accessed as a #BtBencodeString through the string element
  * @BT_BENCODE_TYPE_LIST: indicates that the BEncoded list can be accessed through the list element
  * @BT_BENCODE_TYPE_DICT: indicates that the BEncoded dictionary can be accessed through the dict element
  *
@@ -81,40 +71,148 @@ typedef enum {
 /**
  * BtBencodeError:
  * @BT_BENCODE_ERROR_INVALID: generic encoding error
+ * @BT_BENCODE_ERROR_LIMIT: the data is nested too deeply or is too large
  *
  * Various error types for BEncoding and decoding operations
  */
 typedef enum {
-	BT_BENCODE_ERROR_INVALID
+	BT_BENCODE_ERROR_INVALID,
+	BT_BENCODE_ERROR_LIMIT
 } BtBencodeError;
 
+/**
+ * BtBencodeString:
+ * @str: pointer to the first byte of the string, which is not nul-terminated
+ * @len: the length of the string in bytes
+ *
+ * A view of a BEncoded string. The bytes are not copied out of the buffer that
+ * was decoded, so they are only valid for as long as that buffer is.
+ */
+typedef struct {
+	const gchar *str;
+	gsize        len;
+} BtBencodeString;
+
+typedef struct _BtBencode          BtBencode;
+typedef struct _BtBencodeDictEntry BtBencodeDictEntry;
+typedef struct _BtBencodeArena     BtBencodeArena;
+typedef struct _BtBencodeDecoder   BtBencodeDecoder;
+
+/**
+ * BtBencodeList:
+ * @items: a contiguous array of @len items
+ * @len: the number of items in the list
+ * @raw: the bytes the list was decoded from
+ *
+ * A BEncoded list.
+ */
+typedef struct {
+	BtBencode      *items;
+	guint           len;
+	BtBencodeString raw;
+} BtBencodeList;
+
+/**
+ * BtBencodeDict:
+ * @entries: a contiguous array of @len entries, sorted by key
+ * @len: the number of entries in the dictionary
+ * @raw: the bytes the dictionary was decoded from
+ *
+ * A BEncoded dictionary. Keys are unique and sorted as raw byte strings, like
+ * the specification requires, so lookups are a binary search.
+ *
+ * @raw spans the dictionary exactly as it appeared in the input, which is what
+ * has to be hashed to get an infohash even if the input wasn't sorted. Its
+ * length is always set, but its bytes are only available (and @raw.str
+ * non-%NULL) if the input was decoded in one piece.
+ */
+typedef struct {
+	BtBencodeDictEntry *entries;
+	guint               len;
+	BtBencodeString     raw;
+} BtBencodeDict;
+
 /**
  * BtBencode:
  * @type: a #BtBencodeType specifying the type of data
  * @value: a #gint64 that holds the integer value, if type is %BT_BENCODE_TYPE_INT
- * @string: a #GString that holds the string, if type is %BT_BENCODE_TYPE_STRING
- * @list: a #GSList that holds a singly linked list of other #BtBencode structures, if type is %BT_BENCODE_TYPE_LIST
- * @dict: a #GTree that holds string key -> #BtBencode mappings, if type is %BT_BENCODE_TYPE_DICT
+ * @string: a #BtBencodeString view of the string, if type is %BT_BENCODE_TYPE_STRING
+ * @list: a #BtBencodeList holding the items, if type is %BT_BENCODE_TYPE_LIST
+ * @dict: a #BtBencodeDict holding the entries, if type is %BT_BENCODE_TYPE_DICT
  *
- * Represents BEncoded data.
+ * Represents BEncoded data. All nodes of a decoded structure live in a single
+ * #BtBencodeArena.
  */
-typedef struct {
+struct _BtBencode {
 	BtBencodeType type;
 	union {
 		gint64 value;
-		GString *string;
-		GSList *list;
-		GTree *dict;
+		BtBencodeString string;
+		BtBencodeList list;
+		BtBencodeDict dict;
 	};
-} BtBencode;
+};
+
+/**
+ * BtBencodeDictEntry:
+ * @key: the key of this entry
+ * @value: the value associated with @key
+ *
+ * An entry in a BEncoded dictionary.
+ */
+struct _BtBencodeDictEntry {
+	BtBencodeString key;
+	BtBencode       value;
+};
+
+/**
+ * BtBencodeWriteFunc:
+ * @buf: the next chunk of BEncoded output
+ * @len: the length of the chunk
+ * @user_data: the data passed to bt_bencode_write()
+ * @error: a return location for errors
+ *
+ * Receives the output of bt_bencode_write(). @buf is only valid during the call.
+ *
+ * Returns: %FALSE if the output could not be written, which stops encoding
+ */
+typedef gboolean (*BtBencodeWriteFunc) (const gchar *buf, gsize len, gpointer user_data, GError **error);
+
+GQuark          bt_bencode_error_quark ();
+
+BtBencodeArena *bt_bencode_arena_new (gsize size_hint);
+
+void            bt_bencode_arena_free (BtBencodeArena *arena);
+
+gpointer        bt_bencode_arena_alloc (BtBencodeArena *arena, gsize size);
+
+BtBencode      *bt_bencode_decode_arena (BtBencodeArena *arena, const gchar *buf, gsize len, GError **error);
+
+void            bt_bencode_destroy (BtBencode *data);
+
+BtBencodeDecoder *bt_bencode_decoder_new (BtBencodeArena *arena, guint max_depth, gsize max_size);
+
+void            bt_bencode_decoder_free (BtBencodeDecoder *decoder);
+
+gboolean        bt_bencode_decoder_feed (BtBencodeDecoder *decoder, const gchar *buf, gsize len, gsize *consumed, GError **error);
+
+gboolean        bt_bencode_decoder_is_complete (BtBencodeDecoder *decoder);
+
+BtBencode      *bt_bencode_decoder_finish (BtBencodeDecoder *decoder, GError **error);
+
+BtBencode      *bt_bencode_decode (const gchar *buf, gsize len, GError **error);
+
+gsize           bt_bencode_encoded_size (BtBencode *data);
+
+gsize           bt_bencode_encode_into (BtBencode *data, gchar *buf);
 
-GQuark     bt_bencode_error_quark ();
+GString        *bt_bencode_encode (BtBencode *data);
 
-void       bt_bencode_destroy (BtBencode *data);
+gboolean        bt_bencode_write (BtBencode *data, BtBencodeWriteFunc func, gpointer user_data, GError **error);
 
-BtBencode *bt_bencode_decode (const gchar *buf, gsize len, GError **error);
+BtBencode      *bt_bencode_lookup (BtBencode *dict, const gchar *key);
 
-GString   *bt_bencode_encode (BtBencode *data);
+gchar          *bt_bencode_dup_string (BtBencode *string);
 
 G_END_DECLS
 
@@ -0,0 +1,386 @@
+/**
+ * bt-bitfield.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+
+#include "bt-bitfield.h"
+
+/* gcc can build the AVX2 kernels into any binary and they're only used on
+ * processors that have it */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && (defined(__x86_64__) || defined(__i386__))
+# define BT_BITFIELD_AVX2 1
+# include <immintrin.h>
+#endif
+
+/* the kernels work on whole bytes, as the spare bits are clear */
+typedef struct {
+	guint (*count) (const guchar *a, gsize len);
+	guint (*count_and_not) (const guchar *a, const guchar *b, gsize len);
+
+	/* the first byte from @start on that has a bit set in @a and not in @b,
+	 * or @len if there is none */
+	gsize (*find_and_not) (const guchar *a, const guchar *b, gsize start, gsize len);
+} BtBitfieldKernels;
+
+static guint
+bt_bitfield_popcount_byte (guchar x)
+{
+	x = x - ((x >> 1) & 0x55);
+	x = (x & 0x33) + ((x >> 2) & 0x33);
+
+	return (x + (x >> 4)) & 0x0f;
+}
+
+static guint
+bt_bitfield_popcount_word (guint64 x)
+{
+	x = x - ((x >> 1) & G_GUINT64_CONSTANT (0x5555555555555555));
+	x = (x & G_GUINT64_CONSTANT (0x3333333333333333)) + ((x >> 2) & G_GUINT64_CONSTANT (0x3333333333333333));
+	x = (x + (x >> 4)) & G_GUINT64_CONSTANT (0x0f0f0f0f0f0f0f0f);
+
+	return (guint) ((x * G_GUINT64_CONSTANT (0x0101010101010101)) >> 56);
+}
+
+/* bitfields from the pool aren't aligned for words, and messages certainly
+ * aren't, so words are copied out */
+static guint64
+bt_bitfield_load_word (const guchar *p)
+{
+	guint64 x;
+
+	memcpy (&x, p, sizeof (x));
+
+	return x;
+}
+
+static guint
+bt_bitfield_count_word (const guchar *a, gsize len)
+{
+	guint count = 0;
+	gsize i = 0;
+
+	for (; i + 8 <= len; i += 8)
+		count += bt_bitfield_popcount_word (bt_bitfield_load_word (a + i));
+
+	for (; i < len; i++)
+		count += bt_bitfield_popcount_byte (a[i]);
+
+	return count;
+}
+
+static guint
+bt_bitfield_count_and_not_word (const guchar *a, const guchar *b, gsize len)
+{
+	guint count = 0;
+	gsize i = 0;
+
+	for (; i + 8 <= len; i += 8)
+		count += bt_bitfield_popcount_word (bt_bitfield_load_word (a + i) & ~bt_bitfield_load_word (b + i));
+
+	for (; i < len; i++)
+		count += bt_bitfield_popcount_byte (a[i] & ~b[i]);
+
+	return count;
+}
+
+static gsize
+bt_bitfield_find_and_not_word (const guchar *a, const guchar *b, gsize start, gsize len)
+{
+	gsize i = start;
+
+	for (; i + 8 <= len; i += 8)
+		if ((bt_bitfield_load_word (a + i) & ~bt_bitfield_load_word (b + i)) != 0)
+			break;
+
+	for (; i < len; i++)
+		if ((a[i] & ~b[i]) != 0)
+			return i;
+
+	return len;
+}
+
+static const BtBitfieldKernels bt_bitfield_kernels_word = {
+	bt_bitfield_count_word,
+	bt_bitfield_count_and_not_word,
+	bt_bitfield_find_and_not_word
+};
+
+#ifdef BT_BITFIELD_AVX2
+
+/* counts the bits in each byte with a lookup of each half, then adds the
+ * bytes up into four 64-bit sums */
+__attribute__ ((target ("avx2"))) static inline __m256i
+bt_bitfield_popcount_avx2 (__m256i v, __m256i sums)
+{
+	const __m256i table = _mm256_setr_epi8 (0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+	                                        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8 (0x0f);
+	__m256i counts;
+
+	counts = _mm256_add_epi8 (_mm256_shuffle_epi8 (table, _mm256_and_si256 (v, low)),
+	                          _mm256_shuffle_epi8 (table, _mm256_and_si256 (_mm256_srli_epi16 (v, 4), low)));
+
+	return _mm256_add_epi64 (sums, _mm256_sad_epu8 (counts, _mm256_setzero_si256 ()));
+}
+
+/* the sums are stored rather than extracted, which 32-bit builds can't do */
+__attribute__ ((target ("avx2"))) static guint
+bt_bitfield_sum_avx2 (__m256i sums)
+{
+	guint64 lanes[4];
+
+	_mm256_storeu_si256 ((__m256i *) lanes, sums);
+
+	return (guint) (lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+__attribute__ ((target ("avx2"))) static guint
+bt_bitfield_count_avx2 (const guchar *a, gsize len)
+{
+	__m256i sums = _mm256_setzero_si256 ();
+	gsize i = 0;
+
+	for (; i + 32 <= len; i += 32)
+		sums = bt_bitfield_popcount_avx2 (_mm256_loadu_si256 ((const __m256i *) (a + i)), sums);
+
+	return bt_bitfield_sum_avx2 (sums) + bt_bitfield_count_word (a + i, len - i);
+}
+
+__attribute__ ((target ("avx2"))) static guint
+bt_bitfield_count_and_not_avx2 (const guchar *a, const guchar *b, gsize len)
+{
+	__m256i sums = _mm256_setzero_si256 ();
+	gsize i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i x = _mm256_loadu_si256 ((const __m256i *) (a + i));
+		__m256i y = _mm256_loadu_si256 ((const __m256i *) (b + i));
+
+		sums = bt_bitfield_popcount_avx2 (_mm256_andnot_si256 (y, x), sums);
+	}
+
+	return bt_bitfield_sum_avx2 (sums) + bt_bitfield_count_and_not_word (a + i, b + i, len - i);
+}
+
+__attribute__ ((target ("avx2"))) static gsize
+bt_bitfield_find_and_not_avx2 (const guchar *a, const guchar *b, gsize start, gsize len)
+{
+	gsize i = start;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i x = _mm256_loadu_si256 ((const __m256i *) (a + i));
+		__m256i y = _mm256_loadu_si256 ((const __m256i *) (b + i));
+		__m256i z = _mm256_andnot_si256 (y, x);
+
+		if (!_mm256_testz_si256 (z, z)) {
+			guint zero = (guint) _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (z, _mm256_setzero_si256 ()));
+
+			return i + __builtin_ctz (~zero);
+		}
+	}
+
+	return bt_bitfield_find_and_not_word (a, b, i, len);
+}
+
+static const BtBitfieldKernels bt_bitfield_kernels_avx2 = {
+	bt_bitfield_count_avx2,
+	bt_bitfield_count_and_not_avx2,
+	bt_bitfield_find_and_not_avx2
+};
+
+#endif
+
+/* chosen on first use; threads racing to do that all pick the same thing.
+ * BT_BITFIELD_NO_SIMD in the environment forces the word kernels, to compare
+ * them with the others */
+static const BtBitfieldKernels *bt_bitfield_kernels = NULL;
+
+static const BtBitfieldKernels *
+bt_bitfield_get_kernels (void)
+{
+	if (G_LIKELY (bt_bitfield_kernels != NULL))
+		return bt_bitfield_kernels;
+
+#ifdef BT_BITFIELD_AVX2
+	__builtin_cpu_init ();
+
+	if (__builtin_cpu_supports ("avx2") && g_getenv ("BT_BITFIELD_NO_SIMD") == NULL)
+		return bt_bitfield_kernels = &bt_bitfield_kernels_avx2;
+#endif
+
+	return bt_bitfield_kernels = &bt_bitfield_kernels_word;
+}
+
+/**
+ * bt_bitfield_get:
+ * @bitfield: the bitfield
+ * @index: the bit
+ *
+ * Returns: whether the bit is set
+ */
+gboolean
+bt_bitfield_get (const gchar *bitfield, guint index)
+{
+	return (((const guchar *) bitfield)[index / 8] & (0x80 >> (index % 8))) != 0;
+}
+
+/**
+ * bt_bitfield_set:
+ * @bitfield: the bitfield
+ * @index: the bit
+ *
+ * Sets a bit.
+ */
+void
+bt_bitfield_set (gchar *bitfield, guint index)
+{
+	((guchar *) bitfield)[index / 8] |= 0x80 >> (index % 8);
+}
+
+/**
+ * bt_bitfield_clear:
+ * @bitfield: the bitfield
+ * @index: the bit
+ *
+ * Clears a bit.
+ */
+void
+bt_bitfield_clear (gchar *bitfield, guint index)
+{
+	((guchar *) bitfield)[index / 8] &= ~(0x80 >> (index % 8));
+}
+
+/**
+ * bt_bitfield_clear_spare:
+ * @bitfield: the bitfield
+ * @num_bits: the number of bits that are used
+ *
+ * Clears the bits in the last byte past @num_bits, which peers aren't
+ * supposed to set but can.
+ */
+void
+bt_bitfield_clear_spare (gchar *bitfield, guint num_bits)
+{
+	if (num_bits % 8)
+		((guchar *) bitfield)[num_bits / 8] &= (guchar) (0xff << (8 - num_bits % 8));
+}
+
+/**
+ * bt_bitfield_count:
+ * @bitfield: the bitfield
+ * @num_bits: the number of bits in it
+ *
+ * Returns: the number of bits that are set
+ */
+guint
+bt_bitfield_count (const gchar *bitfield, guint num_bits)
+{
+	g_return_val_if_fail (bitfield != NULL, 0);
+
+	return bt_bitfield_get_kernels ()->count ((const guchar *) bitfield, (num_bits + 7) / 8);
+}
+
+/**
+ * bt_bitfield_count_and_not:
+ * @a: a bitfield
+ * @b: another bitfield of the same size
+ * @num_bits: the number of bits in them
+ *
+ * Counts the bits that are set in @a but not in @b, like the pieces a peer
+ * has that we don't.
+ *
+ * Returns: the number of bits
+ */
+guint
+bt_bitfield_count_and_not (const gchar *a, const gchar *b, guint num_bits)
+{
+	g_return_val_if_fail (a != NULL, 0);
+	g_return_val_if_fail (b != NULL, 0);
+
+	return bt_bitfield_get_kernels ()->count_and_not ((const guchar *) a, (const guchar *) b, (num_bits + 7) / 8);
+}
+
+/**
+ * bt_bitfield_any_and_not:
+ * @a: a bitfield
+ * @b: another bitfield of the same size
+ * @num_bits: the number of bits in them
+ *
+ * Returns: whether any bit is set in @a but not in @b
+ */
+gboolean
+bt_bitfield_any_and_not (const gchar *a, const gchar *b, guint num_bits)
+{
+	gsize len = (num_bits + 7) / 8;
+
+	g_return_val_if_fail (a != NULL, FALSE);
+	g_return_val_if_fail (b != NULL, FALSE);
+
+	return bt_bitfield_get_kernels ()->find_and_not ((const guchar *) a, (const guchar *) b, 0, len) < len;
+}
+
+/**
+ * bt_bitfield_find_and_not:
+ * @a: a bitfield
+ * @b: another bitfield of the same size
+ * @num_bits: the number of bits in them
+ * @start: the first bit to look at
+ *
+ * Finds the first bit from @start on that is set in @a but not in @b.
+ *
+ * Returns: the bit, or -1 if there is none
+ */
+gint
+bt_bitfield_find_and_not (const gchar *a, const gchar *b, guint num_bits, guint start)
+{
+	const guchar *x = (const guchar *) a;
+	const guchar *y = (const guchar *) b;
+	gsize len = (num_bits + 7) / 8;
+	gsize i;
+	guchar bits;
+
+	g_return_val_if_fail (a != NULL, -1);
+	g_return_val_if_fail (b != NULL, -1);
+
+	if (start >= num_bits)
+		return -1;
+
+	/* the part of the first byte from @start on */
+	i = start / 8;
+	bits = x[i] & ~y[i] & (0xff >> (start % 8));
+
+	if (bits == 0) {
+		i = bt_bitfield_get_kernels ()->find_and_not (x, y, i + 1, len);
+
+		if (i == len)
+			return -1;
+
+		bits = x[i] & ~y[i];
+	}
+
+	start = i * 8;
+
+	while ((bits & 0x80) == 0) {
+		bits <<= 1;
+		start++;
+	}
+
+	return start;
+}
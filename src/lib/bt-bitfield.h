@@ -0,0 +1,53 @@
+/**
+ * bt-bitfield.h
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __BT_BITFIELD_H__
+#define __BT_BITFIELD_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Bitfields are kept in the same format as bitfield messages: one bit per
+ * piece, the most significant bit of the first byte being piece 0. The
+ * functions that scan a whole bitfield expect the spare bits past the last
+ * piece to be clear, which bt_bitfield_clear_spare() takes care of.
+ */
+
+gboolean bt_bitfield_get (const gchar *bitfield, guint index);
+
+void     bt_bitfield_set (gchar *bitfield, guint index);
+
+void     bt_bitfield_clear (gchar *bitfield, guint index);
+
+void     bt_bitfield_clear_spare (gchar *bitfield, guint num_bits);
+
+guint    bt_bitfield_count (const gchar *bitfield, guint num_bits);
+
+guint    bt_bitfield_count_and_not (const gchar *a, const gchar *b, guint num_bits);
+
+gboolean bt_bitfield_any_and_not (const gchar *a, const gchar *b, guint num_bits);
+
+gint     bt_bitfield_find_and_not (const gchar *a, const gchar *b, guint num_bits, guint start);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,1542 @@
+/**
+ * bt-dht.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+
+#include "bt-dht.h"
+#include "bt-udp.h"
+#include "bt-bencode.h"
+#include "bt-utils.h"
+#include "sha1.h"
+
+/* nodes per bucket, and the closest nodes returned or announced to */
+#define BT_DHT_K 8
+
+/* one bucket for each bit of common prefix with our id */
+#define BT_DHT_NUM_BUCKETS 160
+
+/* queries one lookup has out at once, and all of them together; lookups wait
+ * for a slot rather than flooding the network */
+#define BT_DHT_ALPHA 3
+#define BT_DHT_MAX_QUERIES 64
+
+/* the closest nodes a lookup keeps track of */
+#define BT_DHT_LOOKUP_SIZE 32
+
+/* the most peers a lookup collects */
+#define BT_DHT_LOOKUP_MAX_PEERS 256
+
+/* seconds a query waits for a response */
+#define BT_DHT_QUERY_TIMEOUT 5
+
+/* unanswered queries after which a node is replaced by the next one that
+ * comes along, and seconds after which a node that's been quiet is pinged
+ * when its bucket is full */
+#define BT_DHT_MAX_FAILS 3
+#define BT_DHT_NODE_STALE (15 * 60)
+
+/* seconds between refreshing a bucket that hasn't changed, and between
+ * lookups for our own id while the table is nearly empty */
+#define BT_DHT_REFRESH_INTERVAL (15 * 60)
+#define BT_DHT_BOOTSTRAP_INTERVAL 30
+
+/* seconds between changing the secret tokens are made from; tokens from the
+ * previous one are still taken */
+#define BT_DHT_SECRET_INTERVAL (5 * 60)
+#define BT_DHT_TOKEN_LENGTH 8
+#define BT_DHT_MAX_TOKEN_LENGTH 20
+
+/* peers announced to us: how long they're kept, how many for each torrent
+ * and for how many torrents, and how many go in one response */
+#define BT_DHT_PEER_TTL (30 * 60)
+#define BT_DHT_MAX_STORED_PEERS 128
+#define BT_DHT_MAX_STORED_HASHES 2048
+#define BT_DHT_MAX_VALUES 50
+
+/* the largest message we send, to stay within a single packet */
+#define BT_DHT_MAX_MESSAGE 1400
+
+/* the longest transaction id taken; it's sent back in the reply, which has to
+ * stay within BT_DHT_MAX_MESSAGE, and clients use a few bytes */
+#define BT_DHT_MAX_TID_LENGTH 16
+
+typedef enum {
+	BT_DHT_QUERY_PING,
+	BT_DHT_QUERY_FIND_NODE,
+	BT_DHT_QUERY_GET_PEERS,
+	BT_DHT_QUERY_ANNOUNCE_PEER
+} BtDhtQueryType;
+
+static const gchar *bt_dht_query_names[] = {"ping", "find_node", "get_peers", "announce_peer"};
+
+/* a node in the routing table */
+typedef struct {
+	/* the id, address and port as they go out in "nodes" */
+	guint8     compact[26];
+	guint8     fails;
+
+	/* when we last heard from it, in seconds */
+	glong      seen;
+} BtDhtNode;
+
+typedef struct {
+	BtDhtNode  nodes[BT_DHT_K];
+	guint      len;
+
+	/* when a node was last added, in seconds */
+	glong      changed;
+} BtDhtBucket;
+
+typedef struct _BtDhtLookup BtDhtLookup;
+
+typedef struct {
+	guint16        tid;
+	BtDhtQueryType type;
+	BtAddress      address;
+	glong          sent;
+
+	/* the id of the node, if it's known */
+	guint8         id[20];
+	gboolean       has_id;
+
+	/* the lookup the query is part of, or NULL */
+	BtDhtLookup   *lookup;
+} BtDhtQuery;
+
+typedef enum {
+	BT_DHT_CANDIDATE_NEW,
+	BT_DHT_CANDIDATE_QUERIED,
+	BT_DHT_CANDIDATE_REPLIED,
+	BT_DHT_CANDIDATE_FAILED
+} BtDhtCandidateState;
+
+/* a node a lookup has heard of */
+typedef struct {
+	guint8     id[20];
+	BtAddress  address;
+	guint8     state;
+
+	/* the token from its get_peers response, for announcing */
+	guint8     token_len;
+	gchar      token[BT_DHT_MAX_TOKEN_LENGTH];
+} BtDhtCandidate;
+
+struct _BtDhtLookup {
+	guint8         target[20];
+	BtDhtQueryType type;
+
+	/* the port to announce once the closest nodes are found, or 0 */
+	guint16        port;
+
+	BtDhtPeersFunc func;
+	gpointer       data;
+
+	/* the closest nodes heard of so far, as BtDhtCandidate sorted by
+	 * distance to the target */
+	GArray        *candidates;
+
+	/* queries out, including ones to candidates that have been pushed out
+	 * since */
+	guint          in_flight;
+
+	/* the peers found, as BtAddress */
+	GArray        *peers;
+};
+
+/* peers announced to us for a torrent */
+typedef struct {
+	gchar      infohash[20];
+
+	/* as BtDhtPeer, in the order they were announced */
+	GArray    *peers;
+} BtDhtStorage;
+
+typedef struct {
+	BtAddress  address;
+	glong      announced;
+} BtDhtPeer;
+
+struct _BtDht {
+	GMainContext *context;
+	BtUdpSocket  *socket;
+	GSource      *tick_source;
+
+	guint8        id[20];
+
+	BtDhtBucket   buckets[BT_DHT_NUM_BUCKETS];
+	guint         num_nodes;
+	glong         last_bootstrap;
+
+	/* the last few addresses we were given, pinged again while the table
+	 * is empty, and when that was last done */
+	BtAddress     routers[BT_DHT_K];
+	guint         num_routers;
+	guint         next_router;
+	glong         last_ping;
+
+	/* queries waiting for a response, by transaction id */
+	GHashTable   *queries;
+	guint16       next_tid;
+
+	GList        *lookups;
+
+	gchar         secret[20];
+	gchar         old_secret[20];
+	glong         secret_changed;
+
+	/* BtDhtStorage by infohash */
+	GHashTable   *storage;
+	glong         storage_expired;
+
+	/* addresses from other threads to be pinged */
+	GStaticMutex  pending_lock;
+	GArray       *pending;
+	GSource      *pending_source;
+
+	BtDhtStats    stats;
+};
+
+static glong
+bt_dht_now ()
+{
+	GTimeVal now;
+
+	g_get_current_time (&now);
+
+	return now.tv_sec;
+}
+
+static void
+bt_dht_random_bytes (guint8 *bytes, guint len)
+{
+	guint i;
+
+	for (i = 0; i < len; i++)
+		bytes[i] = g_random_int_range (0, 256);
+}
+
+/* the number of leading bits two ids have in common, 160 if they're equal */
+static guint
+bt_dht_common_bits (const guint8 *a, const guint8 *b)
+{
+	guint8 x;
+	guint i, bits;
+
+	for (i = 0; i < 20 && a[i] == b[i]; i++)
+		;
+
+	if (i == 20)
+		return 160;
+
+	x = a[i] ^ b[i];
+
+	for (bits = i * 8; !(x & 0x80); x <<= 1)
+		bits++;
+
+	return bits;
+}
+
+/* orders two ids by their distance to a target */
+static gint
+bt_dht_compare_distance (const guint8 *target, const guint8 *a, const guint8 *b)
+{
+	guint i;
+
+	for (i = 0; i < 20; i++) {
+		guint8 x = a[i] ^ target[i], y = b[i] ^ target[i];
+
+		if (x != y)
+			return x < y ? -1 : 1;
+	}
+
+	return 0;
+}
+
+static void
+bt_dht_node_get_address (const BtDhtNode *node, BtAddress *address)
+{
+	bt_address_set_bytes (address, (const gchar *) node->compact + 20, 4, node->compact[24] << 8 | node->compact[25]);
+}
+
+static void
+bt_dht_make_compact (guint8 *compact, const guint8 *id, const BtAddress *address)
+{
+	memcpy (compact, id, 20);
+	memcpy (compact + 20, address->bytes, 4);
+	compact[24] = address->port >> 8;
+	compact[25] = address->port & 0xff;
+}
+
+static BtDhtNode *
+bt_dht_find_node (BtDht *dht, const guint8 *id)
+{
+	BtDhtBucket *bucket;
+	guint bits, i;
+
+	if ((bits = bt_dht_common_bits (dht->id, id)) >= BT_DHT_NUM_BUCKETS)
+		return NULL;
+
+	bucket = &dht->buckets[bits];
+
+	for (i = 0; i < bucket->len; i++)
+		if (memcmp (bucket->nodes[i].compact, id, 20) == 0)
+			return &bucket->nodes[i];
+
+	return NULL;
+}
+
+/* keeps the best BT_DHT_K nodes for a target in order */
+static void
+bt_dht_consider_node (const guint8 *target, BtDhtNode **best, guint *num, BtDhtNode *node)
+{
+	guint i;
+
+	if (node->fails >= BT_DHT_MAX_FAILS)
+		return;
+
+	i = *num;
+
+	if (i == BT_DHT_K) {
+		if (bt_dht_compare_distance (target, node->compact, best[BT_DHT_K - 1]->compact) >= 0)
+			return;
+		i = BT_DHT_K - 1;
+	} else {
+		(*num)++;
+	}
+
+	for (; i > 0 && bt_dht_compare_distance (target, node->compact, best[i - 1]->compact) < 0; i--)
+		best[i] = best[i - 1];
+
+	best[i] = node;
+}
+
+/* finds the nodes in the table closest to a target. The target's own bucket
+ * holds the closest ones, then every bucket further along is the same
+ * distance class, then the ones before it get further away one by one, so the
+ * search stops as soon as a whole class has been looked at and there are
+ * enough. */
+static guint
+bt_dht_closest_nodes (BtDht *dht, const guint8 *target, BtDhtNode **best)
+{
+	guint bits, num = 0, i, j;
+
+	bits = MIN (bt_dht_common_bits (dht->id, target), BT_DHT_NUM_BUCKETS - 1);
+
+	for (j = 0; j < dht->buckets[bits].len; j++)
+		bt_dht_consider_node (target, best, &num, &dht->buckets[bits].nodes[j]);
+
+	if (num < BT_DHT_K)
+		for (i = bits + 1; i < BT_DHT_NUM_BUCKETS; i++)
+			for (j = 0; j < dht->buckets[i].len; j++)
+				bt_dht_consider_node (target, best, &num, &dht->buckets[i].nodes[j]);
+
+	for (i = bits; i-- > 0 && num < BT_DHT_K;)
+		for (j = 0; j < dht->buckets[i].len; j++)
+			bt_dht_consider_node (target, best, &num, &dht->buckets[i].nodes[j]);
+
+	return num;
+}
+
+static void
+bt_dht_set_string (BtBencodeDictEntry *entry, const gchar *key, const gchar *str, gsize len)
+{
+	memset (entry, 0, sizeof (BtBencodeDictEntry));
+	entry->key.str = key;
+	entry->key.len = strlen (key);
+	entry->value.type = BT_BENCODE_TYPE_STRING;
+	entry->value.string.str = str;
+	entry->value.string.len = len;
+}
+
+static void
+bt_dht_set_int (BtBencodeDictEntry *entry, const gchar *key, gint64 value)
+{
+	memset (entry, 0, sizeof (BtBencodeDictEntry));
+	entry->key.str = key;
+	entry->key.len = strlen (key);
+	entry->value.type = BT_BENCODE_TYPE_INT;
+	entry->value.value = value;
+}
+
+static void
+bt_dht_set_dict (BtBencodeDictEntry *entry, const gchar *key, BtBencodeDictEntry *entries, guint len)
+{
+	memset (entry, 0, sizeof (BtBencodeDictEntry));
+	entry->key.str = key;
+	entry->key.len = strlen (key);
+	entry->value.type = BT_BENCODE_TYPE_DICT;
+	entry->value.dict.entries = entries;
+	entry->value.dict.len = len;
+}
+
+/* encodes a message from entries in key order and sends it */
+static void
+bt_dht_send (BtDht *dht, const BtAddress *to, BtBencodeDictEntry *entries, guint len)
+{
+	BtBencode message;
+	gchar buf[BT_DHT_MAX_MESSAGE];
+	gsize size;
+
+	memset (&message, 0, sizeof (message));
+	message.type = BT_BENCODE_TYPE_DICT;
+	message.dict.entries = entries;
+	message.dict.len = len;
+
+	size = bt_bencode_encoded_size (&message);
+
+	g_return_if_fail (size <= sizeof (buf));
+
+	bt_bencode_encode_into (&message, buf);
+
+	bt_udp_socket_send (dht->socket, to, buf, size);
+}
+
+static void
+bt_dht_send_error (BtDht *dht, const BtAddress *to, const BtBencodeString *tid, gint code, const gchar *text)
+{
+	BtBencodeDictEntry entries[3];
+	BtBencode error[2];
+
+	memset (error, 0, sizeof (error));
+	error[0].type = BT_BENCODE_TYPE_INT;
+	error[0].value = code;
+	error[1].type = BT_BENCODE_TYPE_STRING;
+	error[1].string.str = text;
+	error[1].string.len = strlen (text);
+
+	memset (&entries[0], 0, sizeof (BtBencodeDictEntry));
+	entries[0].key.str = "e";
+	entries[0].key.len = 1;
+	entries[0].value.type = BT_BENCODE_TYPE_LIST;
+	entries[0].value.list.items = error;
+	entries[0].value.list.len = 2;
+
+	bt_dht_set_string (&entries[1], "t", tid->str, tid->len);
+	bt_dht_set_string (&entries[2], "y", "e", 1);
+
+	bt_dht_send (dht, to, entries, 3);
+}
+
+/* sends a query; @target is the node id or infohash looked for, and @token
+ * and @port are for announces */
+static void
+bt_dht_send_query (BtDht *dht, const BtAddress *to, const guint8 *id, BtDhtQueryType type, const guint8 *target,
+                   const gchar *token, gsize token_len, guint16 port, BtDhtLookup *lookup)
+{
+	BtDhtQuery *query;
+	BtBencodeDictEntry entries[4], args[4];
+	guint num_args = 0;
+	gchar tid[2];
+
+	query = g_slice_new0 (BtDhtQuery);
+
+	/* transaction ids wrap around long after the old ones have timed out */
+	do {
+		query->tid = dht->next_tid++;
+	} while (g_hash_table_lookup (dht->queries, GUINT_TO_POINTER ((guint) query->tid)) != NULL);
+
+	query->type = type;
+	query->address = *to;
+	query->sent = bt_dht_now ();
+	query->lookup = lookup;
+
+	if (id != NULL) {
+		memcpy (query->id, id, 20);
+		query->has_id = TRUE;
+	}
+
+	g_hash_table_insert (dht->queries, GUINT_TO_POINTER ((guint) query->tid), query);
+
+	tid[0] = query->tid >> 8;
+	tid[1] = query->tid & 0xff;
+
+	/* the arguments, in key order */
+	bt_dht_set_string (&args[num_args++], "id", (const gchar *) dht->id, 20);
+
+	switch (type) {
+	case BT_DHT_QUERY_FIND_NODE:
+		bt_dht_set_string (&args[num_args++], "target", (const gchar *) target, 20);
+		break;
+
+	case BT_DHT_QUERY_GET_PEERS:
+		bt_dht_set_string (&args[num_args++], "info_hash", (const gchar *) target, 20);
+		break;
+
+	case BT_DHT_QUERY_ANNOUNCE_PEER:
+		bt_dht_set_string (&args[num_args++], "info_hash", (const gchar *) target, 20);
+		bt_dht_set_int (&args[num_args++], "port", port);
+		bt_dht_set_string (&args[num_args++], "token", token, token_len);
+		break;
+
+	default:
+		break;
+	}
+
+	bt_dht_set_dict (&entries[0], "a", args, num_args);
+	bt_dht_set_string (&entries[1], "q", bt_dht_query_names[type], strlen (bt_dht_query_names[type]));
+	bt_dht_set_string (&entries[2], "t", tid, 2);
+	bt_dht_set_string (&entries[3], "y", "q", 1);
+
+	bt_dht_send (dht, to, entries, 4);
+
+	dht->stats.queries_sent++;
+}
+
+static gboolean
+bt_dht_query_to (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data)
+{
+	return bt_address_equal (&((BtDhtQuery *) value)->address, (const BtAddress *) data);
+}
+
+/* notes that we heard from a node, adding it to the table if there's room.
+ * A full bucket only takes a new node in place of one that stopped
+ * answering; if its quietest node hasn't been heard from in a while, that one
+ * is pinged so it can be replaced if it's gone. A node that has only sent us
+ * a query isn't known to answer, so it's pinged and goes in once it does. */
+static void
+bt_dht_update_node (BtDht *dht, const guint8 *id, const BtAddress *address, gboolean replied)
+{
+	BtDhtBucket *bucket;
+	BtDhtNode *node, *oldest;
+	gboolean append = FALSE;
+	glong now;
+	guint bits, i;
+
+	if (address->length != 4 || address->port == 0)
+		return;
+
+	if ((bits = bt_dht_common_bits (dht->id, id)) >= BT_DHT_NUM_BUCKETS)
+		return;
+
+	bucket = &dht->buckets[bits];
+	now = bt_dht_now ();
+
+	if ((node = bt_dht_find_node (dht, id)) != NULL) {
+		/* a node only moves if it answers from the new address */
+		if (replied) {
+			bt_dht_make_compact (node->compact, id, address);
+			node->fails = 0;
+		}
+
+		node->seen = now;
+		return;
+	}
+
+	node = NULL;
+	oldest = NULL;
+
+	if (bucket->len < BT_DHT_K) {
+		node = &bucket->nodes[bucket->len];
+		append = TRUE;
+	} else {
+		for (i = 0; i < bucket->len; i++) {
+			if (bucket->nodes[i].fails >= BT_DHT_MAX_FAILS) {
+				node = &bucket->nodes[i];
+				break;
+			}
+
+			if (oldest == NULL || bucket->nodes[i].seen < oldest->seen)
+				oldest = &bucket->nodes[i];
+		}
+	}
+
+	if (node == NULL) {
+		if (now - oldest->seen >= BT_DHT_NODE_STALE && oldest->fails == 0) {
+			BtAddress oldest_address;
+
+			bt_dht_node_get_address (oldest, &oldest_address);
+			bt_dht_send_query (dht, &oldest_address, oldest->compact, BT_DHT_QUERY_PING, NULL, NULL, 0, 0, NULL);
+
+			/* counted as a failure until it answers */
+			oldest->fails++;
+		}
+
+		return;
+	}
+
+	if (!replied) {
+		if (g_hash_table_size (dht->queries) < BT_DHT_MAX_QUERIES
+		    && g_hash_table_find (dht->queries, bt_dht_query_to, (gpointer) address) == NULL)
+			bt_dht_send_query (dht, address, id, BT_DHT_QUERY_PING, NULL, NULL, 0, 0, NULL);
+
+		return;
+	}
+
+	if (append) {
+		bucket->len++;
+
+		/* the first node is enough to start looking for more */
+		if (dht->num_nodes++ == 0)
+			dht->last_bootstrap = 0;
+	}
+
+	bt_dht_make_compact (node->compact, id, address);
+	node->fails = 0;
+	node->seen = now;
+	bucket->changed = now;
+}
+
+static void
+bt_dht_make_token (BtDht *dht, const gchar *secret, const BtAddress *address, gchar *token)
+{
+	SHA1Context sha;
+	gchar hash[20];
+
+	sha1_init (&sha);
+	sha1_update (&sha, secret, 20);
+	sha1_update (&sha, (const gchar *) address->bytes, address->length);
+	sha1_finish (&sha, hash);
+
+	memcpy (token, hash, BT_DHT_TOKEN_LENGTH);
+}
+
+static gboolean
+bt_dht_check_token (BtDht *dht, const BtAddress *address, const BtBencode *token)
+{
+	gchar expected[BT_DHT_TOKEN_LENGTH];
+
+	if (token == NULL || token->type != BT_BENCODE_TYPE_STRING || token->string.len != BT_DHT_TOKEN_LENGTH)
+		return FALSE;
+
+	bt_dht_make_token (dht, dht->secret, address, expected);
+
+	if (memcmp (expected, token->string.str, BT_DHT_TOKEN_LENGTH) == 0)
+		return TRUE;
+
+	bt_dht_make_token (dht, dht->old_secret, address, expected);
+
+	return memcmp (expected, token->string.str, BT_DHT_TOKEN_LENGTH) == 0;
+}
+
+static void
+bt_dht_storage_free (gpointer data)
+{
+	BtDhtStorage *storage = (BtDhtStorage *) data;
+
+	g_array_free (storage->peers, TRUE);
+	g_slice_free (BtDhtStorage, storage);
+}
+
+static void
+bt_dht_store_peer (BtDht *dht, const gchar *infohash, const BtAddress *address)
+{
+	BtDhtStorage *storage;
+	BtDhtPeer peer;
+	guint i;
+
+	if (!(storage = g_hash_table_lookup (dht->storage, infohash))) {
+		if (g_hash_table_size (dht->storage) >= BT_DHT_MAX_STORED_HASHES)
+			return;
+
+		storage = g_slice_new (BtDhtStorage);
+		memcpy (storage->infohash, infohash, 20);
+		storage->peers = g_array_new (FALSE, FALSE, sizeof (BtDhtPeer));
+
+		g_hash_table_insert (dht->storage, storage->infohash, storage);
+	}
+
+	/* a peer that announces again goes to the back, as the newest */
+	for (i = 0; i < storage->peers->len; i++) {
+		if (bt_address_equal (&g_array_index (storage->peers, BtDhtPeer, i).address, address)) {
+			g_array_remove_index (storage->peers, i);
+			break;
+		}
+	}
+
+	if (storage->peers->len >= BT_DHT_MAX_STORED_PEERS)
+		g_array_remove_index (storage->peers, 0);
+
+	peer.address = *address;
+	peer.announced = bt_dht_now ();
+
+	g_array_append_val (storage->peers, peer);
+}
+
+static gboolean
+bt_dht_expire_storage (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data)
+{
+	BtDhtStorage *storage = (BtDhtStorage *) value;
+	glong now = *(glong *) data;
+	guint i;
+
+	for (i = 0; i < storage->peers->len; i++)
+		if (now - g_array_index (storage->peers, BtDhtPeer, i).announced < BT_DHT_PEER_TTL)
+			break;
+
+	g_array_remove_range (storage->peers, 0, i);
+
+	return storage->peers->len == 0;
+}
+
+/* answers a query, with the nodes closest to @target if there is one, and a
+ * token and the peers we know for @infohash if there is one */
+static void
+bt_dht_send_response (BtDht *dht, const BtAddress *to, const BtBencodeString *tid, const guint8 *target, const gchar *infohash)
+{
+	BtBencodeDictEntry entries[3], r[4];
+	BtBencode values[BT_DHT_MAX_VALUES];
+	guint8 compact[BT_DHT_K * 26], values_compact[BT_DHT_MAX_VALUES * 6];
+	BtDhtNode *best[BT_DHT_K];
+	gchar token[BT_DHT_TOKEN_LENGTH];
+	guint num_r = 0, num, i;
+
+	bt_dht_set_string (&r[num_r++], "id", (const gchar *) dht->id, 20);
+
+	if (target != NULL) {
+		num = bt_dht_closest_nodes (dht, target, best);
+
+		for (i = 0; i < num; i++)
+			memcpy (compact + i * 26, best[i]->compact, 26);
+
+		bt_dht_set_string (&r[num_r++], "nodes", (const gchar *) compact, num * 26);
+	}
+
+	if (infohash != NULL) {
+		BtDhtStorage *storage;
+
+		bt_dht_make_token (dht, dht->secret, to, token);
+		bt_dht_set_string (&r[num_r++], "token", token, BT_DHT_TOKEN_LENGTH);
+
+		storage = g_hash_table_lookup (dht->storage, infohash);
+
+		if (storage != NULL && storage->peers->len > 0) {
+			memset (values, 0, sizeof (values));
+
+			/* the newest ones */
+			num = MIN (storage->peers->len, BT_DHT_MAX_VALUES);
+
+			for (i = 0; i < num; i++) {
+				const BtAddress *address = &g_array_index (storage->peers, BtDhtPeer, storage->peers->len - 1 - i).address;
+
+				memcpy (values_compact + i * 6, address->bytes, 4);
+				values_compact[i * 6 + 4] = address->port >> 8;
+				values_compact[i * 6 + 5] = address->port & 0xff;
+
+				values[i].type = BT_BENCODE_TYPE_STRING;
+				values[i].string.str = (const gchar *) values_compact + i * 6;
+				values[i].string.len = 6;
+			}
+
+			memset (&r[num_r], 0, sizeof (BtBencodeDictEntry));
+			r[num_r].key.str = "values";
+			r[num_r].key.len = 6;
+			r[num_r].value.type = BT_BENCODE_TYPE_LIST;
+			r[num_r].value.list.items = values;
+			r[num_r].value.list.len = num;
+			num_r++;
+		}
+	}
+
+	bt_dht_set_dict (&entries[0], "r", r, num_r);
+	bt_dht_set_string (&entries[1], "t", tid->str, tid->len);
+	bt_dht_set_string (&entries[2], "y", "r", 1);
+
+	bt_dht_send (dht, to, entries, 3);
+}
+
+static const guint8 *
+bt_dht_lookup_id (BtBencode *dict, const gchar *key)
+{
+	BtBencode *id = bt_bencode_lookup (dict, key);
+
+	if (id == NULL || id->type != BT_BENCODE_TYPE_STRING || id->string.len != 20)
+		return NULL;
+
+	return (const guint8 *) id->string.str;
+}
+
+static void
+bt_dht_on_query (BtDht *dht, const BtAddress *from, BtBencode *message, const BtBencodeString *tid)
+{
+	BtBencode *q, *a;
+	const guint8 *id, *target;
+
+	dht->stats.queries_received++;
+
+	q = bt_bencode_lookup (message, "q");
+	a = bt_bencode_lookup (message, "a");
+
+	if (!q || q->type != BT_BENCODE_TYPE_STRING || !a || a->type != BT_BENCODE_TYPE_DICT
+		|| !(id = bt_dht_lookup_id (a, "id"))) {
+		bt_dht_send_error (dht, from, tid, 203, "Protocol Error");
+		return;
+	}
+
+	bt_dht_update_node (dht, id, from, FALSE);
+
+	if (q->string.len == 4 && memcmp (q->string.str, "ping", 4) == 0) {
+		bt_dht_send_response (dht, from, tid, NULL, NULL);
+	} else if (q->string.len == 9 && memcmp (q->string.str, "find_node", 9) == 0) {
+		if (!(target = bt_dht_lookup_id (a, "target")))
+			bt_dht_send_error (dht, from, tid, 203, "Protocol Error");
+		else
+			bt_dht_send_response (dht, from, tid, target, NULL);
+	} else if (q->string.len == 9 && memcmp (q->string.str, "get_peers", 9) == 0) {
+		if (!(target = bt_dht_lookup_id (a, "info_hash")))
+			bt_dht_send_error (dht, from, tid, 203, "Protocol Error");
+		else
+			bt_dht_send_response (dht, from, tid, target, (const gchar *) target);
+	} else if (q->string.len == 13 && memcmp (q->string.str, "announce_peer", 13) == 0) {
+		BtBencode *port, *implied_port;
+		BtAddress peer;
+
+		port = bt_bencode_lookup (a, "port");
+		implied_port = bt_bencode_lookup (a, "implied_port");
+
+		if (!(target = bt_dht_lookup_id (a, "info_hash")) || !port || port->type != BT_BENCODE_TYPE_INT
+			|| port->value <= 0 || port->value > 65535) {
+			bt_dht_send_error (dht, from, tid, 203, "Protocol Error");
+			return;
+		}
+
+		if (!bt_dht_check_token (dht, from, bt_bencode_lookup (a, "token"))) {
+			bt_dht_send_error (dht, from, tid, 203, "Bad Token");
+			return;
+		}
+
+		peer = *from;
+
+		/* peers behind NAT ask for the port they're seen from */
+		if (!implied_port || implied_port->type != BT_BENCODE_TYPE_INT || implied_port->value == 0)
+			peer.port = port->value;
+
+		bt_dht_store_peer (dht, (const gchar *) target, &peer);
+		bt_dht_send_response (dht, from, tid, NULL, NULL);
+	} else {
+		bt_dht_send_error (dht, from, tid, 204, "Method Unknown");
+	}
+}
+
+static void bt_dht_lookup_step (BtDht *dht, BtDhtLookup *lookup);
+
+/* puts a candidate where it goes by distance, if it's among the closest; one
+ * with the same id is only replaced by a node that replied */
+static void
+bt_dht_lookup_insert (BtDhtLookup *lookup, const BtDhtCandidate *candidate)
+{
+	guint low, high;
+
+	low = 0;
+	high = lookup->candidates->len;
+
+	while (low < high) {
+		guint mid = (low + high) / 2;
+		BtDhtCandidate *other = &g_array_index (lookup->candidates, BtDhtCandidate, mid);
+		gint cmp = bt_dht_compare_distance (lookup->target, candidate->id, other->id);
+
+		if (cmp == 0) {
+			if (candidate->state == BT_DHT_CANDIDATE_REPLIED && other->state != BT_DHT_CANDIDATE_REPLIED)
+				*other = *candidate;
+
+			return;
+		}
+
+		if (cmp < 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+
+	if (low >= BT_DHT_LOOKUP_SIZE)
+		return;
+
+	g_array_insert_vals (lookup->candidates, low, candidate, 1);
+
+	if (lookup->candidates->len > BT_DHT_LOOKUP_SIZE)
+		g_array_set_size (lookup->candidates, BT_DHT_LOOKUP_SIZE);
+}
+
+/* adds a node a lookup heard of, keeping the closest ones */
+static void
+bt_dht_lookup_add (BtDht *dht, BtDhtLookup *lookup, const guint8 *id, const BtAddress *address)
+{
+	BtDhtCandidate candidate;
+
+	if (memcmp (id, dht->id, 20) == 0 || address->port == 0)
+		return;
+
+	memset (&candidate, 0, sizeof (candidate));
+	memcpy (candidate.id, id, 20);
+	candidate.address = *address;
+	candidate.state = BT_DHT_CANDIDATE_NEW;
+
+	bt_dht_lookup_insert (lookup, &candidate);
+}
+
+static BtDhtCandidate *
+bt_dht_lookup_find (BtDhtLookup *lookup, const BtAddress *address)
+{
+	guint i;
+
+	for (i = 0; i < lookup->candidates->len; i++) {
+		BtDhtCandidate *candidate = &g_array_index (lookup->candidates, BtDhtCandidate, i);
+
+		if (candidate->state == BT_DHT_CANDIDATE_QUERIED && bt_address_equal (&candidate->address, address))
+			return candidate;
+	}
+
+	return NULL;
+}
+
+static void
+bt_dht_lookup_add_peer (BtDhtLookup *lookup, const gchar *compact)
+{
+	BtAddress address;
+	guint i;
+
+	bt_address_set_bytes (&address, compact, 4, (guint8) compact[4] << 8 | (guint8) compact[5]);
+
+	if (address.port == 0 || lookup->peers->len >= BT_DHT_LOOKUP_MAX_PEERS)
+		return;
+
+	for (i = 0; i < lookup->peers->len; i++)
+		if (bt_address_equal (&g_array_index (lookup->peers, BtAddress, i), &address))
+			return;
+
+	g_array_append_val (lookup->peers, address);
+}
+
+static void
+bt_dht_lookup_on_response (BtDht *dht, BtDhtLookup *lookup, BtDhtQuery *query, const guint8 *id, BtBencode *r)
+{
+	BtDhtCandidate *candidate;
+	BtBencode *nodes, *values, *token;
+	guint i;
+
+	lookup->in_flight--;
+
+	if ((candidate = bt_dht_lookup_find (lookup, &query->address)) != NULL) {
+		BtDhtCandidate replied = *candidate;
+
+		replied.state = BT_DHT_CANDIDATE_REPLIED;
+
+		token = bt_bencode_lookup (r, "token");
+
+		if (token && token->type == BT_BENCODE_TYPE_STRING && token->string.len <= BT_DHT_MAX_TOKEN_LENGTH) {
+			memcpy (replied.token, token->string.str, token->string.len);
+			replied.token_len = token->string.len;
+		}
+
+		/* the node may not have the id it was given as, which moves it */
+		if (memcmp (replied.id, id, 20) == 0) {
+			*candidate = replied;
+		} else {
+			memcpy (replied.id, id, 20);
+
+			g_array_remove_index (lookup->candidates, candidate - (BtDhtCandidate *) lookup->candidates->data);
+			bt_dht_lookup_insert (lookup, &replied);
+		}
+	}
+
+	nodes = bt_bencode_lookup (r, "nodes");
+
+	if (nodes && nodes->type == BT_BENCODE_TYPE_STRING) {
+		for (i = 0; i + 26 <= nodes->string.len; i += 26) {
+			const gchar *compact = nodes->string.str + i;
+			BtAddress address;
+
+			bt_address_set_bytes (&address, compact + 20, 4, (guint8) compact[24] << 8 | (guint8) compact[25]);
+			bt_dht_lookup_add (dht, lookup, (const guint8 *) compact, &address);
+		}
+	}
+
+	values = bt_bencode_lookup (r, "values");
+
+	if (lookup->type == BT_DHT_QUERY_GET_PEERS && values && values->type == BT_BENCODE_TYPE_LIST) {
+		for (i = 0; i < values->list.len; i++) {
+			BtBencode *value = bt_bencode_list_index (values, i);
+
+			if (value->type == BT_BENCODE_TYPE_STRING && value->string.len == 6)
+				bt_dht_lookup_add_peer (lookup, value->string.str);
+		}
+	}
+}
+
+static void
+bt_dht_lookup_on_failure (BtDhtLookup *lookup, BtDhtQuery *query)
+{
+	BtDhtCandidate *candidate;
+
+	lookup->in_flight--;
+
+	if ((candidate = bt_dht_lookup_find (lookup, &query->address)) != NULL)
+		candidate->state = BT_DHT_CANDIDATE_FAILED;
+}
+
+static void
+bt_dht_query_free (BtDhtQuery *query)
+{
+	g_slice_free (BtDhtQuery, query);
+}
+
+/* gives the lookups that were waiting for a free slot their turn */
+static void
+bt_dht_run_lookups (BtDht *dht)
+{
+	GList *l, *next;
+
+	for (l = dht->lookups; l != NULL; l = next) {
+		next = l->next;
+
+		if (g_hash_table_size (dht->queries) >= BT_DHT_MAX_QUERIES)
+			break;
+
+		bt_dht_lookup_step (dht, (BtDhtLookup *) l->data);
+	}
+}
+
+/* a query that timed out or came back with an error */
+static void
+bt_dht_query_failed (BtDht *dht, BtDhtQuery *query)
+{
+	BtDhtNode *node;
+
+	if (query->has_id && (node = bt_dht_find_node (dht, query->id)) != NULL && node->fails < G_MAXUINT8)
+		node->fails++;
+
+	if (query->lookup != NULL)
+		bt_dht_lookup_on_failure (query->lookup, query);
+}
+
+static void
+bt_dht_on_response (BtDht *dht, const BtAddress *from, BtBencode *message, const BtBencodeString *tid, gboolean error)
+{
+	BtDhtQuery *query;
+	BtBencode *r;
+	const guint8 *id = NULL;
+	guint key;
+
+	if (tid->len != 2)
+		return;
+
+	key = (guint8) tid->str[0] << 8 | (guint8) tid->str[1];
+
+	/* answers from anyone but the node we asked are ignored */
+	query = g_hash_table_lookup (dht->queries, GUINT_TO_POINTER (key));
+
+	if (query == NULL || !bt_address_equal (&query->address, from))
+		return;
+
+	g_hash_table_steal (dht->queries, GUINT_TO_POINTER (key));
+
+	r = bt_bencode_lookup (message, "r");
+
+	if (!error && r && r->type == BT_BENCODE_TYPE_DICT)
+		id = bt_dht_lookup_id (r, "id");
+
+	if (id == NULL) {
+		bt_dht_query_failed (dht, query);
+	} else {
+		dht->stats.responses++;
+
+		bt_dht_update_node (dht, id, from, TRUE);
+
+		if (query->lookup != NULL)
+			bt_dht_lookup_on_response (dht, query->lookup, query, id, r);
+	}
+
+	if (query->lookup != NULL)
+		bt_dht_lookup_step (dht, query->lookup);
+
+	bt_dht_query_free (query);
+
+	bt_dht_run_lookups (dht);
+}
+
+static void
+bt_dht_on_datagram (BtUdpSocket *socket G_GNUC_UNUSED, const BtAddress *from, const gchar *buf, gsize len, gpointer data)
+{
+	BtDht *dht = (BtDht *) data;
+	BtBencodeArena *arena;
+	BtBencode *message, *t, *y;
+
+	if (from->port == 0)
+		return;
+
+	arena = bt_bencode_arena_new (len);
+
+	message = bt_bencode_decode_arena (arena, buf, len, NULL);
+
+	if (message == NULL || message->type != BT_BENCODE_TYPE_DICT
+		|| !(t = bt_bencode_lookup (message, "t")) || t->type != BT_BENCODE_TYPE_STRING
+		|| t->string.len > BT_DHT_MAX_TID_LENGTH
+		|| !(y = bt_bencode_lookup (message, "y")) || y->type != BT_BENCODE_TYPE_STRING || y->string.len != 1) {
+		bt_bencode_arena_free (arena);
+		return;
+	}
+
+	switch (y->string.str[0]) {
+	case 'q':
+		bt_dht_on_query (dht, from, message, &t->string);
+		break;
+
+	case 'r':
+		bt_dht_on_response (dht, from, message, &t->string, FALSE);
+		break;
+
+	case 'e':
+		bt_dht_on_response (dht, from, message, &t->string, TRUE);
+		break;
+
+	default:
+		break;
+	}
+
+	bt_bencode_arena_free (arena);
+}
+
+/* announces to the closest nodes that gave us a token, and hands over the
+ * peers that were found */
+static void
+bt_dht_lookup_finish (BtDht *dht, BtDhtLookup *lookup)
+{
+	guint i, announced = 0;
+
+	dht->lookups = g_list_remove (dht->lookups, lookup);
+
+	for (i = 0; lookup->port != 0 && i < lookup->candidates->len && announced < BT_DHT_K; i++) {
+		BtDhtCandidate *candidate = &g_array_index (lookup->candidates, BtDhtCandidate, i);
+
+		if (candidate->state != BT_DHT_CANDIDATE_REPLIED || candidate->token_len == 0)
+			continue;
+
+		bt_dht_send_query (dht, &candidate->address, candidate->id, BT_DHT_QUERY_ANNOUNCE_PEER, lookup->target,
+		                   candidate->token, candidate->token_len, lookup->port, NULL);
+		announced++;
+	}
+
+	g_array_free (lookup->candidates, TRUE);
+
+	if (lookup->func != NULL)
+		lookup->func (dht, (const gchar *) lookup->target, lookup->peers, lookup->data);
+	else
+		g_array_free (lookup->peers, TRUE);
+
+	g_slice_free (BtDhtLookup, lookup);
+}
+
+/* queries the closest nodes that haven't been, until the closest BT_DHT_K
+ * that are left have all answered */
+static void
+bt_dht_lookup_step (BtDht *dht, BtDhtLookup *lookup)
+{
+	guint i, replied = 0;
+	gboolean waiting = FALSE;
+
+	for (i = 0; i < lookup->candidates->len && replied < BT_DHT_K; i++) {
+		BtDhtCandidate *candidate = &g_array_index (lookup->candidates, BtDhtCandidate, i);
+
+		if (candidate->state == BT_DHT_CANDIDATE_REPLIED)
+			replied++;
+
+		if (candidate->state != BT_DHT_CANDIDATE_NEW)
+			continue;
+
+		if (lookup->in_flight >= BT_DHT_ALPHA || g_hash_table_size (dht->queries) >= BT_DHT_MAX_QUERIES) {
+			waiting = TRUE;
+			continue;
+		}
+
+		bt_dht_send_query (dht, &candidate->address, candidate->id, lookup->type, lookup->target, NULL, 0, 0, lookup);
+		candidate->state = BT_DHT_CANDIDATE_QUERIED;
+		lookup->in_flight++;
+	}
+
+	if (lookup->in_flight == 0 && !waiting)
+		bt_dht_lookup_finish (dht, lookup);
+}
+
+static void
+bt_dht_start_lookup (BtDht *dht, const guint8 *target, BtDhtQueryType type, guint16 port, BtDhtPeersFunc func, gpointer data)
+{
+	BtDhtLookup *lookup;
+	BtDhtNode *best[BT_DHT_K];
+	guint num, i;
+
+	lookup = g_slice_new0 (BtDhtLookup);
+	memcpy (lookup->target, target, 20);
+	lookup->type = type;
+	lookup->port = port;
+	lookup->func = func;
+	lookup->data = data;
+	lookup->candidates = g_array_sized_new (FALSE, FALSE, sizeof (BtDhtCandidate), BT_DHT_LOOKUP_SIZE + 1);
+	lookup->peers = g_array_new (FALSE, FALSE, sizeof (BtAddress));
+
+	num = bt_dht_closest_nodes (dht, target, best);
+
+	for (i = 0; i < num; i++) {
+		BtAddress address;
+
+		bt_dht_node_get_address (best[i], &address);
+		bt_dht_lookup_add (dht, lookup, best[i]->compact, &address);
+	}
+
+	dht->lookups = g_list_append (dht->lookups, lookup);
+
+	bt_dht_lookup_step (dht, lookup);
+}
+
+static gboolean
+bt_dht_collect_expired (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data)
+{
+	BtDhtQuery *query = (BtDhtQuery *) value;
+	gpointer *expired = (gpointer *) data;
+
+	if (bt_dht_now () - query->sent < BT_DHT_QUERY_TIMEOUT)
+		return FALSE;
+
+	expired[0] = g_slist_prepend (expired[0], query);
+
+	return TRUE;
+}
+
+/* looks for nodes in a bucket nobody has been added to lately, with a random
+ * id that would go in it. Buckets up to the deepest one in use are looked
+ * into even if they're empty, since those are the ones the nodes we've
+ * found so far can't fill in by themselves. */
+static void
+bt_dht_refresh (BtDht *dht, glong now)
+{
+	guint8 target[20];
+	guint i, depth;
+
+	for (depth = BT_DHT_NUM_BUCKETS; depth > 0 && dht->buckets[depth - 1].len == 0; depth--)
+		;
+
+	for (i = 0; i < depth; i++) {
+		BtDhtBucket *bucket = &dht->buckets[i];
+
+		if (now - bucket->changed < BT_DHT_REFRESH_INTERVAL)
+			continue;
+
+		/* the same first i bits as our id, then a different one */
+		bt_dht_random_bytes (target, 20);
+		memcpy (target, dht->id, i / 8);
+		target[i / 8] = (dht->id[i / 8] & ~(0xff >> (i % 8))) | (~dht->id[i / 8] & (0x80 >> (i % 8))) | (target[i / 8] & (0x7f >> (i % 8)));
+
+		bucket->changed = now;
+
+		bt_dht_start_lookup (dht, target, BT_DHT_QUERY_FIND_NODE, 0, NULL, NULL);
+
+		/* one at a time */
+		return;
+	}
+}
+
+static gboolean
+bt_dht_tick (gpointer data)
+{
+	BtDht *dht = (BtDht *) data;
+	gpointer expired[1] = {NULL};
+	GSList *l;
+	glong now;
+	guint i;
+
+	now = bt_dht_now ();
+
+	g_hash_table_foreach_steal (dht->queries, bt_dht_collect_expired, expired);
+
+	for (l = expired[0]; l != NULL; l = l->next) {
+		BtDhtQuery *query = (BtDhtQuery *) l->data;
+
+		dht->stats.timeouts++;
+
+		bt_dht_query_failed (dht, query);
+
+		if (query->lookup != NULL)
+			bt_dht_lookup_step (dht, query->lookup);
+
+		bt_dht_query_free (query);
+	}
+
+	g_slist_free (expired[0]);
+
+	bt_dht_run_lookups (dht);
+
+	if (now - dht->secret_changed >= BT_DHT_SECRET_INTERVAL) {
+		memcpy (dht->old_secret, dht->secret, 20);
+		bt_dht_random_bytes ((guint8 *) dht->secret, 20);
+		dht->secret_changed = now;
+	}
+
+	if (now - dht->storage_expired >= 60) {
+		g_hash_table_foreach_remove (dht->storage, bt_dht_expire_storage, &now);
+		dht->storage_expired = now;
+	}
+
+	/* the first pings can get lost */
+	if (dht->num_nodes == 0 && now - dht->last_ping >= BT_DHT_QUERY_TIMEOUT * 2) {
+		for (i = 0; i < dht->num_routers; i++)
+			bt_dht_send_query (dht, &dht->routers[i], NULL, BT_DHT_QUERY_PING, NULL, NULL, 0, 0, NULL);
+
+		dht->last_ping = now;
+	}
+
+	/* a table that's nearly empty fills up by looking for ourselves */
+	if (dht->num_nodes > 0 && dht->num_nodes < BT_DHT_K * 4 && now - dht->last_bootstrap >= BT_DHT_BOOTSTRAP_INTERVAL) {
+		dht->last_bootstrap = now;
+		bt_dht_start_lookup (dht, dht->id, BT_DHT_QUERY_FIND_NODE, 0, NULL, NULL);
+	} else if (dht->lookups == NULL) {
+		bt_dht_refresh (dht, now);
+	}
+
+	return TRUE;
+}
+
+static gboolean
+bt_dht_ping_pending (gpointer data)
+{
+	BtDht *dht = (BtDht *) data;
+	GArray *pending;
+	guint i;
+
+	g_static_mutex_lock (&dht->pending_lock);
+
+	pending = dht->pending;
+	dht->pending = g_array_new (FALSE, FALSE, sizeof (BtAddress));
+
+	g_source_unref (dht->pending_source);
+	dht->pending_source = NULL;
+
+	g_static_mutex_unlock (&dht->pending_lock);
+
+	for (i = 0; i < pending->len; i++) {
+		BtAddress *address = &g_array_index (pending, BtAddress, i);
+
+		dht->routers[dht->next_router] = *address;
+		dht->next_router = (dht->next_router + 1) % BT_DHT_K;
+		dht->num_routers = MIN (dht->num_routers + 1, BT_DHT_K);
+
+		if (g_hash_table_size (dht->queries) < BT_DHT_MAX_QUERIES)
+			bt_dht_send_query (dht, address, NULL, BT_DHT_QUERY_PING, NULL, NULL, 0, 0, NULL);
+	}
+
+	g_array_free (pending, TRUE);
+
+	dht->last_ping = bt_dht_now ();
+
+	return FALSE;
+}
+
+/**
+ * bt_dht_new:
+ * @context: the main context to run in, or NULL for the default one
+ * @port: the UDP port to listen on, usually the same as for peers
+ * @id: the 20-byte node id, or NULL for a random one
+ * @error: a return location for errors
+ *
+ * Starts a node of the mainline DHT (BEP 5), which finds the peers of
+ * torrents without a tracker. The routing table starts out empty, and fills
+ * up from the nodes given to bt_dht_add_node(). Everything but that has to be
+ * called from the thread running @context.
+ *
+ * Returns: the new node, to be freed with bt_dht_free(), or NULL if the port
+ *   couldn't be bound
+ */
+BtDht *
+bt_dht_new (GMainContext *context, guint16 port, const gchar *id, GError **error)
+{
+	BtDht *dht;
+
+	dht = g_slice_new0 (BtDht);
+
+	if (!(dht->socket = bt_udp_socket_new (context, port, bt_dht_on_datagram, dht, error))) {
+		g_slice_free (BtDht, dht);
+		return NULL;
+	}
+
+	dht->context = context;
+
+	if (id != NULL)
+		memcpy (dht->id, id, 20);
+	else
+		bt_dht_random_bytes (dht->id, 20);
+
+	dht->queries = g_hash_table_new (g_direct_hash, g_direct_equal);
+	dht->storage = g_hash_table_new_full (bt_infohash_hash, bt_infohash_equal, NULL, bt_dht_storage_free);
+
+	bt_dht_random_bytes ((guint8 *) dht->secret, 20);
+	memcpy (dht->old_secret, dht->secret, 20);
+	dht->secret_changed = dht->storage_expired = bt_dht_now ();
+
+	g_static_mutex_init (&dht->pending_lock);
+	dht->pending = g_array_new (FALSE, FALSE, sizeof (BtAddress));
+
+	dht->tick_source = g_timeout_source_new (1000);
+	g_source_set_callback (dht->tick_source, bt_dht_tick, dht, NULL);
+	g_source_attach (dht->tick_source, context);
+
+	return dht;
+}
+
+/**
+ * bt_dht_add_node:
+ * @dht: the DHT
+ * @address: the UDP address of a node
+ *
+ * Pings a node that might be in the DHT, like one a peer told us about with a
+ * PORT message or a well-known router, and adds it to the routing table if it
+ * answers. This can be called from any thread.
+ */
+void
+bt_dht_add_node (BtDht *dht, const BtAddress *address)
+{
+	g_return_if_fail (dht != NULL);
+	g_return_if_fail (address != NULL);
+
+	if (address->length != 4 || address->port == 0)
+		return;
+
+	g_static_mutex_lock (&dht->pending_lock);
+
+	if (dht->pending->len < BT_DHT_MAX_QUERIES)
+		g_array_append_val (dht->pending, *address);
+
+	if (dht->pending_source == NULL) {
+		dht->pending_source = g_idle_source_new ();
+		g_source_set_callback (dht->pending_source, bt_dht_ping_pending, dht, NULL);
+		g_source_attach (dht->pending_source, dht->context);
+	}
+
+	g_static_mutex_unlock (&dht->pending_lock);
+}
+
+/**
+ * bt_dht_get_peers:
+ * @dht: the DHT
+ * @infohash: the 20-byte infohash of the torrent
+ * @port: the port to announce we're listening on for the torrent, or 0 to
+ *   only look
+ * @func: the function to call with the peers once the lookup is done
+ * @data: user data for @func
+ *
+ * Looks for the nodes closest to @infohash, collecting the peers they know
+ * of, and announces us to them if @port is given. If the routing table is
+ * empty @func is called right away, with no peers.
+ */
+void
+bt_dht_get_peers (BtDht *dht, const gchar *infohash, guint16 port, BtDhtPeersFunc func, gpointer data)
+{
+	g_return_if_fail (dht != NULL);
+	g_return_if_fail (infohash != NULL);
+	g_return_if_fail (func != NULL);
+
+	bt_dht_start_lookup (dht, (const guint8 *) infohash, BT_DHT_QUERY_GET_PEERS, port, func, data);
+}
+
+/**
+ * bt_dht_get_id:
+ * @dht: the DHT
+ *
+ * Returns: the 20-byte node id
+ */
+const gchar *
+bt_dht_get_id (BtDht *dht)
+{
+	g_return_val_if_fail (dht != NULL, NULL);
+
+	return (const gchar *) dht->id;
+}
+
+/**
+ * bt_dht_get_port:
+ * @dht: the DHT
+ *
+ * Returns: the UDP port the node listens on
+ */
+guint16
+bt_dht_get_port (BtDht *dht)
+{
+	g_return_val_if_fail (dht != NULL, 0);
+
+	return bt_udp_socket_get_port (dht->socket);
+}
+
+/**
+ * bt_dht_get_stats:
+ * @dht: the DHT
+ * @stats: the counters to fill in
+ *
+ * Gets the counters for the node.
+ */
+void
+bt_dht_get_stats (BtDht *dht, BtDhtStats *stats)
+{
+	g_return_if_fail (dht != NULL);
+	g_return_if_fail (stats != NULL);
+
+	*stats = dht->stats;
+	stats->nodes = dht->num_nodes;
+	stats->lookups = g_list_length (dht->lookups);
+	stats->queries = g_hash_table_size (dht->queries);
+	stats->stored = g_hash_table_size (dht->storage);
+}
+
+static gboolean
+bt_dht_free_query (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data G_GNUC_UNUSED)
+{
+	bt_dht_query_free ((BtDhtQuery *) value);
+
+	return TRUE;
+}
+
+/**
+ * bt_dht_free:
+ * @dht: the DHT
+ *
+ * Stops the node. Lookups that are still running end with the peers they
+ * found so far, so their functions are called from here.
+ */
+void
+bt_dht_free (BtDht *dht)
+{
+	g_return_if_fail (dht != NULL);
+
+	bt_udp_socket_free (dht->socket);
+
+	g_source_destroy (dht->tick_source);
+	g_source_unref (dht->tick_source);
+
+	g_static_mutex_lock (&dht->pending_lock);
+
+	if (dht->pending_source != NULL) {
+		g_source_destroy (dht->pending_source);
+		g_source_unref (dht->pending_source);
+	}
+
+	g_static_mutex_unlock (&dht->pending_lock);
+
+	g_hash_table_foreach_remove (dht->queries, bt_dht_free_query, NULL);
+
+	/* nothing is out anymore, so each of them finishes */
+	while (dht->lookups != NULL) {
+		BtDhtLookup *lookup = (BtDhtLookup *) dht->lookups->data;
+
+		lookup->port = 0;
+		bt_dht_lookup_finish (dht, lookup);
+	}
+
+	g_hash_table_destroy (dht->queries);
+	g_hash_table_destroy (dht->storage);
+	g_array_free (dht->pending, TRUE);
+	g_static_mutex_free (&dht->pending_lock);
+
+	g_slice_free (BtDht, dht);
+}
@@ -0,0 +1,84 @@
+/**
+ * bt-dht.h
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __BT_DHT_H__
+#define __BT_DHT_H__
+
+#include <glib.h>
+
+#include "bt-address.h"
+
+G_BEGIN_DECLS
+
+typedef struct _BtDht BtDht;
+
+/**
+ * BtDhtPeersFunc:
+ * @dht: the DHT
+ * @infohash: the 20-byte infohash that was looked up
+ * @peers: a #GArray of #BtAddress with the peers that were found, which the
+ *   function owns
+ * @data: user data given to bt_dht_get_peers()
+ *
+ * Called once a lookup for the peers of a torrent is done.
+ */
+typedef void (*BtDhtPeersFunc) (BtDht *dht, const gchar *infohash, GArray *peers, gpointer data);
+
+/**
+ * BtDhtStats:
+ * @nodes: nodes in the routing table
+ * @lookups: lookups that are running
+ * @queries: queries waiting for a response
+ * @stored: torrents we keep peers for on behalf of others
+ * @queries_sent: queries sent
+ * @queries_received: queries received
+ * @responses: responses received to our queries
+ * @timeouts: queries that went unanswered
+ *
+ * Counters describing a DHT node.
+ */
+typedef struct {
+	guint   nodes;
+	guint   lookups;
+	guint   queries;
+	guint   stored;
+	guint64 queries_sent;
+	guint64 queries_received;
+	guint64 responses;
+	guint64 timeouts;
+} BtDhtStats;
+
+BtDht       *bt_dht_new (GMainContext *context, guint16 port, const gchar *id, GError **error);
+
+void         bt_dht_add_node (BtDht *dht, const BtAddress *address);
+
+void         bt_dht_get_peers (BtDht *dht, const gchar *infohash, guint16 port, BtDhtPeersFunc func, gpointer data);
+
+const gchar *bt_dht_get_id (BtDht *dht);
+
+guint16      bt_dht_get_port (BtDht *dht);
+
+void         bt_dht_get_stats (BtDht *dht, BtDhtStats *stats);
+
+void         bt_dht_free (BtDht *dht);
+
+G_END_DECLS
+
+#endif
@@ -27,11 +27,16 @@
 #include <unistd.h>
 
 #include "bt-io.h"
+#include "bt-piece-cache.h"
 #include "bt-utils.h"
 #include "sha1.h"
 
+/* default memory budget for the piece read cache */
+#define BT_IO_DEFAULT_CACHE_SIZE (16 * 1024 * 1024)
+
 enum {
-	BT_IO_PROPERTY_TORRENT = 1
+	BT_IO_PROPERTY_TORRENT = 1,
+	BT_IO_PROPERTY_CACHE_SIZE
 };
 
 struct _BtIO {
@@ -42,6 +47,9 @@ struct _BtIO {
 
 	/* a hashtable mapping file path -> iochannel*/
 	GHashTable *channels;	
+
+	/* pieces recently read for uploading to peers */
+	BtPieceCache *cache;
 };
 
 struct _BtIOClass {
@@ -181,24 +189,21 @@ bt_io_write (BtIO *io, guint piece, guint begin, guint len, const gchar* data)
 	g_io_channel_seek_position (channel, offset, G_SEEK_SET, NULL);
 	g_io_channel_write_chars (channel, data, len, NULL, NULL);
 
+	bt_piece_cache_invalidate (io->cache, piece);
+
 	//g_io_channel_flush (channel, NULL);
 }
 
-gchar *
-bt_io_read (BtIO *io, guint piece, guint begin, guint len)
+static gboolean
+bt_io_read_into (BtIO *io, guint piece, guint begin, guint len, gchar *data)
 {
-	gchar* data;
 	gsize read;
 	gint64 offset;
 	GIOChannel *channel;
 
-	g_return_val_if_fail (BT_IS_IO (io), NULL);
-
 	channel = bt_io_get_io_channel (io, piece, begin, len);
 
-	g_return_val_if_fail (channel != NULL, NULL);
-
-	data = g_malloc (len);
+	g_return_val_if_fail (channel != NULL, FALSE);
 
 	// FIXME: handle iochannel errors below
 
@@ -207,7 +212,130 @@ bt_io_read (BtIO *io, guint piece, guint begin, guint len)
 	g_io_channel_seek_position (channel, offset, G_SEEK_SET, NULL);
 	g_io_channel_read_chars (channel, data, len, &read, NULL);
 
-	return g_memdup (data, read);
+	return read == len;
+}
+
+/**
+ * bt_io_read:
+ * @io: the io object
+ * @piece: the piece index
+ * @begin: byte offset in @piece
+ * @len: number of bytes to read
+ *
+ * Reads @len bytes from the file specified by @piece, bypassing the piece cache.
+ *
+ * Returns: a newly allocated buffer to be freed with g_free, or NULL on error.
+ */
+gchar *
+bt_io_read (BtIO *io, guint piece, guint begin, guint len)
+{
+	gchar* data;
+
+	g_return_val_if_fail (BT_IS_IO (io), NULL);
+
+	data = g_malloc (len);
+
+	if (!bt_io_read_into (io, piece, begin, len, data)) {
+		g_free (data);
+		return NULL;
+	}
+
+	return data;
+}
+
+static gboolean
+bt_io_cache_read_piece (guint piece, gchar *buf, guint len, gpointer data)
+{
+	return bt_io_read_into (BT_IO (data), piece, 0, len, buf);
+}
+
+/**
+ * bt_io_read_block:
+ * @io: the io object
+ * @piece: the piece index
+ * @begin: byte offset in @piece
+ * @len: number of bytes to read
+ * @ref: return location for the reference keeping the data alive
+ *
+ * Reads a block for sending to a peer through the piece cache. No data is copied:
+ * the returned pointer is a slice of the cached piece, which stays valid until
+ * the reference stored in @ref is dropped with bt_cached_piece_unref().
+ *
+ * Returns: the block data, which must not be modified or freed, or NULL on error.
+ */
+const gchar *
+bt_io_read_block (BtIO *io, guint piece, guint begin, guint len, BtCachedPiece **ref)
+{
+	BtCachedPiece *cached;
+	guint piece_length;
+
+	g_return_val_if_fail (BT_IS_IO (io), NULL);
+	g_return_val_if_fail (ref != NULL, NULL);
+	g_return_val_if_fail (piece < bt_torrent_get_num_pieces (io->torrent), NULL);
+
+	piece_length = bt_torrent_get_piece_length_extended (io->torrent, piece);
+
+	g_return_val_if_fail (begin < piece_length && len <= piece_length - begin, NULL);
+
+	cached = bt_piece_cache_lookup (io->cache, piece, piece_length, len);
+
+	if (cached == NULL)
+		return NULL;
+
+	*ref = cached;
+
+	return bt_cached_piece_get_data (cached) + begin;
+}
+
+/**
+ * bt_io_is_piece_cached:
+ * @io: the io object
+ * @piece: the piece index
+ *
+ * Checks if a piece can be served to peers without touching the disk.
+ *
+ * Returns: TRUE if @piece is in the read cache.
+ */
+gboolean
+bt_io_is_piece_cached (BtIO *io, guint piece)
+{
+	g_return_val_if_fail (BT_IS_IO (io), FALSE);
+
+	return bt_piece_cache_contains (io->cache, piece);
+}
+
+/**
+ * bt_io_get_cached_pieces:
+ * @io: the io object
+ * @pieces: an array to fill with piece indices
+ * @max: the size of @pieces
+ *
+ * Lists pieces that can be served without touching the disk, the hottest
+ * first, for suggesting to peers.
+ *
+ * Returns: the number of pieces put in @pieces
+ */
+guint
+bt_io_get_cached_pieces (BtIO *io, guint *pieces, guint max)
+{
+	g_return_val_if_fail (BT_IS_IO (io), 0);
+
+	return bt_piece_cache_get_hot (io->cache, pieces, max);
+}
+
+/**
+ * bt_io_get_cache_stats:
+ * @io: the io object
+ * @stats: return location for the counters
+ *
+ * Gets the hit ratio and other counters of the piece read cache.
+ */
+void
+bt_io_get_cache_stats (BtIO *io, BtPieceCacheStats *stats)
+{
+	g_return_if_fail (BT_IS_IO (io));
+
+	bt_piece_cache_get_stats (io->cache, stats);
 }
 
 /**
@@ -271,6 +399,11 @@ bt_io_dispose (GObject *object)
 
 	self->channels = NULL;
 
+	if (self->cache != NULL) {
+		bt_piece_cache_free (self->cache);
+		self->cache = NULL;
+	}
+
 	G_OBJECT_CLASS (bt_io_parent_class)->dispose (object);
 }
 
@@ -290,6 +423,10 @@ bt_io_get_property (GObject *object, guint property, GValue *value, GParamSpec *
 		// FIXME: this might leave a dangling pointer in value
 		g_value_set_pointer (value, self->torrent);
 		break;
+
+	case BT_IO_PROPERTY_CACHE_SIZE:
+		g_value_set_uint (value, bt_piece_cache_get_budget (self->cache));
+		break;
 		
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property, pspec);
@@ -307,6 +444,10 @@ bt_io_set_property (GObject *object, guint property, const GValue *value, GParam
 		self->torrent = BT_TORRENT (g_value_get_pointer (value));
 		bt_add_weak_pointer (G_OBJECT (self->torrent), (gpointer)&self->torrent);
 		break;
+
+	case BT_IO_PROPERTY_CACHE_SIZE:
+		bt_piece_cache_set_budget (self->cache, g_value_get_uint (value));
+		break;
 	
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property, pspec);
@@ -322,6 +463,8 @@ bt_io_init (BtIO *io)
 
 	io->channels = g_hash_table_new (g_str_hash, g_str_equal);
 
+	io->cache = bt_piece_cache_new (BT_IO_DEFAULT_CACHE_SIZE, bt_io_cache_read_piece, io);
+
 	return;
 }
 
@@ -348,5 +491,20 @@ bt_io_class_init (BtIOClass *io_class)
 	
 	g_object_class_install_property (object_class, BT_IO_PROPERTY_TORRENT, pspec);
 
+	/**
+	 * BtIO:cache-size:
+	 *
+	 * The maximum number of bytes of piece data kept in memory for serving peers.
+	 */
+	pspec = g_param_spec_uint ("cache-size",
+	                           "piece cache size",
+	                           "Maximum number of bytes of piece data to cache for uploading.",
+	                           0,
+	                           G_MAXUINT,
+	                           BT_IO_DEFAULT_CACHE_SIZE,
+	                           G_PARAM_READWRITE | G_PARAM_STATIC_NAME | G_PARAM_STATIC_BLURB | G_PARAM_STATIC_NICK);
+
+	g_object_class_install_property (object_class, BT_IO_PROPERTY_CACHE_SIZE, pspec);
+
 	return;
 }
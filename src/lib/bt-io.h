@@ -31,6 +31,7 @@ typedef struct _BtIO      BtIO;
 typedef struct _BtIOClass BtIOClass;
 
 #include "bt-torrent.h"
+#include "bt-piece-cache.h"
 
 GType            bt_io_get_type ();
 
@@ -38,6 +39,14 @@ void             bt_io_write (BtIO *io, guint piece, guint begin, guint len, con
 
 gchar           *bt_io_read (BtIO *io, guint piece, guint begin, guint len);
 
+const gchar     *bt_io_read_block (BtIO *io, guint piece, guint begin, guint len, BtCachedPiece **ref);
+
+gboolean         bt_io_is_piece_cached (BtIO *io, guint piece);
+
+guint            bt_io_get_cached_pieces (BtIO *io, guint *pieces, guint max);
+
+void             bt_io_get_cache_stats (BtIO *io, BtPieceCacheStats *stats);
+
 gboolean         bt_io_check_piece_hash (BtIO *io, guint piece);
 
 #endif
@@ -18,15 +18,54 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include <gnet.h>
 
+#ifdef G_OS_UNIX
+# include <unistd.h>
+#endif
+
 #include "bt-manager.h"
 #include "bt-peer.h"
+#include "bt-bencode.h"
 #include "bt-utils.h"
+#include "bt-shard.h"
+#include "bt-peer-pex.h"
+#include "bt-peer-metadata.h"
+
+/* bump this whenever the format of the torrent index changes */
+#define BT_MANAGER_INDEX_VERSION 1
+
+/* likewise for the resume data */
+#define BT_MANAGER_RESUME_VERSION 1
+
+/* finished torrents are added to the manager this many at a time during a restore */
+#define BT_MANAGER_RESTORE_BATCH 256
+
+/* reading metainfo is mostly disk-bound past a few threads */
+#define BT_MANAGER_RESTORE_MAX_THREADS 16
+
+/* more network threads than this won't find the cores to run on */
+#define BT_MANAGER_MAX_SHARDS 64
+
+/* open connections over all torrents, and how many of them may be connecting
+ * at once; a router's connection table fills up fast with half-open ones */
+#define BT_MANAGER_DEFAULT_MAX_CONNECTIONS 500
+#define BT_MANAGER_DEFAULT_MAX_HALF_OPEN 32
+
+/* milliseconds that have messages for completed pieces are held back, so that
+ * those for several pieces go out together */
+#define BT_MANAGER_DEFAULT_HAVE_INTERVAL 1000
 
 enum {
 	BT_MANAGER_PROPERTY_PORT = 1,
-	BT_MANAGER_PROPERTY_PEER_ID
+	BT_MANAGER_PROPERTY_PEER_ID,
+	BT_MANAGER_PROPERTY_SHARDS,
+	BT_MANAGER_PROPERTY_MAX_CONNECTIONS,
+	BT_MANAGER_PROPERTY_MAX_HALF_OPEN,
+	BT_MANAGER_PROPERTY_HAVE_INTERVAL,
+	BT_MANAGER_PROPERTY_LAZY_HAVE
 };
 
 enum {
@@ -48,8 +87,38 @@ struct _BtManager {
 	/* the listening socket */
 	GTcpSocket *listen_socket;
 	
-	/* hash table mapping infohash -> torrent */
+	/* hash table mapping the 20-byte infohash -> torrent */
 	GHashTable *torrents;
+
+	/* network threads that torrents are spread over, if any */
+	BtShard   **shards;
+	guint       num_shards;
+
+	/* connection limits, and the slots taken, which peers on any thread take
+	 * and give back */
+	gint        max_connections;
+	gint        max_half_open;
+	volatile gint connections;
+	volatile gint half_open;
+
+	/* how have messages are sent, read by the torrents on any thread */
+	guint       have_interval;
+	gboolean    lazy_have;
+
+	/* protocol extensions, where the id of each in extended messages is its
+	 * index plus one; only added to before there are peers, so peers on any
+	 * thread read it without locking */
+	BtPeerExtension *extensions[BT_PEER_EXTENSION_MAX];
+	guint       num_extensions;
+
+	/* the DHT node, if it's running, which lives on the main thread; peers
+	 * on other threads hand it nodes under the lock */
+	BtDht      *dht;
+	GStaticMutex dht_lock;
+
+	/* the client that all torrents announce to UDP trackers through, made
+	 * when the first one does; only used from the main thread */
+	BtUdpTracker *udp_tracker;
 };
 
 struct _BtManagerClass {
@@ -65,6 +134,11 @@ bt_manager_new_connection (BtManager *manager, GTcpSocket *socket, gpointer data
 
 	g_return_if_fail (socket != NULL);
 
+	if (!bt_manager_reserve_connection (manager, FALSE)) {
+		g_debug ("refusing new connection, %d are open", manager->connections);
+		return;
+	}
+
 	g_debug ("received new connection");
 	
 	peer = bt_peer_new_incoming (manager, socket);
@@ -77,11 +151,133 @@ bt_manager_emit_new_connection (GTcpSocket *server G_GNUC_UNUSED, GTcpSocket *cl
 {
 	g_return_if_fail (BT_IS_MANAGER (manager));
 
+	if (client == NULL)
+		return;
+
 	g_signal_emit (manager, bt_manager_signals[BT_MANAGER_SIGNAL_NEW_CONNECTION], 0, client);
 
+	/* the peer keeps its own copy of the descriptor, and a refused socket is
+	 * closed right here */
+	gnet_tcp_socket_unref (client);
+
 	return;
 }
 
+static gboolean
+bt_manager_take_slot (volatile gint *count, gint max)
+{
+	gint n;
+
+	do {
+		n = g_atomic_int_get (count);
+
+		if (n >= max)
+			return FALSE;
+	} while (!g_atomic_int_compare_and_exchange (count, n, n + 1));
+
+	return TRUE;
+}
+
+/**
+ * bt_manager_reserve_connection:
+ * @manager: the manager
+ * @outgoing: whether the connection is still to be made
+ *
+ * Takes a slot for a new connection if the manager's limits allow it. An
+ * outgoing connection also takes a half-open slot, which is given back with
+ * bt_manager_release_half_open() once it's established. A peer is only created
+ * once this has succeeded, and gives its slots back itself when it closes.
+ * This can be called from any thread.
+ *
+ * Returns: TRUE if a slot was taken
+ */
+gboolean
+bt_manager_reserve_connection (BtManager *manager, gboolean outgoing)
+{
+	g_return_val_if_fail (BT_IS_MANAGER (manager), FALSE);
+
+	if (outgoing && !bt_manager_take_slot (&manager->half_open, manager->max_half_open))
+		return FALSE;
+
+	if (!bt_manager_take_slot (&manager->connections, manager->max_connections)) {
+		if (outgoing)
+			g_atomic_int_add (&manager->half_open, -1);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * bt_manager_release_half_open:
+ * @manager: the manager
+ *
+ * Gives back the half-open slot of an outgoing connection, once it was either
+ * established or failed.
+ */
+void
+bt_manager_release_half_open (BtManager *manager)
+{
+	g_return_if_fail (BT_IS_MANAGER (manager));
+
+	g_atomic_int_add (&manager->half_open, -1);
+}
+
+/**
+ * bt_manager_release_connection:
+ * @manager: the manager
+ *
+ * Gives back the slot of a connection that was closed.
+ */
+void
+bt_manager_release_connection (BtManager *manager)
+{
+	g_return_if_fail (BT_IS_MANAGER (manager));
+
+	g_atomic_int_add (&manager->connections, -1);
+}
+
+/**
+ * bt_manager_get_shard:
+ * @manager: the manager
+ * @infohash: the 20-byte infohash of a torrent
+ *
+ * Gets the network thread that runs the peers of the torrent with @infohash.
+ * Every torrent always goes to the same one, so that nothing about its peers
+ * is ever shared between threads.
+ *
+ * Returns: the shard, or NULL if the manager runs everything from the main
+ *   thread
+ */
+BtShard *
+bt_manager_get_shard (BtManager *manager, const gchar *infohash)
+{
+	g_return_val_if_fail (BT_IS_MANAGER (manager), NULL);
+	g_return_val_if_fail (infohash != NULL, NULL);
+
+	if (manager->num_shards == 0)
+		return NULL;
+
+	return manager->shards[bt_infohash_hash (infohash) % manager->num_shards];
+}
+
+static void
+bt_manager_set_num_shards (BtManager *manager, guint num)
+{
+	guint i;
+
+	g_return_if_fail (manager->shards == NULL);
+
+	if (num == 0)
+		return;
+
+	manager->shards = g_new (BtShard *, num);
+	manager->num_shards = num;
+
+	for (i = 0; i < num; i++)
+		manager->shards[i] = bt_shard_new (i);
+}
+
 /**
  * bt_manager_add_torrent:
  * @manager: the manager
@@ -94,32 +290,562 @@ bt_manager_add_torrent (BtManager *manager, BtTorrent *torrent)
 {
 	g_return_if_fail (BT_IS_MANAGER (manager));
 
-	g_hash_table_insert (manager->torrents, g_strdup (bt_torrent_get_infohash_string (torrent)), g_object_ref (torrent));
+	/* the key is owned by the torrent, which lives at least as long as its entry */
+	g_hash_table_insert (manager->torrents, (gpointer) bt_torrent_get_infohash (torrent), g_object_ref (torrent));
 }
 
 /**
  * bt_manager_get_torrent:
  * @manager: the manager
- * @infohash: the torrent's infohash to add
+ * @infohash: the 20-byte infohash of the torrent
  *
  * Get a torrent from the manager with the specified infohash, or NULL.
  */
 BtTorrent *
-bt_manager_get_torrent (BtManager *manager, gchar *infohash)
+bt_manager_get_torrent (BtManager *manager, const gchar *infohash)
 {
-	BtTorrent *torrent;
-	gchar *infohash_string;
-
 	g_return_val_if_fail (BT_IS_MANAGER (manager), NULL);
 	g_return_val_if_fail (infohash != NULL, NULL);
 
-	infohash_string = bt_hash_to_string (infohash);
+	return (BtTorrent *) g_hash_table_lookup (manager->torrents, infohash);
+}
 
-	torrent = (BtTorrent *) g_hash_table_lookup (manager->torrents, infohash_string);
-	
-	g_free (infohash_string);
-	
-	return torrent;
+typedef struct {
+	BtBencodeArena *arena;
+	BtBencode      *items;
+	guint           len;
+} BtManagerIndexBuilder;
+
+static void
+bt_manager_index_set_string (BtBencodeDictEntry *entry, const gchar *key, const gchar *str, gsize len)
+{
+	entry->key.str = key;
+	entry->key.len = strlen (key);
+	entry->value.type = BT_BENCODE_TYPE_STRING;
+	entry->value.string.str = str;
+	entry->value.string.len = len;
+}
+
+static void
+bt_manager_index_add_torrent (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data)
+{
+	BtManagerIndexBuilder *builder = (BtManagerIndexBuilder *) data;
+	BtTorrent *torrent = BT_TORRENT (value);
+	BtBencode *item;
+	BtBencodeDictEntry *entries;
+
+	/* torrents from magnet links have no file to be restored from */
+	if (bt_torrent_get_filename (torrent) == NULL)
+		return;
+
+	item = &builder->items[builder->len++];
+
+	/* keys have to be in sorted order */
+	entries = bt_bencode_arena_alloc (builder->arena, 4 * sizeof (BtBencodeDictEntry));
+
+	bt_manager_index_set_string (&entries[0], "filename", bt_torrent_get_filename (torrent), strlen (bt_torrent_get_filename (torrent)));
+	bt_manager_index_set_string (&entries[1], "infohash", bt_torrent_get_infohash (torrent), 20);
+	bt_manager_index_set_string (&entries[2], "name", bt_torrent_get_name (torrent), strlen (bt_torrent_get_name (torrent)));
+
+	entries[3].key.str = "size";
+	entries[3].key.len = 4;
+	entries[3].value.type = BT_BENCODE_TYPE_INT;
+	entries[3].value.value = bt_torrent_get_size (torrent);
+
+	memset (item, 0, sizeof (BtBencode));
+	item->type = BT_BENCODE_TYPE_DICT;
+	item->dict.entries = entries;
+	item->dict.len = 4;
+}
+
+/**
+ * bt_manager_save_index:
+ * @manager: the manager
+ * @filename: the file to save the index to
+ * @error: a return location for errors
+ *
+ * Saves the name, size, infohash and metainfo file of every torrent, so that
+ * they can be added back with bt_manager_load_index() without reading any of
+ * the metainfo files.
+ *
+ * Returns: TRUE if the index was saved
+ */
+gboolean
+bt_manager_save_index (BtManager *manager, const gchar *filename, GError **error)
+{
+	BtManagerIndexBuilder builder;
+	BtBencodeDictEntry entries[2];
+	BtBencode root;
+	GString *string;
+	gboolean ret;
+
+	g_return_val_if_fail (BT_IS_MANAGER (manager), FALSE);
+	g_return_val_if_fail (filename != NULL, FALSE);
+
+	builder.arena = bt_bencode_arena_new (0);
+	builder.items = bt_bencode_arena_alloc (builder.arena, g_hash_table_size (manager->torrents) * sizeof (BtBencode));
+	builder.len = 0;
+
+	g_hash_table_foreach (manager->torrents, bt_manager_index_add_torrent, &builder);
+
+	memset (entries, 0, sizeof (entries));
+
+	entries[0].key.str = "torrents";
+	entries[0].key.len = 8;
+	entries[0].value.type = BT_BENCODE_TYPE_LIST;
+	entries[0].value.list.items = builder.items;
+	entries[0].value.list.len = builder.len;
+
+	entries[1].key.str = "version";
+	entries[1].key.len = 7;
+	entries[1].value.type = BT_BENCODE_TYPE_INT;
+	entries[1].value.value = BT_MANAGER_INDEX_VERSION;
+
+	memset (&root, 0, sizeof (root));
+	root.type = BT_BENCODE_TYPE_DICT;
+	root.dict.entries = entries;
+	root.dict.len = 2;
+
+	string = bt_bencode_encode (&root);
+
+	ret = g_file_set_contents (filename, string->str, string->len, error);
+
+	g_string_free (string, TRUE);
+	bt_bencode_arena_free (builder.arena);
+
+	return ret;
+}
+
+/**
+ * bt_manager_load_index:
+ * @manager: the manager
+ * @filename: the index saved by bt_manager_save_index()
+ * @error: a return location for errors
+ *
+ * Adds the torrents in an index to the manager. They are dormant until they
+ * are started, so none of their metainfo files are read. Torrents the manager
+ * already has are skipped.
+ *
+ * Returns: TRUE if the index was loaded
+ */
+gboolean
+bt_manager_load_index (BtManager *manager, const gchar *filename, GError **error)
+{
+	BtBencodeArena *arena;
+	BtBencode *index, *version, *torrents;
+	gchar *contents;
+	gsize len;
+	guint i;
+
+	g_return_val_if_fail (BT_IS_MANAGER (manager), FALSE);
+	g_return_val_if_fail (filename != NULL, FALSE);
+
+	if (!g_file_get_contents (filename, &contents, &len, error))
+		return FALSE;
+
+	arena = bt_bencode_arena_new (len);
+
+	if (!(index = bt_bencode_decode_arena (arena, contents, len, error))) {
+		bt_bencode_arena_free (arena);
+		g_free (contents);
+		return FALSE;
+	}
+
+	if (index->type != BT_BENCODE_TYPE_DICT
+		|| !(version = bt_bencode_lookup (index, "version")) || version->type != BT_BENCODE_TYPE_INT || version->value != BT_MANAGER_INDEX_VERSION
+		|| !(torrents = bt_bencode_lookup (index, "torrents")) || torrents->type != BT_BENCODE_TYPE_LIST) {
+		g_set_error (error, BT_ERROR, BT_ERROR_INVALID_INDEX, "invalid torrent index");
+		bt_bencode_arena_free (arena);
+		g_free (contents);
+		return FALSE;
+	}
+
+	for (i = 0; i < torrents->list.len; i++) {
+		BtBencode *item, *file, *infohash, *name, *size;
+		gchar *file_string, *name_string;
+		BtTorrent *torrent;
+
+		item = bt_bencode_list_index (torrents, i);
+
+		if (item->type != BT_BENCODE_TYPE_DICT)
+			continue;
+
+		file = bt_bencode_lookup (item, "filename");
+		infohash = bt_bencode_lookup (item, "infohash");
+		name = bt_bencode_lookup (item, "name");
+		size = bt_bencode_lookup (item, "size");
+
+		if (!file || file->type != BT_BENCODE_TYPE_STRING
+			|| !infohash || infohash->type != BT_BENCODE_TYPE_STRING || infohash->string.len != 20
+			|| !name || name->type != BT_BENCODE_TYPE_STRING
+			|| !size || size->type != BT_BENCODE_TYPE_INT || size->value < 0) {
+			g_warning ("skipping invalid entry in torrent index");
+			continue;
+		}
+
+		if (bt_manager_get_torrent (manager, infohash->string.str))
+			continue;
+
+		file_string = bt_bencode_dup_string (file);
+		name_string = bt_bencode_dup_string (name);
+
+		torrent = bt_torrent_new_dormant (manager, file_string, name_string, size->value, infohash->string.str);
+		bt_manager_add_torrent (manager, torrent);
+		g_object_unref (torrent);
+
+		g_free (file_string);
+		g_free (name_string);
+	}
+
+	bt_bencode_arena_free (arena);
+	g_free (contents);
+
+	return TRUE;
+}
+
+static void
+bt_manager_get_torrents_foreach (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data)
+{
+	GList **torrents = (GList **) data;
+
+	*torrents = g_list_prepend (*torrents, value);
+}
+
+/**
+ * bt_manager_get_torrents:
+ * @manager: the manager
+ *
+ * Get all the torrents in the manager, in no particular order.
+ *
+ * Returns: a list of torrents, to be freed with g_list_free. The torrents
+ *   themselves are not referenced.
+ */
+GList *
+bt_manager_get_torrents (BtManager *manager)
+{
+	GList *torrents = NULL;
+
+	g_return_val_if_fail (BT_IS_MANAGER (manager), NULL);
+
+	g_hash_table_foreach (manager->torrents, bt_manager_get_torrents_foreach, &torrents);
+
+	return torrents;
+}
+
+typedef struct {
+	BtBencodeArena     *arena;
+	BtBencodeDictEntry *entries;
+	guint               len;
+} BtManagerResumeBuilder;
+
+static gint
+bt_manager_resume_compare_entries (gconstpointer a, gconstpointer b)
+{
+	return strcmp (((const BtBencodeDictEntry *) a)->key.str, ((const BtBencodeDictEntry *) b)->key.str);
+}
+
+static void
+bt_manager_resume_add_torrent (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data)
+{
+	BtManagerResumeBuilder *builder = (BtManagerResumeBuilder *) data;
+	BtTorrent *torrent = BT_TORRENT (value);
+	BtBencodeDictEntry *entry, *bitfield;
+	const gchar *pieces;
+	gsize len;
+
+	if (!(pieces = bt_torrent_get_bitfield (torrent, &len)) || len == 0)
+		return;
+
+	entry = &builder->entries[builder->len++];
+	bitfield = bt_bencode_arena_alloc (builder->arena, sizeof (BtBencodeDictEntry));
+
+	bt_manager_index_set_string (bitfield, "bitfield", pieces, len);
+
+	memset (entry, 0, sizeof (BtBencodeDictEntry));
+	entry->key.str = bt_torrent_get_infohash_string (torrent);
+	entry->key.len = 40;
+	entry->value.type = BT_BENCODE_TYPE_DICT;
+	entry->value.dict.entries = bitfield;
+	entry->value.dict.len = 1;
+}
+
+/**
+ * bt_manager_save_resume_data:
+ * @manager: the manager
+ * @filename: the file to save the resume data to
+ * @error: a return location for errors
+ *
+ * Saves the pieces we have of every torrent, to be restored with
+ * bt_manager_restore_session().
+ *
+ * Returns: TRUE if the resume data was saved
+ */
+gboolean
+bt_manager_save_resume_data (BtManager *manager, const gchar *filename, GError **error)
+{
+	BtManagerResumeBuilder builder;
+	BtBencodeDictEntry entries[2];
+	BtBencode root;
+	GString *string;
+	gboolean ret;
+
+	g_return_val_if_fail (BT_IS_MANAGER (manager), FALSE);
+	g_return_val_if_fail (filename != NULL, FALSE);
+
+	builder.arena = bt_bencode_arena_new (0);
+	builder.entries = bt_bencode_arena_alloc (builder.arena, g_hash_table_size (manager->torrents) * sizeof (BtBencodeDictEntry));
+	builder.len = 0;
+
+	g_hash_table_foreach (manager->torrents, bt_manager_resume_add_torrent, &builder);
+
+	/* keys are hex infohashes, so this is the same as sorting them as raw strings */
+	qsort (builder.entries, builder.len, sizeof (BtBencodeDictEntry), bt_manager_resume_compare_entries);
+
+	memset (entries, 0, sizeof (entries));
+
+	entries[0].key.str = "torrents";
+	entries[0].key.len = 8;
+	entries[0].value.type = BT_BENCODE_TYPE_DICT;
+	entries[0].value.dict.entries = builder.entries;
+	entries[0].value.dict.len = builder.len;
+
+	entries[1].key.str = "version";
+	entries[1].key.len = 7;
+	entries[1].value.type = BT_BENCODE_TYPE_INT;
+	entries[1].value.value = BT_MANAGER_RESUME_VERSION;
+
+	memset (&root, 0, sizeof (root));
+	root.type = BT_BENCODE_TYPE_DICT;
+	root.dict.entries = entries;
+	root.dict.len = 2;
+
+	string = bt_bencode_encode (&root);
+
+	ret = g_file_set_contents (filename, string->str, string->len, error);
+
+	g_string_free (string, TRUE);
+
+	bt_bencode_arena_free (builder.arena);
+
+	return ret;
+}
+
+/* one .torrent file for the restore workers; the results are filled in by the worker */
+typedef struct {
+	gchar   *filename;
+	gchar   *name;
+	guint64  size;
+	gchar   *infohash;
+	GError  *error;
+} BtManagerRestoreJob;
+
+static void
+bt_manager_restore_worker (gpointer data, gpointer user_data)
+{
+	BtManagerRestoreJob *job = (BtManagerRestoreJob *) data;
+	GAsyncQueue *done = (GAsyncQueue *) user_data;
+
+	bt_torrent_read_summary (job->filename, &job->name, &job->size, &job->infohash, &job->error);
+
+	g_async_queue_push (done, job);
+}
+
+static guint
+bt_manager_restore_num_threads (void)
+{
+	glong n = 0;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+
+	return CLAMP (n, 1, BT_MANAGER_RESTORE_MAX_THREADS);
+}
+
+/* adds a batch of finished jobs to the manager and frees them */
+static void
+bt_manager_restore_insert (BtManager *manager, BtManagerRestoreJob **jobs, guint len, BtBencode *resume, BtManagerRestoreStats *stats)
+{
+	guint i;
+
+	for (i = 0; i < len; i++) {
+		BtManagerRestoreJob *job = jobs[i];
+		BtTorrent *torrent;
+
+		if (job->error) {
+			g_warning ("could not restore %s: %s", job->filename, job->error->message);
+			g_error_free (job->error);
+			stats->failed++;
+		} else if (bt_manager_get_torrent (manager, job->infohash)) {
+			stats->skipped++;
+		} else {
+			BtBencode *data, *bitfield;
+
+			torrent = bt_torrent_new_dormant (manager, job->filename, job->name, job->size, job->infohash);
+
+			if (resume
+				&& (data = bt_bencode_lookup (resume, bt_torrent_get_infohash_string (torrent)))
+				&& data->type == BT_BENCODE_TYPE_DICT
+				&& (bitfield = bt_bencode_lookup (data, "bitfield"))
+				&& bitfield->type == BT_BENCODE_TYPE_STRING)
+				bt_torrent_set_resume_data (torrent, bitfield->string.str, bitfield->string.len);
+
+			bt_manager_add_torrent (manager, torrent);
+			g_object_unref (torrent);
+
+			stats->added++;
+		}
+
+		g_free (job->filename);
+		g_free (job->name);
+		g_free (job->infohash);
+		g_slice_free (BtManagerRestoreJob, job);
+	}
+}
+
+/**
+ * bt_manager_restore_session:
+ * @manager: the manager
+ * @directory: a directory of .torrent files
+ * @resume_file: resume data saved by bt_manager_save_resume_data(), or NULL
+ * @stats: return location for what was restored and how long it took, or NULL
+ * @error: a return location for errors
+ *
+ * Adds every torrent in @directory to the manager, like at startup. The files
+ * are read and hashed by a pool of worker threads, and the torrents are added
+ * on the calling thread in batches as they finish. They are dormant until
+ * they are started. Torrents the manager already has are skipped, and files
+ * which aren't valid torrents are skipped with a warning.
+ *
+ * This blocks until all of the torrents have been added.
+ *
+ * Returns: TRUE unless the directory couldn't be read
+ */
+gboolean
+bt_manager_restore_session (BtManager *manager, const gchar *directory, const gchar *resume_file, BtManagerRestoreStats *stats, GError **error)
+{
+	BtManagerRestoreStats dummy;
+	BtManagerRestoreJob *batch[BT_MANAGER_RESTORE_BATCH];
+	BtBencodeArena *arena = NULL;
+	BtBencode *resume = NULL;
+	gchar *resume_contents = NULL;
+	GThreadPool *pool;
+	GAsyncQueue *done;
+	GTimer *timer, *phase, *insert;
+	GSList *jobs = NULL, *i;
+	const gchar *name;
+	guint pending = 0;
+	GDir *dir;
+
+	g_return_val_if_fail (BT_IS_MANAGER (manager), FALSE);
+	g_return_val_if_fail (directory != NULL, FALSE);
+
+	if (stats == NULL)
+		stats = &dummy;
+
+	memset (stats, 0, sizeof (BtManagerRestoreStats));
+
+	timer = g_timer_new ();
+	phase = g_timer_new ();
+	insert = g_timer_new ();
+
+	/* find the torrent files */
+	if (!(dir = g_dir_open (directory, 0, error))) {
+		g_timer_destroy (timer);
+		g_timer_destroy (phase);
+		g_timer_destroy (insert);
+		return FALSE;
+	}
+
+	while ((name = g_dir_read_name (dir))) {
+		BtManagerRestoreJob *job;
+
+		if (!g_str_has_suffix (name, ".torrent"))
+			continue;
+
+		job = g_slice_new0 (BtManagerRestoreJob);
+		job->filename = g_build_filename (directory, name, NULL);
+
+		jobs = g_slist_prepend (jobs, job);
+		pending++;
+	}
+
+	g_dir_close (dir);
+
+	/* missing or broken resume data just means starting from scratch */
+	if (resume_file) {
+		GError *resume_error = NULL;
+		gsize len;
+
+		if (g_file_get_contents (resume_file, &resume_contents, &len, &resume_error)) {
+			BtBencode *root, *version, *torrents;
+
+			arena = bt_bencode_arena_new (len);
+			root = bt_bencode_decode_arena (arena, resume_contents, len, &resume_error);
+
+			if (root && root->type == BT_BENCODE_TYPE_DICT
+				&& (version = bt_bencode_lookup (root, "version")) && version->type == BT_BENCODE_TYPE_INT && version->value == BT_MANAGER_RESUME_VERSION
+				&& (torrents = bt_bencode_lookup (root, "torrents")) && torrents->type == BT_BENCODE_TYPE_DICT)
+				resume = torrents;
+		}
+
+		if (resume_error) {
+			g_warning ("could not read resume data: %s", resume_error->message);
+			g_error_free (resume_error);
+		} else if (!resume) {
+			g_warning ("could not read resume data: invalid resume file");
+		}
+	}
+
+	stats->scan_time = g_timer_elapsed (phase, NULL);
+	g_timer_start (phase);
+
+	/* hand the files to the workers */
+	done = g_async_queue_new ();
+	pool = g_thread_pool_new (bt_manager_restore_worker, done, bt_manager_restore_num_threads (), FALSE, NULL);
+
+	for (i = jobs; i != NULL; i = i->next)
+		g_thread_pool_push (pool, i->data, NULL);
+
+	g_slist_free (jobs);
+
+	/* add the results as they come in, taking everything that is ready at once */
+	while (pending > 0) {
+		guint len = 0;
+
+		batch[len++] = g_async_queue_pop (done);
+
+		g_async_queue_lock (done);
+		while (len < BT_MANAGER_RESTORE_BATCH && len < pending && (batch[len] = g_async_queue_try_pop_unlocked (done)))
+			len++;
+		g_async_queue_unlock (done);
+
+		pending -= len;
+
+		g_timer_start (insert);
+		bt_manager_restore_insert (manager, batch, len, resume, stats);
+		stats->insert_time += g_timer_elapsed (insert, NULL);
+	}
+
+	g_thread_pool_free (pool, FALSE, TRUE);
+	g_async_queue_unref (done);
+
+	stats->parse_time = g_timer_elapsed (phase, NULL);
+	stats->total_time = g_timer_elapsed (timer, NULL);
+
+	g_debug ("restored %u torrents (%u skipped, %u failed) in %.3fs: scan %.3fs, parse %.3fs, insert %.3fs",
+	         stats->added, stats->skipped, stats->failed, stats->total_time,
+	         stats->scan_time, stats->parse_time, stats->insert_time);
+
+	if (arena)
+		bt_bencode_arena_free (arena);
+	g_free (resume_contents);
+
+	g_timer_destroy (timer);
+	g_timer_destroy (phase);
+	g_timer_destroy (insert);
+
+	return TRUE;
 }
 
 /**
@@ -172,6 +898,123 @@ bt_manager_start_accepting (BtManager *manager, GError **error)
 	return TRUE;
 }
 
+/**
+ * bt_manager_start_dht:
+ * @manager: the manager
+ * @error: return location for errors
+ *
+ * Starts a DHT node on the port the manager listens on, in the default main
+ * context. Peers that support the DHT are told about it, and the nodes they
+ * tell us about are added to it. Nodes to bootstrap from have to be added
+ * with bt_manager_add_dht_node().
+ *
+ * Returns: TRUE if the node is running, otherwise FALSE and @error is set.
+ */
+gboolean
+bt_manager_start_dht (BtManager *manager, GError **error)
+{
+	BtDht *dht;
+
+	g_return_val_if_fail (BT_IS_MANAGER (manager), FALSE);
+
+	if (manager->dht != NULL)
+		bt_manager_stop_dht (manager);
+
+	if (!(dht = bt_dht_new (NULL, manager->port, NULL, error)))
+		return FALSE;
+
+	g_static_mutex_lock (&manager->dht_lock);
+	manager->dht = dht;
+	g_static_mutex_unlock (&manager->dht_lock);
+
+	return TRUE;
+}
+
+/**
+ * bt_manager_stop_dht:
+ * @manager: the manager
+ *
+ * Stops the DHT node.
+ */
+void
+bt_manager_stop_dht (BtManager *manager)
+{
+	BtDht *dht;
+
+	g_return_if_fail (BT_IS_MANAGER (manager));
+
+	g_static_mutex_lock (&manager->dht_lock);
+	dht = manager->dht;
+	manager->dht = NULL;
+	g_static_mutex_unlock (&manager->dht_lock);
+
+	if (dht != NULL)
+		bt_dht_free (dht);
+}
+
+/**
+ * bt_manager_get_dht:
+ * @manager: the manager
+ *
+ * Gets the DHT node. It must only be used from the main thread, though
+ * other threads may check whether there is one.
+ *
+ * Returns: the node, or NULL if it isn't running.
+ */
+BtDht *
+bt_manager_get_dht (BtManager *manager)
+{
+	g_return_val_if_fail (BT_IS_MANAGER (manager), NULL);
+
+	return manager->dht;
+}
+
+/**
+ * bt_manager_add_dht_node:
+ * @manager: the manager
+ * @address: the UDP address of a node
+ *
+ * Adds a node to the DHT if it's running, like one a peer told us about or a
+ * well-known router. This can be called from any thread.
+ */
+void
+bt_manager_add_dht_node (BtManager *manager, const BtAddress *address)
+{
+	g_return_if_fail (BT_IS_MANAGER (manager));
+	g_return_if_fail (address != NULL);
+
+	g_static_mutex_lock (&manager->dht_lock);
+
+	if (manager->dht != NULL)
+		bt_dht_add_node (manager->dht, address);
+
+	g_static_mutex_unlock (&manager->dht_lock);
+}
+
+/**
+ * bt_manager_get_udp_tracker:
+ * @manager: the manager
+ * @error: return location for errors
+ *
+ * Gets the client for UDP trackers, creating it in the default main context
+ * the first time. Torrents share it so that those on the same tracker share
+ * a connection. It must only be used from the main thread.
+ *
+ * Returns: the client, or NULL if it couldn't be created, with @error set
+ */
+BtUdpTracker *
+bt_manager_get_udp_tracker (BtManager *manager, GError **error)
+{
+	g_return_val_if_fail (BT_IS_MANAGER (manager), NULL);
+
+	/* torrents that are let go while the manager is disposed of shouldn't
+	 * bring it back */
+	if (manager->udp_tracker == NULL && manager->torrents != NULL)
+		manager->udp_tracker = bt_udp_tracker_new (NULL, error);
+
+	return manager->udp_tracker;
+}
+
 /**
  * bt_manager_get_port:
  * @manager: the manager
@@ -224,6 +1067,14 @@ bt_manager_set_port (BtManager *manager, gushort port)
 		}
 	}
 
+	/* the DHT moves along, since peers are told it's on the same port */
+	if (manager->dht != NULL) {
+		if (!bt_manager_start_dht (manager, &error)) {
+			g_warning ("could not restart the DHT: %s", error->message);
+			g_clear_error (&error);
+		}
+	}
+
 	g_object_notify (G_OBJECT (manager), "port");
 
 	g_object_thaw_notify (G_OBJECT (manager));
@@ -246,6 +1097,123 @@ bt_manager_get_peer_id (BtManager *manager)
 	return manager->peer_id;
 }
 
+/**
+ * bt_manager_get_have_interval:
+ * @manager: the manager
+ *
+ * Returns: the time in milliseconds that have messages are held back
+ */
+guint
+bt_manager_get_have_interval (BtManager *manager)
+{
+	g_return_val_if_fail (BT_IS_MANAGER (manager), 0);
+
+	return manager->have_interval;
+}
+
+/**
+ * bt_manager_get_lazy_have:
+ * @manager: the manager
+ *
+ * Returns: whether have messages are left out for peers that have the piece
+ */
+gboolean
+bt_manager_get_lazy_have (BtManager *manager)
+{
+	g_return_val_if_fail (BT_IS_MANAGER (manager), FALSE);
+
+	return manager->lazy_have;
+}
+
+/**
+ * bt_manager_add_extension:
+ * @manager: the manager
+ * @extension: the extension to add
+ *
+ * Adds a protocol extension that peers of all the torrents will offer in their
+ * extended handshakes. This has to be done before any torrents are started or
+ * connections accepted. The manager holds a reference to @extension.
+ *
+ * Returns: the id of the extension in our extended messages, or 0 if there is
+ * no room for it or one with the same name was already added
+ */
+guint
+bt_manager_add_extension (BtManager *manager, BtPeerExtension *extension)
+{
+	const gchar *name;
+	guint i;
+
+	g_return_val_if_fail (BT_IS_MANAGER (manager), 0);
+	g_return_val_if_fail (BT_IS_PEER_EXTENSION (extension), 0);
+
+	name = bt_peer_extension_get_name (extension);
+
+	if (manager->num_extensions == BT_PEER_EXTENSION_MAX)
+		return 0;
+
+	for (i = 0; i < manager->num_extensions; i++)
+		if (strcmp (bt_peer_extension_get_name (manager->extensions[i]), name) == 0)
+			return 0;
+
+	manager->extensions[manager->num_extensions++] = g_object_ref (extension);
+
+	return manager->num_extensions;
+}
+
+/**
+ * bt_manager_get_extension:
+ * @manager: the manager
+ * @id: the id of the extension in our extended messages
+ *
+ * Returns: the extension, or %NULL if there is none with @id
+ */
+BtPeerExtension *
+bt_manager_get_extension (BtManager *manager, guint id)
+{
+	g_return_val_if_fail (BT_IS_MANAGER (manager), NULL);
+
+	if (id == 0 || id > manager->num_extensions)
+		return NULL;
+
+	return manager->extensions[id - 1];
+}
+
+/**
+ * bt_manager_get_extension_id:
+ * @manager: the manager
+ * @extension: an extension
+ *
+ * Returns: the id of @extension in our extended messages, or 0 if it wasn't
+ *   added to @manager
+ */
+guint
+bt_manager_get_extension_id (BtManager *manager, BtPeerExtension *extension)
+{
+	guint i;
+
+	g_return_val_if_fail (BT_IS_MANAGER (manager), 0);
+
+	for (i = 0; i < manager->num_extensions; i++)
+		if (manager->extensions[i] == extension)
+			return i + 1;
+
+	return 0;
+}
+
+/**
+ * bt_manager_get_num_extensions:
+ * @manager: the manager
+ *
+ * Returns: the number of extensions added, which are numbered 1 up to this
+ */
+guint
+bt_manager_get_num_extensions (BtManager *manager)
+{
+	g_return_val_if_fail (BT_IS_MANAGER (manager), 0);
+
+	return manager->num_extensions;
+}
+
 /**
  * bt_manager_set_peer_id:
  * @manager: the manager
@@ -281,18 +1249,53 @@ bt_manager_clear_torrents (gpointer key G_GNUC_UNUSED, gpointer value, gpointer
 	g_object_unref (G_OBJECT (value));
 }
 
+static void
+bt_manager_stop_torrents (gpointer key G_GNUC_UNUSED, gpointer value, gpointer user_data G_GNUC_UNUSED)
+{
+	bt_torrent_stop (BT_TORRENT (value));
+}
+
 static void
 bt_manager_dispose (GObject *object)
 {
 	BtManager *self = BT_MANAGER (object);
+	guint i;
 	
 	if (self->torrents == NULL)
 		return;
 
+	/* lookups that are still running call back into their torrents */
+	bt_manager_stop_dht (self);
+
+	/* peers on network threads are dropped there, before the threads quit */
+	if (self->num_shards > 0)
+		g_hash_table_foreach (self->torrents, &bt_manager_stop_torrents, NULL);
+
+	for (i = 0; i < self->num_shards; i++)
+		bt_shard_stop (self->shards[i]);
+
 	g_hash_table_foreach (self->torrents, &bt_manager_clear_torrents, NULL);
 	g_hash_table_unref (self->torrents);
 	
 	self->torrents = NULL;
+
+	/* the torrents have cancelled their announces by now */
+	if (self->udp_tracker != NULL) {
+		bt_udp_tracker_free (self->udp_tracker);
+		self->udp_tracker = NULL;
+	}
+
+	for (i = 0; i < self->num_shards; i++)
+		bt_shard_free (self->shards[i]);
+
+	g_free (self->shards);
+	self->shards = NULL;
+	self->num_shards = 0;
+
+	for (i = 0; i < self->num_extensions; i++)
+		g_object_unref (self->extensions[i]);
+
+	self->num_extensions = 0;
 	
 	G_OBJECT_CLASS (bt_manager_parent_class)->dispose (object);
 }
@@ -304,6 +1307,8 @@ bt_manager_finalize (GObject *object)
 	
 	g_free (self->peer_id);
 
+	g_static_mutex_free (&self->dht_lock);
+
 	G_OBJECT_CLASS (bt_manager_parent_class)->finalize (object);
 }
 
@@ -320,6 +1325,26 @@ bt_manager_set_property (GObject *object, guint property, const GValue *value, G
 	case BT_MANAGER_PROPERTY_PEER_ID:
 		bt_manager_set_peer_id (self, g_value_get_string (value));
 		break;
+
+	case BT_MANAGER_PROPERTY_SHARDS:
+		bt_manager_set_num_shards (self, g_value_get_uint (value));
+		break;
+
+	case BT_MANAGER_PROPERTY_MAX_CONNECTIONS:
+		self->max_connections = g_value_get_uint (value);
+		break;
+
+	case BT_MANAGER_PROPERTY_MAX_HALF_OPEN:
+		self->max_half_open = g_value_get_uint (value);
+		break;
+
+	case BT_MANAGER_PROPERTY_HAVE_INTERVAL:
+		self->have_interval = g_value_get_uint (value);
+		break;
+
+	case BT_MANAGER_PROPERTY_LAZY_HAVE:
+		self->lazy_have = g_value_get_boolean (value);
+		break;
 		
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property, pspec);
@@ -339,6 +1364,26 @@ bt_manager_get_property (GObject *object, guint property, GValue *value, GParamS
 	case BT_MANAGER_PROPERTY_PEER_ID:
 		g_value_set_string (value, self->peer_id);
 		break;
+
+	case BT_MANAGER_PROPERTY_SHARDS:
+		g_value_set_uint (value, self->num_shards);
+		break;
+
+	case BT_MANAGER_PROPERTY_MAX_CONNECTIONS:
+		g_value_set_uint (value, self->max_connections);
+		break;
+
+	case BT_MANAGER_PROPERTY_MAX_HALF_OPEN:
+		g_value_set_uint (value, self->max_half_open);
+		break;
+
+	case BT_MANAGER_PROPERTY_HAVE_INTERVAL:
+		g_value_set_uint (value, self->have_interval);
+		break;
+
+	case BT_MANAGER_PROPERTY_LAZY_HAVE:
+		g_value_set_boolean (value, self->lazy_have);
+		break;
 		
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property, pspec);
@@ -348,7 +1393,26 @@ bt_manager_get_property (GObject *object, guint property, GValue *value, GParamS
 static void
 bt_manager_init (BtManager *manager)
 {
-	manager->torrents = g_hash_table_new (g_str_hash, g_str_equal);
+	BtPeerPex *pex;
+	BtPeerMetadata *metadata;
+
+	manager->torrents = g_hash_table_new (bt_infohash_hash, bt_infohash_equal);
+	manager->shards = NULL;
+	manager->num_shards = 0;
+	manager->connections = 0;
+	manager->half_open = 0;
+	manager->num_extensions = 0;
+	manager->dht = NULL;
+	g_static_mutex_init (&manager->dht_lock);
+	manager->udp_tracker = NULL;
+
+	pex = bt_peer_pex_new ();
+	bt_manager_add_extension (manager, BT_PEER_EXTENSION (pex));
+	g_object_unref (pex);
+
+	metadata = bt_peer_metadata_new ();
+	bt_manager_add_extension (manager, BT_PEER_EXTENSION (metadata));
+	g_object_unref (metadata);
 
 	return;
 }
@@ -396,6 +1460,87 @@ bt_manager_class_init (BtManagerClass *manager_class)
 	g_free (default_id);
 
 	g_object_class_install_property (object_class, BT_MANAGER_PROPERTY_PEER_ID, pspec);
+
+	/**
+	 * BtManager:shards:
+	 *
+	 * The number of network threads to run peers on, each with its own main
+	 * context. Torrents are spread over them by infohash. With 0, everything
+	 * runs from the default main context.
+	 */
+	pspec = g_param_spec_uint ("shards",
+	                           "network threads",
+	                           "Number of threads to run peer connections on",
+	                           0,
+	                           BT_MANAGER_MAX_SHARDS,
+	                           0,
+	                           G_PARAM_READWRITE | G_PARAM_STATIC_NAME | G_PARAM_STATIC_BLURB | G_PARAM_STATIC_NICK | G_PARAM_CONSTRUCT_ONLY);
+
+	g_object_class_install_property (object_class, BT_MANAGER_PROPERTY_SHARDS, pspec);
+
+	/**
+	 * BtManager:max-connections:
+	 *
+	 * The most peer connections to have open over all torrents. Incoming
+	 * connections past this are refused, and torrents wait for a free slot
+	 * before connecting to more peers.
+	 */
+	pspec = g_param_spec_uint ("max-connections",
+	                           "maximum connections",
+	                           "The maximum number of open peer connections",
+	                           1,
+	                           65535,
+	                           BT_MANAGER_DEFAULT_MAX_CONNECTIONS,
+	                           G_PARAM_READWRITE | G_PARAM_STATIC_NAME | G_PARAM_STATIC_BLURB | G_PARAM_STATIC_NICK | G_PARAM_CONSTRUCT);
+
+	g_object_class_install_property (object_class, BT_MANAGER_PROPERTY_MAX_CONNECTIONS, pspec);
+
+	/**
+	 * BtManager:max-half-open:
+	 *
+	 * The most outgoing connections to have in progress at once.
+	 */
+	pspec = g_param_spec_uint ("max-half-open",
+	                           "maximum half-open connections",
+	                           "The maximum number of outgoing connections being established at once",
+	                           1,
+	                           1024,
+	                           BT_MANAGER_DEFAULT_MAX_HALF_OPEN,
+	                           G_PARAM_READWRITE | G_PARAM_STATIC_NAME | G_PARAM_STATIC_BLURB | G_PARAM_STATIC_NICK | G_PARAM_CONSTRUCT);
+
+	g_object_class_install_property (object_class, BT_MANAGER_PROPERTY_MAX_HALF_OPEN, pspec);
+
+	/**
+	 * BtManager:have-interval:
+	 *
+	 * How long, in milliseconds, the have messages for completed pieces are
+	 * held back so that those for several pieces are sent to each peer at
+	 * once. 0 sends them as soon as each piece completes.
+	 */
+	pspec = g_param_spec_uint ("have-interval",
+	                           "have message interval",
+	                           "The time in milliseconds over which have messages are gathered before being sent",
+	                           0,
+	                           60000,
+	                           BT_MANAGER_DEFAULT_HAVE_INTERVAL,
+	                           G_PARAM_READWRITE | G_PARAM_STATIC_NAME | G_PARAM_STATIC_BLURB | G_PARAM_STATIC_NICK | G_PARAM_CONSTRUCT);
+
+	g_object_class_install_property (object_class, BT_MANAGER_PROPERTY_HAVE_INTERVAL, pspec);
+
+	/**
+	 * BtManager:lazy-have:
+	 *
+	 * Whether to leave out have messages to peers that have the piece
+	 * already. They don't need them to know what to ask us for, but some
+	 * clients use them to tell how far along we are.
+	 */
+	pspec = g_param_spec_boolean ("lazy-have",
+	                              "lazy have messages",
+	                              "Whether to skip have messages to peers that already have the piece",
+	                              FALSE,
+	                              G_PARAM_READWRITE | G_PARAM_STATIC_NAME | G_PARAM_STATIC_BLURB | G_PARAM_STATIC_NICK | G_PARAM_CONSTRUCT);
+
+	g_object_class_install_property (object_class, BT_MANAGER_PROPERTY_LAZY_HAVE, pspec);
 	
 	/**
 	 * BtManager::new-connection:
@@ -30,7 +30,30 @@
 typedef struct _BtManager      BtManager;
 typedef struct _BtManagerClass BtManagerClass;
 
+typedef struct {
+	/* torrents that were added, already in the manager, or couldn't be read */
+	guint   added;
+	guint   skipped;
+	guint   failed;
+
+	/* seconds spent listing the directory and reading the resume data */
+	gdouble scan_time;
+
+	/* seconds from handing the files to the workers until the last one was
+	 * added, which includes insert_time */
+	gdouble parse_time;
+
+	/* seconds spent adding torrents to the manager */
+	gdouble insert_time;
+
+	gdouble total_time;
+} BtManagerRestoreStats;
+
+#include "bt-shard.h"
 #include "bt-torrent.h"
+#include "bt-peer-extension.h"
+#include "bt-dht.h"
+#include "bt-udp-tracker.h"
 
 GType            bt_manager_get_type ();
 
@@ -40,12 +63,40 @@ void             bt_manager_add_torrent (BtManager *manager, BtTorrent *torrent)
 
 void             bt_manager_remove_torrent (BtManager *manager);
 
-BtTorrent       *bt_manager_get_torrent (BtManager *manager, gchar *id);
+BtTorrent       *bt_manager_get_torrent (BtManager *manager, const gchar *infohash);
+
+BtShard         *bt_manager_get_shard (BtManager *manager, const gchar *infohash);
+
+gboolean         bt_manager_reserve_connection (BtManager *manager, gboolean outgoing);
+
+void             bt_manager_release_half_open (BtManager *manager);
+
+void             bt_manager_release_connection (BtManager *manager);
+
+gboolean         bt_manager_save_index (BtManager *manager, const gchar *filename, GError **error);
+
+gboolean         bt_manager_load_index (BtManager *manager, const gchar *filename, GError **error);
+
+GList           *bt_manager_get_torrents (BtManager *manager);
+
+gboolean         bt_manager_save_resume_data (BtManager *manager, const gchar *filename, GError **error);
+
+gboolean         bt_manager_restore_session (BtManager *manager, const gchar *directory, const gchar *resume_file, BtManagerRestoreStats *stats, GError **error);
 
 void             bt_manager_stop_accepting (BtManager *manager);
 
 gboolean         bt_manager_start_accepting (BtManager *manager, GError **error);
 
+gboolean         bt_manager_start_dht (BtManager *manager, GError **error);
+
+void             bt_manager_stop_dht (BtManager *manager);
+
+BtDht           *bt_manager_get_dht (BtManager *manager);
+
+void             bt_manager_add_dht_node (BtManager *manager, const BtAddress *address);
+
+BtUdpTracker    *bt_manager_get_udp_tracker (BtManager *manager, GError **error);
+
 gushort          bt_manager_get_port (BtManager *manager);
 
 void             bt_manager_set_port (BtManager *manager, gushort port);
@@ -54,4 +105,16 @@ const gchar     *bt_manager_get_peer_id (BtManager *manager);
 
 void             bt_manager_set_peer_id (BtManager *manager, const gchar *peer_id);
 
+guint            bt_manager_get_have_interval (BtManager *manager);
+
+gboolean         bt_manager_get_lazy_have (BtManager *manager);
+
+guint            bt_manager_add_extension (BtManager *manager, BtPeerExtension *extension);
+
+BtPeerExtension *bt_manager_get_extension (BtManager *manager, guint id);
+
+guint            bt_manager_get_extension_id (BtManager *manager, BtPeerExtension *extension);
+
+guint            bt_manager_get_num_extensions (BtManager *manager);
+
 #endif
@@ -40,8 +40,87 @@ bt_peer_extension_get_type ()
 		};
 		
 		type = g_type_register_static (G_TYPE_INTERFACE, "BtPeerExtension", &info, 0);
+		g_type_interface_add_prerequisite (type, G_TYPE_OBJECT);
 	}
 
 	return type;
 }
 
+/**
+ * bt_peer_extension_get_name:
+ * @extension: the extension
+ *
+ * Returns: the name the extension goes by in extended handshakes
+ */
+const gchar *
+bt_peer_extension_get_name (BtPeerExtension *extension)
+{
+	g_return_val_if_fail (BT_IS_PEER_EXTENSION (extension), NULL);
+
+	return BT_PEER_EXTENSION_GET_IFACE (extension)->get_name (extension);
+}
+
+/**
+ * bt_peer_extension_add_handshake:
+ * @extension: the extension
+ * @peer: the peer the handshake is for
+ * @entries: a #GArray of #BtBencodeDictEntry
+ *
+ * Lets the extension add keys of its own to the extended handshake sent to
+ * @peer. The entries don't need to be sorted, but their strings have to stay
+ * valid until the handshake is sent, right after.
+ */
+void
+bt_peer_extension_add_handshake (BtPeerExtension *extension, BtPeer *peer, GArray *entries)
+{
+	BtPeerExtensionIface *iface;
+
+	g_return_if_fail (BT_IS_PEER_EXTENSION (extension));
+
+	iface = BT_PEER_EXTENSION_GET_IFACE (extension);
+
+	if (iface->add_handshake != NULL)
+		iface->add_handshake (extension, peer, entries);
+}
+
+/**
+ * bt_peer_extension_on_handshake:
+ * @extension: the extension
+ * @peer: the peer that sent the handshake
+ * @handshake: the decoded handshake dictionary
+ *
+ * Tells the extension that @peer supports it. @handshake is only valid during
+ * the call.
+ */
+void
+bt_peer_extension_on_handshake (BtPeerExtension *extension, BtPeer *peer, BtBencode *handshake)
+{
+	BtPeerExtensionIface *iface;
+
+	g_return_if_fail (BT_IS_PEER_EXTENSION (extension));
+
+	iface = BT_PEER_EXTENSION_GET_IFACE (extension);
+
+	if (iface->on_handshake != NULL)
+		iface->on_handshake (extension, peer, handshake);
+}
+
+/**
+ * bt_peer_extension_on_message:
+ * @extension: the extension
+ * @peer: the peer that sent the message
+ * @payload: the message past the extended message id
+ * @len: the length of @payload
+ *
+ * Hands a message to the extension it is for.
+ *
+ * Returns: %FALSE if the message was invalid
+ */
+gboolean
+bt_peer_extension_on_message (BtPeerExtension *extension, BtPeer *peer, const gchar *payload, gsize len)
+{
+	g_return_val_if_fail (BT_IS_PEER_EXTENSION (extension), FALSE);
+
+	return BT_PEER_EXTENSION_GET_IFACE (extension)->on_message (extension, peer, payload, len);
+}
+
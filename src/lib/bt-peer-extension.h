@@ -23,6 +23,10 @@
 
 #include <glib-object.h>
 
+/* the most extensions a manager can have registered; ids for messages are
+ * handed out from 1 up to this */
+#define BT_PEER_EXTENSION_MAX 8
+
 #define BT_TYPE_PEER_EXTENSION            (bt_peer_extension_get_type ())
 #define BT_PEER_EXTENSION(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), BT_TYPE_PEER_EXTENSION, BtPeerExtension))
 #define BT_IS_PEER_EXTENSION(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), BT_TYPE_PEER_EXTENSION))
@@ -31,10 +35,40 @@
 typedef struct _BtPeerExtension      BtPeerExtension;
 typedef struct _BtPeerExtensionIface BtPeerExtensionIface;
 
+#include "bt-bencode.h"
+#include "bt-peer.h"
+
+/**
+ * BtPeerExtensionIface:
+ * @parent: the parent interface
+ * @get_name: returns the name of the extension in the extended handshake, like "ut_pex"
+ * @add_handshake: appends #BtBencodeDictEntry items of its own to the extended handshake we send to a peer; optional
+ * @on_handshake: called when a peer's extended handshake says it supports the extension, with the whole handshake; optional
+ * @on_message: called with the payload of a message for the extension, which points into the peer's receive buffer and is only valid during the call; returns %FALSE if it is invalid, which drops the peer
+ *
+ * An extension to the peer protocol, as in BEP 10. All of these are called on
+ * the thread of the peer's torrent.
+ */
 struct _BtPeerExtensionIface {
 	GTypeInterface parent;
+
+	const gchar *(*get_name) (BtPeerExtension *extension);
+
+	void (*add_handshake) (BtPeerExtension *extension, BtPeer *peer, GArray *entries);
+
+	void (*on_handshake) (BtPeerExtension *extension, BtPeer *peer, BtBencode *handshake);
+
+	gboolean (*on_message) (BtPeerExtension *extension, BtPeer *peer, const gchar *payload, gsize len);
 };
 
-GType bt_peer_extension_get_type ();
+GType        bt_peer_extension_get_type ();
+
+const gchar *bt_peer_extension_get_name (BtPeerExtension *extension);
+
+void         bt_peer_extension_add_handshake (BtPeerExtension *extension, BtPeer *peer, GArray *entries);
+
+void         bt_peer_extension_on_handshake (BtPeerExtension *extension, BtPeer *peer, BtBencode *handshake);
+
+gboolean     bt_peer_extension_on_message (BtPeerExtension *extension, BtPeer *peer, const gchar *payload, gsize len);
 
 #endif
@@ -0,0 +1,594 @@
+/**
+ * bt-peer-metadata.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+
+#include "bt-peer-metadata.h"
+#include "bt-peer-private.h"
+#include "bt-peer-protocol.h"
+#include "bt-bitfield.h"
+
+/* the metadata goes in pieces of this size, all but the last */
+#define BT_PEER_METADATA_PIECE_SIZE 16384
+
+/* the largest metadata we'll fetch, which is a few million pieces */
+#define BT_PEER_METADATA_MAX_SIZE (8 * 1024 * 1024)
+
+/* requests each peer may have outstanding, and the seconds after which a
+ * request that wasn't answered is sent to someone else */
+#define BT_PEER_METADATA_MAX_REQUESTS 2
+#define BT_PEER_METADATA_TIMEOUT 30
+
+/* seconds between looking for peers to ask for the pieces we still need */
+#define BT_PEER_METADATA_INTERVAL 5
+
+typedef enum {
+	BT_PEER_METADATA_MSG_REQUEST,
+	BT_PEER_METADATA_MSG_DATA,
+	BT_PEER_METADATA_MSG_REJECT
+} BtPeerMetadataMsg;
+
+struct _BtPeerMetadata {
+	GObject parent;
+};
+
+struct _BtPeerMetadataClass {
+	GObjectClass parent;
+};
+
+/* the metadata being fetched, kept on a torrent that needs it from the first
+ * peer that says how big it is until it's loaded */
+typedef struct {
+	BtTorrent *torrent;
+	GSource   *source;
+
+	/* whether the metadata matched the infohash and was handed to the
+	 * torrent, which loads it on the main thread */
+	gboolean   done;
+
+	/* the id of our messages */
+	guint      id;
+
+	gchar     *data;
+	gsize      size;
+	guint      num_pieces;
+
+	/* the pieces that came, one bit each */
+	gchar     *received;
+	guint      num_received;
+
+	/* when each piece was last requested, in seconds, or 0 */
+	glong     *requested;
+} BtPeerMetadataFetch;
+
+/* what's kept on each peer that supports the extension */
+typedef struct {
+	/* the size of the metadata according to the peer, or 0 */
+	gsize      size;
+
+	guint      in_flight;
+	glong      last_request;
+
+	/* whether the peer turned down a request, after which it isn't asked
+	 * again */
+	gboolean   rejected;
+
+	/* whether the peer sent pieces of the metadata being fetched, and
+	 * whether some it sent didn't match the infohash, after which it isn't
+	 * asked again either */
+	gboolean   sent;
+	gboolean   failed;
+} BtPeerMetadataPeer;
+
+static void bt_peer_metadata_extension_init (BtPeerExtensionIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (BtPeerMetadata, bt_peer_metadata, G_TYPE_OBJECT,
+	G_IMPLEMENT_INTERFACE (BT_TYPE_PEER_EXTENSION, bt_peer_metadata_extension_init))
+
+static GQuark
+bt_peer_metadata_quark ()
+{
+	return g_quark_from_static_string ("bt-peer-metadata");
+}
+
+/* stops asking for pieces and lets go of the ones that came */
+static void
+bt_peer_metadata_fetch_clear (BtPeerMetadataFetch *fetch)
+{
+	if (fetch->source != NULL) {
+		g_source_destroy (fetch->source);
+		g_source_unref (fetch->source);
+		fetch->source = NULL;
+	}
+
+	g_free (fetch->data);
+	g_free (fetch->received);
+	g_free (fetch->requested);
+
+	fetch->data = NULL;
+	fetch->received = NULL;
+	fetch->requested = NULL;
+}
+
+static void
+bt_peer_metadata_fetch_free (gpointer data)
+{
+	BtPeerMetadataFetch *fetch = (BtPeerMetadataFetch *) data;
+
+	bt_peer_metadata_fetch_clear (fetch);
+	g_slice_free (BtPeerMetadataFetch, fetch);
+}
+
+static void
+bt_peer_metadata_peer_free (gpointer data)
+{
+	g_slice_free (BtPeerMetadataPeer, data);
+}
+
+static BtPeerMetadataPeer *
+bt_peer_metadata_get_peer (BtPeer *peer)
+{
+	BtPeerMetadataPeer *state;
+
+	state = g_object_get_qdata (G_OBJECT (peer), bt_peer_metadata_quark ());
+
+	if (state == NULL) {
+		state = g_slice_new0 (BtPeerMetadataPeer);
+		g_object_set_qdata_full (G_OBJECT (peer), bt_peer_metadata_quark (), state, bt_peer_metadata_peer_free);
+	}
+
+	return state;
+}
+
+/* sends a message, which is a dictionary followed by the data of a piece for
+ * BT_PEER_METADATA_MSG_DATA */
+static void
+bt_peer_metadata_send (BtPeer *peer, guint id, BtPeerMetadataMsg type, guint piece, const gchar *data, gsize len, gsize total_size)
+{
+	BtBencodeDictEntry entries[3];
+	BtBencode message;
+	gchar *buf;
+	gsize header_len;
+
+	/* the keys are already in order */
+	memset (entries, 0, sizeof (entries));
+
+	entries[0].key.str = "msg_type";
+	entries[0].key.len = 8;
+	entries[0].value.type = BT_BENCODE_TYPE_INT;
+	entries[0].value.value = type;
+
+	entries[1].key.str = "piece";
+	entries[1].key.len = 5;
+	entries[1].value.type = BT_BENCODE_TYPE_INT;
+	entries[1].value.value = piece;
+
+	entries[2].key.str = "total_size";
+	entries[2].key.len = 10;
+	entries[2].value.type = BT_BENCODE_TYPE_INT;
+	entries[2].value.value = total_size;
+
+	memset (&message, 0, sizeof (message));
+	message.type = BT_BENCODE_TYPE_DICT;
+	message.dict.entries = entries;
+	message.dict.len = type == BT_PEER_METADATA_MSG_DATA ? 3 : 2;
+
+	header_len = bt_bencode_encoded_size (&message);
+
+	buf = g_malloc (header_len + len);
+
+	bt_bencode_encode_into (&message, buf);
+
+	if (len > 0)
+		memcpy (buf + header_len, data, len);
+
+	bt_peer_send_extended (peer, id, buf, header_len + len);
+
+	g_free (buf);
+}
+
+/* asks the peer for pieces that nobody has been asked for lately */
+static void
+bt_peer_metadata_request (BtPeerMetadataFetch *fetch, BtPeer *peer)
+{
+	BtPeerMetadataPeer *state;
+	GTimeVal now;
+	guint i;
+
+	state = bt_peer_metadata_get_peer (peer);
+
+	if (fetch->done || state->size != fetch->size || state->rejected || state->failed
+		|| peer->status != BT_PEER_STATUS_CONNECTED)
+		return;
+
+	g_get_current_time (&now);
+
+	/* whatever the peer was sitting on has been asked of others by now */
+	if (state->in_flight > 0 && now.tv_sec - state->last_request >= BT_PEER_METADATA_TIMEOUT)
+		state->in_flight = 0;
+
+	for (i = 0; i < fetch->num_pieces && state->in_flight < BT_PEER_METADATA_MAX_REQUESTS; i++) {
+		if (bt_bitfield_get (fetch->received, i))
+			continue;
+
+		if (fetch->requested[i] != 0 && now.tv_sec - fetch->requested[i] < BT_PEER_METADATA_TIMEOUT)
+			continue;
+
+		bt_peer_metadata_send (peer, fetch->id, BT_PEER_METADATA_MSG_REQUEST, i, NULL, 0, 0);
+
+		fetch->requested[i] = now.tv_sec;
+		state->in_flight++;
+		state->last_request = now.tv_sec;
+	}
+}
+
+static void
+bt_peer_metadata_request_peer (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data)
+{
+	BtPeer *peer = BT_PEER (value);
+	BtPeerMetadataFetch *fetch = (BtPeerMetadataFetch *) data;
+
+	if (bt_peer_supports_extension (peer, fetch->id))
+		bt_peer_metadata_request (fetch, peer);
+}
+
+/* picks up the requests that timed out or were rejected */
+static gboolean
+bt_peer_metadata_tick (gpointer data)
+{
+	BtPeerMetadataFetch *fetch = (BtPeerMetadataFetch *) data;
+
+	bt_torrent_foreach_peer (fetch->torrent, bt_peer_metadata_request_peer, fetch);
+
+	return TRUE;
+}
+
+/* starts fetching metadata of the given size, which is asked of the peers
+ * that agree on it */
+static BtPeerMetadataFetch *
+bt_peer_metadata_fetch_new (BtTorrent *torrent, guint id, gsize size)
+{
+	BtPeerMetadataFetch *fetch;
+
+	fetch = g_slice_new0 (BtPeerMetadataFetch);
+	fetch->torrent = torrent;
+	fetch->id = id;
+	fetch->size = size;
+	fetch->num_pieces = (fetch->size + BT_PEER_METADATA_PIECE_SIZE - 1) / BT_PEER_METADATA_PIECE_SIZE;
+	fetch->data = g_malloc (fetch->size);
+	fetch->received = g_malloc0 ((fetch->num_pieces + 7) / 8);
+	fetch->requested = g_new0 (glong, fetch->num_pieces);
+
+	fetch->source = g_timeout_source_new (BT_PEER_METADATA_INTERVAL * 1000);
+	g_source_set_callback (fetch->source, bt_peer_metadata_tick, fetch, NULL);
+	g_source_attach (fetch->source, bt_reactor_get_context (bt_reactor_get_current ()));
+
+	g_object_set_qdata_full (G_OBJECT (torrent), bt_peer_metadata_quark (), fetch, bt_peer_metadata_fetch_free);
+
+	return fetch;
+}
+
+/* the sizes the peers that may still be asked say the metadata has, and how
+ * many of them say so */
+typedef struct {
+	guint       id;
+	GHashTable *votes;
+	gsize       size;
+	guint       count;
+} BtPeerMetadataVote;
+
+/* puts the blame for metadata that didn't match on the peers that sent it, and
+ * counts the size the others give */
+static void
+bt_peer_metadata_vote_peer (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data)
+{
+	BtPeer *peer = BT_PEER (value);
+	BtPeerMetadataVote *vote = (BtPeerMetadataVote *) data;
+	BtPeerMetadataPeer *state;
+	guint count;
+
+	if (!bt_peer_supports_extension (peer, vote->id))
+		return;
+
+	state = bt_peer_metadata_get_peer (peer);
+
+	if (state->sent)
+		state->failed = TRUE;
+
+	state->sent = FALSE;
+
+	if (state->failed || state->rejected || state->size == 0)
+		return;
+
+	count = GPOINTER_TO_UINT (g_hash_table_lookup (vote->votes, GUINT_TO_POINTER (state->size))) + 1;
+	g_hash_table_insert (vote->votes, GUINT_TO_POINTER (state->size), GUINT_TO_POINTER (count));
+
+	if (count > vote->count) {
+		vote->size = state->size;
+		vote->count = count;
+	}
+}
+
+/* hands the metadata to the torrent once every piece is in; if it doesn't
+ * match the infohash, the peers that sent it aren't asked again and the
+ * fetch starts over, with the size most of the others give */
+static void
+bt_peer_metadata_complete (BtPeerMetadataFetch *fetch)
+{
+	BtTorrent *torrent = fetch->torrent;
+	BtPeerMetadataVote vote;
+	GError *error = NULL;
+
+	if (bt_torrent_set_metadata (torrent, fetch->data, fetch->size, &error)) {
+		g_debug ("got metadata for %s", bt_torrent_get_infohash_string (torrent));
+
+		/* kept so that nothing is fetched again before the torrent is
+		 * loaded */
+		fetch->done = TRUE;
+		bt_peer_metadata_fetch_clear (fetch);
+		return;
+	}
+
+	g_warning ("could not load metadata for %s: %s", bt_torrent_get_infohash_string (torrent), error->message);
+	g_clear_error (&error);
+
+	memset (&vote, 0, sizeof (vote));
+	vote.id = fetch->id;
+	vote.votes = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	bt_torrent_foreach_peer (torrent, bt_peer_metadata_vote_peer, &vote);
+
+	g_hash_table_destroy (vote.votes);
+
+	/* frees the fetch; the next peer to say how big the metadata is starts
+	 * another if nobody here can be asked */
+	g_object_set_qdata (G_OBJECT (torrent), bt_peer_metadata_quark (), NULL);
+
+	if (vote.count == 0)
+		return;
+
+	fetch = bt_peer_metadata_fetch_new (torrent, vote.id, vote.size);
+
+	bt_torrent_foreach_peer (torrent, bt_peer_metadata_request_peer, fetch);
+}
+
+static const gchar *
+bt_peer_metadata_get_name (BtPeerExtension *extension G_GNUC_UNUSED)
+{
+	return "ut_metadata";
+}
+
+/* tells the peer how big the metadata is, if we have it */
+static void
+bt_peer_metadata_add_handshake (BtPeerExtension *extension G_GNUC_UNUSED, BtPeer *peer, GArray *entries)
+{
+	BtBencodeDictEntry entry;
+	gsize len;
+
+	if (peer->torrent == NULL || bt_torrent_get_metadata (peer->torrent, &len) == NULL)
+		return;
+
+	memset (&entry, 0, sizeof (entry));
+	entry.key.str = "metadata_size";
+	entry.key.len = 13;
+	entry.value.type = BT_BENCODE_TYPE_INT;
+	entry.value.value = len;
+
+	g_array_append_val (entries, entry);
+}
+
+/* starts fetching from the peer if the torrent needs the metadata; the first
+ * peer to say how big it is decides that, and peers that disagree aren't
+ * asked unless the metadata turns out not to match */
+static void
+bt_peer_metadata_on_handshake (BtPeerExtension *extension, BtPeer *peer, BtBencode *handshake)
+{
+	BtPeerMetadataFetch *fetch;
+	BtBencode *size;
+
+	if (peer->torrent == NULL || !bt_torrent_needs_metadata (peer->torrent))
+		return;
+
+	size = bt_bencode_lookup (handshake, "metadata_size");
+
+	if (size == NULL || size->type != BT_BENCODE_TYPE_INT
+		|| size->value <= 0 || size->value > BT_PEER_METADATA_MAX_SIZE)
+		return;
+
+	bt_peer_metadata_get_peer (peer)->size = size->value;
+
+	fetch = g_object_get_qdata (G_OBJECT (peer->torrent), bt_peer_metadata_quark ());
+
+	if (fetch == NULL)
+		fetch = bt_peer_metadata_fetch_new (peer->torrent, bt_manager_get_extension_id (peer->manager, extension), size->value);
+
+	bt_peer_metadata_request (fetch, peer);
+}
+
+/* serves a piece of the metadata, or turns the request down if we don't have
+ * it yet */
+static void
+bt_peer_metadata_on_request (BtPeer *peer, guint id, guint piece)
+{
+	const gchar *metadata;
+	gsize size, offset;
+
+	metadata = bt_torrent_get_metadata (peer->torrent, &size);
+	offset = (gsize) piece * BT_PEER_METADATA_PIECE_SIZE;
+
+	if (metadata == NULL || offset >= size) {
+		bt_peer_metadata_send (peer, id, BT_PEER_METADATA_MSG_REJECT, piece, NULL, 0, 0);
+		return;
+	}
+
+	bt_peer_metadata_send (peer, id, BT_PEER_METADATA_MSG_DATA, piece,
+	                       metadata + offset, MIN (size - offset, BT_PEER_METADATA_PIECE_SIZE), size);
+}
+
+/* takes a piece the peer sent, which has to be exactly where it goes */
+static gboolean
+bt_peer_metadata_on_data (BtPeer *peer, BtPeerMetadataFetch *fetch, guint piece, gint64 total_size, const gchar *data, gsize len)
+{
+	BtPeerMetadataPeer *state;
+	gsize offset;
+
+	state = bt_peer_metadata_get_peer (peer);
+
+	if (state->in_flight > 0)
+		state->in_flight--;
+
+	/* something we didn't ask for, or the torrent already has it */
+	if (fetch == NULL || fetch->done || total_size != (gint64) fetch->size)
+		return TRUE;
+
+	if (piece >= fetch->num_pieces)
+		return FALSE;
+
+	offset = (gsize) piece * BT_PEER_METADATA_PIECE_SIZE;
+
+	if (len != MIN (fetch->size - offset, BT_PEER_METADATA_PIECE_SIZE))
+		return FALSE;
+
+	if (!bt_bitfield_get (fetch->received, piece)) {
+		memcpy (fetch->data + offset, data, len);
+		bt_bitfield_set (fetch->received, piece);
+		fetch->num_received++;
+
+		state->sent = TRUE;
+	}
+
+	if (fetch->num_received == fetch->num_pieces)
+		bt_peer_metadata_complete (fetch);
+	else
+		bt_peer_metadata_request (fetch, peer);
+
+	return TRUE;
+}
+
+static gboolean
+bt_peer_metadata_on_message (BtPeerExtension *extension, BtPeer *peer, const gchar *payload, gsize len)
+{
+	BtPeerMetadataFetch *fetch;
+	BtPeerMetadataPeer *state;
+	BtBencodeArena *arena;
+	BtBencodeDecoder *decoder;
+	BtBencode *message, *type, *piece, *total_size;
+	gsize consumed = 0;
+	gboolean ret = TRUE;
+
+	if (peer->torrent == NULL)
+		return TRUE;
+
+	/* the dictionary is followed by the data of a piece, if there is one */
+	arena = bt_bencode_arena_new (256);
+	decoder = bt_bencode_decoder_new (arena, 1, 0);
+
+	if (!bt_bencode_decoder_feed (decoder, payload, len, &consumed, NULL)
+		|| !bt_bencode_decoder_is_complete (decoder)
+		|| !(message = bt_bencode_decoder_finish (decoder, NULL))
+		|| message->type != BT_BENCODE_TYPE_DICT) {
+		bt_bencode_decoder_free (decoder);
+		bt_bencode_arena_free (arena);
+		return FALSE;
+	}
+
+	bt_bencode_decoder_free (decoder);
+
+	type = bt_bencode_lookup (message, "msg_type");
+	piece = bt_bencode_lookup (message, "piece");
+	total_size = bt_bencode_lookup (message, "total_size");
+
+	if (!type || type->type != BT_BENCODE_TYPE_INT
+		|| !piece || piece->type != BT_BENCODE_TYPE_INT
+		|| piece->value < 0 || piece->value > BT_PEER_METADATA_MAX_SIZE / BT_PEER_METADATA_PIECE_SIZE) {
+		bt_bencode_arena_free (arena);
+		return FALSE;
+	}
+
+	fetch = g_object_get_qdata (G_OBJECT (peer->torrent), bt_peer_metadata_quark ());
+
+	switch (type->value) {
+	case BT_PEER_METADATA_MSG_REQUEST:
+		bt_peer_metadata_on_request (peer, bt_manager_get_extension_id (peer->manager, extension), piece->value);
+		break;
+
+	case BT_PEER_METADATA_MSG_DATA:
+		ret = bt_peer_metadata_on_data (peer, fetch,
+		                                piece->value, total_size && total_size->type == BT_BENCODE_TYPE_INT ? total_size->value : -1,
+		                                payload + consumed, len - consumed);
+		break;
+
+	case BT_PEER_METADATA_MSG_REJECT:
+		state = bt_peer_metadata_get_peer (peer);
+		state->rejected = TRUE;
+
+		if (state->in_flight > 0)
+			state->in_flight--;
+
+		/* someone else gets asked on the next tick */
+		if (fetch != NULL && !fetch->done && (guint) piece->value < fetch->num_pieces)
+			fetch->requested[piece->value] = 0;
+		break;
+
+	default:
+		// newer message types are to be ignored
+		break;
+	}
+
+	bt_bencode_arena_free (arena);
+
+	return ret;
+}
+
+static void
+bt_peer_metadata_extension_init (BtPeerExtensionIface *iface)
+{
+	iface->get_name = bt_peer_metadata_get_name;
+	iface->add_handshake = bt_peer_metadata_add_handshake;
+	iface->on_handshake = bt_peer_metadata_on_handshake;
+	iface->on_message = bt_peer_metadata_on_message;
+}
+
+/**
+ * bt_peer_metadata_new:
+ *
+ * Creates the metadata extension, ut_metadata, through which a torrent started
+ * from a magnet link fetches its info dict from its peers, and loaded torrents
+ * pass theirs on.
+ *
+ * Returns: the new extension
+ */
+BtPeerMetadata *
+bt_peer_metadata_new ()
+{
+	return BT_PEER_METADATA (g_object_new (BT_TYPE_PEER_METADATA, NULL));
+}
+
+static void
+bt_peer_metadata_init (BtPeerMetadata *metadata G_GNUC_UNUSED)
+{
+	return;
+}
+
+static void
+bt_peer_metadata_class_init (BtPeerMetadataClass *metadata_class G_GNUC_UNUSED)
+{
+	return;
+}
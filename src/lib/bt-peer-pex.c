@@ -0,0 +1,482 @@
+/**
+ * bt-peer-pex.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+
+#include "bt-peer-pex.h"
+#include "bt-peer-private.h"
+#include "bt-peer-protocol.h"
+#include "bt-bitfield.h"
+
+/* seconds between the messages each peer is sent, and the least we take
+ * between messages from a peer; anything sooner is ignored */
+#define BT_PEER_PEX_INTERVAL 60
+#define BT_PEER_PEX_MIN_RECEIVE_INTERVAL 45
+
+/* the most peers added or dropped in one message, either way */
+#define BT_PEER_PEX_MAX_ADDED 50
+#define BT_PEER_PEX_MAX_DROPPED 50
+
+/* flags for added peers */
+#define BT_PEER_PEX_FLAG_SEED 0x02
+#define BT_PEER_PEX_FLAG_REACHABLE 0x10
+
+struct _BtPeerPex {
+	GObject parent;
+};
+
+struct _BtPeerPexClass {
+	GObjectClass parent;
+};
+
+/* what a torrent's peers have been told, kept on the torrent while any of
+ * them supports the extension. All peers are sent the same changes at the
+ * same time, so the difference is only worked out and encoded once. */
+typedef struct {
+	BtTorrent *torrent;
+	GSource   *source;
+
+	/* the id of our messages */
+	guint      id;
+
+	/* the peers that went out as added and not yet as dropped, as
+	 * BtPeerPexEntry sorted by address */
+	GArray    *sent;
+} BtPeerPexTorrent;
+
+/* what's kept on each peer that supports the extension */
+typedef struct {
+	/* when the last message from the peer was taken, in seconds */
+	glong      last_received;
+
+	/* whether the peer was sent the full list yet, which it gets on the first
+	 * tick after the handshake; from then on it only gets changes */
+	gboolean   sent_full;
+} BtPeerPexPeer;
+
+typedef struct {
+	BtAddress  address;
+	guint8     flags;
+} BtPeerPexEntry;
+
+typedef struct {
+	guint      id;
+
+	/* the connectable peers, as BtPeerPexEntry */
+	GArray    *current;
+
+	/* the peers to send to */
+	GPtrArray *receivers;
+} BtPeerPexScan;
+
+static void bt_peer_pex_extension_init (BtPeerExtensionIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (BtPeerPex, bt_peer_pex, G_TYPE_OBJECT,
+	G_IMPLEMENT_INTERFACE (BT_TYPE_PEER_EXTENSION, bt_peer_pex_extension_init))
+
+static GQuark
+bt_peer_pex_quark ()
+{
+	return g_quark_from_static_string ("bt-peer-pex");
+}
+
+static gint
+bt_peer_pex_compare_entries (gconstpointer a, gconstpointer b, gpointer data G_GNUC_UNUSED)
+{
+	const BtAddress *x = &((const BtPeerPexEntry *) a)->address;
+	const BtAddress *y = &((const BtPeerPexEntry *) b)->address;
+	gint cmp;
+
+	if (x->length != y->length)
+		return x->length < y->length ? -1 : 1;
+
+	if ((cmp = memcmp (x->bytes, y->bytes, x->length)) != 0)
+		return cmp;
+
+	return x->port < y->port ? -1 : (gint) (x->port > y->port);
+}
+
+static void
+bt_peer_pex_torrent_free (gpointer data)
+{
+	BtPeerPexTorrent *state = (BtPeerPexTorrent *) data;
+
+	if (state->source != NULL) {
+		g_source_destroy (state->source);
+		g_source_unref (state->source);
+	}
+
+	g_array_free (state->sent, TRUE);
+	g_slice_free (BtPeerPexTorrent, state);
+}
+
+static void
+bt_peer_pex_peer_free (gpointer data)
+{
+	g_slice_free (BtPeerPexPeer, data);
+}
+
+static BtPeerPexPeer *
+bt_peer_pex_get_peer (BtPeer *peer)
+{
+	BtPeerPexPeer *state;
+
+	state = g_object_get_qdata (G_OBJECT (peer), bt_peer_pex_quark ());
+
+	if (state == NULL) {
+		state = g_slice_new0 (BtPeerPexPeer);
+		g_object_set_qdata_full (G_OBJECT (peer), bt_peer_pex_quark (), state, bt_peer_pex_peer_free);
+	}
+
+	return state;
+}
+
+static void
+bt_peer_pex_append_compact (GString *string, const BtAddress *address)
+{
+	g_string_append_len (string, (const gchar *) address->bytes, address->length);
+	g_string_append_c (string, address->port >> 8);
+	g_string_append_c (string, address->port & 0xff);
+}
+
+/* encodes a message adding the given entries and dropping the others */
+static GString *
+bt_peer_pex_encode (BtPeerPexEntry *added, guint num_added, BtPeerPexEntry *dropped, guint num_dropped)
+{
+	GString *strings[6];
+	BtBencodeDictEntry entries[6];
+	const gchar *keys[6] = {"added", "added.f", "added6", "added6.f", "dropped", "dropped6"};
+	BtBencode message;
+	GString *encoded;
+	guint i;
+
+	for (i = 0; i < 6; i++)
+		strings[i] = g_string_new (NULL);
+
+	for (i = 0; i < num_added; i++) {
+		guint v6 = added[i].address.length == 16 ? 2 : 0;
+
+		bt_peer_pex_append_compact (strings[v6], &added[i].address);
+		g_string_append_c (strings[v6 + 1], added[i].flags);
+	}
+
+	for (i = 0; i < num_dropped; i++)
+		bt_peer_pex_append_compact (strings[dropped[i].address.length == 16 ? 5 : 4], &dropped[i].address);
+
+	/* the keys are already in order */
+	memset (entries, 0, sizeof (entries));
+
+	for (i = 0; i < 6; i++) {
+		entries[i].key.str = keys[i];
+		entries[i].key.len = strlen (keys[i]);
+		entries[i].value.type = BT_BENCODE_TYPE_STRING;
+		entries[i].value.string.str = strings[i]->str;
+		entries[i].value.string.len = strings[i]->len;
+	}
+
+	memset (&message, 0, sizeof (message));
+	message.type = BT_BENCODE_TYPE_DICT;
+	message.dict.entries = entries;
+	message.dict.len = 6;
+
+	encoded = bt_bencode_encode (&message);
+
+	for (i = 0; i < 6; i++)
+		g_string_free (strings[i], TRUE);
+
+	return encoded;
+}
+
+static void
+bt_peer_pex_scan_peer (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data)
+{
+	BtPeer *peer = BT_PEER (value);
+	BtPeerPexScan *scan = (BtPeerPexScan *) data;
+	BtPeerPexEntry entry;
+
+	/* only peers that got through the handshake are passed on */
+	if (peer->status != BT_PEER_STATUS_CONNECTED)
+		return;
+
+	if (bt_peer_supports_extension (peer, scan->id))
+		g_ptr_array_add (scan->receivers, peer);
+
+	memset (&entry, 0, sizeof (entry));
+
+	if (!bt_peer_get_listen_address (peer, &entry.address))
+		return;
+
+	if (peer->outgoing)
+		entry.flags |= BT_PEER_PEX_FLAG_REACHABLE;
+
+	if (peer->bitfield != NULL && bt_bitfield_count (peer->bitfield, bt_torrent_get_num_pieces (peer->torrent)) == bt_torrent_get_num_pieces (peer->torrent))
+		entry.flags |= BT_PEER_PEX_FLAG_SEED;
+
+	g_array_append_val (scan->current, entry);
+}
+
+/* works out what changed since the last tick, with at most so many added and
+ * dropped; whatever doesn't fit is left for the next one */
+static void
+bt_peer_pex_diff (BtPeerPexTorrent *state, GArray *current, GArray *added, GArray *dropped)
+{
+	GArray *sent;
+	guint i = 0, j = 0;
+
+	sent = g_array_sized_new (FALSE, FALSE, sizeof (BtPeerPexEntry), current->len);
+
+	while (i < state->sent->len || j < current->len) {
+		BtPeerPexEntry *old = i < state->sent->len ? &g_array_index (state->sent, BtPeerPexEntry, i) : NULL;
+		BtPeerPexEntry *now = j < current->len ? &g_array_index (current, BtPeerPexEntry, j) : NULL;
+		gint cmp;
+
+		if (old == NULL)
+			cmp = 1;
+		else if (now == NULL)
+			cmp = -1;
+		else
+			cmp = bt_peer_pex_compare_entries (old, now, NULL);
+
+		if (cmp == 0) {
+			g_array_append_val (sent, *now);
+			i++;
+			j++;
+		} else if (cmp < 0) {
+			/* gone since it was sent */
+			if (dropped->len < BT_PEER_PEX_MAX_DROPPED)
+				g_array_append_val (dropped, *old);
+			else
+				g_array_append_val (sent, *old);
+			i++;
+		} else {
+			/* new since the last tick */
+			if (added->len < BT_PEER_PEX_MAX_ADDED) {
+				g_array_append_val (added, *now);
+				g_array_append_val (sent, *now);
+			}
+			j++;
+		}
+	}
+
+	g_array_free (state->sent, TRUE);
+	state->sent = sent;
+}
+
+static gboolean
+bt_peer_pex_tick (gpointer data)
+{
+	BtPeerPexTorrent *state = (BtPeerPexTorrent *) data;
+	BtPeerPexScan scan;
+	GArray *added, *dropped;
+	GString *changes = NULL, *full = NULL;
+	guint i;
+
+	/* a torrent from a magnet link only finds out it's private once it has
+	 * its metadata */
+	if (bt_torrent_is_private (state->torrent)) {
+		g_object_set_qdata (G_OBJECT (state->torrent), bt_peer_pex_quark (), NULL);
+		return FALSE;
+	}
+
+	scan.id = state->id;
+	scan.current = g_array_new (FALSE, FALSE, sizeof (BtPeerPexEntry));
+	scan.receivers = g_ptr_array_new ();
+
+	bt_torrent_foreach_peer (state->torrent, bt_peer_pex_scan_peer, &scan);
+
+	g_qsort_with_data (scan.current->data, scan.current->len, sizeof (BtPeerPexEntry), bt_peer_pex_compare_entries, NULL);
+
+	added = g_array_new (FALSE, FALSE, sizeof (BtPeerPexEntry));
+	dropped = g_array_new (FALSE, FALSE, sizeof (BtPeerPexEntry));
+
+	bt_peer_pex_diff (state, scan.current, added, dropped);
+
+	for (i = 0; i < scan.receivers->len; i++) {
+		BtPeer *peer = g_ptr_array_index (scan.receivers, i);
+		BtPeerPexPeer *peer_state = bt_peer_pex_get_peer (peer);
+
+		/* the peer itself may be in there, which it has to ignore */
+		if (!peer_state->sent_full) {
+			if (full == NULL)
+				full = bt_peer_pex_encode ((BtPeerPexEntry *) scan.current->data, MIN (scan.current->len, BT_PEER_PEX_MAX_ADDED), NULL, 0);
+
+			bt_peer_send_extended (peer, scan.id, full->str, full->len);
+			peer_state->sent_full = TRUE;
+		} else if (added->len > 0 || dropped->len > 0) {
+			if (changes == NULL)
+				changes = bt_peer_pex_encode ((BtPeerPexEntry *) added->data, added->len, (BtPeerPexEntry *) dropped->data, dropped->len);
+
+			bt_peer_send_extended (peer, scan.id, changes->str, changes->len);
+		}
+	}
+
+	if (full != NULL)
+		g_string_free (full, TRUE);
+
+	if (changes != NULL)
+		g_string_free (changes, TRUE);
+
+	g_array_free (added, TRUE);
+	g_array_free (dropped, TRUE);
+	g_array_free (scan.current, TRUE);
+
+	/* with nobody left to send to, the state goes until a peer comes along */
+	if (scan.receivers->len == 0) {
+		g_ptr_array_free (scan.receivers, TRUE);
+		g_object_set_qdata (G_OBJECT (state->torrent), bt_peer_pex_quark (), NULL);
+		return FALSE;
+	}
+
+	g_ptr_array_free (scan.receivers, TRUE);
+
+	return TRUE;
+}
+
+static const gchar *
+bt_peer_pex_get_name (BtPeerExtension *extension G_GNUC_UNUSED)
+{
+	return "ut_pex";
+}
+
+/* starts sending to the peer's torrent, unless it is already or the torrent
+ * is private */
+static void
+bt_peer_pex_on_handshake (BtPeerExtension *extension, BtPeer *peer, BtBencode *handshake G_GNUC_UNUSED)
+{
+	BtPeerPexTorrent *state;
+
+	if (peer->torrent == NULL || bt_torrent_is_private (peer->torrent))
+		return;
+
+	if (g_object_get_qdata (G_OBJECT (peer->torrent), bt_peer_pex_quark ()) != NULL)
+		return;
+
+	state = g_slice_new0 (BtPeerPexTorrent);
+	state->torrent = peer->torrent;
+	state->id = bt_manager_get_extension_id (peer->manager, extension);
+	state->sent = g_array_new (FALSE, FALSE, sizeof (BtPeerPexEntry));
+
+	state->source = g_timeout_source_new (BT_PEER_PEX_INTERVAL * 1000);
+	g_source_set_callback (state->source, bt_peer_pex_tick, state, NULL);
+	g_source_attach (state->source, bt_reactor_get_context (bt_reactor_get_current ()));
+
+	g_object_set_qdata_full (G_OBJECT (peer->torrent), bt_peer_pex_quark (), state, bt_peer_pex_torrent_free);
+}
+
+static void
+bt_peer_pex_add_compact (GArray *addresses, const BtBencode *string, guint length)
+{
+	guint i;
+
+	if (string == NULL || string->type != BT_BENCODE_TYPE_STRING)
+		return;
+
+	for (i = 0; i + length + 2 <= string->string.len && addresses->len < BT_PEER_PEX_MAX_ADDED; i += length + 2) {
+		const gchar *entry = string->string.str + i;
+		BtAddress address;
+
+		bt_address_set_bytes (&address, entry, length, (guint8) entry[length] << 8 | (guint8) entry[length + 1]);
+
+		if (address.port != 0)
+			g_array_append_val (addresses, address);
+	}
+}
+
+/* takes the added peers as candidates for the torrent, at most so many at a
+ * time and no more often than peers are supposed to send them */
+static gboolean
+bt_peer_pex_on_message (BtPeerExtension *extension G_GNUC_UNUSED, BtPeer *peer, const gchar *payload, gsize len)
+{
+	BtPeerPexPeer *state;
+	BtBencodeArena *arena;
+	BtBencode *message;
+	GArray *addresses;
+	GTimeVal now;
+
+	if (peer->torrent == NULL || bt_torrent_is_private (peer->torrent))
+		return TRUE;
+
+	state = bt_peer_pex_get_peer (peer);
+
+	g_get_current_time (&now);
+
+	if (state->last_received != 0 && now.tv_sec - state->last_received < BT_PEER_PEX_MIN_RECEIVE_INTERVAL) {
+		g_debug ("ignoring early peer exchange from %s", bt_peer_get_address_string (peer));
+		return TRUE;
+	}
+
+	state->last_received = now.tv_sec;
+
+	arena = bt_bencode_arena_new (len);
+
+	message = bt_bencode_decode_arena (arena, payload, len, NULL);
+
+	if (message == NULL || message->type != BT_BENCODE_TYPE_DICT) {
+		bt_bencode_arena_free (arena);
+		return FALSE;
+	}
+
+	addresses = g_array_new (FALSE, FALSE, sizeof (BtAddress));
+
+	bt_peer_pex_add_compact (addresses, bt_bencode_lookup (message, "added"), 4);
+	bt_peer_pex_add_compact (addresses, bt_bencode_lookup (message, "added6"), 16);
+
+	bt_bencode_arena_free (arena);
+
+	g_debug ("peer exchange from %s added %u peers", bt_peer_get_address_string (peer), addresses->len);
+
+	bt_torrent_add_candidates (peer->torrent, addresses);
+
+	return TRUE;
+}
+
+static void
+bt_peer_pex_extension_init (BtPeerExtensionIface *iface)
+{
+	iface->get_name = bt_peer_pex_get_name;
+	iface->on_handshake = bt_peer_pex_on_handshake;
+	iface->on_message = bt_peer_pex_on_message;
+}
+
+/**
+ * bt_peer_pex_new:
+ *
+ * Creates the peer exchange extension, ut_pex, through which peers tell each
+ * other who else they are connected to. It is left out for private torrents.
+ *
+ * Returns: the new extension
+ */
+BtPeerPex *
+bt_peer_pex_new ()
+{
+	return BT_PEER_PEX (g_object_new (BT_TYPE_PEER_PEX, NULL));
+}
+
+static void
+bt_peer_pex_init (BtPeerPex *pex G_GNUC_UNUSED)
+{
+	return;
+}
+
+static void
+bt_peer_pex_class_init (BtPeerPexClass *pex_class G_GNUC_UNUSED)
+{
+	return;
+}
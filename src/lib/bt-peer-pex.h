@@ -0,0 +1,39 @@
+/**
+ * bt-peer-pex.h
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __BT_PEER_PEX_H__
+#define __BT_PEER_PEX_H__
+
+#include <glib-object.h>
+
+#define BT_TYPE_PEER_PEX    (bt_peer_pex_get_type ())
+#define BT_PEER_PEX(obj)    (G_TYPE_CHECK_INSTANCE_CAST ((obj), BT_TYPE_PEER_PEX, BtPeerPex))
+#define BT_IS_PEER_PEX(obj) (G_TYPE_CHECK_INSTANCE_TYPE ((obj), BT_TYPE_PEER_PEX))
+
+typedef struct _BtPeerPex      BtPeerPex;
+typedef struct _BtPeerPexClass BtPeerPexClass;
+
+#include "bt-peer-extension.h"
+
+GType      bt_peer_pex_get_type ();
+
+BtPeerPex *bt_peer_pex_new ();
+
+#endif
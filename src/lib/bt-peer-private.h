@@ -24,6 +24,7 @@
 #include <gnet.h>
 
 #include "bt-peer.h"
+#include "bt-reactor.h"
  
 typedef enum {
 	BT_PEER_STATUS_DISCONNECTED,
@@ -31,7 +32,8 @@ typedef enum {
 	BT_PEER_STATUS_CONNECTED_IN,
 	BT_PEER_STATUS_WAIT_PEER_ID,
 	BT_PEER_STATUS_CONNECTED,
-	BT_PEER_STATUS_IDLE
+	BT_PEER_STATUS_IDLE,
+	BT_PEER_STATUS_CLOSING
 } BtPeerStatus;
 
 typedef enum {
@@ -42,47 +44,122 @@ typedef enum {
 
 typedef BtPeerDataStatus (*BtPeerMsgFunc) (BtPeer *peer, guint* bytes_read);
 
+/* the state of a peer, ordered so that what's looked at for every message
+ * comes first and flags are packed into bits; there can be thousands of
+ * these on one thread */
 struct _BtPeer {
 	GObject      parent;
 	
-	/* the BtManager for this peer */
-	BtManager   *manager;
-	
+	BtPeerStatus status;
+
+	guint        peer_choking : 1;
+	guint        peer_interested : 1;
+	guint        interested : 1;
+	guint        choking : 1;
+
+	/* whether the handshake went through at some point, which is how the
+	 * torrent ranks peers to reconnect to, along with @downloaded */
+	guint        established : 1;
+
+	/* slots taken from the manager for this connection, given back when it's
+	 * established or closed */
+	guint        has_slot : 1;
+	guint        half_open : 1;
+
+	/* whether @peer_id has been received, and whether @hostname is being
+	 * looked up */
+	guint        has_peer_id : 1;
+	guint        resolving : 1;
+
+	/* whether both sides support the fast extension, extended messages, and
+	 * the DHT */
+	guint        fast : 1;
+	guint        extended : 1;
+	guint        dht : 1;
+
+	/* whether we made the connection, so that the address is the one the
+	 * peer listens on */
+	guint        outgoing : 1;
+
+	/* the network connection, NULL once closed */
+	BtConnection *connection;
+
+	GString     *buffer;
+
+	/* messages about pieces that came while the torrent had no metadata, kept
+	 * whole to be handled once it does, or NULL */
+	GString     *early;
+
+	/* the pieces the peer has, one bit each, from the torrent's pool and NULL
+	 * until the peer sends a bitfield or a have */
+	gchar       *bitfield;
+
+	/* how many of those we don't have yet, which is what decides whether
+	 * we're interested */
+	guint        missing;
+
+	/* the piece we're downloading from the peer, claimed from the torrent,
+	 * or -1; with a bit for each of its blocks that's been asked for, and
+	 * how many of them have yet to come */
+	gint         piece;
+	gchar       *blocks;
+	guint        blocks_left;
+
+	/* the requests in flight, as the offsets of the blocks in @piece, made
+	 * when first needed */
+	GArray      *requests;
+
+	/* the pieces the peer suggested, and the ones it lets us download while
+	 * it chokes us, as guint32, or NULL until it sends any */
+	GArray      *suggested;
+	GArray      *fast_pieces;
+
+	/* pieces we completed that the peer hasn't been told about yet, as
+	 * guint32, made when first needed */
+	GArray      *haves;
+
+	/* the pieces the peer may request from us while choked, as guint32, or
+	 * NULL without the fast extension */
+	GArray      *allowed_fast;
+
 	/* the torrent that this peer is serving */
 	BtTorrent   *torrent;
-	
-	/* the internet address of this peer */
-	GInetAddr   *address;
-	
-	/* the address as a string address:port */
-	gchar       *address_string;
-	
-	/* the network connection */
-	GConn       *socket;
-	
-	/* the actual tcp socket */
-	GTcpSocket  *tcp_socket;
 
-	gchar       *peer_id;
-	
-	gboolean     peer_choking;
-	gboolean     peer_interested;
-	gboolean     interested;
-	gboolean     choking;
+	/* the BtManager for this peer */
+	BtManager   *manager;
 
-	gchar       *bitfield;
+	/* the piece data received from the peer */
+	guint64      downloaded;
 
-	GString     *buffer;
-	
 	void       (*encryption_func) (BtPeer *peer, guint len, gpointer buf);
 
-	BtPeerMsgFunc extension_func;
+	/* the ids the peer gave the manager's extensions in its extended
+	 * handshake, indexed by our ids minus one; 0 if it doesn't support one */
+	guint8       extension_ids[BT_PEER_EXTENSION_MAX];
 
-	BtPeerStatus status;
+	/* the internet address of this peer */
+	BtAddress    address;
+
+	gchar        peer_id[20];
+
+	/* the port an incoming peer listens on, from its extended handshake, or
+	 * 0 if it didn't say */
+	guint16      listen_port;
+
+	/* the address as a string address:port, made when first asked for */
+	gchar       *address_string;
+
+	/* the name of the address once it's been looked up */
+	gchar       *hostname;
+
+	/* the socket of an incoming connection, only used during construction */
+	GTcpSocket  *tcp_socket;
 };
 
 struct _BtPeerClass {
 	GObjectClass parent;
 };
 
+void bt_peer_move_to_shard (BtPeer *peer);
+
 #endif
@@ -23,7 +23,9 @@
 #include "bt-peer-private.h"
 #include "bt-peer-protocol.h"
 #include "bt-peer-encryption.h"
+#include "bt-bitfield.h"
 #include "bt-utils.h"
+#include "sha1.h"
 
 // defines for fixed length messages, the 4-byte length prefix included
 // bitfield and piece messages are of variable lengths
@@ -36,6 +38,44 @@
 #define BT_PEER_MSG_LENGTH_CANCEL 17
 #define BT_PEER_MSG_LENGTH_DHT_PORT 7
 #define BT_PEER_MSG_LENGTH_KEEP_ALIVE 4
+#define BT_PEER_MSG_LENGTH_SUGGEST_PIECE 9
+#define BT_PEER_MSG_LENGTH_HAVE_ALL 5
+#define BT_PEER_MSG_LENGTH_HAVE_NONE 5
+#define BT_PEER_MSG_LENGTH_REJECT_REQUEST 17
+#define BT_PEER_MSG_LENGTH_ALLOWED_FAST 9
+
+// bits in the reserved bytes of the handshake for the fast extension and the
+// DHT, in the last byte, and for extended messages, in the sixth
+#define BT_PEER_RESERVED_FAST 0x04
+#define BT_PEER_RESERVED_DHT 0x01
+#define BT_PEER_RESERVED_EXTENDED 0x10
+
+// the largest extended message taken from a peer; metadata pieces are the
+// largest of those we know of, at 16 KiB and a small dictionary
+#define BT_PEER_MAX_EXTENDED_LENGTH (64 * 1024)
+
+// how much may wait to be sent to a peer before its requests stop being
+// served, so that one that never reads can't make us buffer without end
+#define BT_PEER_MAX_PENDING (1024 * 1024)
+
+// how much of what a peer says about its pieces is kept until the torrent has
+// its metadata, which is enough for a bitfield of 8 million pieces
+#define BT_PEER_MAX_EARLY_LENGTH (1024 * 1024)
+
+// what we call ourselves in extended handshakes
+#define BT_PEER_CLIENT_NAME "BitTorque"
+
+// pieces each peer may request while choked, and pieces from the read cache
+// suggested to peers that become interested
+#define BT_PEER_ALLOWED_FAST_SET 10
+#define BT_PEER_MAX_SUGGESTIONS 4
+
+// the size of the blocks we ask for, which is what every client serves, how
+// many of them we keep asking for from each peer at once, and how many
+// pieces a peer may suggest or allow fast before we stop listening
+#define BT_PEER_BLOCK_SIZE 16384
+#define BT_PEER_MAX_REQUESTS 16
+#define BT_PEER_MAX_LISTED_PIECES 64
 
 typedef enum {
 	BT_PEER_MSG_CHOKE,
@@ -48,6 +88,12 @@ typedef enum {
 	BT_PEER_MSG_PIECE,
 	BT_PEER_MSG_CANCEL,
 	BT_PEER_MSG_DHT_PORT,
+	BT_PEER_MSG_SUGGEST_PIECE = 13, // the fast extension
+	BT_PEER_MSG_HAVE_ALL,
+	BT_PEER_MSG_HAVE_NONE,
+	BT_PEER_MSG_REJECT_REQUEST,
+	BT_PEER_MSG_ALLOWED_FAST,
+	BT_PEER_MSG_EXTENDED = 20,
 	BT_PEER_MSG_KEEP_ALIVE // helper, not really a protocol message
 } BtPeerMsg;
 
@@ -63,6 +109,12 @@ static BtPeerDataStatus bt_peer_on_piece (BtPeer *peer, guint *bytes_read);
 static BtPeerDataStatus bt_peer_on_cancel (BtPeer *peer, guint *bytes_read);
 static BtPeerDataStatus bt_peer_on_dht_port (BtPeer* peer, guint *bytes_read);
 static BtPeerDataStatus bt_peer_on_keep_alive (BtPeer *peer, guint *bytes_read);
+static BtPeerDataStatus bt_peer_on_suggest_piece (BtPeer *peer, guint *bytes_read);
+static BtPeerDataStatus bt_peer_on_have_all (BtPeer *peer, guint *bytes_read);
+static BtPeerDataStatus bt_peer_on_have_none (BtPeer *peer, guint *bytes_read);
+static BtPeerDataStatus bt_peer_on_reject_request (BtPeer *peer, guint *bytes_read);
+static BtPeerDataStatus bt_peer_on_allowed_fast (BtPeer *peer, guint *bytes_read);
+static BtPeerDataStatus bt_peer_on_extended (BtPeer *peer, guint *bytes_read);
 
 static BtPeerMsgFunc handler_lookup_table[] = {
 	&bt_peer_on_choke,
@@ -75,18 +127,31 @@ static BtPeerMsgFunc handler_lookup_table[] = {
 	&bt_peer_on_piece,
 	&bt_peer_on_cancel,
 	&bt_peer_on_dht_port,
-	NULL, // no global handler for extensions
+	NULL,
+	NULL,
+	NULL,
+	&bt_peer_on_suggest_piece,
+	&bt_peer_on_have_all,
+	&bt_peer_on_have_none,
+	&bt_peer_on_reject_request,
+	&bt_peer_on_allowed_fast,
+	NULL,
+	NULL,
+	&bt_peer_on_extended,
 	&bt_peer_on_keep_alive
 };
 
 static void
 bt_peer_write_data (BtPeer *peer, guint len, gpointer buf)
 {
+	if (peer->connection == NULL)
+		return;
+
 	if (peer->encryption_func != NULL) {
 		peer->encryption_func (peer, len, buf);
 	}
 	
-	gnet_conn_write (peer->socket, buf, len);
+	bt_connection_write (peer->connection, buf, len);
 }
 
 void
@@ -99,6 +164,14 @@ bt_peer_send_handshake (BtPeer *peer)
 	g_memmove (buf + 1, "BitTorrent protocol", 19);
 	
 	memset (buf + 20, '\0', 8);
+
+	buf[25] |= BT_PEER_RESERVED_EXTENDED;
+	buf[27] |= BT_PEER_RESERVED_FAST;
+
+	/* the node itself is only used on the main thread, but anyone can see
+	 * whether there is one */
+	if (bt_manager_get_dht (peer->manager) != NULL)
+		buf[27] |= BT_PEER_RESERVED_DHT;
 	
 	g_memmove (buf + 28, bt_torrent_get_infohash (peer->torrent), 20);
 	
@@ -106,7 +179,7 @@ bt_peer_send_handshake (BtPeer *peer)
 
 	bt_peer_write_data (peer, (guint) 68, buf);
 	
-	g_debug ("sent handshake for %s", peer->address_string);
+	g_debug ("sent handshake for %s", bt_peer_get_address_string (peer));
 }
 
 static guint
@@ -149,6 +222,338 @@ bt_peer_send_request (BtPeer *peer, guint block)
 	bt_peer_write_data (peer, 17, &buf);
 }
 
+/**
+ * bt_peer_send_piece:
+ * @peer: the peer
+ * @piece: the piece index
+ * @begin: byte offset in @piece
+ * @length: length of the block
+ *
+ * Sends a block of data to the peer. The block is taken from the torrent's piece
+ * cache, so serving the same piece to many peers only reads it from disk once.
+ */
+void
+bt_peer_send_piece (BtPeer *peer, guint piece, guint begin, guint length)
+{
+	BtCachedPiece *ref = NULL;
+	const gchar *block;
+	gchar buf[13];
+	guint32 tmp;
+
+	block = bt_io_read_block (peer->torrent->io, piece, begin, length, &ref);
+
+	if (block == NULL) {
+		g_warning ("could not read piece %i for uploading", piece);
+		return;
+	}
+
+	tmp = g_htonl (length + 9);
+	g_memmove (buf, &tmp, 4);
+
+	buf[4] = BT_PEER_MSG_PIECE;
+
+	tmp = g_htonl (piece);
+	g_memmove (buf + 5, &tmp, 4);
+
+	tmp = g_htonl (begin);
+	g_memmove (buf + 9, &tmp, 4);
+
+	bt_peer_write_data (peer, 13, buf);
+
+	if (peer->encryption_func != NULL) {
+		/* encryption works in place, so it must not touch the shared cached block */
+		gchar *copy = g_memdup (block, length);
+		bt_peer_write_data (peer, length, copy);
+		g_free (copy);
+	} else if (peer->connection != NULL) {
+		bt_connection_write (peer->connection, block, length);
+	}
+
+	bt_cached_piece_unref (ref);
+
+	bt_torrent_add_transferred (peer->torrent, 0, length);
+}
+
+/* sends a message of up to three 32-bit arguments */
+static void
+bt_peer_send_fixed (BtPeer *peer, BtPeerMsg type, guint num_args, guint32 a, guint32 b, guint32 c)
+{
+	gchar buf[17];
+	guint32 tmp;
+
+	tmp = g_htonl (1 + 4 * num_args);
+	g_memmove (buf, &tmp, 4);
+
+	buf[4] = type;
+
+	tmp = g_htonl (a);
+	g_memmove (buf + 5, &tmp, 4);
+
+	tmp = g_htonl (b);
+	g_memmove (buf + 9, &tmp, 4);
+
+	tmp = g_htonl (c);
+	g_memmove (buf + 13, &tmp, 4);
+
+	bt_peer_write_data (peer, 5 + 4 * num_args, buf);
+}
+
+/* the canonical set of pieces a peer may ask for while choked, from the fast
+ * extension; it only depends on the peer's address, so reconnecting doesn't
+ * get it any more pieces */
+static void
+bt_peer_make_allowed_fast (BtPeer *peer)
+{
+	guint num_pieces = bt_torrent_get_num_pieces (peer->torrent);
+	guint k = MIN (BT_PEER_ALLOWED_FAST_SET, num_pieces);
+	gchar x[24];
+	gsize len = 24;
+	guint i, j;
+
+	peer->allowed_fast = g_array_sized_new (FALSE, FALSE, sizeof (guint32), k);
+
+	// the set is only defined for IPv4
+	if (peer->address.length != 4)
+		return;
+
+	memcpy (x, peer->address.bytes, 3);
+	x[3] = 0;
+	memcpy (x + 4, bt_torrent_get_infohash (peer->torrent), 20);
+
+	while (peer->allowed_fast->len < k) {
+		SHA1Context sha;
+
+		sha1_init (&sha);
+		sha1_update (&sha, x, len);
+		sha1_finish (&sha, x);
+		len = 20;
+
+		for (i = 0; i < 5 && peer->allowed_fast->len < k; i++) {
+			guint32 index;
+
+			memcpy (&index, x + i * 4, 4);
+			index = g_ntohl (index) % num_pieces;
+
+			for (j = 0; j < peer->allowed_fast->len; j++)
+				if (g_array_index (peer->allowed_fast, guint32, j) == index)
+					break;
+
+			if (j == peer->allowed_fast->len)
+				g_array_append_val (peer->allowed_fast, index);
+		}
+	}
+}
+
+static gboolean
+bt_peer_is_allowed_fast (BtPeer *peer, guint piece)
+{
+	guint i;
+
+	if (peer->allowed_fast == NULL)
+		return FALSE;
+
+	for (i = 0; i < peer->allowed_fast->len; i++)
+		if (g_array_index (peer->allowed_fast, guint32, i) == piece)
+			return TRUE;
+
+	return FALSE;
+}
+
+/* tells a peer that just connected which pieces we have; with the fast
+ * extension a seed or a new download doesn't need to send a whole bitfield */
+static void
+bt_peer_send_available (BtPeer *peer)
+{
+	guint num_pieces = bt_torrent_get_num_pieces (peer->torrent);
+	guint num_have = bt_torrent_get_num_have (peer->torrent);
+	guint i;
+
+	/* without the metadata we don't even know how many pieces there are */
+	if (!bt_torrent_is_loaded (peer->torrent)) {
+		if (peer->fast)
+			bt_peer_send_fixed (peer, BT_PEER_MSG_HAVE_NONE, 0, 0, 0, 0);
+		return;
+	}
+
+	if (peer->fast && num_have == num_pieces) {
+		bt_peer_send_fixed (peer, BT_PEER_MSG_HAVE_ALL, 0, 0, 0, 0);
+	} else if (peer->fast && num_have == 0) {
+		bt_peer_send_fixed (peer, BT_PEER_MSG_HAVE_NONE, 0, 0, 0, 0);
+	} else if (num_have > 0) {
+		const gchar *bitfield;
+		gchar *buf;
+		gsize len;
+		guint32 tmp;
+
+		bitfield = bt_torrent_get_bitfield (peer->torrent, &len);
+
+		buf = g_malloc (len + 5);
+
+		tmp = g_htonl (len + 1);
+		g_memmove (buf, &tmp, 4);
+		buf[4] = BT_PEER_MSG_BITFIELD;
+		g_memmove (buf + 5, bitfield, len);
+
+		bt_peer_write_data (peer, len + 5, buf);
+
+		g_free (buf);
+	}
+
+	if (!peer->fast)
+		return;
+
+	bt_peer_make_allowed_fast (peer);
+
+	for (i = 0; i < peer->allowed_fast->len; i++) {
+		guint32 piece = g_array_index (peer->allowed_fast, guint32, i);
+
+		if (bt_torrent_has_piece (peer->torrent, piece))
+			bt_peer_send_fixed (peer, BT_PEER_MSG_ALLOWED_FAST, 1, piece, 0, 0);
+	}
+}
+
+/* tells a peer that supports the DHT where our node is */
+static void
+bt_peer_send_dht_port (BtPeer *peer)
+{
+	gchar buf[BT_PEER_MSG_LENGTH_DHT_PORT];
+	guint32 len;
+	guint16 port;
+
+	if (!peer->dht)
+		return;
+
+	len = g_htonl (3);
+	g_memmove (buf, &len, 4);
+
+	buf[4] = BT_PEER_MSG_DHT_PORT;
+
+	port = g_htons (bt_manager_get_port (peer->manager));
+	g_memmove (buf + 5, &port, 2);
+
+	bt_peer_write_data (peer, BT_PEER_MSG_LENGTH_DHT_PORT, buf);
+}
+
+/* points a peer that became interested at pieces it can get from our read
+ * cache without us going to the disk */
+static void
+bt_peer_send_suggestions (BtPeer *peer)
+{
+	guint pieces[BT_PEER_MAX_SUGGESTIONS * 4];
+	guint num, i, sent = 0;
+
+	if (!peer->fast || peer->torrent == NULL || peer->torrent->io == NULL)
+		return;
+
+	num = bt_io_get_cached_pieces (peer->torrent->io, pieces, G_N_ELEMENTS (pieces));
+
+	for (i = 0; i < num && sent < BT_PEER_MAX_SUGGESTIONS; i++) {
+		if (peer->bitfield != NULL && bt_bitfield_get (peer->bitfield, pieces[i]))
+			continue;
+
+		bt_peer_send_fixed (peer, BT_PEER_MSG_SUGGEST_PIECE, 1, pieces[i], 0, 0);
+		sent++;
+	}
+}
+
+/* orders dictionary entries by key, the way they have to be encoded */
+static gint
+bt_peer_compare_entries (gconstpointer a, gconstpointer b, gpointer data G_GNUC_UNUSED)
+{
+	const BtBencodeString *key_a = &((const BtBencodeDictEntry *) a)->key;
+	const BtBencodeString *key_b = &((const BtBencodeDictEntry *) b)->key;
+	gint cmp;
+
+	cmp = memcmp (key_a->str, key_b->str, MIN (key_a->len, key_b->len));
+
+	if (cmp != 0)
+		return cmp;
+
+	return (key_a->len > key_b->len) - (key_a->len < key_b->len);
+}
+
+static void
+bt_peer_append_entry (GArray *entries, const gchar *key, BtBencodeType type)
+{
+	BtBencodeDictEntry entry;
+
+	memset (&entry, 0, sizeof (entry));
+	entry.key.str = key;
+	entry.key.len = strlen (key);
+	entry.value.type = type;
+
+	g_array_append_val (entries, entry);
+}
+
+/* tells the peer which extensions we support and the ids of their messages,
+ * along with whatever the extensions want to add */
+static void
+bt_peer_send_extended_handshake (BtPeer *peer)
+{
+	BtBencodeDictEntry m[BT_PEER_EXTENSION_MAX];
+	BtBencode handshake;
+	GArray *entries;
+	guint num, i;
+	gchar *buf;
+	gsize len;
+	guint32 tmp;
+
+	if (!peer->extended)
+		return;
+
+	num = bt_manager_get_num_extensions (peer->manager);
+
+	entries = g_array_new (FALSE, FALSE, sizeof (BtBencodeDictEntry));
+
+	memset (m, 0, sizeof (m));
+
+	for (i = 0; i < num; i++) {
+		BtPeerExtension *extension = bt_manager_get_extension (peer->manager, i + 1);
+
+		m[i].key.str = bt_peer_extension_get_name (extension);
+		m[i].key.len = strlen (m[i].key.str);
+		m[i].value.type = BT_BENCODE_TYPE_INT;
+		m[i].value.value = i + 1;
+
+		bt_peer_extension_add_handshake (extension, peer, entries);
+	}
+
+	g_qsort_with_data (m, num, sizeof (BtBencodeDictEntry), bt_peer_compare_entries, NULL);
+
+	bt_peer_append_entry (entries, "m", BT_BENCODE_TYPE_DICT);
+	g_array_index (entries, BtBencodeDictEntry, entries->len - 1).value.dict.entries = m;
+	g_array_index (entries, BtBencodeDictEntry, entries->len - 1).value.dict.len = num;
+
+	bt_peer_append_entry (entries, "p", BT_BENCODE_TYPE_INT);
+	g_array_index (entries, BtBencodeDictEntry, entries->len - 1).value.value = bt_manager_get_port (peer->manager);
+
+	bt_peer_append_entry (entries, "v", BT_BENCODE_TYPE_STRING);
+	g_array_index (entries, BtBencodeDictEntry, entries->len - 1).value.string.str = BT_PEER_CLIENT_NAME;
+	g_array_index (entries, BtBencodeDictEntry, entries->len - 1).value.string.len = strlen (BT_PEER_CLIENT_NAME);
+
+	g_qsort_with_data (entries->data, entries->len, sizeof (BtBencodeDictEntry), bt_peer_compare_entries, NULL);
+
+	memset (&handshake, 0, sizeof (handshake));
+	handshake.type = BT_BENCODE_TYPE_DICT;
+	handshake.dict.entries = (BtBencodeDictEntry *) entries->data;
+	handshake.dict.len = entries->len;
+
+	len = bt_bencode_encoded_size (&handshake);
+
+	buf = g_malloc (len + 6);
+
+	tmp = g_htonl (len + 2);
+	g_memmove (buf, &tmp, 4);
+	buf[4] = BT_PEER_MSG_EXTENDED;
+	buf[5] = 0;
+	bt_bencode_encode_into (&handshake, buf + 6);
+
+	bt_peer_write_data (peer, len + 6, buf);
+
+	g_free (buf);
+	g_array_free (entries, TRUE);
+}
+
 static void G_GNUC_UNUSED
 bt_peer_send_keep_alive (BtPeer *peer)
 {
@@ -217,6 +622,362 @@ bt_peer_uninterest (BtPeer *peer)
 	peer->interested = FALSE;
 }
 
+/* tells the peer whether we want anything from it, if that changed */
+static void
+bt_peer_update_interest (BtPeer *peer)
+{
+	if (peer->missing > 0 && !peer->interested)
+		bt_peer_interest (peer);
+	else if (peer->missing == 0 && peer->interested)
+		bt_peer_uninterest (peer);
+}
+
+/**
+ * bt_peer_piece_completed:
+ * @peer: the peer
+ * @piece: the piece
+ * @lazy: whether to leave out the have message if the peer has the piece
+ *
+ * Lets the peer know that we completed a piece, which may mean it has nothing
+ * left that we want. The have message is only queued, and goes out with
+ * others on the next bt_peer_flush_haves(). Called by the torrent for each of
+ * its peers.
+ */
+void
+bt_peer_piece_completed (BtPeer *peer, guint piece, gboolean lazy)
+{
+	guint32 index = piece;
+
+	g_return_if_fail (BT_IS_PEER (peer));
+
+	if (peer->bitfield != NULL && bt_bitfield_get (peer->bitfield, piece)) {
+		peer->missing--;
+		bt_peer_update_interest (peer);
+
+		if (lazy)
+			return;
+	}
+
+	if (peer->connection == NULL)
+		return;
+
+	if (peer->haves == NULL)
+		peer->haves = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+	g_array_append_val (peer->haves, index);
+}
+
+/**
+ * bt_peer_flush_haves:
+ * @peer: the peer
+ *
+ * Sends the have messages queued by bt_peer_piece_completed() in one write.
+ */
+void
+bt_peer_flush_haves (BtPeer *peer)
+{
+	gchar *buf;
+	guint i;
+
+	g_return_if_fail (BT_IS_PEER (peer));
+
+	if (peer->haves == NULL || peer->haves->len == 0)
+		return;
+
+	buf = g_malloc (peer->haves->len * 9);
+
+	for (i = 0; i < peer->haves->len; i++) {
+		guint32 len = g_htonl (5);
+		guint32 piece = g_htonl (g_array_index (peer->haves, guint32, i));
+
+		g_memmove (buf + i * 9, &len, 4);
+		buf[i * 9 + 4] = BT_PEER_MSG_HAVE;
+		g_memmove (buf + i * 9 + 5, &piece, 4);
+	}
+
+	bt_peer_write_data (peer, peer->haves->len * 9, buf);
+
+	g_debug ("sent %u have messages to %s", peer->haves->len, bt_peer_get_address_string (peer));
+
+	g_free (buf);
+	g_array_set_size (peer->haves, 0);
+}
+
+/* whether the peer lets us download the piece while it chokes us */
+static gboolean
+bt_peer_is_fast_piece (BtPeer *peer, guint piece)
+{
+	guint i;
+
+	if (peer->fast_pieces == NULL)
+		return FALSE;
+
+	for (i = 0; i < peer->fast_pieces->len; i++)
+		if (g_array_index (peer->fast_pieces, guint32, i) == piece)
+			return TRUE;
+
+	return FALSE;
+}
+
+/* adds a piece to a list the peer sent, up to a limit so that it can't make
+ * us keep any number of them */
+static void
+bt_peer_add_to_list (GArray **list, guint32 piece)
+{
+	guint i;
+
+	if (*list == NULL)
+		*list = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+	if ((*list)->len >= BT_PEER_MAX_LISTED_PIECES)
+		return;
+
+	for (i = 0; i < (*list)->len; i++)
+		if (g_array_index (*list, guint32, i) == piece)
+			return;
+
+	g_array_append_val (*list, piece);
+}
+
+static void
+bt_peer_remove_from_list (GArray *list, guint32 piece)
+{
+	guint i;
+
+	if (list == NULL)
+		return;
+
+	for (i = 0; i < list->len; i++) {
+		if (g_array_index (list, guint32, i) == piece) {
+			g_array_remove_index (list, i);
+			return;
+		}
+	}
+}
+
+/* claims the first piece of a list that the peer has and nobody else is
+ * downloading, taking the ones tried out of the list if @consume */
+static gint
+bt_peer_claim_from_list (BtPeer *peer, GArray *list, gboolean consume)
+{
+	guint i = 0;
+
+	if (list == NULL)
+		return -1;
+
+	while (i < list->len) {
+		guint32 piece = g_array_index (list, guint32, i);
+
+		if (consume)
+			g_array_remove_index (list, i);
+		else
+			i++;
+
+		if (bt_bitfield_get (peer->bitfield, piece) && bt_torrent_claim_piece (peer->torrent, piece))
+			return piece;
+	}
+
+	return -1;
+}
+
+/* starts on a new piece: while the peer chokes us only one it allows fast
+ * will do, otherwise one it suggested or else whatever the torrent picks */
+static gboolean
+bt_peer_start_piece (BtPeer *peer)
+{
+	guint32 length;
+	gint piece;
+
+	if (peer->peer_choking) {
+		piece = bt_peer_claim_from_list (peer, peer->fast_pieces, FALSE);
+	} else {
+		piece = bt_peer_claim_from_list (peer, peer->suggested, TRUE);
+
+		if (piece < 0)
+			piece = bt_torrent_pick_piece (peer->torrent, peer->bitfield);
+	}
+
+	if (piece < 0)
+		return FALSE;
+
+	length = bt_torrent_get_piece_length_extended (peer->torrent, piece);
+
+	peer->piece = piece;
+	peer->blocks_left = (length + BT_PEER_BLOCK_SIZE - 1) / BT_PEER_BLOCK_SIZE;
+	peer->blocks = g_malloc0 ((peer->blocks_left + 7) / 8);
+
+	if (peer->requests == NULL)
+		peer->requests = g_array_sized_new (FALSE, FALSE, sizeof (guint32), BT_PEER_MAX_REQUESTS);
+
+	return TRUE;
+}
+
+/* forgets about the piece we were downloading from the peer */
+static void
+bt_peer_clear_piece (BtPeer *peer)
+{
+	peer->piece = -1;
+	peer->blocks_left = 0;
+
+	g_free (peer->blocks);
+	peer->blocks = NULL;
+
+	if (peer->requests != NULL)
+		g_array_set_size (peer->requests, 0);
+}
+
+/**
+ * bt_peer_release_piece:
+ * @peer: the peer
+ *
+ * Gives the piece that was being downloaded from the peer back to the
+ * torrent, so that it can be picked for another peer, and forgets the
+ * requests in flight. The blocks that already came are downloaded again by
+ * whoever gets the piece next. Called when the peer goes away, from the
+ * thread that runs it.
+ */
+void
+bt_peer_release_piece (BtPeer *peer)
+{
+	g_return_if_fail (BT_IS_PEER (peer));
+
+	if (peer->piece < 0)
+		return;
+
+	if (peer->torrent != NULL)
+		bt_torrent_unpick_piece (peer->torrent, peer->piece);
+
+	bt_peer_clear_piece (peer);
+}
+
+/* keeps up to BT_PEER_MAX_REQUESTS requests in flight, starting on a new
+ * piece when the last one is all asked for; nothing is asked for while
+ * we're not interested, or choked, apart from pieces that are allowed fast */
+static void
+bt_peer_request_blocks (BtPeer *peer)
+{
+	guint32 length;
+	guint block, num_blocks;
+
+	if (peer->status != BT_PEER_STATUS_CONNECTED || peer->torrent == NULL || peer->bitfield == NULL || !peer->interested)
+		return;
+
+	if (peer->piece < 0 && !bt_peer_start_piece (peer))
+		return;
+
+	if (peer->peer_choking && !bt_peer_is_fast_piece (peer, peer->piece))
+		return;
+
+	length = bt_torrent_get_piece_length_extended (peer->torrent, peer->piece);
+	num_blocks = (length + BT_PEER_BLOCK_SIZE - 1) / BT_PEER_BLOCK_SIZE;
+
+	for (block = 0; block < num_blocks && peer->requests->len < BT_PEER_MAX_REQUESTS; block++) {
+		guint32 begin = block * BT_PEER_BLOCK_SIZE;
+
+		if (bt_bitfield_get (peer->blocks, block))
+			continue;
+
+		bt_bitfield_set (peer->blocks, block);
+		g_array_append_val (peer->requests, begin);
+
+		bt_peer_send_fixed (peer, BT_PEER_MSG_REQUEST, 3, peer->piece, begin, MIN (BT_PEER_BLOCK_SIZE, length - begin));
+	}
+}
+
+/* takes a block out of the requests in flight; returns FALSE if it wasn't
+ * one of them */
+static gboolean
+bt_peer_take_request (BtPeer *peer, guint piece, guint32 begin)
+{
+	guint i;
+
+	if (peer->piece < 0 || (guint) peer->piece != piece)
+		return FALSE;
+
+	for (i = 0; i < peer->requests->len; i++) {
+		if (g_array_index (peer->requests, guint32, i) == begin) {
+			g_array_remove_index_fast (peer->requests, i);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* checks the piece once all of its blocks came, and either completes it or
+ * gives it back to be downloaded again */
+static void
+bt_peer_finish_piece (BtPeer *peer)
+{
+	guint piece = peer->piece;
+
+	bt_peer_clear_piece (peer);
+
+	if (bt_io_check_piece_hash (peer->torrent->io, piece)) {
+		g_debug ("completed piece %u from %s", piece, bt_peer_get_address_string (peer));
+		bt_torrent_complete_piece (peer->torrent, piece);
+	} else {
+		g_debug ("piece %u from %s failed the hash check", piece, bt_peer_get_address_string (peer));
+		bt_torrent_unpick_piece (peer->torrent, piece);
+	}
+}
+
+/**
+ * bt_peer_supports_extension:
+ * @peer: the peer
+ * @id: the id of the extension, from bt_manager_add_extension()
+ *
+ * Returns: whether the peer said in its extended handshake that it supports
+ * the extension
+ */
+gboolean
+bt_peer_supports_extension (BtPeer *peer, guint id)
+{
+	g_return_val_if_fail (BT_IS_PEER (peer), FALSE);
+	g_return_val_if_fail (id > 0 && id <= BT_PEER_EXTENSION_MAX, FALSE);
+
+	return peer->extension_ids[id - 1] != 0;
+}
+
+/**
+ * bt_peer_send_extended:
+ * @peer: the peer
+ * @id: the id of the extension, from bt_manager_add_extension()
+ * @payload: the message, past the extended message id
+ * @len: the length of @payload
+ *
+ * Sends a message of an extension, with the id the peer gave it.
+ *
+ * Returns: %FALSE if the peer doesn't support the extension, in which case
+ * nothing is sent
+ */
+gboolean
+bt_peer_send_extended (BtPeer *peer, guint id, const gchar *payload, gsize len)
+{
+	gchar *buf;
+	guint32 tmp;
+
+	g_return_val_if_fail (BT_IS_PEER (peer), FALSE);
+	g_return_val_if_fail (payload != NULL || len == 0, FALSE);
+
+	if (!bt_peer_supports_extension (peer, id))
+		return FALSE;
+
+	buf = g_malloc (len + 6);
+
+	tmp = g_htonl (len + 2);
+	g_memmove (buf, &tmp, 4);
+	buf[4] = BT_PEER_MSG_EXTENDED;
+	buf[5] = peer->extension_ids[id - 1];
+	g_memmove (buf + 6, payload, len);
+
+	bt_peer_write_data (peer, len + 6, buf);
+
+	g_free (buf);
+
+	return TRUE;
+}
+
 static BtPeerDataStatus
 bt_peer_check_peer_id (BtPeer *peer)
 {
@@ -224,7 +985,8 @@ bt_peer_check_peer_id (BtPeer *peer)
 		return BT_PEER_DATA_STATUS_NEED_MORE;
 
 	// FIXME: make sure we're not already connected to this peer_id
-	peer->peer_id = g_memdup (peer->buffer->str, 20);
+	memcpy (peer->peer_id, peer->buffer->str, 20);
+	peer->has_peer_id = TRUE;
 	
 	g_debug ("got peer id, we are connected");
 	
@@ -258,10 +1020,30 @@ bt_peer_check_handshake (BtPeer *peer)
 	
 	infohash[20] = (gchar) 0;
 
+	peer->fast = (peer->buffer->str[27] & BT_PEER_RESERVED_FAST) != 0;
+	peer->extended = (peer->buffer->str[25] & BT_PEER_RESERVED_EXTENDED) != 0;
+	peer->dht = (peer->buffer->str[27] & BT_PEER_RESERVED_DHT) != 0 && bt_manager_get_dht (peer->manager) != NULL;
+
 	if (peer->status == BT_PEER_STATUS_CONNECTED_IN)
 	{
-		peer->torrent = bt_manager_get_torrent (peer->manager, infohash);
-		bt_add_weak_pointer (G_OBJECT (peer->torrent), (gpointer)&peer->torrent);
+		BtTorrent *torrent = bt_manager_get_torrent (peer->manager, infohash);
+
+		/* dormant torrents aren't running, so they don't take peers; those
+		 * waiting for metadata do, to get it from them */
+		if (torrent && !bt_torrent_is_loaded (torrent) && !bt_torrent_needs_metadata (torrent))
+			torrent = NULL;
+
+		/* nor do full ones; the count of a torrent on another thread may be a
+		 * little behind, so the limit is only a soft one for incoming peers */
+		if (torrent && bt_torrent_get_num_peers (torrent) >= bt_torrent_get_max_peers (torrent)) {
+			g_debug ("refusing connection for full torrent %s", bt_torrent_get_name (torrent));
+			return BT_PEER_DATA_STATUS_INVALID;
+		}
+
+		peer->torrent = torrent;
+
+		if (peer->torrent)
+			bt_add_weak_pointer (G_OBJECT (peer->torrent), (gpointer)&peer->torrent);
 	}
 
 	if (!peer->torrent) {
@@ -271,9 +1053,15 @@ bt_peer_check_handshake (BtPeer *peer)
 	
 	g_debug ("connection received for torrent %s", bt_torrent_get_name (peer->torrent));
 
-	if (peer->status == BT_PEER_STATUS_CONNECTED_IN)
+	/* a torrent on a network thread takes the peer there, once it's moved */
+	if (peer->status == BT_PEER_STATUS_CONNECTED_IN && bt_torrent_get_shard (peer->torrent) == NULL)
 	{
-		bt_torrent_add_peer (peer->torrent, peer);
+		/* we're already talking to this address */
+		if (!bt_torrent_add_peer (peer->torrent, peer)) {
+			bt_remove_weak_pointer (G_OBJECT (peer->torrent), (gpointer)&peer->torrent);
+			peer->torrent = NULL;
+			return BT_PEER_DATA_STATUS_INVALID;
+		}
 
 		g_object_unref (G_OBJECT (peer));
 	}
@@ -301,6 +1089,11 @@ bt_peer_on_choke (BtPeer* peer, guint *bytes_read)
 	peer->peer_choking = TRUE;
 	g_debug ("choked by peer");
 
+	// the requests in flight are dropped, unless the peer has the fast
+	// extension, in which case it rejects the ones it won't serve
+	if (!peer->fast)
+		bt_peer_release_piece (peer);
+
 	*bytes_read = 5;
 
 	return BT_PEER_DATA_STATUS_SUCCESS;
@@ -328,6 +1121,8 @@ bt_peer_on_unchoke (BtPeer* peer, guint *bytes_read)
 
 	*bytes_read = 5;
 
+	bt_peer_request_blocks (peer);
+
 	return BT_PEER_DATA_STATUS_SUCCESS;
 }
 
@@ -348,6 +1143,9 @@ bt_peer_on_interested (BtPeer* peer, guint *bytes_read)
 	if (msg_len != 1)
 		return BT_PEER_DATA_STATUS_INVALID;
 
+	if (!peer->peer_interested)
+		bt_peer_send_suggestions (peer);
+
 	peer->peer_interested = TRUE;
 	g_debug ("peer interested");
 
@@ -381,6 +1179,20 @@ bt_peer_on_uninterested (BtPeer* peer, guint *bytes_read)
 	return BT_PEER_DATA_STATUS_SUCCESS;
 }
 
+/* the peer's bitfield, taken from the torrent's pool the first time it's
+ * needed, or NULL if the torrent is gone, and its pool with it */
+static gchar *
+bt_peer_ensure_bitfield (BtPeer *peer)
+{
+	if (peer->torrent == NULL)
+		return NULL;
+
+	if (peer->bitfield == NULL)
+		peer->bitfield = bt_torrent_alloc_bitfield (peer->torrent);
+
+	return peer->bitfield;
+}
+
 static BtPeerDataStatus
 bt_peer_on_have (BtPeer* peer, guint *bytes_read)
 {
@@ -399,11 +1211,25 @@ bt_peer_on_have (BtPeer* peer, guint *bytes_read)
 		return BT_PEER_DATA_STATUS_INVALID;
 
 	piece = g_ntohl (*((guint32*)(peer->buffer->str + 5)));
-	peer->bitfield[piece / 8] |= 1 << (7 - (piece % 8));
+
+	if (bt_peer_ensure_bitfield (peer) == NULL || piece >= bt_torrent_get_num_pieces (peer->torrent))
+		return BT_PEER_DATA_STATUS_INVALID;
+
+	if (!bt_bitfield_get (peer->bitfield, piece)) {
+		bt_bitfield_set (peer->bitfield, piece);
+
+		if (!bt_torrent_has_piece (peer->torrent, piece)) {
+			peer->missing++;
+			bt_peer_update_interest (peer);
+		}
+	}
+
 	g_debug ("peer has piece %i", piece);
 
 	*bytes_read = 9;
 
+	bt_peer_request_blocks (peer);
+
 	return BT_PEER_DATA_STATUS_SUCCESS;
 }
 
@@ -420,17 +1246,24 @@ bt_peer_on_bitfield (BtPeer* peer, guint* bytes_read)
 
 	msg_len = g_ntohl (*((guint32*)(peer->buffer->str)));
 
-	if ((msg_len - 1) * 8 < bt_torrent_get_num_pieces (peer->torrent))
+	if (bt_peer_ensure_bitfield (peer) == NULL || (msg_len - 1) * 8 < bt_torrent_get_num_pieces (peer->torrent))
 		return BT_PEER_DATA_STATUS_INVALID;
 
 	if (msg_len > (peer->buffer->len - 4))
 		return BT_PEER_DATA_STATUS_NEED_MORE;
 
-	peer->bitfield = g_memdup (peer->buffer->str + 5, msg_len - 1);
+	// anything past the last piece is spare bits and isn't kept
+	memcpy (peer->bitfield, peer->buffer->str + 5, (bt_torrent_get_num_pieces (peer->torrent) + 7) / 8);
+	bt_bitfield_clear_spare (peer->bitfield, bt_torrent_get_num_pieces (peer->torrent));
 	g_debug ("peer sent bitfield");
 
+	peer->missing = bt_torrent_count_missing (peer->torrent, peer->bitfield);
+	bt_peer_update_interest (peer);
+
 	*bytes_read = msg_len + 4;
 
+	bt_peer_request_blocks (peer);
+
 	return BT_PEER_DATA_STATUS_SUCCESS;
 }
 
@@ -438,7 +1271,7 @@ static BtPeerDataStatus
 bt_peer_on_request (BtPeer* peer, guint *bytes_read)
 {
 	guint32 msg_len;
-	guint32 piece, begin, length;
+	guint32 piece, begin, length, piece_length;
 
 	if (peer->buffer->len < 17)
 		return BT_PEER_DATA_STATUS_NEED_MORE;
@@ -456,9 +1289,27 @@ bt_peer_on_request (BtPeer* peer, guint *bytes_read)
 	g_debug ("peer requested piece %i, begin %i, length %i", piece, begin, length);
 
 	// mainline disconnects requests greater than 2^17, so do we
-	if (length > 131072)
+	if (length == 0 || length > 131072)
+		return BT_PEER_DATA_STATUS_INVALID;
+
+	if (piece >= bt_torrent_get_num_pieces (peer->torrent))
+		return BT_PEER_DATA_STATUS_INVALID;
+
+	// checked without adding, which could wrap around
+	piece_length = bt_torrent_get_piece_length_extended (peer->torrent, piece);
+
+	if (begin >= piece_length || length > piece_length - begin)
 		return BT_PEER_DATA_STATUS_INVALID;
 
+	// requests are dropped while choked, unless the piece is one that's allowed
+	// fast, for pieces we can't serve, and while the peer isn't reading what
+	// it already asked for; peers with the fast extension are told so
+	if (bt_torrent_has_piece (peer->torrent, piece) && (!peer->choking || bt_peer_is_allowed_fast (peer, piece))
+	    && peer->connection != NULL && bt_connection_get_pending (peer->connection) < BT_PEER_MAX_PENDING)
+		bt_peer_send_piece (peer, piece, begin, length);
+	else if (peer->fast)
+		bt_peer_send_fixed (peer, BT_PEER_MSG_REJECT_REQUEST, 3, piece, begin, length);
+
 	*bytes_read = 17;
 
 	return BT_PEER_DATA_STATUS_SUCCESS;
@@ -468,8 +1319,7 @@ static BtPeerDataStatus
 bt_peer_on_piece (BtPeer* peer, guint* bytes_read)
 {
 	guint32 msg_len;
-	guint32 piece, begin;
-	gchar* data;
+	guint32 piece, begin, length;
 
 	// redundant, checked in bt_peer_peek_msg_type
 	if (peer->buffer->len < 5)
@@ -480,7 +1330,7 @@ bt_peer_on_piece (BtPeer* peer, guint* bytes_read)
 	msg_len = g_ntohl (*((guint32*)(peer->buffer->str)));
 
 	// incoming data should be _at least_ 1 byte
-	if (msg_len <= 13)
+	if (msg_len <= 9)
 		return BT_PEER_DATA_STATUS_INVALID;
 
 	if (msg_len - 1 > bt_torrent_get_piece_length (peer->torrent))
@@ -489,20 +1339,31 @@ bt_peer_on_piece (BtPeer* peer, guint* bytes_read)
 	if (msg_len > (peer->buffer->len - 4))
 		return BT_PEER_DATA_STATUS_NEED_MORE;
 
-	// FIXME: make sure we previously requested the incoming block
+	piece = g_ntohl (*(guint32*)(peer->buffer->str + 5));
+	begin = g_ntohl (*(guint32*)(peer->buffer->str + 9));
+	length = msg_len - 9;
 
-	piece = g_htonl (*(guint*)(peer->buffer->str + 5));
-	begin = g_htonl (*(guint*)(peer->buffer->str + 9));
-	data = g_memdup (peer->buffer->str + 13, msg_len - 9);
+	// blocks we didn't ask for, or no longer wait for after being choked,
+	// are thrown away
+	if (bt_peer_take_request (peer, piece, begin)) {
+		if (length != MIN (BT_PEER_BLOCK_SIZE, bt_torrent_get_piece_length_extended (peer->torrent, piece) - begin))
+			return BT_PEER_DATA_STATUS_INVALID;
 
-	bt_io_write (peer->torrent->io, piece, begin, msg_len - 9, data);
+		bt_io_write (peer->torrent->io, piece, begin, length, peer->buffer->str + 13);
 
-	g_free (data);
+		peer->downloaded += length;
+		bt_torrent_add_transferred (peer->torrent, length, 0);
+
+		if (--peer->blocks_left == 0)
+			bt_peer_finish_piece (peer);
+	}
 
 	g_debug ("peer sent piece %i beginning at %i", piece, begin);
 
 	*bytes_read = msg_len + 4;
 
+	bt_peer_request_blocks (peer);
+
 	return BT_PEER_DATA_STATUS_SUCCESS;
 }
 
@@ -549,10 +1410,18 @@ bt_peer_on_dht_port (BtPeer* peer, guint *bytes_read)
 	if (msg_len != 3)
 		return BT_PEER_DATA_STATUS_INVALID;
 
-	port = g_ntohl (*((guint16*)(peer->buffer->str + 5)));
+	port = g_ntohs (*((guint16*)(peer->buffer->str + 5)));
 
 	g_debug ("peer sent dht port %i", port);
 
+	/* its node is at the same address as the peer */
+	if (port != 0) {
+		BtAddress address = peer->address;
+
+		address.port = port;
+		bt_manager_add_dht_node (peer->manager, &address);
+	}
+
 	*bytes_read = 7;
 
 	return BT_PEER_DATA_STATUS_SUCCESS;
@@ -579,10 +1448,267 @@ bt_peer_on_keep_alive (BtPeer* peer, guint *bytes_read)
 	return BT_PEER_DATA_STATUS_SUCCESS;
 }
 
+/* checks a fixed-length message from the fast extension, which peers that
+ * didn't say they support it must not send */
+static BtPeerDataStatus
+bt_peer_check_fast_msg (BtPeer *peer, guint length)
+{
+	if (peer->buffer->len < length)
+		return BT_PEER_DATA_STATUS_NEED_MORE;
+
+	if (!peer->fast || g_ntohl (*((guint32*)(peer->buffer->str))) != length - 4)
+		return BT_PEER_DATA_STATUS_INVALID;
+
+	return BT_PEER_DATA_STATUS_SUCCESS;
+}
+
+static BtPeerDataStatus
+bt_peer_on_suggest_piece (BtPeer* peer, guint *bytes_read)
+{
+	BtPeerDataStatus status;
+	guint32 piece;
+
+	status = bt_peer_check_fast_msg (peer, BT_PEER_MSG_LENGTH_SUGGEST_PIECE);
+
+	if (status != BT_PEER_DATA_STATUS_SUCCESS)
+		return status;
+
+	piece = g_ntohl (*((guint32*)(peer->buffer->str + 5)));
+
+	if (piece >= bt_torrent_get_num_pieces (peer->torrent))
+		return BT_PEER_DATA_STATUS_INVALID;
+
+	g_debug ("peer suggested piece %i", piece);
+
+	// tried before the torrent picks one, the next time we start on a piece
+	if (!bt_torrent_has_piece (peer->torrent, piece))
+		bt_peer_add_to_list (&peer->suggested, piece);
+
+	*bytes_read = BT_PEER_MSG_LENGTH_SUGGEST_PIECE;
+
+	bt_peer_request_blocks (peer);
+
+	return BT_PEER_DATA_STATUS_SUCCESS;
+}
+
+/* sets the whole bitfield at once, for have all and have none */
+static BtPeerDataStatus
+bt_peer_set_all (BtPeer *peer, gboolean have)
+{
+	guint num_pieces = bt_torrent_get_num_pieces (peer->torrent);
+
+	if (bt_peer_ensure_bitfield (peer) == NULL)
+		return BT_PEER_DATA_STATUS_INVALID;
+
+	memset (peer->bitfield, have ? 0xff : 0, (num_pieces + 7) / 8);
+	bt_bitfield_clear_spare (peer->bitfield, num_pieces);
+
+	peer->missing = have ? bt_torrent_count_missing (peer->torrent, peer->bitfield) : 0;
+	bt_peer_update_interest (peer);
+	bt_peer_request_blocks (peer);
+
+	return BT_PEER_DATA_STATUS_SUCCESS;
+}
+
+static BtPeerDataStatus
+bt_peer_on_have_all (BtPeer* peer, guint *bytes_read)
+{
+	BtPeerDataStatus status;
+
+	status = bt_peer_check_fast_msg (peer, BT_PEER_MSG_LENGTH_HAVE_ALL);
+
+	if (status != BT_PEER_DATA_STATUS_SUCCESS)
+		return status;
+
+	g_debug ("peer has all pieces");
+
+	*bytes_read = BT_PEER_MSG_LENGTH_HAVE_ALL;
+
+	return bt_peer_set_all (peer, TRUE);
+}
+
+static BtPeerDataStatus
+bt_peer_on_have_none (BtPeer* peer, guint *bytes_read)
+{
+	BtPeerDataStatus status;
+
+	status = bt_peer_check_fast_msg (peer, BT_PEER_MSG_LENGTH_HAVE_NONE);
+
+	if (status != BT_PEER_DATA_STATUS_SUCCESS)
+		return status;
+
+	g_debug ("peer has no pieces");
+
+	*bytes_read = BT_PEER_MSG_LENGTH_HAVE_NONE;
+
+	return bt_peer_set_all (peer, FALSE);
+}
+
+static BtPeerDataStatus
+bt_peer_on_reject_request (BtPeer* peer, guint *bytes_read)
+{
+	BtPeerDataStatus status;
+	guint32 piece, begin, length;
+
+	status = bt_peer_check_fast_msg (peer, BT_PEER_MSG_LENGTH_REJECT_REQUEST);
+
+	if (status != BT_PEER_DATA_STATUS_SUCCESS)
+		return status;
+
+	piece = g_ntohl (*(guint32*)(peer->buffer->str + 5));
+	begin = g_ntohl (*(guint32*)(peer->buffer->str + 9));
+	length = g_ntohl (*(guint32*)(peer->buffer->str + 13));
+
+	if (piece >= bt_torrent_get_num_pieces (peer->torrent))
+		return BT_PEER_DATA_STATUS_INVALID;
+
+	g_debug ("peer rejected request for piece %i, begin %i, length %i", piece, begin, length);
+
+	// the block can be asked for again, but not right away, from a peer that
+	// just said no; once nothing of the piece is in flight, it's given back
+	// so that another peer can have it
+	if (bt_peer_take_request (peer, piece, begin)) {
+		bt_bitfield_clear (peer->blocks, begin / BT_PEER_BLOCK_SIZE);
+
+		if (peer->requests->len == 0)
+			bt_peer_release_piece (peer);
+	}
+
+	// a piece that was allowed fast and is rejected while we're choked isn't
+	// asked for again until we're unchoked
+	if (peer->peer_choking)
+		bt_peer_remove_from_list (peer->fast_pieces, piece);
+
+	*bytes_read = BT_PEER_MSG_LENGTH_REJECT_REQUEST;
+
+	return BT_PEER_DATA_STATUS_SUCCESS;
+}
+
+static BtPeerDataStatus
+bt_peer_on_allowed_fast (BtPeer* peer, guint *bytes_read)
+{
+	BtPeerDataStatus status;
+	guint32 piece;
+
+	status = bt_peer_check_fast_msg (peer, BT_PEER_MSG_LENGTH_ALLOWED_FAST);
+
+	if (status != BT_PEER_DATA_STATUS_SUCCESS)
+		return status;
+
+	piece = g_ntohl (*((guint32*)(peer->buffer->str + 5)));
+
+	if (piece >= bt_torrent_get_num_pieces (peer->torrent))
+		return BT_PEER_DATA_STATUS_INVALID;
+
+	g_debug ("peer allows piece %i while choked", piece);
+
+	if (!bt_torrent_has_piece (peer->torrent, piece))
+		bt_peer_add_to_list (&peer->fast_pieces, piece);
+
+	*bytes_read = BT_PEER_MSG_LENGTH_ALLOWED_FAST;
+
+	bt_peer_request_blocks (peer);
+
+	return BT_PEER_DATA_STATUS_SUCCESS;
+}
+
+/* takes the ids of our extensions from the peer's extended handshake, which
+ * is decoded right out of the receive buffer; it may be sent again later to
+ * change them, and extensions it leaves out keep their ids */
+static gboolean
+bt_peer_on_extended_handshake (BtPeer *peer, const gchar *payload, gsize len)
+{
+	BtBencodeArena *arena;
+	BtBencode *handshake, *m, *p;
+	guint num, i;
+
+	arena = bt_bencode_arena_new (len);
+
+	handshake = bt_bencode_decode_arena (arena, payload, len, NULL);
+
+	if (handshake == NULL || handshake->type != BT_BENCODE_TYPE_DICT) {
+		bt_bencode_arena_free (arena);
+		return FALSE;
+	}
+
+	p = bt_bencode_lookup (handshake, "p");
+
+	if (p != NULL && p->type == BT_BENCODE_TYPE_INT && p->value > 0 && p->value <= G_MAXUINT16)
+		peer->listen_port = p->value;
+
+	m = bt_bencode_lookup (handshake, "m");
+	num = bt_manager_get_num_extensions (peer->manager);
+
+	for (i = 0; m != NULL && m->type == BT_BENCODE_TYPE_DICT && i < num; i++) {
+		BtPeerExtension *extension = bt_manager_get_extension (peer->manager, i + 1);
+		BtBencode *id = bt_bencode_lookup (m, bt_peer_extension_get_name (extension));
+		gboolean had = peer->extension_ids[i] != 0;
+
+		if (id == NULL || id->type != BT_BENCODE_TYPE_INT || id->value < 0 || id->value > 255)
+			continue;
+
+		peer->extension_ids[i] = id->value;
+
+		if (!had && id->value != 0)
+			bt_peer_extension_on_handshake (extension, peer, handshake);
+	}
+
+	g_debug ("peer sent extended handshake");
+
+	bt_bencode_arena_free (arena);
+
+	return TRUE;
+}
+
+static BtPeerDataStatus
+bt_peer_on_extended (BtPeer* peer, guint *bytes_read)
+{
+	BtPeerExtension *extension;
+	const gchar *payload;
+	guint32 msg_len;
+	gboolean valid;
+	guint8 id;
+
+	if (peer->buffer->len < 6)
+		return BT_PEER_DATA_STATUS_NEED_MORE;
+
+	g_return_val_if_fail (peer->buffer->str[4] == BT_PEER_MSG_EXTENDED, BT_PEER_DATA_STATUS_INVALID);
+
+	msg_len = g_ntohl (*((guint32*)(peer->buffer->str)));
+
+	if (msg_len < 2 || msg_len > BT_PEER_MAX_EXTENDED_LENGTH)
+		return BT_PEER_DATA_STATUS_INVALID;
+
+	if (msg_len > (peer->buffer->len - 4))
+		return BT_PEER_DATA_STATUS_NEED_MORE;
+
+	// the payload is handed over in place, so extensions mustn't hold on to it
+	id = (guint8) peer->buffer->str[5];
+	payload = peer->buffer->str + 6;
+
+	if (id == 0) {
+		valid = bt_peer_on_extended_handshake (peer, payload, msg_len - 2);
+	} else if ((extension = bt_manager_get_extension (peer->manager, id)) != NULL) {
+		valid = bt_peer_extension_on_message (extension, peer, payload, msg_len - 2);
+	} else {
+		// ids are ours to give out, but peers may still send old ones
+		g_debug ("peer sent unknown extended message %i", id);
+		valid = TRUE;
+	}
+
+	if (!valid)
+		return BT_PEER_DATA_STATUS_INVALID;
+
+	*bytes_read = msg_len + 4;
+
+	return BT_PEER_DATA_STATUS_SUCCESS;
+}
+
 static BtPeerDataStatus
 bt_peer_peek_msg_type (BtPeer* peer, BtPeerMsg* type)
 {
 	guint32 msg_len;
+	guint8 id;
 
 	if (peer->buffer->len < 4)
 		return BT_PEER_DATA_STATUS_NEED_MORE;
@@ -597,11 +1723,52 @@ bt_peer_peek_msg_type (BtPeer* peer, BtPeerMsg* type)
 	if (peer->buffer->len < 5)
 		return BT_PEER_DATA_STATUS_NEED_MORE;
 
-	// only 0 through 8 are valid protocol messages, 9 is a mainline extension
-	if (peer->buffer->str[4] > 9)
+	// the id is unsigned, or ids from 128 up would pass as negative
+	id = (guint8) peer->buffer->str[4];
+
+	// only 0 through 8 are valid protocol messages, 9 is a mainline extension,
+	// 13 through 17 are the fast extension and 20 is for extended messages
+	if (id > 9
+	    && !(peer->fast && id >= BT_PEER_MSG_SUGGEST_PIECE && id <= BT_PEER_MSG_ALLOWED_FAST)
+	    && !(peer->extended && id == BT_PEER_MSG_EXTENDED))
+		return BT_PEER_DATA_STATUS_INVALID;
+
+	*type = (BtPeerMsg) id;
+
+	return BT_PEER_DATA_STATUS_SUCCESS;
+}
+
+/* puts aside a message about pieces that came before the torrent has its
+ * metadata, for bt_peer_catch_up() */
+static BtPeerDataStatus
+bt_peer_defer_msg (BtPeer *peer, BtPeerMsg type, guint *bytes_read)
+{
+	guint32 msg_len = g_ntohl (*((guint32*)(peer->buffer->str)));
+
+	if (msg_len > BT_PEER_MAX_EARLY_LENGTH)
 		return BT_PEER_DATA_STATUS_INVALID;
 
-	*type = (BtPeerMsg) peer->buffer->str[4];
+	if (peer->buffer->len < msg_len + 4)
+		return BT_PEER_DATA_STATUS_NEED_MORE;
+
+	switch (type) {
+	case BT_PEER_MSG_HAVE:
+	case BT_PEER_MSG_BITFIELD:
+	case BT_PEER_MSG_HAVE_ALL:
+	case BT_PEER_MSG_HAVE_NONE:
+		if (peer->early == NULL)
+			peer->early = g_string_new (NULL);
+
+		if (peer->early->len + msg_len + 4 <= BT_PEER_MAX_EARLY_LENGTH)
+			g_string_append_len (peer->early, peer->buffer->str, msg_len + 4);
+		break;
+
+	default:
+		// we can't have asked for pieces yet, and have none to give
+		break;
+	}
+
+	*bytes_read = msg_len + 4;
 
 	return BT_PEER_DATA_STATUS_SUCCESS;
 }
@@ -615,131 +1782,177 @@ bt_peer_handle_msg (BtPeer* peer, guint* bytes_read)
 
 	status = bt_peer_peek_msg_type (peer, &type);
 
-	switch (status)
-	{
-	case BT_PEER_DATA_STATUS_SUCCESS:
-		handler = handler_lookup_table[type];
-		break;
+	if (status != BT_PEER_DATA_STATUS_SUCCESS)
+		return status;
 
-	case BT_PEER_DATA_STATUS_INVALID:
-		// try extension handler if we have one
-		if (peer->extension_func != NULL)
-			return peer->extension_func (peer, bytes_read);
-		break;
+	/* the messages about pieces can't be checked before there are any, and
+	 * have to wait for those put aside until then to be caught up on */
+	if (((type >= BT_PEER_MSG_HAVE && type <= BT_PEER_MSG_CANCEL)
+	     || (type >= BT_PEER_MSG_SUGGEST_PIECE && type <= BT_PEER_MSG_ALLOWED_FAST))
+	    && (!bt_torrent_is_loaded (peer->torrent) || peer->early != NULL))
+		return bt_peer_defer_msg (peer, type, bytes_read);
 
-	default:
-		return status;
-		
-	}
+	if ((guint) type >= G_N_ELEMENTS (handler_lookup_table))
+		return BT_PEER_DATA_STATUS_INVALID;
+
+	handler = handler_lookup_table[type];
 
 	g_return_val_if_fail (handler != NULL, BT_PEER_DATA_STATUS_INVALID);
 
 	return handler (peer, bytes_read);
 }
 
-void
-bt_peer_data_received (BtPeer *peer, guint len, gpointer buf, gpointer data G_GNUC_UNUSED)
+/* takes one step through the protocol with what's in the buffer; returns TRUE
+ * if something was consumed and there may be more to do */
+static gboolean
+bt_peer_process_buffer (BtPeer *peer)
 {
 	guint bytes_read = 0;
 
-	g_return_if_fail (BT_IS_PEER (peer));
-
-	g_debug ("data received for %s", peer->address_string);
-
-	if (buf)
-		g_string_append_len (peer->buffer, buf, (gssize) len);
-
 	switch (peer->status) {
 	case BT_PEER_STATUS_CONNECTED_IN:
 		switch (bt_peer_check_handshake (peer)) {
 		case BT_PEER_DATA_STATUS_NEED_MORE:
-			gnet_conn_read (peer->socket);
-			return;
+			return FALSE;
 
 		case BT_PEER_DATA_STATUS_INVALID:
 			// TODO: try encryption here
 			bt_peer_disconnect (peer);
-			return;
+			return FALSE;
 		
 		default:
 			g_string_erase (peer->buffer, 0, 48);
 			bt_peer_send_handshake (peer);
 			peer->status = BT_PEER_STATUS_WAIT_PEER_ID;
-			break;
+
+			/* the rest of the buffer is handled on the torrent's thread */
+			if (bt_torrent_get_shard (peer->torrent) != NULL) {
+				bt_peer_move_to_shard (peer);
+				return FALSE;
+			}
+
+			return TRUE;
 		}
-		
-		break;
 	
 	case BT_PEER_STATUS_CONNECTED_OUT:
 		switch (bt_peer_check_handshake (peer)) {
 		case BT_PEER_DATA_STATUS_NEED_MORE:
-			gnet_conn_read (peer->socket);
-			return;
+			return FALSE;
 
 		case BT_PEER_DATA_STATUS_INVALID:
 			// TODO: try encryption here, possibly?
 			bt_peer_disconnect (peer);
-			break;
+			return FALSE;
 		
 		default:
 			g_debug ("received valid handshake, waiting for peerid");
 		
 			g_string_erase (peer->buffer, 0, 48);
 			peer->status = BT_PEER_STATUS_WAIT_PEER_ID;
-			break;
+			return TRUE;
 		}
-		
-		break;
 
 	case BT_PEER_STATUS_WAIT_PEER_ID:
 		switch (bt_peer_check_peer_id (peer)) {
 		case BT_PEER_DATA_STATUS_NEED_MORE:
-			gnet_conn_read (peer->socket);
-			return;
+			return FALSE;
 
 		case BT_PEER_DATA_STATUS_INVALID:
 			bt_peer_disconnect (peer);
-			return;
+			return FALSE;
 
 		default:
 			g_string_erase (peer->buffer, 0, 20);
 			peer->status = BT_PEER_STATUS_CONNECTED;
+			peer->established = TRUE;
+			bt_peer_send_extended_handshake (peer);
+			bt_peer_send_available (peer);
+			bt_peer_send_dht_port (peer);
 			// for debuging:
 			// bt_peer_interest (peer);
 			// bt_peer_unchoke (peer);
-			break;
+			return TRUE;
 		}
 
-		break;
-
 	case BT_PEER_STATUS_CONNECTED:
 		switch (bt_peer_handle_msg (peer, &bytes_read))
 		{
 		case BT_PEER_DATA_STATUS_NEED_MORE:
-			gnet_conn_read (peer->socket);
-			return;
+			return FALSE;
 
 		case BT_PEER_DATA_STATUS_INVALID:
 			g_debug ("got illegal data from peer");
 			bt_peer_disconnect (peer);
-			return;
+			return FALSE;
 
 		default:
 			g_string_erase (peer->buffer, 0, bytes_read);
-			break;
+			return TRUE;
 		}
 
-		break;
-
 	default:
-		break;
+		return FALSE;
 	}
+}
 
-	
-	// recurse if there is anything left in buffer
-	if (peer->buffer->len)
-		bt_peer_data_received (peer, 0, NULL, NULL);
-	else
-		gnet_conn_read (peer->socket);
+/**
+ * bt_peer_catch_up:
+ * @peer: the peer
+ *
+ * Handles what the peer said about its pieces before its torrent had the
+ * metadata, once the torrent is loaded. The peer may be disconnected if any
+ * of it turns out to be invalid.
+ */
+void
+bt_peer_catch_up (BtPeer *peer)
+{
+	GString *buffer;
+	guint bytes_read;
+
+	g_return_if_fail (BT_IS_PEER (peer));
+
+	if (peer->early == NULL)
+		return;
+
+	/* the early messages are handled as if they were just received; the
+	 * connection keeps appending to the real buffer, which is put back */
+	buffer = peer->buffer;
+	peer->buffer = peer->early;
+	peer->early = NULL;
+
+	while (peer->buffer->len > 0 && peer->status == BT_PEER_STATUS_CONNECTED) {
+		bytes_read = 0;
+
+		if (bt_peer_handle_msg (peer, &bytes_read) != BT_PEER_DATA_STATUS_SUCCESS) {
+			g_debug ("got illegal data from peer");
+			bt_peer_disconnect (peer);
+			break;
+		}
+
+		g_string_erase (peer->buffer, 0, bytes_read);
+	}
+
+	g_string_free (peer->buffer, TRUE);
+	peer->buffer = buffer;
 }
 
+void
+bt_peer_data_received (BtPeer *peer, guint len, gpointer buf, gpointer data G_GNUC_UNUSED)
+{
+	g_return_if_fail (BT_IS_PEER (peer));
+
+	g_debug ("data received for %s", bt_peer_get_address_string (peer));
+
+	/* a peer that's going away may no longer have a torrent to handle
+	 * messages with */
+	if (peer->status == BT_PEER_STATUS_CLOSING)
+		return;
+
+	if (buf)
+		g_string_append_len (peer->buffer, buf, (gssize) len);
+
+	/* the reactor reads everything that's available at once, so there can be
+	 * any number of messages waiting */
+	while (peer->buffer->len > 0 && peer->status != BT_PEER_STATUS_CLOSING && bt_peer_process_buffer (peer))
+		;
+}
@@ -27,12 +27,26 @@ void bt_peer_send_handshake (BtPeer *peer);
 
 void bt_peer_send_request (BtPeer *peer, guint block);
 
+void bt_peer_send_piece (BtPeer *peer, guint piece, guint begin, guint length);
+
 void bt_peer_choke (BtPeer *peer);
 void bt_peer_unchoke (BtPeer *peer);
 
 void bt_peer_interest (BtPeer *peer);
 void bt_peer_uninterest (BtPeer *peer);
 
+void bt_peer_piece_completed (BtPeer *peer, guint piece, gboolean lazy);
+
+void bt_peer_flush_haves (BtPeer *peer);
+
+void bt_peer_release_piece (BtPeer *peer);
+
+void bt_peer_catch_up (BtPeer *peer);
+
+gboolean bt_peer_supports_extension (BtPeer *peer, guint id);
+
+gboolean bt_peer_send_extended (BtPeer *peer, guint id, const gchar *payload, gsize len);
+
 void bt_peer_data_received (BtPeer *peer, guint len, gpointer buf, gpointer data);
 
 #endif
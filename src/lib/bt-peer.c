@@ -18,17 +18,21 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
  */
 
+#include <string.h>
+
 #include "bt-peer.h"
 #include "bt-peer-private.h"
 #include "bt-peer-protocol.h"
 #include "bt-torrent.h"
 #include "bt-utils.h"
+#include "bt-resolver.h"
 
 enum {
 	BT_PEER_PROPERTY_TORRENT = 1,
 	BT_PEER_PROPERTY_MANAGER,
 	BT_PEER_PROPERTY_SOCKET,
-	BT_PEER_PROPERTY_ADDRESS
+	BT_PEER_PROPERTY_ADDRESS,
+	BT_PEER_PROPERTY_HOSTNAME
 };
 
 enum {
@@ -49,11 +53,171 @@ bt_peer_new_incoming (BtManager *manager, GTcpSocket *socket)
 }
 
 BtPeer *
-bt_peer_new_outgoing (BtManager *manager, BtTorrent *torrent, GInetAddr *address)
+bt_peer_new_outgoing (BtManager *manager, BtTorrent *torrent, const BtAddress *address)
 {
 	return BT_PEER (g_object_new (BT_TYPE_PEER, "manager", manager, "torrent", torrent, "address", address, NULL));
 }
 
+/**
+ * bt_peer_get_address:
+ * @peer: the peer
+ *
+ * Returns: the remote address of the peer, owned by the peer
+ */
+const BtAddress *
+bt_peer_get_address (BtPeer *peer)
+{
+	g_return_val_if_fail (BT_IS_PEER (peer), NULL);
+
+	return &peer->address;
+}
+
+/**
+ * bt_peer_get_address_string:
+ * @peer: the peer
+ *
+ * Gets the peer's address and port as a numeric string, for messages. It's
+ * only made the first time it's asked for.
+ *
+ * Returns: the address string, owned by the peer
+ */
+const gchar *
+bt_peer_get_address_string (BtPeer *peer)
+{
+	g_return_val_if_fail (BT_IS_PEER (peer), NULL);
+
+	if (peer->address_string == NULL)
+		peer->address_string = bt_address_to_string (&peer->address);
+
+	return peer->address_string;
+}
+
+static void
+bt_peer_hostname_resolved (const BtAddress *address G_GNUC_UNUSED, const gchar *hostname, gpointer data)
+{
+	BtPeer *peer = BT_PEER (data);
+
+	if (hostname != NULL) {
+		peer->hostname = g_strdup (hostname);
+		g_object_notify (G_OBJECT (peer), "hostname");
+	}
+
+	g_object_unref (G_OBJECT (peer));
+}
+
+/**
+ * bt_peer_get_hostname:
+ * @peer: the peer
+ *
+ * Gets the name of the peer's address. The first call starts a lookup in the
+ * background and returns NULL; #BtPeer:hostname is notified once the name is
+ * known. Should be called from the thread that runs the peer.
+ *
+ * Returns: the name, owned by the peer, or NULL if it isn't known
+ */
+const gchar *
+bt_peer_get_hostname (BtPeer *peer)
+{
+	g_return_val_if_fail (BT_IS_PEER (peer), NULL);
+
+	if (peer->hostname == NULL && !peer->resolving) {
+		peer->resolving = TRUE;
+		bt_resolver_lookup (&peer->address, bt_reactor_get_context (bt_reactor_get_current ()), bt_peer_hostname_resolved, g_object_ref (peer));
+	}
+
+	return peer->hostname;
+}
+
+/**
+ * bt_peer_get_peer_id:
+ * @peer: the peer
+ *
+ * Returns: the 20-byte id the peer sent in its handshake, owned by the peer, or
+ *   NULL if it hasn't been received
+ */
+const gchar *
+bt_peer_get_peer_id (BtPeer *peer)
+{
+	g_return_val_if_fail (BT_IS_PEER (peer), NULL);
+
+	return peer->has_peer_id ? peer->peer_id : NULL;
+}
+
+/**
+ * bt_peer_get_listen_address:
+ * @peer: the peer
+ * @address: return location for the address
+ *
+ * Gets the address other peers could connect to this one on, which for an
+ * incoming peer is only known if it sent its port in an extended handshake.
+ *
+ * Returns: whether the address is known
+ */
+gboolean
+bt_peer_get_listen_address (BtPeer *peer, BtAddress *address)
+{
+	g_return_val_if_fail (BT_IS_PEER (peer), FALSE);
+	g_return_val_if_fail (address != NULL, FALSE);
+
+	if (!peer->outgoing && peer->listen_port == 0)
+		return FALSE;
+
+	*address = peer->address;
+
+	if (!peer->outgoing)
+		address->port = peer->listen_port;
+
+	return TRUE;
+}
+
+/**
+ * bt_peer_is_established:
+ * @peer: the peer
+ *
+ * Returns: whether the peer completed its handshake, even if it has been
+ *   disconnected since
+ */
+gboolean
+bt_peer_is_established (BtPeer *peer)
+{
+	g_return_val_if_fail (BT_IS_PEER (peer), FALSE);
+
+	return peer->established;
+}
+
+/**
+ * bt_peer_get_downloaded:
+ * @peer: the peer
+ *
+ * Returns: the number of bytes of piece data received from the peer
+ */
+guint64
+bt_peer_get_downloaded (BtPeer *peer)
+{
+	g_return_val_if_fail (BT_IS_PEER (peer), 0);
+
+	return peer->downloaded;
+}
+
+/* gives the manager back whatever slots the connection still holds */
+static void
+bt_peer_release_slots (BtPeer *peer)
+{
+	if (peer->half_open) {
+		peer->half_open = FALSE;
+
+		if (peer->manager != NULL)
+			bt_manager_release_half_open (peer->manager);
+	}
+
+	if (peer->has_slot) {
+		peer->has_slot = FALSE;
+
+		if (peer->manager != NULL)
+			bt_manager_release_connection (peer->manager);
+	}
+}
+
 static gboolean
 bt_peer_disconnect_source (gpointer data)
 {
@@ -63,11 +227,19 @@ bt_peer_disconnect_source (gpointer data)
 
 	peer = BT_PEER (data);
 
-	gnet_conn_delete (peer->socket);
+	if (peer->connection != NULL) {
+		bt_connection_close (peer->connection);
+		peer->connection = NULL;
+	}
+
+	bt_peer_release_slots (peer);
+	bt_peer_release_piece (peer);
 
 	// unreference if not associated with a torrent
 	if (!peer->torrent)
 		g_object_unref (G_OBJECT (peer));
+	else
+		bt_torrent_remove_peer (peer->torrent, peer);
 
 	return FALSE;
 }
@@ -75,13 +247,141 @@ bt_peer_disconnect_source (gpointer data)
 void
 bt_peer_disconnect (BtPeer *peer)
 {
+	GSource *source;
+
 	g_return_if_fail (BT_IS_PEER (peer));
 
-	g_idle_add (bt_peer_disconnect_source, peer);
+	if (peer->status == BT_PEER_STATUS_CLOSING)
+		return;
+
+	peer->status = BT_PEER_STATUS_CLOSING;
+
+	/* on whichever thread runs the peer's connection */
+	source = g_idle_source_new ();
+	g_source_set_callback (source, bt_peer_disconnect_source, g_object_ref (peer), g_object_unref);
+	g_source_attach (source, bt_reactor_get_context (bt_reactor_get_current ()));
+	g_source_unref (source);
+}
+
+/**
+ * bt_peer_detach:
+ * @peer: the peer
+ *
+ * Takes the peer away from its torrent, for when the torrent drops all of its
+ * peers, and closes its connection. The torrent's reference to the peer is
+ * given up, and the peer doesn't touch the torrent again. This has to be
+ * called from the thread that runs the peer, or once that has stopped.
+ */
+void
+bt_peer_detach (BtPeer *peer)
+{
+	gboolean closing;
+
+	g_return_if_fail (BT_IS_PEER (peer));
+	g_return_if_fail (peer->torrent != NULL);
+
+	bt_peer_release_piece (peer);
+
+	if (peer->bitfield != NULL)
+		bt_torrent_free_bitfield (peer->torrent, peer->bitfield);
+
+	peer->bitfield = NULL;
+
+	bt_remove_weak_pointer (G_OBJECT (peer->torrent), (gpointer)&peer->torrent);
+	peer->torrent = NULL;
+
+	/* a disconnect that's on its way drops the torrent's reference itself,
+	 * now that the peer has no torrent */
+	closing = peer->status == BT_PEER_STATUS_CLOSING;
+	peer->status = BT_PEER_STATUS_CLOSING;
+
+	if (closing)
+		return;
+
+	if (peer->connection != NULL) {
+		bt_connection_close (peer->connection);
+		peer->connection = NULL;
+	}
+
+	bt_peer_release_slots (peer);
+
+	g_object_unref (G_OBJECT (peer));
+}
+
+/* runs on the shard's thread: the peer's connection joins the shard's reactor
+ * and the peer joins its torrent */
+static void
+bt_peer_adopt (gpointer data)
+{
+	BtPeer *peer = BT_PEER (data);
+
+	bt_connection_attach (peer->connection, bt_reactor_get_current ());
+
+	if (peer->torrent != NULL && !bt_torrent_add_peer (peer->torrent, peer)) {
+		bt_remove_weak_pointer (G_OBJECT (peer->torrent), (gpointer)&peer->torrent);
+		peer->torrent = NULL;
+	}
+
+	/* without a torrent, the peer goes away once it's disconnected */
+	if (peer->torrent == NULL) {
+		bt_peer_disconnect (peer);
+		return;
+	}
+
+	g_object_unref (G_OBJECT (peer));
+
+	/* whatever came after the handshake is still waiting */
+	if (peer->buffer->len > 0)
+		bt_peer_data_received (peer, 0, NULL, NULL);
+}
+
+static gboolean
+bt_peer_move_to_shard_source (gpointer data)
+{
+	BtPeer *peer = BT_PEER (data);
+
+	/* the torrent went away while we weren't looking */
+	if (peer->torrent == NULL) {
+		bt_connection_close (peer->connection);
+		peer->connection = NULL;
+		g_object_unref (G_OBJECT (peer));
+		return FALSE;
+	}
+
+	bt_shard_invoke (bt_torrent_get_shard (peer->torrent), bt_peer_adopt, peer);
+
+	return FALSE;
+}
+
+/**
+ * bt_peer_move_to_shard:
+ * @peer: an incoming peer that has sent a handshake
+ *
+ * Hands an incoming peer over to the network thread of the torrent it asked
+ * for. The peer is no longer touched from this thread once this returns, and
+ * it is added to its torrent once the shard has taken it.
+ */
+void
+bt_peer_move_to_shard (BtPeer *peer)
+{
+	GSource *source;
+
+	g_return_if_fail (BT_IS_PEER (peer));
+	g_return_if_fail (peer->torrent != NULL);
+
+	bt_connection_detach (peer->connection);
+
+	/* the reactor may still have events for the connection from this wakeup,
+	 * so the shard only gets it once the reactor is done */
+	source = g_idle_source_new ();
+	g_source_set_priority (source, G_PRIORITY_HIGH);
+	g_source_set_callback (source, bt_peer_move_to_shard_source, peer, NULL);
+	g_source_attach (source, bt_reactor_get_context (bt_reactor_get_current ()));
+	g_source_unref (source);
 }
 
 static void
-bt_peer_connection_callback (GConn *connection G_GNUC_UNUSED, GConnEvent *event, gpointer data)
+bt_peer_connection_callback (BtConnection *connection G_GNUC_UNUSED, BtConnectionEvent event, gpointer data)
 {
 	BtPeer *peer;
 	
@@ -89,21 +389,35 @@ bt_peer_connection_callback (GConn *connection G_GNUC_UNUSED, GConnEvent *event,
 	
 	peer = BT_PEER (data);
 	
-	switch (event->type) {
-	case GNET_CONN_CONNECT:
+	switch (event) {
+	case BT_CONNECTION_EVENT_CONNECTED:
+		if (peer->half_open) {
+			peer->half_open = FALSE;
+
+			if (peer->manager != NULL)
+				bt_manager_release_half_open (peer->manager);
+
+			/* that may have been what the torrent was waiting for */
+			if (peer->torrent != NULL)
+				bt_torrent_connect_candidates (peer->torrent);
+		}
+
 		g_signal_emit (peer, bt_peer_signals[BT_PEER_SIGNAL_CONNECTED], 0);
 		break;
 	
-	case GNET_CONN_CLOSE:
-		g_debug ("connection closed for %s", peer->address_string);
+	case BT_CONNECTION_EVENT_CLOSED:
+		g_debug ("connection closed for %s", bt_peer_get_address_string (peer));
+		bt_peer_disconnect (peer);
 		break;
 	
-	case GNET_CONN_ERROR:
-		g_debug ("connection error for %s", peer->address_string);
+	case BT_CONNECTION_EVENT_ERROR:
+		g_debug ("connection error for %s", bt_peer_get_address_string (peer));
+		bt_peer_disconnect (peer);
 		break;
 	
-	case GNET_CONN_READ:
-		g_signal_emit (peer, bt_peer_signals[BT_PEER_SIGNAL_DATA_RECEIVED], 0, event->length, event->buffer);
+	case BT_CONNECTION_EVENT_DATA:
+		/* the reactor has already appended it to the peer's buffer */
+		g_signal_emit (peer, bt_peer_signals[BT_PEER_SIGNAL_DATA_RECEIVED], 0, 0, NULL);
 		break;
 	
 	default:
@@ -116,12 +430,11 @@ bt_peer_connected (BtPeer *peer, gpointer data G_GNUC_UNUSED)
 {
 	g_return_if_fail (BT_IS_PEER (peer));
 
-	g_debug ("peer became connected for %s", peer->address_string);
+	g_debug ("peer became connected for %s", bt_peer_get_address_string (peer));
 
 	if (peer->status == BT_PEER_STATUS_DISCONNECTED) {
 		bt_peer_send_handshake (peer);
 		peer->status = BT_PEER_STATUS_CONNECTED_OUT;
-		gnet_conn_read (peer->socket);
 	}
 }
 
@@ -133,14 +446,26 @@ bt_peer_dispose (GObject *object)
 	if (self->manager == NULL)
 		return;
 
+	bt_peer_release_slots (self);
+	bt_peer_release_piece (self);
+
 	bt_remove_weak_pointer (G_OBJECT (self->manager), (gpointer)&self->manager);
 	bt_remove_weak_pointer (G_OBJECT (self->torrent), (gpointer)&self->torrent);
 
+	/* the pool goes away with the torrent, so if it's gone there's nothing
+	 * to give the bitfield back to */
+	if (self->bitfield != NULL && self->torrent != NULL)
+		bt_torrent_free_bitfield (self->torrent, self->bitfield);
+
+	self->bitfield = NULL;
 	self->manager = NULL;
 	self->torrent = NULL;
-	
-	gnet_inetaddr_unref (self->address);
 
+	if (self->connection != NULL) {
+		bt_connection_close (self->connection);
+		self->connection = NULL;
+	}
+	
 	G_OBJECT_CLASS (bt_peer_parent_class)->dispose (object);
 	
 	return;
@@ -149,6 +474,31 @@ bt_peer_dispose (GObject *object)
 static void
 bt_peer_finalize (GObject *object)
 {
+	BtPeer *self = BT_PEER (object);
+
+	g_free (self->address_string);
+	g_free (self->hostname);
+
+	if (self->haves != NULL)
+		g_array_free (self->haves, TRUE);
+
+	if (self->allowed_fast != NULL)
+		g_array_free (self->allowed_fast, TRUE);
+
+	if (self->requests != NULL)
+		g_array_free (self->requests, TRUE);
+
+	if (self->suggested != NULL)
+		g_array_free (self->suggested, TRUE);
+
+	if (self->fast_pieces != NULL)
+		g_array_free (self->fast_pieces, TRUE);
+
+	g_free (self->blocks);
+
+	if (self->early != NULL)
+		g_string_free (self->early, TRUE);
+
 	G_OBJECT_CLASS (bt_peer_parent_class)->finalize (object);
 	
 	return;
@@ -167,7 +517,8 @@ bt_peer_set_property (GObject *object, guint property, const GValue *value, GPar
 		break;
 		
 	case BT_PEER_PROPERTY_ADDRESS:
-		self->address = (GInetAddr *) g_value_dup_boxed (value);
+		if (g_value_get_pointer (value) != NULL)
+			self->address = *(const BtAddress *) g_value_get_pointer (value);
 		break;
 	
 	case BT_PEER_PROPERTY_SOCKET:
@@ -197,6 +548,14 @@ bt_peer_get_property (GObject *object, guint property, GValue *value, GParamSpec
 		// FIXME: this might leave a dangling pointer in value
 		g_value_set_pointer (value, self->torrent);
 		break;
+
+	case BT_PEER_PROPERTY_ADDRESS:
+		g_value_set_pointer (value, &self->address);
+		break;
+
+	case BT_PEER_PROPERTY_HOSTNAME:
+		g_value_set_string (value, self->hostname);
+		break;
 	
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property, pspec);
@@ -211,31 +570,31 @@ bt_peer_constructor (GType type, guint num, GObjectConstructParam *properties)
 	GObject *object;
 	BtPeer *self;
 
-	gchar *canonical;
-
 	object = G_OBJECT_CLASS (bt_peer_parent_class)->constructor (type, num, properties);
 	self = BT_PEER (object);
 
-	if (self->address != NULL) {
-		self->socket = gnet_conn_new_inetaddr (self->address, (GConnFunc) bt_peer_connection_callback, self);
+	/* whoever created the peer reserved its slots */
+	self->has_slot = TRUE;
+	self->half_open = self->tcp_socket == NULL;
+	self->outgoing = self->tcp_socket == NULL;
+
+	if (self->tcp_socket == NULL) {
 		self->status = BT_PEER_STATUS_DISCONNECTED;
-		gnet_conn_connect (self->socket);
+		self->connection = bt_connection_new_connect (bt_reactor_get_current (), &self->address, self->buffer, bt_peer_connection_callback, self);
 	} else {
-		self->socket = gnet_conn_new_socket (self->tcp_socket, (GConnFunc) bt_peer_connection_callback, self);
-		self->address = gnet_tcp_socket_get_remote_inetaddr (self->tcp_socket);
+		GInetAddr *remote = gnet_tcp_socket_get_remote_inetaddr (self->tcp_socket);
+
+		bt_address_set_inetaddr (&self->address, remote);
+		gnet_inetaddr_unref (remote);
+
 		self->torrent = NULL;
 		self->status = BT_PEER_STATUS_CONNECTED_IN;
+		self->connection = bt_connection_new_socket (bt_reactor_get_current (), self->tcp_socket, self->buffer, bt_peer_connection_callback, self);
 		gnet_tcp_socket_unref (self->tcp_socket);
-		gnet_conn_read (self->socket);
+		self->tcp_socket = NULL;
 	}
 
-	canonical = gnet_inetaddr_get_canonical_name (self->address);
-	self->address_string = g_strdup_printf ("%s:%d", canonical, gnet_inetaddr_get_port (self->address));
-	g_free (canonical);
-
-	g_debug ("new connection created with %s", self->address_string);
-
-	gnet_conn_set_watch_error (self->socket, TRUE);
+	g_debug ("new %s connection created", self->status == BT_PEER_STATUS_CONNECTED_IN ? "incoming" : "outgoing");
 
 	return object;
 }
@@ -245,11 +604,37 @@ bt_peer_init (BtPeer *peer)
 {
 	peer->manager = NULL;
 	peer->torrent = NULL;
-	peer->socket = NULL;
-	peer->address = NULL;
+	peer->connection = NULL;
+	memset (&peer->address, 0, sizeof (BtAddress));
+	peer->address_string = NULL;
+	peer->hostname = NULL;
+	peer->resolving = FALSE;
+	peer->has_peer_id = FALSE;
+	peer->bitfield = NULL;
+	peer->missing = 0;
+	peer->haves = NULL;
+	peer->allowed_fast = NULL;
+	peer->piece = -1;
+	peer->blocks = NULL;
+	peer->blocks_left = 0;
+	peer->requests = NULL;
+	peer->suggested = NULL;
+	peer->fast_pieces = NULL;
+	peer->fast = FALSE;
 	peer->encryption_func = NULL;
-	peer->extension_func = NULL;
+	peer->extended = FALSE;
+	peer->dht = FALSE;
+	peer->outgoing = FALSE;
+	peer->listen_port = 0;
+	memset (peer->extension_ids, 0, sizeof (peer->extension_ids));
+	peer->choking = TRUE;
+	peer->peer_choking = TRUE;
+	peer->established = FALSE;
+	peer->downloaded = 0;
+	peer->has_slot = FALSE;
+	peer->half_open = FALSE;
 	peer->buffer = g_string_sized_new (1024);
+	peer->early = NULL;
 
 	return;
 }
@@ -310,14 +695,27 @@ bt_peer_class_init (BtPeerClass *peer_class)
 	 *
 	 * The remote address of this peer.
 	 */
-	pspec = g_param_spec_boxed ("address",
-	                            "the address for an outgoing connection",
-	                            "The address of this peer.",
-	                            BT_TYPE_INET_ADDR,
-	                            G_PARAM_READWRITE | G_PARAM_STATIC_NAME | G_PARAM_STATIC_BLURB | G_PARAM_STATIC_NICK | G_PARAM_CONSTRUCT_ONLY);
+	pspec = g_param_spec_pointer ("address",
+	                              "the address for an outgoing connection",
+	                              "The address of this peer, a BtAddress which is copied on construction.",
+	                              G_PARAM_READWRITE | G_PARAM_STATIC_NAME | G_PARAM_STATIC_BLURB | G_PARAM_STATIC_NICK | G_PARAM_CONSTRUCT_ONLY);
 	
 	g_object_class_install_property (object_class, BT_PEER_PROPERTY_ADDRESS, pspec);
 
+	/**
+	 * BtPeer:hostname:
+	 *
+	 * The name of the peer's address, which is only known some time after
+	 * bt_peer_get_hostname() has been called, and NULL until then.
+	 */
+	pspec = g_param_spec_string ("hostname",
+	                             "the name of the peer's address",
+	                             "The name of the peer's address, from a reverse lookup.",
+	                             NULL,
+	                             G_PARAM_READABLE | G_PARAM_STATIC_NAME | G_PARAM_STATIC_BLURB | G_PARAM_STATIC_NICK);
+
+	g_object_class_install_property (object_class, BT_PEER_PROPERTY_HOSTNAME, pspec);
+
 	/**
 	 * BtPeer::connected:
 	 *
@@ -25,6 +25,8 @@
 
 #include <gnet.h>
 
+#include "bt-address.h"
+
 #define BT_TYPE_PEER (bt_peer_get_type ())
 #define BT_PEER(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), BT_TYPE_PEER, BtPeer))
 #define BT_IS_PEER(obj) (G_TYPE_CHECK_INSTANCE_TYPE ((obj), BT_TYPE_PEER))
@@ -39,8 +41,24 @@ GType   bt_peer_get_type ();
 
 BtPeer *bt_peer_new_incoming (BtManager *manager, GTcpSocket *socket);
 
-BtPeer *bt_peer_new_outgoing (BtManager *manager, BtTorrent *torrent, GInetAddr *inetaddr);
+BtPeer *bt_peer_new_outgoing (BtManager *manager, BtTorrent *torrent, const BtAddress *address);
 
 void    bt_peer_disconnect (BtPeer *peer);
 
+void    bt_peer_detach (BtPeer *peer);
+
+const BtAddress *bt_peer_get_address (BtPeer *peer);
+
+const gchar *bt_peer_get_address_string (BtPeer *peer);
+
+const gchar *bt_peer_get_hostname (BtPeer *peer);
+
+const gchar *bt_peer_get_peer_id (BtPeer *peer);
+
+gboolean   bt_peer_get_listen_address (BtPeer *peer, BtAddress *address);
+
+gboolean   bt_peer_is_established (BtPeer *peer);
+
+guint64    bt_peer_get_downloaded (BtPeer *peer);
+
 #endif
@@ -0,0 +1,505 @@
+/**
+ * bt-piece-cache.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+
+#include "bt-piece-cache.h"
+
+/*
+ * The cache uses the 2Q replacement policy. Pieces seen for the first time
+ * go into a small FIFO (a1in) so that a single sequential pass over the
+ * torrent cannot flush the pieces that are really hot. When a piece falls
+ * out of a1in we only remember its index (a1out, the "ghost" queue); if it
+ * is requested again while still remembered it is promoted into the main
+ * LRU queue (am), which holds everything that has proven to be popular.
+ */
+
+/* share of the budget given to the a1in queue, in percent */
+#define BT_PIECE_CACHE_A1IN_SHARE 25
+
+typedef enum {
+	BT_PIECE_CACHE_QUEUE_NONE,
+	BT_PIECE_CACHE_QUEUE_A1IN,
+	BT_PIECE_CACHE_QUEUE_AM
+} BtPieceCacheQueue;
+
+struct _BtCachedPiece {
+	gint               ref_count;
+
+	/* the piece index and its length in bytes */
+	guint              index;
+	guint              len;
+
+	/* the queue this piece is resident in, or NONE once it has been evicted */
+	BtPieceCacheQueue  queue;
+
+	/* embedded link so that moving between queues never allocates */
+	GList              link;
+
+	gchar             *data;
+};
+
+typedef struct {
+	guint  index;
+	GList  link;
+} BtPieceCacheGhost;
+
+struct _BtPieceCache {
+	/* maximum number of bytes resident pieces may take up */
+	gsize                 budget;
+
+	/* bytes currently taken up by a1in and by all resident pieces */
+	gsize                 a1in_size;
+	gsize                 size;
+
+	/* the number of ghost entries we remember, derived from the piece size */
+	guint                 ghost_limit;
+
+	GQueue                a1in;
+	GQueue                a1out;
+	GQueue                am;
+
+	/* piece index -> BtCachedPiece, and piece index -> BtPieceCacheGhost */
+	GHashTable           *pieces;
+	GHashTable           *ghosts;
+
+	BtPieceCacheReadFunc  read_func;
+	gpointer              read_data;
+
+	guint64               hits;
+	guint64               misses;
+	guint64               bytes_served;
+	guint64               bytes_loaded;
+};
+
+static void
+bt_cached_piece_free (BtCachedPiece *piece)
+{
+	g_free (piece->data);
+	g_slice_free (BtCachedPiece, piece);
+}
+
+/**
+ * bt_cached_piece_ref:
+ * @piece: the cached piece
+ *
+ * Takes a reference on a cached piece, keeping its data alive even if the cache
+ * evicts it in the meantime.
+ *
+ * Returns: @piece
+ */
+BtCachedPiece *
+bt_cached_piece_ref (BtCachedPiece *piece)
+{
+	g_return_val_if_fail (piece != NULL, NULL);
+
+	piece->ref_count++;
+
+	return piece;
+}
+
+/**
+ * bt_cached_piece_unref:
+ * @piece: the cached piece
+ *
+ * Drops a reference on a cached piece. The data is freed once the piece is no longer
+ * resident in the cache and the last reference is gone.
+ */
+void
+bt_cached_piece_unref (BtCachedPiece *piece)
+{
+	g_return_if_fail (piece != NULL);
+	g_return_if_fail (piece->ref_count > 0);
+
+	if (--piece->ref_count == 0)
+		bt_cached_piece_free (piece);
+}
+
+/**
+ * bt_cached_piece_get_data:
+ * @piece: the cached piece
+ *
+ * Gets the contents of the piece. Blocks are handed out as slices of this buffer,
+ * which must not be modified.
+ *
+ * Returns: the piece data, valid for as long as a reference is held
+ */
+const gchar *
+bt_cached_piece_get_data (BtCachedPiece *piece)
+{
+	g_return_val_if_fail (piece != NULL, NULL);
+
+	return piece->data;
+}
+
+/**
+ * bt_cached_piece_get_length:
+ * @piece: the cached piece
+ *
+ * Returns: the length of the piece in bytes
+ */
+guint
+bt_cached_piece_get_length (BtCachedPiece *piece)
+{
+	g_return_val_if_fail (piece != NULL, 0);
+
+	return piece->len;
+}
+
+static void
+bt_piece_cache_forget_ghost (BtPieceCache *cache, BtPieceCacheGhost *ghost)
+{
+	g_queue_unlink (&cache->a1out, &ghost->link);
+	g_hash_table_remove (cache->ghosts, GUINT_TO_POINTER (ghost->index));
+	g_slice_free (BtPieceCacheGhost, ghost);
+}
+
+static void
+bt_piece_cache_remember_ghost (BtPieceCache *cache, guint index)
+{
+	BtPieceCacheGhost *ghost;
+
+	if (cache->ghost_limit == 0)
+		return;
+
+	while (cache->a1out.length >= cache->ghost_limit)
+		bt_piece_cache_forget_ghost (cache, (BtPieceCacheGhost *) g_queue_peek_tail (&cache->a1out));
+
+	ghost = g_slice_new (BtPieceCacheGhost);
+	ghost->index = index;
+	ghost->link.data = ghost;
+	ghost->link.next = ghost->link.prev = NULL;
+
+	g_queue_push_head_link (&cache->a1out, &ghost->link);
+	g_hash_table_insert (cache->ghosts, GUINT_TO_POINTER (index), ghost);
+}
+
+/* takes a piece out of whatever queue it is in and drops the cache's reference */
+static void
+bt_piece_cache_remove (BtPieceCache *cache, BtCachedPiece *piece)
+{
+	switch (piece->queue) {
+	case BT_PIECE_CACHE_QUEUE_A1IN:
+		g_queue_unlink (&cache->a1in, &piece->link);
+		cache->a1in_size -= piece->len;
+		break;
+
+	case BT_PIECE_CACHE_QUEUE_AM:
+		g_queue_unlink (&cache->am, &piece->link);
+		break;
+
+	case BT_PIECE_CACHE_QUEUE_NONE:
+		g_return_if_reached ();
+	}
+
+	piece->queue = BT_PIECE_CACHE_QUEUE_NONE;
+	cache->size -= piece->len;
+
+	g_hash_table_remove (cache->pieces, GUINT_TO_POINTER (piece->index));
+
+	bt_cached_piece_unref (piece);
+}
+
+/* evict pieces until we fit in the budget, leaving room for @needed more bytes */
+static void
+bt_piece_cache_reclaim (BtPieceCache *cache, gsize needed)
+{
+	gsize a1in_limit = cache->budget / 100 * BT_PIECE_CACHE_A1IN_SHARE;
+
+	while (cache->size > 0 && cache->size + needed > cache->budget) {
+		BtCachedPiece *victim;
+
+		if (cache->a1in.length > 0 && (cache->a1in_size > a1in_limit || cache->am.length == 0)) {
+			victim = (BtCachedPiece *) g_queue_peek_tail (&cache->a1in);
+			bt_piece_cache_remember_ghost (cache, victim->index);
+		} else {
+			victim = (BtCachedPiece *) g_queue_peek_tail (&cache->am);
+		}
+
+		bt_piece_cache_remove (cache, victim);
+	}
+}
+
+/**
+ * bt_piece_cache_new:
+ * @budget: the maximum number of bytes to keep in memory
+ * @func: function used to load pieces on a cache miss
+ * @data: user data for @func
+ *
+ * Creates a new piece cache.
+ *
+ * Returns: the new cache, to be freed with bt_piece_cache_free()
+ */
+BtPieceCache *
+bt_piece_cache_new (gsize budget, BtPieceCacheReadFunc func, gpointer data)
+{
+	BtPieceCache *cache;
+
+	g_return_val_if_fail (func != NULL, NULL);
+
+	cache = g_slice_new0 (BtPieceCache);
+
+	cache->budget = budget;
+	cache->read_func = func;
+	cache->read_data = data;
+
+	cache->pieces = g_hash_table_new (g_direct_hash, g_direct_equal);
+	cache->ghosts = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	return cache;
+}
+
+/**
+ * bt_piece_cache_free:
+ * @cache: the cache
+ *
+ * Frees the cache. Pieces that are still referenced stay alive until they are unreferenced.
+ */
+void
+bt_piece_cache_free (BtPieceCache *cache)
+{
+	g_return_if_fail (cache != NULL);
+
+	while (cache->a1in.length > 0)
+		bt_piece_cache_remove (cache, (BtCachedPiece *) g_queue_peek_head (&cache->a1in));
+
+	while (cache->am.length > 0)
+		bt_piece_cache_remove (cache, (BtCachedPiece *) g_queue_peek_head (&cache->am));
+
+	while (cache->a1out.length > 0)
+		bt_piece_cache_forget_ghost (cache, (BtPieceCacheGhost *) g_queue_peek_head (&cache->a1out));
+
+	g_hash_table_destroy (cache->pieces);
+	g_hash_table_destroy (cache->ghosts);
+
+	g_slice_free (BtPieceCache, cache);
+}
+
+/**
+ * bt_piece_cache_set_budget:
+ * @cache: the cache
+ * @budget: the maximum number of bytes to keep in memory
+ *
+ * Changes the memory budget, evicting pieces right away if needed. A budget of 0
+ * disables caching altogether.
+ */
+void
+bt_piece_cache_set_budget (BtPieceCache *cache, gsize budget)
+{
+	g_return_if_fail (cache != NULL);
+
+	cache->budget = budget;
+
+	bt_piece_cache_reclaim (cache, 0);
+}
+
+/**
+ * bt_piece_cache_get_budget:
+ * @cache: the cache
+ *
+ * Returns: the maximum number of bytes the cache keeps in memory
+ */
+gsize
+bt_piece_cache_get_budget (BtPieceCache *cache)
+{
+	g_return_val_if_fail (cache != NULL, 0);
+
+	return cache->budget;
+}
+
+/**
+ * bt_piece_cache_lookup:
+ * @cache: the cache
+ * @piece: the piece index
+ * @len: the length of the piece
+ * @served: the number of bytes the caller is going to hand out, for statistics
+ *
+ * Gets a piece from the cache, loading it from disk if it is not resident.
+ * The returned reference must be dropped with bt_cached_piece_unref().
+ *
+ * Returns: a new reference to the cached piece, or NULL if it could not be read
+ */
+BtCachedPiece *
+bt_piece_cache_lookup (BtPieceCache *cache, guint piece, guint len, guint served)
+{
+	BtCachedPiece *cached;
+	BtPieceCacheGhost *ghost;
+	gboolean promote = FALSE;
+
+	g_return_val_if_fail (cache != NULL, NULL);
+	g_return_val_if_fail (len > 0, NULL);
+
+	cached = (BtCachedPiece *) g_hash_table_lookup (cache->pieces, GUINT_TO_POINTER (piece));
+
+	if (cached != NULL && cached->len == len) {
+		/* pieces in a1in stay where they are, only am is kept in LRU order */
+		if (cached->queue == BT_PIECE_CACHE_QUEUE_AM) {
+			g_queue_unlink (&cache->am, &cached->link);
+			g_queue_push_head_link (&cache->am, &cached->link);
+		}
+
+		cache->hits++;
+		cache->bytes_served += served;
+
+		return bt_cached_piece_ref (cached);
+	}
+
+	if (cached != NULL)
+		bt_piece_cache_remove (cache, cached);
+
+	cache->misses++;
+
+	cached = g_slice_new0 (BtCachedPiece);
+	cached->ref_count = 1;
+	cached->index = piece;
+	cached->len = len;
+	cached->link.data = cached;
+	cached->data = g_malloc (len);
+
+	if (!cache->read_func (piece, cached->data, len, cache->read_data)) {
+		bt_cached_piece_free (cached);
+		return NULL;
+	}
+
+	cache->bytes_loaded += len;
+
+	/* a piece too big for the cache is handed out, but never kept */
+	if (len > cache->budget)
+		return cached;
+
+	cache->ghost_limit = MAX (1, cache->budget / len / 2);
+
+	ghost = (BtPieceCacheGhost *) g_hash_table_lookup (cache->ghosts, GUINT_TO_POINTER (piece));
+
+	if (ghost != NULL) {
+		/* seen recently enough to be remembered, so it's hot */
+		bt_piece_cache_forget_ghost (cache, ghost);
+		promote = TRUE;
+	}
+
+	bt_piece_cache_reclaim (cache, len);
+
+	if (promote) {
+		cached->queue = BT_PIECE_CACHE_QUEUE_AM;
+		g_queue_push_head_link (&cache->am, &cached->link);
+	} else {
+		cached->queue = BT_PIECE_CACHE_QUEUE_A1IN;
+		g_queue_push_head_link (&cache->a1in, &cached->link);
+		cache->a1in_size += len;
+	}
+
+	cache->size += len;
+
+	g_hash_table_insert (cache->pieces, GUINT_TO_POINTER (piece), cached);
+
+	/* one reference for the cache, one for the caller */
+	return bt_cached_piece_ref (cached);
+}
+
+/**
+ * bt_piece_cache_contains:
+ * @cache: the cache
+ * @piece: the piece index
+ *
+ * Checks whether a piece is currently resident, without touching the replacement queues.
+ *
+ * Returns: TRUE if @piece can be served from memory
+ */
+gboolean
+bt_piece_cache_contains (BtPieceCache *cache, guint piece)
+{
+	g_return_val_if_fail (cache != NULL, FALSE);
+
+	return g_hash_table_lookup (cache->pieces, GUINT_TO_POINTER (piece)) != NULL;
+}
+
+/**
+ * bt_piece_cache_get_hot:
+ * @cache: the cache
+ * @pieces: an array to fill with piece indices
+ * @max: the size of @pieces
+ *
+ * Lists resident pieces, the ones that have proven popular and were used most
+ * recently first, without touching the replacement queues.
+ *
+ * Returns: the number of pieces put in @pieces
+ */
+guint
+bt_piece_cache_get_hot (BtPieceCache *cache, guint *pieces, guint max)
+{
+	GList *i;
+	guint n = 0;
+
+	g_return_val_if_fail (cache != NULL, 0);
+	g_return_val_if_fail (pieces != NULL || max == 0, 0);
+
+	for (i = cache->am.head; i != NULL && n < max; i = i->next)
+		pieces[n++] = ((BtCachedPiece *) i->data)->index;
+
+	for (i = cache->a1in.head; i != NULL && n < max; i = i->next)
+		pieces[n++] = ((BtCachedPiece *) i->data)->index;
+
+	return n;
+}
+
+/**
+ * bt_piece_cache_invalidate:
+ * @cache: the cache
+ * @piece: the piece index
+ *
+ * Drops a piece from the cache, e.g. because its data on disk has changed.
+ */
+void
+bt_piece_cache_invalidate (BtPieceCache *cache, guint piece)
+{
+	BtCachedPiece *cached;
+
+	g_return_if_fail (cache != NULL);
+
+	cached = (BtCachedPiece *) g_hash_table_lookup (cache->pieces, GUINT_TO_POINTER (piece));
+
+	if (cached != NULL)
+		bt_piece_cache_remove (cache, cached);
+}
+
+/**
+ * bt_piece_cache_get_stats:
+ * @cache: the cache
+ * @stats: return location for the counters
+ *
+ * Gets the cache counters.
+ */
+void
+bt_piece_cache_get_stats (BtPieceCache *cache, BtPieceCacheStats *stats)
+{
+	g_return_if_fail (cache != NULL);
+	g_return_if_fail (stats != NULL);
+
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->bytes_served = cache->bytes_served;
+	stats->bytes_loaded = cache->bytes_loaded;
+	stats->bytes_cached = cache->size;
+
+	if (cache->hits + cache->misses > 0)
+		stats->hit_ratio = (gdouble) cache->hits / (gdouble) (cache->hits + cache->misses);
+	else
+		stats->hit_ratio = 0;
+}
@@ -0,0 +1,92 @@
+/**
+ * bt-piece-cache.h
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __BT_PIECE_CACHE_H__
+#define __BT_PIECE_CACHE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _BtPieceCache  BtPieceCache;
+typedef struct _BtCachedPiece BtCachedPiece;
+
+/**
+ * BtPieceCacheReadFunc:
+ * @piece: the piece index to load
+ * @buf: the buffer to read the piece into
+ * @len: the length of the piece
+ * @data: user data given to bt_piece_cache_new()
+ *
+ * Called by the cache on a miss to load a whole piece from disk.
+ *
+ * Returns: TRUE if @len bytes were read into @buf, otherwise FALSE
+ */
+typedef gboolean (*BtPieceCacheReadFunc) (guint piece, gchar *buf, guint len, gpointer data);
+
+/**
+ * BtPieceCacheStats:
+ * @hits: number of block reads served from memory
+ * @misses: number of block reads that had to load the piece from disk
+ * @bytes_served: number of block bytes handed out from the cache
+ * @bytes_loaded: number of piece bytes read from disk to fill the cache
+ * @bytes_cached: number of bytes currently held by resident pieces
+ * @hit_ratio: @hits / (@hits + @misses), or 0 if nothing was read yet
+ *
+ * Counters describing how well the piece cache is doing.
+ */
+typedef struct {
+	guint64 hits;
+	guint64 misses;
+	guint64 bytes_served;
+	guint64 bytes_loaded;
+	gsize   bytes_cached;
+	gdouble hit_ratio;
+} BtPieceCacheStats;
+
+BtPieceCache  *bt_piece_cache_new (gsize budget, BtPieceCacheReadFunc func, gpointer data);
+
+void           bt_piece_cache_free (BtPieceCache *cache);
+
+void           bt_piece_cache_set_budget (BtPieceCache *cache, gsize budget);
+
+gsize          bt_piece_cache_get_budget (BtPieceCache *cache);
+
+BtCachedPiece *bt_piece_cache_lookup (BtPieceCache *cache, guint piece, guint len, guint served);
+
+gboolean       bt_piece_cache_contains (BtPieceCache *cache, guint piece);
+
+guint          bt_piece_cache_get_hot (BtPieceCache *cache, guint *pieces, guint max);
+
+void           bt_piece_cache_invalidate (BtPieceCache *cache, guint piece);
+
+void           bt_piece_cache_get_stats (BtPieceCache *cache, BtPieceCacheStats *stats);
+
+BtCachedPiece *bt_cached_piece_ref (BtCachedPiece *piece);
+
+void           bt_cached_piece_unref (BtCachedPiece *piece);
+
+const gchar   *bt_cached_piece_get_data (BtCachedPiece *piece);
+
+guint          bt_cached_piece_get_length (BtCachedPiece *piece);
+
+G_END_DECLS
+
+#endif
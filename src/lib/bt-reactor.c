@@ -0,0 +1,867 @@
+/**
+ * bt-reactor.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+#ifdef HAVE_EPOLL
+# include <sys/epoll.h>
+#endif
+
+#include "bt-reactor.h"
+
+/* how many socket events to take from the kernel per wakeup */
+#define BT_REACTOR_MAX_EVENTS 512
+
+/* size of each read from a socket */
+#define BT_REACTOR_READ_SIZE 16384
+
+/* a connection reads at most this much per wakeup so one fast peer can't
+ * starve the others; the rest is read on the next wakeup */
+#define BT_REACTOR_READ_BUDGET (256 * 1024)
+
+#ifdef MSG_NOSIGNAL
+# define BT_REACTOR_SEND_FLAGS MSG_NOSIGNAL
+#else
+# define BT_REACTOR_SEND_FLAGS 0
+#endif
+
+struct _BtConnection {
+	BtReactor        *reactor;
+
+	gint              fd;
+
+	/* received data is appended here; owned by whoever created the connection */
+	GString          *buffer;
+
+	/* data waiting to be written, starting at out_pos */
+	GString          *out;
+	gsize             out_pos;
+
+	BtConnectionFunc  func;
+	gpointer          data;
+
+	/* links into the reactor's queues, NULL when not queued */
+	GList            *read_link;
+	GList            *write_link;
+
+	/* an error from connect () to be reported on the next wakeup */
+	gint              error;
+
+	guint             connecting : 1;
+	guint             writable   : 1;
+	guint             dead       : 1;
+
+#ifndef HAVE_EPOLL
+	GPollFD           poll;
+	guint             index;
+#endif
+};
+
+struct _BtReactor {
+	GSource         source;
+
+#ifdef HAVE_EPOLL
+	/* the only thing the main loop polls: readable whenever any socket has events */
+	gint            epoll_fd;
+	GPollFD         poll;
+#else
+	GPtrArray      *connections;
+#endif
+
+	/* connections that may have more to read, and ones with data to write */
+	GQueue          reads;
+	GQueue          writes;
+
+	/* connections closed during a dispatch, freed at the end of it */
+	GSList         *dead;
+	gboolean        dispatching;
+
+	BtReactorStats  stats;
+};
+
+static BtReactor *bt_reactor_default = NULL;
+
+/* the reactor new connections go to on each thread, if not the default one */
+static GStaticPrivate bt_reactor_current = G_STATIC_PRIVATE_INIT;
+
+static void
+bt_reactor_queue_read (BtReactor *reactor, BtConnection *connection)
+{
+	if (connection->read_link != NULL)
+		return;
+
+	connection->read_link = g_list_alloc ();
+	connection->read_link->data = connection;
+	g_queue_push_tail_link (&reactor->reads, connection->read_link);
+}
+
+static void
+bt_reactor_unqueue_read (BtReactor *reactor, BtConnection *connection)
+{
+	if (connection->read_link == NULL)
+		return;
+
+	g_queue_delete_link (&reactor->reads, connection->read_link);
+	connection->read_link = NULL;
+}
+
+static void
+bt_reactor_queue_write (BtReactor *reactor, BtConnection *connection)
+{
+	if (connection->write_link != NULL)
+		return;
+
+	connection->write_link = g_list_alloc ();
+	connection->write_link->data = connection;
+	g_queue_push_tail_link (&reactor->writes, connection->write_link);
+}
+
+static void
+bt_reactor_unqueue_write (BtReactor *reactor, BtConnection *connection)
+{
+	if (connection->write_link == NULL)
+		return;
+
+	g_queue_delete_link (&reactor->writes, connection->write_link);
+	connection->write_link = NULL;
+}
+
+static void
+bt_connection_free (BtConnection *connection)
+{
+	g_string_free (connection->out, TRUE);
+	g_slice_free (BtConnection, connection);
+}
+
+/* reads everything the socket has, up to the budget, then tells the owner;
+ * the connection has to be at the head of the read queue */
+static void
+bt_reactor_read (BtReactor *reactor, BtConnection *connection)
+{
+	GString *buffer = connection->buffer;
+	gsize total = 0;
+	BtConnectionEvent event = BT_CONNECTION_EVENT_DATA;
+	gboolean drained = FALSE;
+
+	if (connection->error) {
+		errno = connection->error;
+		event = BT_CONNECTION_EVENT_ERROR;
+		drained = TRUE;
+	}
+
+	while (!drained && total < BT_REACTOR_READ_BUDGET) {
+		gsize len = buffer->len;
+		gssize n;
+
+		g_string_set_size (buffer, len + BT_REACTOR_READ_SIZE);
+
+		n = read (connection->fd, buffer->str + len, BT_REACTOR_READ_SIZE);
+
+		g_string_truncate (buffer, len + MAX (n, 0));
+
+		if (n > 0) {
+			total += n;
+		} else if (n == 0) {
+			event = BT_CONNECTION_EVENT_CLOSED;
+			drained = TRUE;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			drained = TRUE;
+		} else if (errno != EINTR) {
+			event = BT_CONNECTION_EVENT_ERROR;
+			drained = TRUE;
+		}
+	}
+
+	reactor->stats.bytes_read += total;
+
+	/* with edge-triggered events there won't be another one until the socket
+	 * has been drained, so stay queued until it has */
+	if (drained)
+		bt_reactor_unqueue_read (reactor, connection);
+	else
+		g_queue_push_tail_link (&reactor->reads, g_queue_pop_head_link (&reactor->reads));
+
+	if (total > 0)
+		connection->func (connection, BT_CONNECTION_EVENT_DATA, connection->data);
+
+	if (event != BT_CONNECTION_EVENT_DATA && !connection->dead && connection->reactor == reactor) {
+		bt_reactor_unqueue_write (reactor, connection);
+		connection->func (connection, event, connection->data);
+	}
+}
+
+/* writes as much of the pending data as the socket takes */
+static void
+bt_reactor_write (BtReactor *reactor, BtConnection *connection)
+{
+	GString *out = connection->out;
+
+	while (connection->out_pos < out->len) {
+		gssize n;
+
+		n = send (connection->fd, out->str + connection->out_pos, out->len - connection->out_pos, BT_REACTOR_SEND_FLAGS);
+
+		if (n >= 0) {
+			connection->out_pos += n;
+			reactor->stats.bytes_written += n;
+			reactor->stats.writes++;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			/* wait until the socket says it's writable again */
+			connection->writable = FALSE;
+			bt_reactor_unqueue_write (reactor, connection);
+			return;
+		} else if (errno != EINTR) {
+			bt_reactor_unqueue_write (reactor, connection);
+			connection->func (connection, BT_CONNECTION_EVENT_ERROR, connection->data);
+			return;
+		}
+	}
+
+	g_string_truncate (out, 0);
+	connection->out_pos = 0;
+
+	bt_reactor_unqueue_write (reactor, connection);
+}
+
+/* handles the readiness of one socket as reported by epoll or poll */
+static void
+bt_reactor_handle_events (BtReactor *reactor, BtConnection *connection, gboolean in, gboolean out, gboolean error)
+{
+	/* it may have been closed or moved by a callback earlier in this batch */
+	if (connection->dead || connection->reactor != reactor)
+		return;
+
+	reactor->stats.events++;
+
+	if (connection->connecting && (out || error)) {
+		gint err = 0;
+		socklen_t len = sizeof (err);
+
+		connection->connecting = FALSE;
+
+		if (getsockopt (connection->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+			err = errno;
+
+		if (err != 0) {
+			connection->func (connection, BT_CONNECTION_EVENT_ERROR, connection->data);
+			return;
+		}
+
+		connection->func (connection, BT_CONNECTION_EVENT_CONNECTED, connection->data);
+
+		if (connection->dead || connection->reactor != reactor)
+			return;
+	}
+
+	if (out) {
+		connection->writable = TRUE;
+
+		if (connection->out_pos < connection->out->len)
+			bt_reactor_queue_write (reactor, connection);
+	}
+
+	if (in || error)
+		bt_reactor_queue_read (reactor, connection);
+}
+
+static gboolean
+bt_reactor_prepare (GSource *source, gint *timeout)
+{
+	BtReactor *reactor = (BtReactor *) source;
+
+#ifndef HAVE_EPOLL
+	guint i;
+
+	/* poll is level-triggered, so only ask about writing when we're waiting to */
+	for (i = 0; i < reactor->connections->len; i++) {
+		BtConnection *connection = g_ptr_array_index (reactor->connections, i);
+
+		connection->poll.events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+
+		if (connection->connecting || !connection->writable)
+			connection->poll.events |= G_IO_OUT;
+	}
+#endif
+
+	*timeout = -1;
+
+	return reactor->reads.length > 0 || reactor->writes.length > 0;
+}
+
+static gboolean
+bt_reactor_check (GSource *source)
+{
+	BtReactor *reactor = (BtReactor *) source;
+
+#ifdef HAVE_EPOLL
+	if (reactor->poll.revents)
+		return TRUE;
+#else
+	guint i;
+
+	for (i = 0; i < reactor->connections->len; i++)
+		if (((BtConnection *) g_ptr_array_index (reactor->connections, i))->poll.revents)
+			return TRUE;
+#endif
+
+	return reactor->reads.length > 0 || reactor->writes.length > 0;
+}
+
+static gboolean
+bt_reactor_dispatch (GSource *source, GSourceFunc callback G_GNUC_UNUSED, gpointer data G_GNUC_UNUSED)
+{
+	BtReactor *reactor = (BtReactor *) source;
+	guint i, n;
+
+	reactor->stats.wakeups++;
+	reactor->dispatching = TRUE;
+
+	/* collect the whole ready set first */
+#ifdef HAVE_EPOLL
+	if (reactor->poll.revents) {
+		struct epoll_event events[BT_REACTOR_MAX_EVENTS];
+		gint count;
+
+		count = epoll_wait (reactor->epoll_fd, events, BT_REACTOR_MAX_EVENTS, 0);
+
+		for (i = 0; count > 0 && i < (guint) count; i++)
+			bt_reactor_handle_events (reactor, (BtConnection *) events[i].data.ptr,
+			                          events[i].events & (EPOLLIN | EPOLLRDHUP),
+			                          events[i].events & EPOLLOUT,
+			                          events[i].events & (EPOLLERR | EPOLLHUP));
+
+		reactor->poll.revents = 0;
+	}
+#else
+	for (i = 0; i < reactor->connections->len; i++) {
+		BtConnection *connection = g_ptr_array_index (reactor->connections, i);
+		gushort revents = connection->poll.revents;
+
+		connection->poll.revents = 0;
+
+		if (revents)
+			bt_reactor_handle_events (reactor, connection, revents & G_IO_IN, revents & G_IO_OUT, revents & (G_IO_HUP | G_IO_ERR));
+	}
+#endif
+
+	/* read from every connection that is ready, once each */
+	for (n = reactor->reads.length; n > 0 && reactor->reads.length > 0; n--)
+		bt_reactor_read (reactor, (BtConnection *) g_queue_peek_head (&reactor->reads));
+
+	/* and write out everything that was sent while handling that, or since the
+	 * last wakeup, so each connection gets one write for all its messages */
+	while (reactor->writes.length > 0)
+		bt_reactor_write (reactor, (BtConnection *) g_queue_peek_head (&reactor->writes));
+
+	reactor->dispatching = FALSE;
+
+	g_slist_foreach (reactor->dead, (GFunc) bt_connection_free, NULL);
+	g_slist_free (reactor->dead);
+	reactor->dead = NULL;
+
+	return TRUE;
+}
+
+static void
+bt_reactor_finalize (GSource *source)
+{
+#ifdef HAVE_EPOLL
+	close (((BtReactor *) source)->epoll_fd);
+#else
+	g_ptr_array_free (((BtReactor *) source)->connections, TRUE);
+#endif
+}
+
+static GSourceFuncs bt_reactor_funcs = {
+	bt_reactor_prepare,
+	bt_reactor_check,
+	bt_reactor_dispatch,
+	bt_reactor_finalize,
+	NULL,
+	NULL
+};
+
+/**
+ * bt_reactor_new:
+ * @context: the main context to run in, or NULL for the default one
+ *
+ * Creates a reactor, which runs all of its connections from a single #GSource
+ * so that the main loop wakes up once for any number of ready sockets. Reads
+ * and writes are done with as few system calls as possible: reads drain the
+ * socket into the connection's buffer, and everything written to a connection
+ * between two wakeups is sent together. On Linux the sockets are watched with
+ * edge-triggered epoll, anywhere else with poll.
+ *
+ * Returns: the new reactor, to be freed with bt_reactor_free()
+ */
+BtReactor *
+bt_reactor_new (GMainContext *context)
+{
+	BtReactor *reactor;
+
+	reactor = (BtReactor *) g_source_new (&bt_reactor_funcs, sizeof (BtReactor));
+
+	g_queue_init (&reactor->reads);
+	g_queue_init (&reactor->writes);
+	reactor->dead = NULL;
+	reactor->dispatching = FALSE;
+	memset (&reactor->stats, 0, sizeof (BtReactorStats));
+
+#ifdef HAVE_EPOLL
+	reactor->epoll_fd = epoll_create (1024);
+
+	if (reactor->epoll_fd < 0)
+		g_error ("could not create epoll instance: %s", g_strerror (errno));
+
+	fcntl (reactor->epoll_fd, F_SETFD, FD_CLOEXEC);
+
+	reactor->poll.fd = reactor->epoll_fd;
+	reactor->poll.events = G_IO_IN;
+	reactor->poll.revents = 0;
+
+	g_source_add_poll ((GSource *) reactor, &reactor->poll);
+#else
+	reactor->connections = g_ptr_array_new ();
+#endif
+
+	g_source_set_can_recurse ((GSource *) reactor, FALSE);
+	g_source_attach ((GSource *) reactor, context);
+
+	return reactor;
+}
+
+/**
+ * bt_reactor_get_default:
+ *
+ * Gets the reactor for the default main context, creating it the first time.
+ * This also raises the limit on open files as far as it goes, since a client
+ * with thousands of peers needs more than the usual 1024.
+ *
+ * Returns: the default reactor
+ */
+BtReactor *
+bt_reactor_get_default ()
+{
+	if (G_UNLIKELY (bt_reactor_default == NULL)) {
+		struct rlimit limit;
+
+		if (getrlimit (RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+			limit.rlim_cur = limit.rlim_max;
+			setrlimit (RLIMIT_NOFILE, &limit);
+		}
+
+		bt_reactor_default = bt_reactor_new (NULL);
+	}
+
+	return bt_reactor_default;
+}
+
+/**
+ * bt_reactor_set_current:
+ * @reactor: the reactor, or NULL for the default one
+ *
+ * Sets the reactor that bt_reactor_get_current() returns on the calling
+ * thread. Network threads call this with their own reactor before running
+ * their main loop.
+ */
+void
+bt_reactor_set_current (BtReactor *reactor)
+{
+	g_static_private_set (&bt_reactor_current, reactor, NULL);
+}
+
+/**
+ * bt_reactor_get_current:
+ *
+ * Gets the reactor for connections made on the calling thread, which is the
+ * default reactor unless bt_reactor_set_current() was called on it.
+ *
+ * Returns: the reactor
+ */
+BtReactor *
+bt_reactor_get_current ()
+{
+	BtReactor *reactor = g_static_private_get (&bt_reactor_current);
+
+	return reactor ? reactor : bt_reactor_get_default ();
+}
+
+/**
+ * bt_reactor_get_context:
+ * @reactor: the reactor
+ *
+ * Gets the main context the reactor runs in. Anything that touches the
+ * reactor's connections from a main loop source should attach it here.
+ *
+ * Returns: the main context
+ */
+GMainContext *
+bt_reactor_get_context (BtReactor *reactor)
+{
+	g_return_val_if_fail (reactor != NULL, NULL);
+
+	return g_source_get_context ((GSource *) reactor);
+}
+
+/**
+ * bt_reactor_free:
+ * @reactor: the reactor
+ *
+ * Detaches the reactor from its main context and frees it. All of its
+ * connections have to be closed first.
+ */
+void
+bt_reactor_free (BtReactor *reactor)
+{
+	g_return_if_fail (reactor != NULL);
+	g_return_if_fail (reactor->stats.connections == 0);
+
+	if (reactor == bt_reactor_default)
+		bt_reactor_default = NULL;
+
+	g_source_destroy ((GSource *) reactor);
+	g_source_unref ((GSource *) reactor);
+}
+
+/**
+ * bt_reactor_get_stats:
+ * @reactor: the reactor
+ * @stats: return location for the counters
+ *
+ * Gets counters for what the reactor has been doing.
+ */
+void
+bt_reactor_get_stats (BtReactor *reactor, BtReactorStats *stats)
+{
+	g_return_if_fail (reactor != NULL);
+	g_return_if_fail (stats != NULL);
+
+	*stats = reactor->stats;
+}
+
+/* starts watching the connection's socket */
+static void
+bt_reactor_register (BtReactor *reactor, BtConnection *connection)
+{
+#ifdef HAVE_EPOLL
+	struct epoll_event event;
+
+	/* registered once for everything; edge-triggered events only arrive on
+	 * changes, so there's never a need to modify this */
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.ptr = connection;
+
+	if (epoll_ctl (reactor->epoll_fd, EPOLL_CTL_ADD, connection->fd, &event) != 0 && connection->error == 0)
+		connection->error = errno;
+#else
+	connection->poll.fd = connection->fd;
+	connection->poll.events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+	connection->poll.revents = 0;
+	connection->index = reactor->connections->len;
+
+	g_ptr_array_add (reactor->connections, connection);
+	g_source_add_poll ((GSource *) reactor, &connection->poll);
+#endif
+}
+
+static void
+bt_reactor_unregister (BtReactor *reactor, BtConnection *connection)
+{
+#ifdef HAVE_EPOLL
+	/* closing alone wouldn't do if the descriptor was ever duplicated */
+	epoll_ctl (reactor->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+#else
+	BtConnection *last;
+
+	g_source_remove_poll ((GSource *) reactor, &connection->poll);
+
+	last = g_ptr_array_index (reactor->connections, reactor->connections->len - 1);
+	last->index = connection->index;
+	g_ptr_array_remove_index_fast (reactor->connections, connection->index);
+#endif
+}
+
+static BtConnection *
+bt_connection_new (BtReactor *reactor, gint fd, GString *buffer, BtConnectionFunc func, gpointer data)
+{
+	BtConnection *connection;
+
+	connection = g_slice_new0 (BtConnection);
+	connection->reactor = reactor;
+	connection->fd = fd;
+	connection->buffer = buffer;
+	connection->out = g_string_sized_new (256);
+	connection->func = func;
+	connection->data = data;
+
+	reactor->stats.connections++;
+
+	if (fd < 0)
+		return connection;
+
+	fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+	fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+	bt_reactor_register (reactor, connection);
+
+	return connection;
+}
+
+/**
+ * bt_connection_new_socket:
+ * @reactor: the reactor
+ * @socket: an accepted socket
+ * @buffer: the buffer to append received data to
+ * @func: the function to call for events on the connection
+ * @data: user data for @func
+ *
+ * Creates a connection for an incoming socket. The connection uses its own
+ * copy of the socket's file descriptor, so @socket can be unreferenced.
+ *
+ * Returns: the new connection
+ */
+BtConnection *
+bt_connection_new_socket (BtReactor *reactor, GTcpSocket *socket, GString *buffer, BtConnectionFunc func, gpointer data)
+{
+	BtConnection *connection;
+	gint fd;
+
+	g_return_val_if_fail (reactor != NULL, NULL);
+	g_return_val_if_fail (socket != NULL, NULL);
+	g_return_val_if_fail (buffer != NULL, NULL);
+	g_return_val_if_fail (func != NULL, NULL);
+
+	fd = dup (g_io_channel_unix_get_fd (gnet_tcp_socket_get_io_channel (socket)));
+
+	connection = bt_connection_new (reactor, fd, buffer, func, data);
+
+	if (fd < 0)
+		connection->error = errno;
+
+	connection->writable = TRUE;
+
+	/* there may be data waiting already */
+	bt_reactor_queue_read (reactor, connection);
+
+	return connection;
+}
+
+/**
+ * bt_connection_new_connect:
+ * @reactor: the reactor
+ * @address: the address to connect to
+ * @buffer: the buffer to append received data to
+ * @func: the function to call for events on the connection
+ * @data: user data for @func
+ *
+ * Starts connecting to @address. @func is called with
+ * %BT_CONNECTION_EVENT_CONNECTED once the connection is established, or with
+ * %BT_CONNECTION_EVENT_ERROR if it fails. Data can be written before that and
+ * is sent once connected.
+ *
+ * Returns: the new connection
+ */
+BtConnection *
+bt_connection_new_connect (BtReactor *reactor, const BtAddress *address, GString *buffer, BtConnectionFunc func, gpointer data)
+{
+	BtConnection *connection;
+	struct sockaddr_storage sa;
+	socklen_t sa_len;
+	gint fd, error = 0;
+
+	g_return_val_if_fail (reactor != NULL, NULL);
+	g_return_val_if_fail (address != NULL, NULL);
+	g_return_val_if_fail (buffer != NULL, NULL);
+	g_return_val_if_fail (func != NULL, NULL);
+
+	sa_len = bt_address_to_sockaddr (address, &sa);
+
+	fd = socket (sa.ss_family, SOCK_STREAM, 0);
+
+	if (fd < 0)
+		error = errno;
+
+	connection = bt_connection_new (reactor, fd, buffer, func, data);
+	connection->connecting = TRUE;
+
+	if (fd >= 0 && connect (fd, (struct sockaddr *) &sa, sa_len) != 0 && errno != EINPROGRESS)
+		error = errno;
+
+	/* failures are reported from the reactor like any other, never from here */
+	if (error != 0) {
+		connection->connecting = FALSE;
+		connection->error = error;
+		bt_reactor_queue_read (reactor, connection);
+	}
+
+	return connection;
+}
+
+/**
+ * bt_connection_write:
+ * @connection: the connection
+ * @buf: the data
+ * @len: the length of @buf
+ *
+ * Queues data to be sent. Everything written to a connection before the
+ * reactor next runs goes out in one write.
+ */
+void
+bt_connection_write (BtConnection *connection, const gchar *buf, gsize len)
+{
+	g_return_if_fail (connection != NULL);
+	g_return_if_fail (buf != NULL || len == 0);
+
+	if (connection->dead || len == 0)
+		return;
+
+	g_string_append_len (connection->out, buf, len);
+
+	if (connection->writable && !connection->connecting && connection->reactor != NULL)
+		bt_reactor_queue_write (connection->reactor, connection);
+}
+
+/**
+ * bt_connection_get_pending:
+ * @connection: the connection
+ *
+ * Gets the amount of data that was written to the connection but hasn't been
+ * sent yet, to tell whether the peer is keeping up.
+ *
+ * Returns: the number of bytes waiting to be sent
+ */
+gsize
+bt_connection_get_pending (BtConnection *connection)
+{
+	g_return_val_if_fail (connection != NULL, 0);
+
+	return connection->out->len - connection->out_pos;
+}
+
+/**
+ * bt_connection_detach:
+ * @connection: the connection
+ *
+ * Takes the connection out of its reactor without closing it, so that it can
+ * be given to a reactor on another thread with bt_connection_attach(). Data
+ * that was received or written stays where it is. Nothing happens on a
+ * detached connection until it is attached again, but it can be closed.
+ */
+void
+bt_connection_detach (BtConnection *connection)
+{
+	BtReactor *reactor;
+
+	g_return_if_fail (connection != NULL);
+	g_return_if_fail (connection->reactor != NULL);
+	g_return_if_fail (!connection->dead);
+
+	reactor = connection->reactor;
+
+	bt_reactor_unqueue_read (reactor, connection);
+	bt_reactor_unqueue_write (reactor, connection);
+
+	if (connection->fd >= 0)
+		bt_reactor_unregister (reactor, connection);
+
+	reactor->stats.connections--;
+	connection->reactor = NULL;
+}
+
+/**
+ * bt_connection_attach:
+ * @connection: a detached connection
+ * @reactor: the reactor to run it from
+ *
+ * Gives a detached connection to @reactor, which has to be called from the
+ * thread that runs @reactor. Events that arrived while it was detached are
+ * picked up from there.
+ */
+void
+bt_connection_attach (BtConnection *connection, BtReactor *reactor)
+{
+	g_return_if_fail (connection != NULL);
+	g_return_if_fail (connection->reactor == NULL);
+	g_return_if_fail (reactor != NULL);
+
+	connection->reactor = reactor;
+	reactor->stats.connections++;
+
+	if (connection->fd >= 0)
+		bt_reactor_register (reactor, connection);
+
+	/* edge-triggered events that came in before this are lost, so look */
+	bt_reactor_queue_read (reactor, connection);
+
+	if (connection->writable && !connection->connecting && connection->out_pos < connection->out->len)
+		bt_reactor_queue_write (reactor, connection);
+}
+
+/**
+ * bt_connection_close:
+ * @connection: the connection
+ *
+ * Closes the connection and frees it. Data that hasn't been sent yet is
+ * dropped.
+ */
+void
+bt_connection_close (BtConnection *connection)
+{
+	BtReactor *reactor;
+
+	g_return_if_fail (connection != NULL);
+	g_return_if_fail (!connection->dead);
+
+	reactor = connection->reactor;
+
+	connection->dead = TRUE;
+
+	/* a detached connection belongs to no reactor */
+	if (reactor == NULL) {
+		if (connection->fd >= 0)
+			close (connection->fd);
+
+		bt_connection_free (connection);
+		return;
+	}
+
+	bt_reactor_unqueue_read (reactor, connection);
+	bt_reactor_unqueue_write (reactor, connection);
+
+	if (connection->fd >= 0) {
+		bt_reactor_unregister (reactor, connection);
+		close (connection->fd);
+	}
+
+	reactor->stats.connections--;
+
+	/* the dispatch loop may still look at it */
+	if (reactor->dispatching)
+		reactor->dead = g_slist_prepend (reactor->dead, connection);
+	else
+		bt_connection_free (connection);
+}
@@ -0,0 +1,113 @@
+/**
+ * bt-reactor.h
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __BT_REACTOR_H__
+#define __BT_REACTOR_H__
+
+#include <glib.h>
+#include <gnet.h>
+
+#include "bt-address.h"
+
+G_BEGIN_DECLS
+
+typedef struct _BtReactor    BtReactor;
+typedef struct _BtConnection BtConnection;
+
+/**
+ * BtConnectionEvent:
+ * @BT_CONNECTION_EVENT_CONNECTED: an outgoing connection was established
+ * @BT_CONNECTION_EVENT_DATA: data was appended to the receive buffer
+ * @BT_CONNECTION_EVENT_CLOSED: the remote end closed the connection
+ * @BT_CONNECTION_EVENT_ERROR: the connection failed
+ *
+ * What happened on a #BtConnection.
+ */
+typedef enum {
+	BT_CONNECTION_EVENT_CONNECTED,
+	BT_CONNECTION_EVENT_DATA,
+	BT_CONNECTION_EVENT_CLOSED,
+	BT_CONNECTION_EVENT_ERROR
+} BtConnectionEvent;
+
+/**
+ * BtConnectionFunc:
+ * @connection: the connection
+ * @event: what happened
+ * @data: user data given when the connection was created
+ *
+ * Called by the reactor for events on a connection. After a CLOSED or ERROR
+ * event nothing more will be read or written, and the connection should be
+ * closed with bt_connection_close(). It is safe to close it from here.
+ */
+typedef void (*BtConnectionFunc) (BtConnection *connection, BtConnectionEvent event, gpointer data);
+
+/**
+ * BtReactorStats:
+ * @connections: number of open connections
+ * @wakeups: number of times the reactor was dispatched
+ * @events: number of socket events handled
+ * @bytes_read: bytes read from all connections
+ * @bytes_written: bytes written to all connections
+ * @writes: number of write calls, which is less than the number of messages
+ *   sent as long as writes are being batched
+ *
+ * Counters describing what the reactor has been doing.
+ */
+typedef struct {
+	guint   connections;
+	guint64 wakeups;
+	guint64 events;
+	guint64 bytes_read;
+	guint64 bytes_written;
+	guint64 writes;
+} BtReactorStats;
+
+BtReactor    *bt_reactor_new (GMainContext *context);
+
+BtReactor    *bt_reactor_get_default ();
+
+void          bt_reactor_set_current (BtReactor *reactor);
+
+BtReactor    *bt_reactor_get_current ();
+
+GMainContext *bt_reactor_get_context (BtReactor *reactor);
+
+void          bt_reactor_free (BtReactor *reactor);
+
+void          bt_reactor_get_stats (BtReactor *reactor, BtReactorStats *stats);
+
+BtConnection *bt_connection_new_socket (BtReactor *reactor, GTcpSocket *socket, GString *buffer, BtConnectionFunc func, gpointer data);
+
+BtConnection *bt_connection_new_connect (BtReactor *reactor, const BtAddress *address, GString *buffer, BtConnectionFunc func, gpointer data);
+
+void          bt_connection_write (BtConnection *connection, const gchar *buf, gsize len);
+
+gsize         bt_connection_get_pending (BtConnection *connection);
+
+void          bt_connection_detach (BtConnection *connection);
+
+void          bt_connection_attach (BtConnection *connection, BtReactor *reactor);
+
+void          bt_connection_close (BtConnection *connection);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,298 @@
+/**
+ * bt-resolver.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include "bt-resolver.h"
+
+/* lookups running at once; each one blocks its thread for as long as the
+ * name server takes */
+#define BT_RESOLVER_MAX_THREADS 4
+
+/* names to remember; the cache starts over once it has this many */
+#define BT_RESOLVER_MAX_CACHE 4096
+
+typedef struct {
+	BtAddress       address;
+	GMainContext   *context;
+	BtResolverFunc  func;
+	gpointer        data;
+	gchar          *hostname;
+
+	/* set instead of @func for lookups by name, which fill in @address */
+	BtResolverNameFunc name_func;
+	gboolean        found;
+} BtResolverRequest;
+
+G_LOCK_DEFINE_STATIC (bt_resolver);
+
+static GThreadPool *bt_resolver_pool = NULL;
+
+/* address bytes in hex -> the name, or "" for addresses that have none */
+static GHashTable *bt_resolver_cache = NULL;
+
+/* names only depend on the address, not the port */
+static gchar *
+bt_resolver_cache_key (const BtAddress *address)
+{
+	static const gchar hex[] = "0123456789abcdef";
+	const guint8 *bytes = address->bytes;
+	gint len = address->length;
+	gchar *key;
+	gint i;
+
+	key = g_new (gchar, len * 2 + 1);
+
+	for (i = 0; i < len; i++) {
+		key[i * 2] = hex[bytes[i] >> 4];
+		key[i * 2 + 1] = hex[bytes[i] & 15];
+	}
+
+	key[len * 2] = '\0';
+
+	return key;
+}
+
+static gboolean
+bt_resolver_deliver (gpointer data)
+{
+	BtResolverRequest *request = (BtResolverRequest *) data;
+
+	if (request->name_func != NULL)
+		request->name_func (request->hostname, request->found ? &request->address : NULL, request->data);
+	else
+		request->func (&request->address, request->hostname, request->data);
+
+	return FALSE;
+}
+
+static void
+bt_resolver_request_free (gpointer data)
+{
+	BtResolverRequest *request = (BtResolverRequest *) data;
+
+	g_main_context_unref (request->context);
+	g_free (request->hostname);
+	g_slice_free (BtResolverRequest, request);
+}
+
+/* finds the address of a name, preferring IPv4 since that's what trackers
+ * and the DHT speak */
+static void
+bt_resolver_find_address (BtResolverRequest *request)
+{
+	struct addrinfo hints, *result, *ai;
+	guint16 port = request->address.port;
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	if (getaddrinfo (request->hostname, NULL, &hints, &result) != 0)
+		return;
+
+	for (ai = result; ai != NULL && ai->ai_family != AF_INET; ai = ai->ai_next)
+		;
+
+	if (ai == NULL)
+		ai = result;
+
+	if (ai != NULL && ai->ai_addrlen <= sizeof (struct sockaddr_storage)) {
+		struct sockaddr_storage sa;
+
+		memset (&sa, 0, sizeof (sa));
+		memcpy (&sa, ai->ai_addr, ai->ai_addrlen);
+
+		if (bt_address_set_sockaddr (&request->address, &sa)) {
+			request->address.port = port;
+			request->found = TRUE;
+		}
+	}
+
+	freeaddrinfo (result);
+}
+
+/* runs on a pool thread */
+static void
+bt_resolver_worker (gpointer data, gpointer user_data G_GNUC_UNUSED)
+{
+	BtResolverRequest *request = (BtResolverRequest *) data;
+	struct sockaddr_storage sa;
+	socklen_t sa_len;
+	gchar host[NI_MAXHOST];
+	GSource *source;
+	gchar *key;
+
+	if (request->name_func != NULL) {
+		bt_resolver_find_address (request);
+
+		source = g_idle_source_new ();
+		g_source_set_callback (source, bt_resolver_deliver, request, bt_resolver_request_free);
+		g_source_attach (source, request->context);
+		g_source_unref (source);
+		return;
+	}
+
+	sa_len = bt_address_to_sockaddr (&request->address, &sa);
+
+	if (getnameinfo ((struct sockaddr *) &sa, sa_len, host, sizeof (host), NULL, 0, NI_NAMEREQD) == 0)
+		request->hostname = g_strdup (host);
+
+	key = bt_resolver_cache_key (&request->address);
+
+	G_LOCK (bt_resolver);
+
+	if (g_hash_table_size (bt_resolver_cache) >= BT_RESOLVER_MAX_CACHE)
+		g_hash_table_remove_all (bt_resolver_cache);
+
+	g_hash_table_replace (bt_resolver_cache, key, g_strdup (request->hostname ? request->hostname : ""));
+
+	G_UNLOCK (bt_resolver);
+
+	source = g_idle_source_new ();
+	g_source_set_callback (source, bt_resolver_deliver, request, bt_resolver_request_free);
+	g_source_attach (source, request->context);
+	g_source_unref (source);
+}
+
+/**
+ * bt_resolver_lookup_cached:
+ * @address: an address
+ * @hostname: return location for the name, to be freed with g_free (), which
+ *   is set to NULL if the address has no name
+ *
+ * Looks for the name of an address among those that were looked up before.
+ * This never blocks.
+ *
+ * Returns: TRUE if the address was looked up before
+ */
+gboolean
+bt_resolver_lookup_cached (const BtAddress *address, gchar **hostname)
+{
+	const gchar *name = NULL;
+	gchar *key;
+
+	g_return_val_if_fail (address != NULL, FALSE);
+	g_return_val_if_fail (hostname != NULL, FALSE);
+
+	key = bt_resolver_cache_key (address);
+
+	G_LOCK (bt_resolver);
+
+	if (bt_resolver_cache != NULL)
+		name = g_hash_table_lookup (bt_resolver_cache, key);
+
+	*hostname = name && *name ? g_strdup (name) : NULL;
+
+	G_UNLOCK (bt_resolver);
+
+	g_free (key);
+
+	return name != NULL;
+}
+
+/* hands a request to the threads, starting them the first time */
+static void
+bt_resolver_push (BtResolverRequest *request)
+{
+	G_LOCK (bt_resolver);
+
+	if (G_UNLIKELY (bt_resolver_pool == NULL)) {
+		bt_resolver_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+		bt_resolver_pool = g_thread_pool_new (bt_resolver_worker, NULL, BT_RESOLVER_MAX_THREADS, FALSE, NULL);
+	}
+
+	G_UNLOCK (bt_resolver);
+
+	g_thread_pool_push (bt_resolver_pool, request, NULL);
+}
+
+/**
+ * bt_resolver_lookup:
+ * @address: the address to look up
+ * @context: the main context to call @func in, or NULL for the default one
+ * @func: the function to call with the result
+ * @data: user data for @func
+ *
+ * Finds the name of an address with a reverse lookup, on one of a few threads
+ * kept for that so a slow name server never holds up a main loop. Results are
+ * cached. @func is always called from @context, never from here, even if the
+ * name was cached, so @data has to stay valid until then.
+ */
+void
+bt_resolver_lookup (const BtAddress *address, GMainContext *context, BtResolverFunc func, gpointer data)
+{
+	BtResolverRequest *request;
+	GSource *source;
+
+	g_return_if_fail (address != NULL);
+	g_return_if_fail (func != NULL);
+
+	request = g_slice_new0 (BtResolverRequest);
+	request->address = *address;
+	request->context = g_main_context_ref (context ? context : g_main_context_default ());
+	request->func = func;
+	request->data = data;
+
+	if (bt_resolver_lookup_cached (address, &request->hostname)) {
+		source = g_idle_source_new ();
+		g_source_set_callback (source, bt_resolver_deliver, request, bt_resolver_request_free);
+		g_source_attach (source, request->context);
+		g_source_unref (source);
+		return;
+	}
+
+	bt_resolver_push (request);
+}
+
+/**
+ * bt_resolver_lookup_name:
+ * @hostname: the name to look up
+ * @port: the port to give the address
+ * @context: the main context to call @func in, or NULL for the default one
+ * @func: the function to call with the result
+ * @data: user data for @func
+ *
+ * Finds the address of a name, like that of a tracker, on the same threads as
+ * bt_resolver_lookup(). An IPv4 address is given if there is one. Results
+ * aren't cached, so callers that look up the same name often should keep
+ * them. @func is always called from @context.
+ */
+void
+bt_resolver_lookup_name (const gchar *hostname, guint16 port, GMainContext *context, BtResolverNameFunc func, gpointer data)
+{
+	BtResolverRequest *request;
+
+	g_return_if_fail (hostname != NULL);
+	g_return_if_fail (func != NULL);
+
+	request = g_slice_new0 (BtResolverRequest);
+	request->address.port = port;
+	request->context = g_main_context_ref (context ? context : g_main_context_default ());
+	request->name_func = func;
+	request->data = data;
+	request->hostname = g_strdup (hostname);
+
+	bt_resolver_push (request);
+}
@@ -0,0 +1,58 @@
+/**
+ * bt-resolver.h
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __BT_RESOLVER_H__
+#define __BT_RESOLVER_H__
+
+#include <glib.h>
+#include "bt-address.h"
+
+G_BEGIN_DECLS
+
+/**
+ * BtResolverFunc:
+ * @address: the address that was looked up
+ * @hostname: its name, or NULL if it has none
+ * @data: user data given to bt_resolver_lookup()
+ *
+ * Called with the result of a reverse lookup.
+ */
+typedef void (*BtResolverFunc) (const BtAddress *address, const gchar *hostname, gpointer data);
+
+/**
+ * BtResolverNameFunc:
+ * @hostname: the name that was looked up
+ * @address: its address with the port that was asked for, or NULL if it
+ *   couldn't be found
+ * @data: user data given to bt_resolver_lookup_name()
+ *
+ * Called with the result of a lookup by name.
+ */
+typedef void (*BtResolverNameFunc) (const gchar *hostname, const BtAddress *address, gpointer data);
+
+void     bt_resolver_lookup (const BtAddress *address, GMainContext *context, BtResolverFunc func, gpointer data);
+
+gboolean bt_resolver_lookup_cached (const BtAddress *address, gchar **hostname);
+
+void     bt_resolver_lookup_name (const gchar *hostname, guint16 port, GMainContext *context, BtResolverNameFunc func, gpointer data);
+
+G_END_DECLS
+
+#endif
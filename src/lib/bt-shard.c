@@ -0,0 +1,410 @@
+/**
+ * bt-shard.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "bt-shard.h"
+
+/* main loop iterations a stopped shard gets to finish what it was doing */
+#define BT_SHARD_FINAL_ITERATIONS 16
+
+/* a function waiting to be run on the shard, in its queue */
+typedef struct _BtShardCall BtShardCall;
+
+struct _BtShardCall {
+	BtShardCall * volatile next;
+	BtShardFunc            func;
+	gpointer               data;
+};
+
+typedef struct {
+	GSource  source;
+	BtShard *shard;
+} BtShardSource;
+
+/* a call that another thread is waiting on */
+typedef struct {
+	BtShardFunc  func;
+	gpointer     data;
+	GMutex      *mutex;
+	GCond       *cond;
+	gboolean     done;
+} BtShardWait;
+
+struct _BtShard {
+	guint          index;
+
+	GThread       *thread;
+	GMainContext  *context;
+	GMainLoop     *loop;
+	BtReactor     *reactor;
+	GSource       *source;
+
+	/* calls from other threads, in a lock-free queue with any number of
+	 * producers and the shard's thread as the only consumer. Producers swap
+	 * themselves in at the head, the consumer takes from the tail, and the
+	 * stub keeps the queue from ever being empty. */
+	BtShardCall * volatile head;
+	BtShardCall           *tail;
+	BtShardCall            stub;
+
+	/* calls pushed but not yet run; the thread is woken when this leaves zero */
+	volatile gint          pending;
+};
+
+static void
+bt_shard_push (BtShard *shard, BtShardCall *call)
+{
+	BtShardCall *prev;
+
+	call->next = NULL;
+
+	do {
+		prev = g_atomic_pointer_get ((volatile gpointer *) &shard->head);
+	} while (!g_atomic_pointer_compare_and_exchange ((volatile gpointer *) &shard->head, prev, call));
+
+	/* between the swap and this, the consumer sees the queue as not quite
+	 * linked up yet and waits for the next round */
+	g_atomic_pointer_set ((volatile gpointer *) &prev->next, call);
+}
+
+static BtShardCall *
+bt_shard_pop (BtShard *shard)
+{
+	BtShardCall *tail = shard->tail;
+	BtShardCall *next = g_atomic_pointer_get ((volatile gpointer *) &tail->next);
+
+	if (tail == &shard->stub) {
+		if (next == NULL)
+			return NULL;
+
+		shard->tail = next;
+		tail = next;
+		next = g_atomic_pointer_get ((volatile gpointer *) &next->next);
+	}
+
+	if (next != NULL) {
+		shard->tail = next;
+		return tail;
+	}
+
+	/* a push is halfway done */
+	if (tail != g_atomic_pointer_get ((volatile gpointer *) &shard->head))
+		return NULL;
+
+	/* tail is the last call; put the stub behind it so it can be taken */
+	bt_shard_push (shard, &shard->stub);
+
+	next = g_atomic_pointer_get ((volatile gpointer *) &tail->next);
+
+	if (next != NULL) {
+		shard->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+static gboolean
+bt_shard_source_prepare (GSource *source, gint *timeout)
+{
+	BtShard *shard = ((BtShardSource *) source)->shard;
+
+	*timeout = -1;
+
+	return g_atomic_int_get (&shard->pending) > 0;
+}
+
+static gboolean
+bt_shard_source_check (GSource *source)
+{
+	BtShard *shard = ((BtShardSource *) source)->shard;
+
+	return g_atomic_int_get (&shard->pending) > 0;
+}
+
+static gboolean
+bt_shard_source_dispatch (GSource *source, GSourceFunc callback G_GNUC_UNUSED, gpointer data G_GNUC_UNUSED)
+{
+	BtShard *shard = ((BtShardSource *) source)->shard;
+	BtShardCall *call;
+	gint count = 0;
+
+	while ((call = bt_shard_pop (shard)) != NULL) {
+		call->func (call->data);
+		g_slice_free (BtShardCall, call);
+		count++;
+	}
+
+	g_atomic_int_add (&shard->pending, -count);
+
+	return TRUE;
+}
+
+static GSourceFuncs bt_shard_source_funcs = {
+	bt_shard_source_prepare,
+	bt_shard_source_check,
+	bt_shard_source_dispatch,
+	NULL,
+	NULL,
+	NULL
+};
+
+static gpointer
+bt_shard_thread (gpointer data)
+{
+	BtShard *shard = (BtShard *) data;
+
+	/* peers created from here connect through this shard's reactor */
+	bt_reactor_set_current (shard->reactor);
+
+	g_main_loop_run (shard->loop);
+
+	return NULL;
+}
+
+/**
+ * bt_shard_new:
+ * @index: the number of this shard, for debugging
+ *
+ * Starts a network thread with its own main context and #BtReactor. Torrents
+ * that are assigned to the shard have all of their peers run from it.
+ *
+ * Returns: the new shard, to be stopped with bt_shard_stop() and then freed
+ *   with bt_shard_free()
+ */
+BtShard *
+bt_shard_new (guint index)
+{
+	BtShard *shard;
+	GError *error = NULL;
+
+	shard = g_new0 (BtShard, 1);
+	shard->index = index;
+
+	shard->stub.next = NULL;
+	shard->head = &shard->stub;
+	shard->tail = &shard->stub;
+	shard->pending = 0;
+
+	shard->context = g_main_context_new ();
+	shard->loop = g_main_loop_new (shard->context, FALSE);
+	shard->reactor = bt_reactor_new (shard->context);
+
+	shard->source = g_source_new (&bt_shard_source_funcs, sizeof (BtShardSource));
+	((BtShardSource *) shard->source)->shard = shard;
+
+	/* run calls from other threads before socket events */
+	g_source_set_priority (shard->source, G_PRIORITY_HIGH);
+	g_source_attach (shard->source, shard->context);
+
+	shard->thread = g_thread_create (bt_shard_thread, shard, TRUE, &error);
+
+	if (shard->thread == NULL)
+		g_error ("could not start network thread: %s", error->message);
+
+	return shard;
+}
+
+static void
+bt_shard_quit (gpointer data)
+{
+	g_main_loop_quit (((BtShard *) data)->loop);
+}
+
+/**
+ * bt_shard_stop:
+ * @shard: the shard
+ *
+ * Stops the shard's thread and waits for it to finish. Calls that were made
+ * before this one still run first, since the calls are run in order; those
+ * that other threads make after it may be dropped. Its connections stay open
+ * until they are closed, which from then on can be done from any thread.
+ */
+void
+bt_shard_stop (BtShard *shard)
+{
+	g_return_if_fail (shard != NULL);
+
+	if (shard->thread == NULL)
+		return;
+
+	bt_shard_invoke (shard, bt_shard_quit, shard);
+
+	g_thread_join (shard->thread);
+	shard->thread = NULL;
+}
+
+/**
+ * bt_shard_free:
+ * @shard: the shard
+ *
+ * Frees a stopped shard. Sources that were still waiting to run, like peers
+ * that were being disconnected, are given a last chance to finish here.
+ */
+void
+bt_shard_free (BtShard *shard)
+{
+	BtShardCall *call;
+	BtReactorStats stats;
+	guint i;
+
+	g_return_if_fail (shard != NULL);
+	g_return_if_fail (shard->thread == NULL);
+
+	while ((call = bt_shard_pop (shard)) != NULL)
+		g_slice_free (BtShardCall, call);
+
+	g_source_destroy (shard->source);
+	g_source_unref (shard->source);
+
+	for (i = 0; i < BT_SHARD_FINAL_ITERATIONS && g_main_context_pending (shard->context); i++)
+		g_main_context_iteration (shard->context, FALSE);
+
+	bt_reactor_get_stats (shard->reactor, &stats);
+
+	/* freeing the reactor now would leave whoever owns them with dangling
+	 * connections, so it has to stay */
+	if (stats.connections > 0) {
+		g_warning ("network thread %u still has %u connections", shard->index, stats.connections);
+		g_free (shard);
+		return;
+	}
+
+	bt_reactor_free (shard->reactor);
+
+	g_main_loop_unref (shard->loop);
+	g_main_context_unref (shard->context);
+
+	g_free (shard);
+}
+
+/**
+ * bt_shard_invoke:
+ * @shard: the shard
+ * @func: the function to run
+ * @data: user data for @func
+ *
+ * Runs @func on the shard's thread, which is the only place where the peers
+ * of its torrents may be touched. This can be called from any thread and
+ * never blocks; calls from one thread run in the order they were made.
+ */
+void
+bt_shard_invoke (BtShard *shard, BtShardFunc func, gpointer data)
+{
+	BtShardCall *call;
+
+	g_return_if_fail (shard != NULL);
+	g_return_if_fail (func != NULL);
+
+	call = g_slice_new (BtShardCall);
+	call->func = func;
+	call->data = data;
+
+	bt_shard_push (shard, call);
+
+	/* only the first call since the queue was last drained needs a wakeup */
+	if (g_atomic_int_exchange_and_add (&shard->pending, 1) == 0)
+		g_main_context_wakeup (shard->context);
+}
+
+static void
+bt_shard_run_and_signal (gpointer data)
+{
+	BtShardWait *wait = (BtShardWait *) data;
+
+	wait->func (wait->data);
+
+	g_mutex_lock (wait->mutex);
+	wait->done = TRUE;
+	g_cond_signal (wait->cond);
+	g_mutex_unlock (wait->mutex);
+}
+
+/**
+ * bt_shard_invoke_and_wait:
+ * @shard: the shard
+ * @func: the function to run
+ * @data: user data for @func
+ *
+ * Runs @func on the shard's thread like bt_shard_invoke(), and waits for it
+ * to have run. When called from the shard's own thread, or once the shard is
+ * stopped and nothing else can touch its peers, @func is run right away.
+ */
+void
+bt_shard_invoke_and_wait (BtShard *shard, BtShardFunc func, gpointer data)
+{
+	BtShardWait wait;
+
+	g_return_if_fail (shard != NULL);
+	g_return_if_fail (func != NULL);
+
+	if (shard->thread == NULL || shard->thread == g_thread_self ()) {
+		func (data);
+		return;
+	}
+
+	wait.func = func;
+	wait.data = data;
+	wait.mutex = g_mutex_new ();
+	wait.cond = g_cond_new ();
+	wait.done = FALSE;
+
+	bt_shard_invoke (shard, bt_shard_run_and_signal, &wait);
+
+	g_mutex_lock (wait.mutex);
+
+	while (!wait.done)
+		g_cond_wait (wait.cond, wait.mutex);
+
+	g_mutex_unlock (wait.mutex);
+
+	g_cond_free (wait.cond);
+	g_mutex_free (wait.mutex);
+}
+
+/**
+ * bt_shard_get_index:
+ * @shard: the shard
+ *
+ * Returns: the index the shard was created with
+ */
+guint
+bt_shard_get_index (BtShard *shard)
+{
+	g_return_val_if_fail (shard != NULL, 0);
+
+	return shard->index;
+}
+
+/**
+ * bt_shard_get_reactor:
+ * @shard: the shard
+ *
+ * Gets the reactor that runs the shard's connections. It may only be used
+ * from the shard's thread.
+ *
+ * Returns: the reactor
+ */
+BtReactor *
+bt_shard_get_reactor (BtShard *shard)
+{
+	g_return_val_if_fail (shard != NULL, NULL);
+
+	return shard->reactor;
+}
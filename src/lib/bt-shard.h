@@ -0,0 +1,56 @@
+/**
+ * bt-shard.h
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __BT_SHARD_H__
+#define __BT_SHARD_H__
+
+#include <glib.h>
+
+#include "bt-reactor.h"
+
+G_BEGIN_DECLS
+
+typedef struct _BtShard BtShard;
+
+/**
+ * BtShardFunc:
+ * @data: user data given to bt_shard_invoke()
+ *
+ * A function to run on a shard's thread.
+ */
+typedef void (*BtShardFunc) (gpointer data);
+
+BtShard      *bt_shard_new (guint index);
+
+void          bt_shard_stop (BtShard *shard);
+
+void          bt_shard_free (BtShard *shard);
+
+void          bt_shard_invoke (BtShard *shard, BtShardFunc func, gpointer data);
+
+void          bt_shard_invoke_and_wait (BtShard *shard, BtShardFunc func, gpointer data);
+
+guint         bt_shard_get_index (BtShard *shard);
+
+BtReactor    *bt_shard_get_reactor (BtShard *shard);
+
+G_END_DECLS
+
+#endif
@@ -18,19 +18,55 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include <gnet.h>
 
 #include "bt-torrent.h"
+#include "bt-bitfield.h"
+#include "bt-peer-protocol.h"
 #include "bt-bencode.h"
 #include "bt-manager.h"
 #include "bt-utils.h"
+#include "sha1.h"
 
 #define BT_TORRENT_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), BT_TYPE_TORRENT, BtTorrentPrivate))
 
+/* the largest piece length taken, whole pieces being cached and hashed at
+ * once; torrents in the wild stay well below it */
+#define BT_TORRENT_MAX_PIECE_LENGTH (64 * 1024 * 1024)
+
+/* tracker responses bigger than this are rejected while they're still arriving */
+#define BT_TORRENT_MAX_TRACKER_RESPONSE (1024 * 1024)
+
+/* peers to be connected to at once, unless set otherwise */
+#define BT_TORRENT_DEFAULT_MAX_PEERS 50
+
+/* seconds between tries to fill free peer slots while candidates are waiting */
+#define BT_TORRENT_REFILL_INTERVAL 5
+
+/* seconds before connecting to a candidate again, doubled for each failure */
+#define BT_TORRENT_RECONNECT_DELAY 30
+
+/* candidates that fail this many times in a row are forgotten */
+#define BT_TORRENT_MAX_CANDIDATE_FAILURES 4
+
+/* addresses to remember per torrent; more than that are ignored until some
+ * have been forgotten */
+#define BT_TORRENT_MAX_CANDIDATES 4096
+
+/* peer bitfields to allocate at a time */
+#define BT_TORRENT_BITFIELD_BLOCK 64
+
+/* seconds between looking for peers in the DHT, which is also how often we
+ * announce ourselves there; nodes forget peers after half an hour */
+#define BT_TORRENT_DHT_INTERVAL (15 * 60)
+
 enum {
 	BT_TORRENT_PROPERTY_NAME = 1,
 	BT_TORRENT_PROPERTY_SIZE,
-	BT_TORRENT_PROPERTY_MANAGER
+	BT_TORRENT_PROPERTY_MANAGER,
+	BT_TORRENT_PROPERTY_MAX_PEERS
 };
 
 enum {
@@ -48,9 +84,16 @@ struct _BtTorrentPrivate {
 
 	/* name of this torrent */
 	gchar     *name;
+
+	/* the .torrent file, only read in full once the torrent is started */
+	gchar     *filename;
+	gboolean   loaded;
 	
 	/* size of the torrent in bytes */
 	guint64    size;
+
+	/* whether peers may only come from the trackers, as in BEP 27 */
+	gboolean   is_private;
 	
 	/* length of each piece */
 	guint32    piece_length;
@@ -70,8 +113,9 @@ struct _BtTorrentPrivate {
 	/* number of pieces in the torrent */
 	guint      num_pieces;
 	
-	/* percent download completion */
+	/* percent download completion, and the pieces it's made from */
 	gdouble    completion;
+	guint      num_have;
 	
 	/* number of blocks */
 	guint      num_blocks;
@@ -82,840 +126,2756 @@ struct _BtTorrentPrivate {
 	/* bitfield of pieces that we have */
 	gchar     *bitfield;
 
+	/* pieces that we have or that are being downloaded, which the piece picker
+	 * passes over */
+	gchar     *claimed;
+
+	/* bitfields for the peers, cut from blocks and kept on a free list once
+	 * they're given back, only touched from the shard's thread */
+	GSList      *peer_bitfield_blocks;
+	guint        peer_bitfield_block_used;
+	GTrashStack *peer_bitfield_free;
+
+	/* pieces we had in an earlier session, copied into the bitfield on load */
+	gchar     *resume_bitfield;
+	gsize      resume_bitfield_len;
+
 	/* array of 20-byte hashes for each piece */
 	gchar     *pieces;
 
+	/* the info dict exactly as it was hashed, for peers that only know the
+	 * infohash */
+	gchar     *metadata;
+	gsize      metadata_len;
+
 	/* an array of files in this torrent */
 	GArray    *files;
 	
-	/* a list of peers */
-	GList     *peers;
+	/* the peers, by address, only touched from the shard's thread if there is
+	 * one; the count can be read from anywhere. Both tables are NULL until
+	 * the torrent is loaded or made from an infohash */
+	GHashTable *peers;
+	volatile gint num_peers;
+	guint      max_peers;
+
+	/* addresses that could be connected to, a set of BtTorrentCandidate */
+	GHashTable *candidates;
+	guint      candidate_seq;
+	GSource   *refill_source;
+
+	/* sends the have messages that were queued for the peers */
+	GSource   *have_source;
+
+	/* the network thread that runs this torrent's peers, or NULL */
+	BtShard   *shard;
+
+	/* piece data received from and sent to the peers since the torrent was
+	 * started, counted from the shard's thread and told to the trackers */
+	GStaticMutex transfer_lock;
+	guint64    downloaded;
+	guint64    uploaded;
+
+	/* looks for peers in the DHT while the torrent is running */
+	GSource   *dht_source;
 
 	/* tracker */
 	GConnHttp *tracker_connection;
+	gboolean   tracker_udp_pending;
+	BtBencodeArena   *tracker_arena;
+	BtBencodeDecoder *tracker_decoder;
 	guint32    tracker_interval;
 	guint32    tracker_min_interval;
 	gchar     *tracker_id;
+
+	/* whether a tracker heard that the torrent started, after which the
+	 * announces are regular ones */
+	gboolean   tracker_started;
 };
 
 G_DEFINE_TYPE (BtTorrent, bt_torrent, G_TYPE_OBJECT)
 
-static gboolean
-bt_torrent_announce_http_parse_response (BtTorrent *torrent, gchar *buf, gsize len)
-{
-	BtTorrentPrivate *priv;
-	GError *error;
-	BtBencode *response, *failure, *warning, *interval, *tracker_id, *peers;
-
-	g_return_val_if_fail (BT_IS_TORRENT (torrent), FALSE);
-	g_return_val_if_fail (buf != NULL, FALSE);
-
-	error = NULL;
-
-	if (!(response = bt_bencode_decode (buf, len, &error))) {
-		g_warning ("could not decode tracker response: %s", error->message);
-		g_clear_error (&error);
-		return FALSE;
-	}
-
-	failure = bt_bencode_lookup (response, "failure reason");
+typedef struct {
+	BtTorrent *torrent;
+	GArray    *addresses;
+} BtTorrentConnectJob;
 
-	if (failure) {
-		if (failure->type == BT_BENCODE_TYPE_STRING)
-			g_warning ("tracker sent error: %s", failure->string->str);
-		return FALSE;
-	}
+/* an address we know of for the torrent, connected to or not. There can be
+ * thousands of these, so each one takes 36 bytes. The address comes first so
+ * that a candidate is its own key in the candidate set, and a #BtAddress can
+ * be used to look one up. */
+typedef struct {
+	BtAddress  address;
 
-	warning = bt_bencode_lookup (response, "warning message");
+	/* piece data received from it over all connections, in kB */
+	guint32    downloaded;
 
-	if (warning && warning->type == BT_BENCODE_TYPE_STRING)
-		g_warning ("tracker sent warning: %s", warning->string->str);
+	/* earliest time to connect to it again, in seconds */
+	guint32    next_attempt;
 
-	interval = bt_bencode_lookup (response, "interval");
+	/* order in which we learned of it */
+	guint32    seq;
 
-	priv = BT_TORRENT_GET_PRIVATE (torrent);
+	/* connections in a row that never got through the handshake */
+	guint8     failures  : 7;
+	guint8     connected : 1;
+} BtTorrentCandidate;
 
-	if (interval && interval->type == BT_BENCODE_TYPE_INT) {
-		priv->tracker_interval = interval->value;
-		g_debug ("tracker announce interval: %d", priv->tracker_interval);
-	}
+typedef struct {
+	GPtrArray *ready;
+	glong      now;
+	guint      waiting;
+} BtTorrentCandidateScan;
 
-	interval = bt_bencode_lookup (response, "min interval");
+static void
+bt_torrent_candidate_free (gpointer data)
+{
+	g_slice_free (BtTorrentCandidate, data);
+}
 
-	if (interval && interval->type == BT_BENCODE_TYPE_INT) {
-		priv->tracker_min_interval = interval->value;
-		g_debug ("tracker announce minimum interval: %d", priv->tracker_min_interval);
-	}
+static void
+bt_torrent_candidate_scan (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data)
+{
+	BtTorrentCandidate *candidate = (BtTorrentCandidate *) value;
+	BtTorrentCandidateScan *scan = (BtTorrentCandidateScan *) data;
 
-	tracker_id = bt_bencode_lookup (response, "tracker id");
+	if (candidate->connected)
+		return;
 
-	if (tracker_id && tracker_id->type == BT_BENCODE_TYPE_STRING) {
-		priv->tracker_id = g_strdup (tracker_id->string->str);
-		g_debug ("tracker id: %s", priv->tracker_id);
-	}
+	if ((glong) candidate->next_attempt > scan->now)
+		scan->waiting++;
+	else
+		g_ptr_array_add (scan->ready, candidate);
+}
 
-	peers = bt_bencode_lookup (response, "peers");
+/* the ones we got the most from first, then the ones that fail least, then
+ * the ones we've known about longest */
+static int
+bt_torrent_candidate_compare (const void *a, const void *b)
+{
+	const BtTorrentCandidate *x = *(BtTorrentCandidate * const *) a;
+	const BtTorrentCandidate *y = *(BtTorrentCandidate * const *) b;
 
-	if (peers) {
-		if (peers->type == BT_BENCODE_TYPE_STRING) {
-			int num, i;
+	if (x->downloaded != y->downloaded)
+		return x->downloaded > y->downloaded ? -1 : 1;
 
-			if (peers->string->len % 6 != 0)
-				g_warning ("invalid peers string");
+	if (x->failures != y->failures)
+		return x->failures < y->failures ? -1 : 1;
 
-			num = peers->string->len / 6;
+	return x->seq < y->seq ? -1 : (gint) (x->seq > y->seq);
+}
 
-			for (i = 0; i < num; i++) {
-				GInetAddr *address;
-				BtPeer *peer;
-				
-				address = gnet_inetaddr_new_bytes (peers->string->str + i * 6, 4);
-				
-				gnet_inetaddr_set_port (address, g_ntohs (*((gushort *) (peers->string->str + i * 6 + 4))));
-				
-				peer = bt_peer_new_outgoing (priv->manager, torrent, address);
-				
-				bt_torrent_add_peer (torrent, peer);
-				
-				g_object_unref (G_OBJECT (peer));
-				gnet_inetaddr_unref (address);
-			}
-		} else if (peers->type == BT_BENCODE_TYPE_LIST) {
-			// if tracker didn't support compact=1
-			GSList *i;
-			for (i = peers->list; i != NULL; i = i->next) {
-				GInetAddr *address;
-				BtPeer *peer;
-				BtBencode *j, *ip, *port;
+static void
+bt_torrent_stop_refill (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
 
-				j = bt_bencode_slitem (i);
-				if (j->type != BT_BENCODE_TYPE_DICT)
-					continue;
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-				ip = bt_bencode_lookup (j, "ip");
-				if (!ip || ip->type != BT_BENCODE_TYPE_STRING)
-					continue;
+	if (priv->refill_source == NULL)
+		return;
 
-				port = bt_bencode_lookup (j, "port");
-				if (!port || port->type != BT_BENCODE_TYPE_INT)
-					continue;
+	g_source_destroy (priv->refill_source);
+	g_source_unref (priv->refill_source);
+	priv->refill_source = NULL;
+}
 
-				// FIXME: blocks if ip is a dns name
-				address = gnet_inetaddr_new (ip->string->str, 4);
+static gboolean
+bt_torrent_refill_source (gpointer data)
+{
+	BtTorrentPrivate *priv;
 
-				gnet_inetaddr_set_port (address, port->value);
+	priv = BT_TORRENT_GET_PRIVATE (data);
 
-				peer = bt_peer_new_outgoing (priv->manager, torrent, address);
-				
-				bt_torrent_add_peer (torrent, peer);
-				
-				g_object_unref (G_OBJECT (peer));
-				gnet_inetaddr_unref (address);
-			}
-		}
-	}
+	g_source_unref (priv->refill_source);
+	priv->refill_source = NULL;
 
-	bt_bencode_destroy (response);
+	bt_torrent_connect_candidates (BT_TORRENT (data));
 
-	return TRUE;
+	return FALSE;
 }
 
-/**
- * bt_torrent_tracker_stop_announce:
- * @torrent: the torrent
- *
- * Stops any currently running announce.
- */
-void
-bt_torrent_tracker_stop_announce (BtTorrent *torrent)
+static void
+bt_torrent_stop_have_flush (BtTorrent *torrent)
 {
 	BtTorrentPrivate *priv;
 
-	g_return_if_fail (BT_IS_TORRENT (torrent));
-
 	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-	if (priv->tracker_connection == NULL)
+	if (priv->have_source == NULL)
 		return;
-	
-	gnet_conn_http_delete (priv->tracker_connection);
-	
-	priv->tracker_connection = NULL;
-	
-	return;
+
+	g_source_destroy (priv->have_source);
+	g_source_unref (priv->have_source);
+	priv->have_source = NULL;
+}
+
+static void
+bt_torrent_flush_haves_peer (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data G_GNUC_UNUSED)
+{
+	bt_peer_flush_haves (BT_PEER (value));
 }
 
 static gboolean
-bt_torrent_tracker_stop_announce_source (gpointer data)
+bt_torrent_have_source (gpointer data)
 {
-	BtTorrent *torrent;
-	
-	g_return_val_if_fail (BT_IS_TORRENT (data), FALSE);
-	
-	torrent = BT_TORRENT (data);
-	
-	bt_torrent_tracker_stop_announce (torrent);
-	
-	return FALSE; 
+	BtTorrentPrivate *priv;
+
+	priv = BT_TORRENT_GET_PRIVATE (data);
+
+	g_source_unref (priv->have_source);
+	priv->have_source = NULL;
+
+	g_hash_table_foreach (priv->peers, bt_torrent_flush_haves_peer, NULL);
+
+	return FALSE;
 }
 
+/* tries again later, for candidates that are waiting on a slot or a delay */
 static void
-bt_torrent_tracker_http_response (GConnHttp *connection G_GNUC_UNUSED, GConnHttpEvent *event, gpointer data)
+bt_torrent_start_refill (BtTorrent *torrent)
 {
 	BtTorrentPrivate *priv;
-	GConnHttpEventResponse *event_response;
-	GConnHttpEventData *event_data;
-	BtTorrent *torrent;
-	gchar *buf;
-	gsize len;
-	
-	g_return_if_fail (data != NULL && event != NULL);
 
-	torrent = BT_TORRENT (data);
 	priv = BT_TORRENT_GET_PRIVATE (torrent);
-	
-	switch (event->type) {
-	case GNET_CONN_HTTP_RESOLVED:
-		g_debug ("tracker address resolved");
-		break;
-		
-	case GNET_CONN_HTTP_RESPONSE:
-		event_response = (GConnHttpEventResponse *) event;
-		g_debug ("tracker sent response with code: %d", event_response->response_code);
-		break;
-
-	case GNET_CONN_HTTP_DATA_COMPLETE:
-		event_data = (GConnHttpEventData *) event;
-		gnet_conn_http_steal_buffer (connection, &buf, &len);
-		bt_torrent_announce_http_parse_response (torrent, buf, len);
-		g_free (buf);
-		g_idle_add (bt_torrent_tracker_stop_announce_source, torrent);
-		break;
 
-	case GNET_CONN_HTTP_ERROR:
-		g_warning ("tracker conection error");
-		g_idle_add (bt_torrent_tracker_stop_announce_source, torrent);
-		
-	default:
-		break;
-	}
+	if (priv->refill_source != NULL)
+		return;
 
-	return;
+	priv->refill_source = g_timeout_source_new (BT_TORRENT_REFILL_INTERVAL * 1000);
+	g_source_set_callback (priv->refill_source, bt_torrent_refill_source, torrent, NULL);
+	g_source_attach (priv->refill_source, bt_reactor_get_context (bt_reactor_get_current ()));
 }
 
-static void
-bt_torrent_tracker_announce_single (BtTorrent *torrent, const gchar *tracker)
+/**
+ * bt_torrent_connect_candidates:
+ * @torrent: the torrent
+ *
+ * Connects to the best of the peers we know of, for as long as the torrent
+ * and the manager have slots for them. This is called whenever a slot may
+ * have come free, and every few seconds while there are peers waiting. If the
+ * torrent has a shard, this has to be called from its thread.
+ */
+void
+bt_torrent_connect_candidates (BtTorrent *torrent)
 {
 	BtTorrentPrivate *priv;
-	gchar *query, *tmp;
+	BtTorrentCandidateScan scan;
+	GTimeVal now;
+	gint free;
+	guint i;
 
 	g_return_if_fail (BT_IS_TORRENT (torrent));
-	g_return_if_fail (tracker != NULL);
 
 	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-	if (priv->tracker_connection != NULL) {
-		g_debug ("already trying to update tracker");
+	if (priv->manager == NULL || priv->candidates == NULL || g_hash_table_size (priv->candidates) == 0)
 		return;
-	}
 
-	/* build query */
-	tmp = bt_url_encode (priv->infohash, 20);
+	free = (gint) priv->max_peers - g_atomic_int_get (&priv->num_peers);
 
-	query = g_strdup_printf ("%s?info_hash=%s&peer_id=%s&port=%d&uploaded=%d&downloaded=%d&left=%" G_GINT64_FORMAT "&compact=1&no_peer_id=1&event=%s&numwant=%d",
-	                         priv->announce,
-	                         tmp,
-	                         bt_manager_get_peer_id (priv->manager),
-	                         bt_manager_get_port (priv->manager),
-	                         0,
-	                         0,
-	                         priv->size,
-	                         "started",
-	                         30);
+	if (free <= 0)
+		return;
 
-	g_debug ("hitting tracker with query %s", query);
+	g_get_current_time (&now);
 
-	g_free (tmp);
+	scan.ready = g_ptr_array_new ();
+	scan.now = now.tv_sec;
+	scan.waiting = 0;
 
-	priv->tracker_connection = gnet_conn_http_new ();
+	g_hash_table_foreach (priv->candidates, bt_torrent_candidate_scan, &scan);
 
-	if (!gnet_conn_http_set_escaped_uri (priv->tracker_connection, query)) {
-		gnet_conn_http_delete (priv->tracker_connection);
-		priv->tracker_connection = NULL;
-		g_warning ("could not accept uri");
+	qsort (scan.ready->pdata, scan.ready->len, sizeof (gpointer), bt_torrent_candidate_compare);
+
+	for (i = 0; i < scan.ready->len && free > 0; i++) {
+		BtTorrentCandidate *candidate = g_ptr_array_index (scan.ready, i);
+		BtPeer *peer;
+
+		/* an incoming peer may have come from the same address */
+		if (g_hash_table_lookup (priv->peers, &candidate->address) != NULL)
+			continue;
+
+		if (!bt_manager_reserve_connection (priv->manager, TRUE))
+			break;
+
+		candidate->connected = TRUE;
+
+		peer = bt_peer_new_outgoing (priv->manager, torrent, &candidate->address);
+
+		bt_torrent_add_peer (torrent, peer);
+
+		g_object_unref (G_OBJECT (peer));
+
+		free--;
 	}
-	else
-		gnet_conn_http_run_async (priv->tracker_connection, bt_torrent_tracker_http_response, torrent);
 
-	g_free (query);
+	/* a freed slot of our own is noticed right away, but not one of the
+	 * manager's, nor the end of a candidate's delay */
+	if (i < scan.ready->len || scan.waiting > 0)
+		bt_torrent_start_refill (torrent);
 
-	return;
+	g_ptr_array_free (scan.ready, TRUE);
 }
 
 /**
- * bt_torrent_tracker_announce:
+ * bt_torrent_add_candidates:
  * @torrent: the torrent
+ * @addresses: a #GArray of #BtAddress, which is freed
  *
- * Starts a tracker announce.
+ * Remembers addresses to connect to, and connects to them if there are slots
+ * for them. Addresses that are already known and those past the most the
+ * torrent keeps are left out. If the torrent has a shard, this has to be
+ * called from its thread.
  */
 void
-bt_torrent_tracker_announce (BtTorrent *torrent)
+bt_torrent_add_candidates (BtTorrent *torrent, GArray *addresses)
 {
 	BtTorrentPrivate *priv;
+	guint i;
 
 	g_return_if_fail (BT_IS_TORRENT (torrent));
+	g_return_if_fail (addresses != NULL);
 
 	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-	bt_torrent_tracker_announce_single (torrent, priv->announce);
-}
-
-static gboolean
-bt_torrent_parse_file (BtTorrent *torrent, const gchar *filename, GError **error)
-{
-	BtTorrentPrivate *priv;
-	BtBencode *metainfo, *info, *announce, *announce_list, *name, *length, *files, *pieces, *piece_length;
-	gchar *contents;
-	gsize len;
+	/* a dormant torrent has nowhere to keep them */
+	if (priv->candidates == NULL) {
+		g_array_free (addresses, TRUE);
+		return;
+	}
 
-	g_return_val_if_fail (BT_IS_TORRENT (torrent), FALSE);
-	g_return_val_if_fail (filename != NULL, FALSE);
+	for (i = 0; i < addresses->len; i++) {
+		BtAddress *address = &g_array_index (addresses, BtAddress, i);
+		BtTorrentCandidate *candidate;
 
-	/* read the contents of the torrent file */
-	if (!g_file_get_contents (filename, &contents, &len, error))
-		return FALSE;
+		if (g_hash_table_size (priv->candidates) >= BT_TORRENT_MAX_CANDIDATES)
+			break;
 
-	/* decode the bencoded file into our own structure */
-	metainfo = bt_bencode_decode (contents, len, error);
+		if (g_hash_table_lookup (priv->candidates, address) != NULL)
+			continue;
 
-	/* we won't need the contents anymore */
-	g_free (contents);
+		candidate = g_slice_new0 (BtTorrentCandidate);
+		candidate->address = *address;
+		candidate->seq = priv->candidate_seq++;
 
-	if (!metainfo)
-		return FALSE;
+		g_hash_table_insert (priv->candidates, candidate, candidate);
+	}
 
-	/* make sure we have the "info" dict */
-	info = bt_bencode_lookup (metainfo, "info");
-	if (!info || info->type != BT_BENCODE_TYPE_DICT)
-		goto cleanup;
+	g_array_free (addresses, TRUE);
 
-	/* check for the "name" entry */
-	name = bt_bencode_lookup (info, "name");
-	if (!name || name->type != BT_BENCODE_TYPE_STRING)
-		goto cleanup;
+	bt_torrent_connect_candidates (torrent);
+}
 
-	priv = BT_TORRENT_GET_PRIVATE (torrent);
+static void
+bt_torrent_add_candidates_job (gpointer data)
+{
+	BtTorrentConnectJob *job = (BtTorrentConnectJob *) data;
 
-	priv->name = g_strdup (name->string->str);
-	g_debug ("torrent name: %s", priv->name);
+	bt_torrent_add_candidates (job->torrent, job->addresses);
 
-	/* check the info hash of this torrent */
-	priv->infohash = bt_get_infohash (info);
-	priv->infohash_string = bt_hash_to_string (priv->infohash);
-	g_debug ("torrent info hash: %s", priv->infohash_string);
+	g_object_unref (job->torrent);
+	g_slice_free (BtTorrentConnectJob, job);
+}
 
-	/* find out how to announce to the tracker(s) */
-	/* TODO: PROTOCOL: should we be more lenient about missing announce if there is an announce-list? */
-	announce = bt_bencode_lookup (metainfo, "announce");
-	announce_list = bt_bencode_lookup (metainfo, "announce-list");
+/* hands the addresses from a tracker to whichever thread runs the peers */
+static void
+bt_torrent_add_addresses (BtTorrent *torrent, GArray *addresses)
+{
+	BtTorrentPrivate *priv;
+	BtTorrentConnectJob *job;
 
-	if (announce == NULL)
-		goto cleanup;
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-	priv->announce = g_strdup (announce->string->str);
+	if (addresses->len == 0) {
+		g_array_free (addresses, TRUE);
+		return;
+	}
 
-	g_debug ("torrent announce url: %s", priv->announce);
+	if (priv->shard == NULL) {
+		bt_torrent_add_candidates (torrent, addresses);
+		return;
+	}
 
-	if (announce_list) {
-		/* the announce-list is a list of lists of strings (doubly nested) */
-		GSList *i;
+	job = g_slice_new (BtTorrentConnectJob);
+	job->torrent = g_object_ref (torrent);
+	job->addresses = addresses;
 
-		priv->announce_list = NULL;
+	bt_shard_invoke (priv->shard, bt_torrent_add_candidates_job, job);
+}
+
+static void
+bt_torrent_dht_peers (BtDht *dht G_GNUC_UNUSED, const gchar *infohash G_GNUC_UNUSED, GArray *peers, gpointer data)
+{
+	BtTorrent *torrent = BT_TORRENT (data);
+
+	/* the torrent may have been stopped while the lookup ran */
+	if (BT_TORRENT_GET_PRIVATE (torrent)->dht_source != NULL)
+		bt_torrent_add_addresses (torrent, peers);
+	else
+		g_array_free (peers, TRUE);
+
+	g_object_unref (torrent);
+}
+
+/* looks for peers in the DHT and announces us to the nodes that keep them */
+static gboolean
+bt_torrent_dht_source (gpointer data)
+{
+	BtTorrent *torrent = BT_TORRENT (data);
+	BtTorrentPrivate *priv;
+	BtDht *dht;
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	/* private torrents only get their peers from the trackers, which a
+	 * torrent from a magnet link only finds out once it has the metadata */
+	if ((dht = bt_manager_get_dht (priv->manager)) != NULL && !priv->is_private)
+		bt_dht_get_peers (dht, priv->infohash, bt_manager_get_port (priv->manager), bt_torrent_dht_peers, g_object_ref (torrent));
+
+	return TRUE;
+}
+
+static void
+bt_torrent_start_dht (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	if (priv->dht_source != NULL)
+		return;
+
+	priv->dht_source = g_timeout_source_new (BT_TORRENT_DHT_INTERVAL * 1000);
+	g_source_set_callback (priv->dht_source, bt_torrent_dht_source, torrent, NULL);
+	g_source_attach (priv->dht_source, NULL);
+
+	bt_torrent_dht_source (torrent);
+}
+
+static void
+bt_torrent_stop_dht (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	if (priv->dht_source == NULL)
+		return;
+
+	g_source_destroy (priv->dht_source);
+	g_source_unref (priv->dht_source);
+	priv->dht_source = NULL;
+}
+
+static void
+bt_torrent_candidate_disconnected (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data G_GNUC_UNUSED)
+{
+	((BtTorrentCandidate *) value)->connected = FALSE;
+}
+
+/* closes the peer and lets go of it, along with its hold on the torrent */
+static gboolean
+bt_torrent_detach_peer (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data G_GNUC_UNUSED)
+{
+	bt_peer_detach (BT_PEER (value));
+
+	return TRUE;
+}
+
+/* has to run on the shard's thread, if there is one */
+static void
+bt_torrent_drop_peers (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	bt_torrent_stop_refill (torrent);
+	bt_torrent_stop_have_flush (torrent);
+
+	if (priv->peers == NULL)
+		return;
+
+	g_hash_table_foreach_steal (priv->peers, bt_torrent_detach_peer, NULL);
+
+	g_atomic_int_set (&priv->num_peers, 0);
+
+	g_hash_table_foreach (priv->candidates, bt_torrent_candidate_disconnected, NULL);
+}
+
+static void
+bt_torrent_drop_peers_job (gpointer data)
+{
+	bt_torrent_drop_peers (BT_TORRENT (data));
+	g_object_unref (data);
+}
+
+/* for a torrent that is being disposed of, which can't be referenced */
+static void
+bt_torrent_drop_peers_func (gpointer data)
+{
+	bt_torrent_drop_peers (BT_TORRENT (data));
+}
+
+static gboolean
+bt_torrent_announce_http_parse_response (BtTorrent *torrent, BtBencode *response)
+{
+	BtTorrentPrivate *priv;
+	BtBencode *failure, *warning, *interval, *tracker_id, *peers;
+	GArray *addresses;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), FALSE);
+	g_return_val_if_fail (response != NULL, FALSE);
+
+	if (response->type != BT_BENCODE_TYPE_DICT) {
+		g_warning ("tracker response is not a dictionary");
+		return FALSE;
+	}
+
+	failure = bt_bencode_lookup (response, "failure reason");
+
+	if (failure) {
+		if (failure->type == BT_BENCODE_TYPE_STRING)
+			g_warning ("tracker sent error: %.*s", (gint) failure->string.len, failure->string.str);
+		return FALSE;
+	}
+
+	warning = bt_bencode_lookup (response, "warning message");
+
+	if (warning && warning->type == BT_BENCODE_TYPE_STRING)
+		g_warning ("tracker sent warning: %.*s", (gint) warning->string.len, warning->string.str);
+
+	interval = bt_bencode_lookup (response, "interval");
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	if (interval && interval->type == BT_BENCODE_TYPE_INT) {
+		priv->tracker_interval = interval->value;
+		g_debug ("tracker announce interval: %d", priv->tracker_interval);
+	}
+
+	interval = bt_bencode_lookup (response, "min interval");
+
+	if (interval && interval->type == BT_BENCODE_TYPE_INT) {
+		priv->tracker_min_interval = interval->value;
+		g_debug ("tracker announce minimum interval: %d", priv->tracker_min_interval);
+	}
+
+	tracker_id = bt_bencode_lookup (response, "tracker id");
+
+	if (tracker_id && tracker_id->type == BT_BENCODE_TYPE_STRING) {
+		g_free (priv->tracker_id);
+		priv->tracker_id = bt_bencode_dup_string (tracker_id);
+		g_debug ("tracker id: %s", priv->tracker_id);
+	}
+
+	peers = bt_bencode_lookup (response, "peers");
+	addresses = g_array_new (FALSE, FALSE, sizeof (BtAddress));
+
+	if (peers) {
+		if (peers->type == BT_BENCODE_TYPE_STRING) {
+			int num, i;
+
+			if (peers->string.len % 6 != 0)
+				g_warning ("invalid peers string");
+
+			num = peers->string.len / 6;
+
+			g_array_set_size (addresses, num);
+
+			for (i = 0; i < num; i++) {
+				const gchar *entry = peers->string.str + i * 6;
+
+				bt_address_set_bytes (&g_array_index (addresses, BtAddress, i), entry, 4,
+				                      (guint8) entry[4] << 8 | (guint8) entry[5]);
+			}
+		} else if (peers->type == BT_BENCODE_TYPE_LIST) {
+			// if tracker didn't support compact=1
+			guint i;
+			for (i = 0; i < peers->list.len; i++) {
+				GInetAddr *inetaddr;
+				BtAddress address;
+				BtBencode *j, *ip, *port;
+				gchar *ip_string;
+
+				j = bt_bencode_list_index (peers, i);
+				if (j->type != BT_BENCODE_TYPE_DICT)
+					continue;
+
+				ip = bt_bencode_lookup (j, "ip");
+				if (!ip || ip->type != BT_BENCODE_TYPE_STRING)
+					continue;
+
+				port = bt_bencode_lookup (j, "port");
+				if (!port || port->type != BT_BENCODE_TYPE_INT)
+					continue;
+
+				// FIXME: blocks if ip is a dns name
+				ip_string = bt_bencode_dup_string (ip);
+				inetaddr = gnet_inetaddr_new (ip_string, port->value);
+				g_free (ip_string);
+
+				if (inetaddr == NULL)
+					continue;
+
+				bt_address_set_inetaddr (&address, inetaddr);
+				gnet_inetaddr_unref (inetaddr);
+
+				g_array_append_val (addresses, address);
+			}
+		}
+	}
+
+	bt_torrent_add_addresses (torrent, addresses);
+
+	return TRUE;
+}
+
+/**
+ * bt_torrent_tracker_stop_announce:
+ * @torrent: the torrent
+ *
+ * Stops any currently running announce.
+ */
+void
+bt_torrent_tracker_stop_announce (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+	BtUdpTracker *udp;
+
+	g_return_if_fail (BT_IS_TORRENT (torrent));
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	if (priv->tracker_udp_pending) {
+		if ((udp = bt_manager_get_udp_tracker (priv->manager, NULL)) != NULL)
+			bt_udp_tracker_cancel (udp, torrent);
+
+		priv->tracker_udp_pending = FALSE;
+	}
+
+	if (priv->tracker_connection == NULL)
+		return;
+	
+	gnet_conn_http_delete (priv->tracker_connection);
+	
+	priv->tracker_connection = NULL;
+
+	if (priv->tracker_decoder)
+		bt_bencode_decoder_free (priv->tracker_decoder);
+
+	bt_bencode_arena_free (priv->tracker_arena);
+
+	priv->tracker_decoder = NULL;
+	priv->tracker_arena = NULL;
+	
+	return;
+}
+
+static gboolean
+bt_torrent_tracker_stop_announce_source (gpointer data)
+{
+	BtTorrent *torrent;
+	
+	g_return_val_if_fail (BT_IS_TORRENT (data), FALSE);
+	
+	torrent = BT_TORRENT (data);
+	
+	bt_torrent_tracker_stop_announce (torrent);
+	
+	return FALSE; 
+}
+
+static void
+bt_torrent_tracker_http_response (GConnHttp *connection G_GNUC_UNUSED, GConnHttpEvent *event, gpointer data)
+{
+	BtTorrentPrivate *priv;
+	GConnHttpEventResponse *event_response;
+	BtTorrent *torrent;
+	BtBencode *response;
+	GError *error = NULL;
+	gchar *buf;
+	gsize len;
+	
+	g_return_if_fail (data != NULL && event != NULL);
+
+	torrent = BT_TORRENT (data);
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+	
+	switch (event->type) {
+	case GNET_CONN_HTTP_RESOLVED:
+		g_debug ("tracker address resolved");
+		break;
+		
+	case GNET_CONN_HTTP_RESPONSE:
+		event_response = (GConnHttpEventResponse *) event;
+		g_debug ("tracker sent response with code: %d", event_response->response_code);
+		break;
+
+	case GNET_CONN_HTTP_DATA_PARTIAL:
+	case GNET_CONN_HTTP_DATA_COMPLETE:
+		/* decode the response as it arrives instead of buffering all of it */
+		gnet_conn_http_steal_buffer (connection, &buf, &len);
+
+		if (priv->tracker_decoder == NULL) {
+			/* the response was already found to be invalid */
+			g_free (buf);
+			break;
+		}
+
+		if (!bt_bencode_decoder_feed (priv->tracker_decoder, buf, len, NULL, &error)) {
+			g_warning ("could not decode tracker response: %s", error->message);
+			g_clear_error (&error);
+			g_free (buf);
+			bt_bencode_decoder_free (priv->tracker_decoder);
+			priv->tracker_decoder = NULL;
+			g_idle_add (bt_torrent_tracker_stop_announce_source, torrent);
+			break;
+		}
+
+		g_free (buf);
+
+		if (event->type == GNET_CONN_HTTP_DATA_PARTIAL)
+			break;
+
+		if ((response = bt_bencode_decoder_finish (priv->tracker_decoder, &error))) {
+			if (bt_torrent_announce_http_parse_response (torrent, response))
+				priv->tracker_started = TRUE;
+		} else {
+			g_warning ("could not decode tracker response: %s", error->message);
+			g_clear_error (&error);
+		}
+
+		g_idle_add (bt_torrent_tracker_stop_announce_source, torrent);
+		break;
+
+	case GNET_CONN_HTTP_ERROR:
+		g_warning ("tracker conection error");
+		g_idle_add (bt_torrent_tracker_stop_announce_source, torrent);
+		
+	default:
+		break;
+	}
+
+	return;
+}
+
+static void
+bt_torrent_tracker_udp_response (BtUdpTracker *udp G_GNUC_UNUSED, BtUdpTrackerResponse *response, const GError *error, gpointer data)
+{
+	BtTorrent *torrent = BT_TORRENT (data);
+	BtTorrentPrivate *priv;
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+	priv->tracker_udp_pending = FALSE;
+
+	if (error != NULL) {
+		g_warning ("tracker sent error: %s", error->message);
+		return;
+	}
+
+	priv->tracker_started = TRUE;
+
+	priv->tracker_interval = response->interval;
+	g_debug ("tracker announce interval: %d", priv->tracker_interval);
+
+	bt_torrent_add_addresses (torrent, response->peers);
+}
+
+/* the bytes of the pieces we don't have yet */
+static guint64
+bt_torrent_get_left (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+	guint64 have;
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	if (priv->num_pieces == 0)
+		return priv->size;
+
+	have = (guint64) priv->num_have * priv->piece_length;
+
+	/* the last piece is usually short */
+	if (bt_bitfield_get (priv->bitfield, priv->num_pieces - 1))
+		have -= (guint64) priv->num_pieces * priv->piece_length - priv->size;
+
+	return priv->size - have;
+}
+
+/* what the trackers are told was transferred since the torrent started */
+static void
+bt_torrent_get_transferred (BtTorrent *torrent, guint64 *downloaded, guint64 *uploaded)
+{
+	BtTorrentPrivate *priv;
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	g_static_mutex_lock (&priv->transfer_lock);
+	*downloaded = priv->downloaded;
+	*uploaded = priv->uploaded;
+	g_static_mutex_unlock (&priv->transfer_lock);
+}
+
+/* announces through the manager's UDP tracker client, which shares the
+ * tracker's connection with the other torrents on it */
+static void
+bt_torrent_tracker_announce_udp (BtTorrent *torrent, const gchar *tracker)
+{
+	BtTorrentPrivate *priv;
+	BtUdpTrackerAnnounce announce;
+	BtUdpTracker *udp;
+	GError *error = NULL;
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	if (priv->tracker_udp_pending) {
+		g_debug ("already trying to update tracker");
+		return;
+	}
+
+	if (!(udp = bt_manager_get_udp_tracker (priv->manager, &error))) {
+		g_warning ("could not announce to %s: %s", tracker, error->message);
+		g_error_free (error);
+		return;
+	}
+
+	memset (&announce, 0, sizeof (announce));
+	memcpy (announce.infohash, priv->infohash, 20);
+	memcpy (announce.peer_id, bt_manager_get_peer_id (priv->manager), 20);
+	bt_torrent_get_transferred (torrent, &announce.downloaded, &announce.uploaded);
+	announce.left = bt_torrent_get_left (torrent);
+	announce.event = priv->tracker_started ? BT_UDP_TRACKER_EVENT_NONE : BT_UDP_TRACKER_EVENT_STARTED;
+	announce.num_want = 30;
+	announce.port = bt_manager_get_port (priv->manager);
+
+	if (!bt_udp_tracker_announce (udp, tracker, &announce, bt_torrent_tracker_udp_response, torrent, &error)) {
+		g_warning ("could not announce to %s: %s", tracker, error->message);
+		g_error_free (error);
+		return;
+	}
+
+	priv->tracker_udp_pending = TRUE;
+}
+
+static void
+bt_torrent_tracker_announce_single (BtTorrent *torrent, const gchar *tracker)
+{
+	BtTorrentPrivate *priv;
+	gchar *query, *tmp;
+	guint64 downloaded, uploaded;
+
+	g_return_if_fail (BT_IS_TORRENT (torrent));
+	g_return_if_fail (tracker != NULL);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	if (g_ascii_strncasecmp (tracker, "udp://", 6) == 0) {
+		bt_torrent_tracker_announce_udp (torrent, tracker);
+		return;
+	}
+
+	if (priv->tracker_connection != NULL) {
+		g_debug ("already trying to update tracker");
+		return;
+	}
+
+	/* build query */
+	tmp = bt_url_encode (priv->infohash, 20);
+
+	bt_torrent_get_transferred (torrent, &downloaded, &uploaded);
+
+	/* regular announces leave the event out */
+	query = g_strdup_printf ("%s?info_hash=%s&peer_id=%s&port=%d&uploaded=%" G_GUINT64_FORMAT "&downloaded=%" G_GUINT64_FORMAT "&left=%" G_GUINT64_FORMAT "&compact=1&no_peer_id=1%s&numwant=%d",
+	                         priv->announce,
+	                         tmp,
+	                         bt_manager_get_peer_id (priv->manager),
+	                         bt_manager_get_port (priv->manager),
+	                         uploaded,
+	                         downloaded,
+	                         bt_torrent_get_left (torrent),
+	                         priv->tracker_started ? "" : "&event=started",
+	                         30);
+
+	g_debug ("hitting tracker with query %s", query);
+
+	g_free (tmp);
+
+	priv->tracker_connection = gnet_conn_http_new ();
+
+	if (!gnet_conn_http_set_escaped_uri (priv->tracker_connection, query)) {
+		gnet_conn_http_delete (priv->tracker_connection);
+		priv->tracker_connection = NULL;
+		g_warning ("could not accept uri");
+	} else {
+		priv->tracker_arena = bt_bencode_arena_new (0);
+		priv->tracker_decoder = bt_bencode_decoder_new (priv->tracker_arena, 0, BT_TORRENT_MAX_TRACKER_RESPONSE);
+		gnet_conn_http_run_async (priv->tracker_connection, bt_torrent_tracker_http_response, torrent);
+	}
+
+	g_free (query);
+
+	return;
+}
+
+/**
+ * bt_torrent_tracker_announce:
+ * @torrent: the torrent
+ *
+ * Starts a tracker announce.
+ */
+void
+bt_torrent_tracker_announce (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_if_fail (BT_IS_TORRENT (torrent));
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	/* magnet links don't have to name a tracker */
+	if (priv->announce == NULL)
+		return;
+
+	bt_torrent_tracker_announce_single (torrent, priv->announce);
+}
+
+/* checks the parts of the info dict that every torrent needs and works out its
+ * total size, without keeping anything else around */
+static gboolean
+bt_torrent_check_info (BtBencode *info, guint64 *size)
+{
+	BtBencode *name, *length, *files, *pieces, *piece_length;
+
+	name = bt_bencode_lookup (info, "name");
+	length = bt_bencode_lookup (info, "length");
+	files = bt_bencode_lookup (info, "files");
+	piece_length = bt_bencode_lookup (info, "piece length");
+	pieces = bt_bencode_lookup (info, "pieces");
+
+	if (!name || name->type != BT_BENCODE_TYPE_STRING)
+		return FALSE;
+	if (!pieces || pieces->type != BT_BENCODE_TYPE_STRING
+		|| (pieces->string.len % 20) != 0)
+		return FALSE;
+	if ((length && files) || (!length && !files))
+		return FALSE;
+	if (!piece_length || piece_length->type != BT_BENCODE_TYPE_INT
+		|| piece_length->value <= 0 || piece_length->value > BT_TORRENT_MAX_PIECE_LENGTH)
+		return FALSE;
+	if ((length && (length->type != BT_BENCODE_TYPE_INT || length->value < 0))
+		|| (files && files->type != BT_BENCODE_TYPE_LIST))
+		return FALSE;
+
+	if (length) {
+		*size = length->value;
+	} else {
+		guint i;
+
+		*size = 0;
+
+		for (i = 0; i < files->list.len; i++) {
+			BtBencode *entry, *path;
+
+			entry = bt_bencode_list_index (files, i);
+			if (entry->type != BT_BENCODE_TYPE_DICT)
+				return FALSE;
+
+			length = bt_bencode_lookup (entry, "length");
+			path = bt_bencode_lookup (entry, "path");
+			if (!length || length->type != BT_BENCODE_TYPE_INT || length->value < 0
+				|| !path || path->type != BT_BENCODE_TYPE_LIST)
+				return FALSE;
+
+			/* the files can't add up to more than a length could say */
+			if ((guint64) length->value > G_MAXINT64 - *size)
+				return FALSE;
+
+			*size += length->value;
+		}
+	}
+
+	/* there has to be a hash for every piece, and nothing else */
+	if (pieces->string.len / 20 != (*size + piece_length->value - 1) / piece_length->value)
+		return FALSE;
+
+	return TRUE;
+}
+
+/* reads and decodes a metainfo file, returning its "info" dict; strings in the
+ * result point into *contents, which has to be freed along with *arena */
+static BtBencode *
+bt_torrent_read_metainfo (const gchar *filename, gchar **contents, BtBencodeArena **arena, BtBencode **info, GError **error)
+{
+	BtBencode *metainfo, *announce;
+	gsize len;
+
+	if (!g_file_get_contents (filename, contents, &len, error))
+		return NULL;
+
+	*arena = bt_bencode_arena_new (len);
+
+	if (!(metainfo = bt_bencode_decode_arena (*arena, *contents, len, error))) {
+		bt_bencode_arena_free (*arena);
+		g_free (*contents);
+		return NULL;
+	}
+
+	/* TODO: PROTOCOL: should we be more lenient about missing announce if there is an announce-list? */
+	if (metainfo->type != BT_BENCODE_TYPE_DICT
+		|| !(*info = bt_bencode_lookup (metainfo, "info")) || (*info)->type != BT_BENCODE_TYPE_DICT
+		|| !(announce = bt_bencode_lookup (metainfo, "announce")) || announce->type != BT_BENCODE_TYPE_STRING) {
+		g_set_error (error, BT_ERROR, BT_ERROR_INVALID_TORRENT, "invalid torrent file");
+		bt_bencode_arena_free (*arena);
+		g_free (*contents);
+		return NULL;
+	}
+
+	return metainfo;
+}
+
+/**
+ * bt_torrent_read_summary:
+ * @filename: the .torrent file
+ * @name: return location for the name of the torrent
+ * @size: return location for the size of the torrent in bytes
+ * @infohash: return location for the 20-byte infohash
+ * @error: a return location for errors
+ *
+ * Checks a metainfo file and reads the information a dormant torrent needs, to
+ * be passed to bt_torrent_new_dormant(). This doesn't touch any objects, so it
+ * can be called from any thread.
+ *
+ * Returns: TRUE if the file is a valid torrent
+ */
+gboolean
+bt_torrent_read_summary (const gchar *filename, gchar **name, guint64 *size, gchar **infohash, GError **error)
+{
+	BtBencodeArena *arena;
+	BtBencode *info;
+	gchar *contents;
+
+	g_return_val_if_fail (filename != NULL, FALSE);
+	g_return_val_if_fail (name != NULL && size != NULL && infohash != NULL, FALSE);
+
+	if (!bt_torrent_read_metainfo (filename, &contents, &arena, &info, error))
+		return FALSE;
+
+	if (!bt_torrent_check_info (info, size)) {
+		g_set_error (error, BT_ERROR, BT_ERROR_INVALID_TORRENT, "invalid torrent file");
+		bt_bencode_arena_free (arena);
+		g_free (contents);
+		return FALSE;
+	}
+
+	*name = bt_bencode_dup_string (bt_bencode_lookup (info, "name"));
+	*infohash = bt_get_infohash (info);
+
+	bt_bencode_arena_free (arena);
+	g_free (contents);
+
+	return TRUE;
+}
+
+static void
+bt_torrent_free_files (GArray *files)
+{
+	guint i;
+
+	for (i = 0; i < files->len; i++)
+		g_free (g_array_index (files, BtTorrentFile, i).name);
+
+	g_array_free (files, TRUE);
+}
+
+/* takes the name, size, pieces and files from an info dict that has been
+ * checked, and keeps its bytes around to pass on to other peers; nothing about
+ * the torrent changes unless all of it can be taken */
+static gboolean
+bt_torrent_parse_info (BtTorrent *torrent, BtBencode *info, guint64 size)
+{
+	BtTorrentPrivate *priv;
+	BtBencode *length, *files, *pieces, *piece_length, *private;
+	GArray *parsed;
+	gchar *name;
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	name = bt_bencode_dup_string (bt_bencode_lookup (info, "name"));
+
+	private = bt_bencode_lookup (info, "private");
+	length = bt_bencode_lookup (info, "length");
+	files = bt_bencode_lookup (info, "files");
+	piece_length = bt_bencode_lookup (info, "piece length");
+	pieces = bt_bencode_lookup (info, "pieces");
+
+	parsed = g_array_new (FALSE, TRUE, sizeof (BtTorrentFile));
+
+	if (length) {
+		/* this torrent is one single file */
+		BtTorrentFile file = {g_strdup (name), length->value, 0, 0};
+
+		g_array_append_val (parsed, file);
+	}
+
+	if (files) {
+		/* we have multiple files in the torrent, so loop through them */
+		guint i;
+		guint64 offset = 0;
+
+		for (i = 0; i < files->list.len; i++) {
+			BtBencode *entry, *path;
+			guint j;
+			gchar **path_strv;
+			gchar *full_path;
+			BtTorrentFile file = {NULL, 0, 0, 0};
+			gsize k = 0;
+
+			entry = bt_bencode_list_index (files, i);
+			length = bt_bencode_lookup (entry, "length");
+			path = bt_bencode_lookup (entry, "path");
+
+			path_strv = g_malloc0 ((path->list.len + 1) * sizeof (gpointer));
+
+			for (j = 0; j < path->list.len; j++) {
+				if (bt_bencode_list_index (path, j)->type != BT_BENCODE_TYPE_STRING) {
+					g_strfreev (path_strv);
+					bt_torrent_free_files (parsed);
+					g_free (name);
+					return FALSE;
+				}
+
+				path_strv[k++] = bt_bencode_dup_string (bt_bencode_list_index (path, j));
+			}
+
+			full_path = g_build_filenamev (path_strv);
+			g_strfreev (path_strv);
+			g_debug ("%s", full_path);
+
+			file.size = length->value;
+			file.name = full_path;
+			file.offset = offset;
+
+			g_array_append_val (parsed, file);
+
+			offset += file.size;
+		}
+	}
+
+	g_free (priv->name);
+	priv->name = name;
+	priv->size = size;
+
+	priv->is_private = private != NULL && private->type == BT_BENCODE_TYPE_INT && private->value == 1;
+
+	priv->piece_length = (guint32) piece_length->value;
+
+	g_array_append_vals (priv->files, parsed->data, parsed->len);
+	g_array_free (parsed, TRUE);
+
+	priv->num_pieces = (priv->size + priv->piece_length - 1) / priv->piece_length;
+
+	priv->pieces = g_memdup (pieces->string.str, pieces->string.len);
+
+	priv->bitfield = g_malloc0 ((priv->num_pieces + 7) /  8);
+	priv->claimed = g_malloc0 ((priv->num_pieces + 7) /  8);
+
+	priv->block_size = MIN (priv->piece_length, 16384);
+
+	priv->num_blocks = (priv->size + priv->block_size - 1) / priv->block_size;
+
+	priv->metadata = g_memdup (info->dict.raw.str, info->dict.raw.len);
+	priv->metadata_len = info->dict.raw.len;
+
+	return TRUE;
+}
+
+/* reads the rest of the metainfo file for a torrent that is being loaded */
+static gboolean
+bt_torrent_parse_file (BtTorrent *torrent, GError **error)
+{
+	BtTorrentPrivate *priv;
+	BtBencodeArena *arena;
+	BtBencode *metainfo, *info, *announce, *announce_list;
+	gchar *contents, *infohash;
+	guint64 size;
+	gboolean changed;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), FALSE);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	if (!(metainfo = bt_torrent_read_metainfo (priv->filename, &contents, &arena, &info, error)))
+		return FALSE;
+
+	if (!bt_torrent_check_info (info, &size))
+		goto cleanup;
+
+	/* the file might have been replaced since the torrent was added */
+	infohash = bt_get_infohash (info);
+	changed = memcmp (infohash, priv->infohash, 20) != 0;
+	g_free (infohash);
+
+	if (changed) {
+		g_set_error (error, BT_ERROR, BT_ERROR_INVALID_TORRENT, "torrent file has changed since it was added");
+		bt_bencode_arena_free (arena);
+		g_free (contents);
+		return FALSE;
+	}
+
+	/* find out how to announce to the tracker(s) */
+	announce = bt_bencode_lookup (metainfo, "announce");
+	announce_list = bt_bencode_lookup (metainfo, "announce-list");
+
+	priv->announce = bt_bencode_dup_string (announce);
+	g_debug ("torrent announce url: %s", priv->announce);
+
+	if (announce_list) {
+		/* the announce-list is a list of lists of strings (doubly nested) */
+		guint i;
+
+		priv->announce_list = NULL;
 
 		if (announce_list->type != BT_BENCODE_TYPE_LIST)
 			goto cleanup;
 
-		for (i = announce_list->list; i != NULL; i = i->next) {
-			GSList *list, *k;
-			BtBencode *j;
+		for (i = 0; i < announce_list->list.len; i++) {
+			GSList *list;
+			BtBencode *j;
+			guint k;
+
+			/* initialize the new tier */
+			list = NULL;
+
+			j = bt_bencode_list_index (announce_list, i);
+			if (j->type != BT_BENCODE_TYPE_LIST)
+				goto cleanup;
+
+			for (k = 0; k < j->list.len; k++) {
+				BtBencode *l;
+
+				l = bt_bencode_list_index (j, k);
+				if (l->type != BT_BENCODE_TYPE_STRING)
+					goto cleanup;
+
+				/* add it to this tier */
+				list = g_slist_prepend (list, bt_bencode_dup_string (l));
+				g_debug ("announce: %s", (gchar *) list->data);
+			}
+
+			/* add the tier to the announce list */
+			list = g_slist_reverse (list);
+			priv->announce_list = g_slist_prepend (priv->announce_list, list);
+		}
+
+		priv->announce_list = g_slist_reverse (priv->announce_list);
+	}
+
+	if (!bt_torrent_parse_info (torrent, info, size))
+		goto cleanup;
+
+	bt_bencode_arena_free (arena);
+	g_free (contents);
+	return TRUE;
+
+cleanup:
+	g_set_error (error, BT_ERROR, BT_ERROR_INVALID_TORRENT, "invalid torrent file");
+	bt_bencode_arena_free (arena);
+	g_free (contents);
+	return FALSE;
+}
+
+/**
+ * bt_torrent_get_infohash:
+ * @torrent: the torrent
+ *
+ * Get the infohash of this torrent as a 20-byte array.
+ *
+ * Returns: the infohash of the torrent, which is a pointer to an internal string and should
+ *   not be modified or freed.
+ */
+const gchar *
+bt_torrent_get_infohash (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), NULL);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	return priv->infohash;
+}
+
+/**
+ * bt_torrent_get_infohash_string:
+ * @torrent: the torrent
+ *
+ * Get the infohash of this torrent as a 40-byte string.
+ *
+ * Returns: the infohash of the torrent as a string, which is a pointer to an internal
+ *   string and should not be modified or freed.
+ */
+const gchar *
+bt_torrent_get_infohash_string (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), NULL);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	return priv->infohash_string;
+}
+
+/**
+ * bt_torrent_get_name:
+ * @torrent: the torrent
+ *
+ * Get the name of this torrent.
+ *
+ * Returns: the name of the torrent, which is a pointer to an internal string and should
+ *   not be modified or freed.
+ */
+const gchar *
+bt_torrent_get_name (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), NULL);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	return priv->name;
+}
+
+/**
+ * bt_torrent_get_size:
+ * @torrent: the torrent
+ *
+ * Get the size of this torrent in bytes.
+ *
+ * Returns: the size of the torrent in bytes as a guint64.
+ */
+guint64
+bt_torrent_get_size (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	return priv->size;
+}
+
+/**
+ * bt_torrent_get_num_pieces:
+ * @torrent: the torrent
+ *
+ * Get the number of pieces for the torrent.
+ *
+ * Returns: the number of pieces for the torrent as a guint.
+ */
+guint
+bt_torrent_get_num_pieces (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	return priv->num_pieces;
+}
+
+/**
+ * bt_torrent_get_piece_length:
+ * @torrent: the torrent
+ *
+ * Get the piece length for the torrent.
+ *
+ * Returns: the piece length for the torrent as a guint32.
+ */
+guint32
+bt_torrent_get_piece_length (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	return priv->piece_length;
+}
+
+/**
+ * bt_torrent_get_piece_length_extended:
+ * @torrent: the torrent
+ * @piece: the piece index
+ *
+ * Get the piece length for the piece index.
+ *
+ * Returns: the piece length for the piece index as a guint32.
+ * Always the same as @bt_torrent_get_piece_length except for the last piece,
+ * which might be slighty less.
+ */
+guint32
+bt_torrent_get_piece_length_extended (BtTorrent *torrent, guint piece)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	if (piece == (priv->num_pieces - 1))
+		return priv->size - ((priv->num_pieces - 1) * priv->piece_length);
+	else
+		return priv->piece_length;
+}
+
+/**
+ * bt_torrent_get_piece_hash:
+ * @torrent: the torrent
+ * @piece: the piece index
+ *
+ * Get the infohash of the piece as a 20-byte array.
+ *
+ * Returns: the 20-byte infohash of the piece, 
+ * which is a pointer to an internal string and should not be modified or freed.
+ */
+const gchar *
+bt_torrent_get_piece_hash (BtTorrent* torrent, guint piece)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), NULL);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	g_return_val_if_fail (piece < priv->num_pieces, NULL);
+
+	return &priv->pieces[20 * piece];
+}
+
+/**
+ * bt_torrent_has_piece:
+ * @torrent: the torrent
+ * @piece: the piece index
+ *
+ * Checks whether we have downloaded and verified the piece.
+ *
+ * Returns: TRUE if the piece is complete.
+ */
+gboolean
+bt_torrent_has_piece (BtTorrent *torrent, guint piece)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), FALSE);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	g_return_val_if_fail (piece < priv->num_pieces, FALSE);
+
+	return bt_bitfield_get (priv->bitfield, piece);
+}
+
+/**
+ * bt_torrent_count_missing:
+ * @torrent: the torrent
+ * @bitfield: a peer's bitfield, with the spare bits clear
+ *
+ * Counts the pieces in @bitfield that we don't have yet.
+ *
+ * Returns: the number of pieces
+ */
+guint
+bt_torrent_count_missing (BtTorrent *torrent, const gchar *bitfield)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
+	g_return_val_if_fail (bitfield != NULL, 0);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	return bt_bitfield_count_and_not (bitfield, priv->bitfield, priv->num_pieces);
+}
+
+/**
+ * bt_torrent_get_num_have:
+ * @torrent: the torrent
+ *
+ * Returns: the number of pieces we have
+ */
+guint
+bt_torrent_get_num_have (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	return priv->num_have;
+}
+
+/**
+ * bt_torrent_pick_piece:
+ * @torrent: the torrent
+ * @bitfield: the bitfield of the peer to download from, with the spare bits
+ *   clear
+ *
+ * Picks a piece to download from a peer: one it has that we neither have nor
+ * are downloading from another peer. The search starts at a random piece so
+ * that peers with the same pieces don't all get the same ones. The piece is
+ * claimed until it's completed or given back with bt_torrent_unpick_piece().
+ * If the torrent has a shard, this has to be called from its thread.
+ *
+ * Returns: the piece, or -1 if the peer has nothing for us
+ */
+gint
+bt_torrent_pick_piece (BtTorrent *torrent, const gchar *bitfield)
+{
+	BtTorrentPrivate *priv;
+	guint start;
+	gint piece;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), -1);
+	g_return_val_if_fail (bitfield != NULL, -1);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	if (priv->num_pieces == 0)
+		return -1;
+
+	start = g_random_int_range (0, priv->num_pieces);
+	piece = bt_bitfield_find_and_not (bitfield, priv->claimed, priv->num_pieces, start);
+
+	if (piece < 0 && start > 0)
+		piece = bt_bitfield_find_and_not (bitfield, priv->claimed, start, 0);
+
+	if (piece >= 0)
+		bt_bitfield_set (priv->claimed, piece);
+
+	return piece;
+}
+
+/**
+ * bt_torrent_claim_piece:
+ * @torrent: the torrent
+ * @piece: the piece
+ *
+ * Claims a particular piece to download, like one that a peer suggested or
+ * lets us download while it chokes us, in the same way as
+ * bt_torrent_pick_piece(). If the torrent has a shard, this has to be called
+ * from its thread.
+ *
+ * Returns: %FALSE if we have the piece or are downloading it from another
+ * peer
+ */
+gboolean
+bt_torrent_claim_piece (BtTorrent *torrent, guint piece)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), FALSE);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	g_return_val_if_fail (piece < priv->num_pieces, FALSE);
+
+	if (bt_bitfield_get (priv->claimed, piece))
+		return FALSE;
+
+	bt_bitfield_set (priv->claimed, piece);
+
+	return TRUE;
+}
+
+typedef struct {
+	guint    piece;
+	gboolean lazy;
+} BtTorrentCompletedPiece;
+
+static void
+bt_torrent_piece_completed_peer (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data)
+{
+	BtTorrentCompletedPiece *completed = (BtTorrentCompletedPiece *) data;
+
+	bt_peer_piece_completed (BT_PEER (value), completed->piece, completed->lazy);
+}
+
+/**
+ * bt_torrent_complete_piece:
+ * @torrent: the torrent
+ * @piece: the piece
+ *
+ * Marks a piece as downloaded and verified, and tells the peers, which
+ * stop being interesting once they have nothing else we lack. That's a
+ * constant amount of work for each peer. The have messages are gathered for
+ * #BtManager:have-interval and then sent to each peer together. If the
+ * torrent has a shard, this has to be called from its thread.
+ */
+void
+bt_torrent_complete_piece (BtTorrent *torrent, guint piece)
+{
+	BtTorrentPrivate *priv;
+	BtTorrentCompletedPiece completed;
+	guint interval;
+
+	g_return_if_fail (BT_IS_TORRENT (torrent));
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	g_return_if_fail (piece < priv->num_pieces);
+
+	if (bt_bitfield_get (priv->bitfield, piece))
+		return;
+
+	bt_bitfield_set (priv->bitfield, piece);
+	bt_bitfield_set (priv->claimed, piece);
+
+	priv->num_have++;
+	priv->completion = 100.0 * priv->num_have / priv->num_pieces;
+
+	if (priv->manager == NULL)
+		return;
+
+	completed.piece = piece;
+	completed.lazy = bt_manager_get_lazy_have (priv->manager);
+
+	g_hash_table_foreach (priv->peers, bt_torrent_piece_completed_peer, &completed);
+
+	interval = bt_manager_get_have_interval (priv->manager);
+
+	if (interval == 0) {
+		g_hash_table_foreach (priv->peers, bt_torrent_flush_haves_peer, NULL);
+	} else if (priv->have_source == NULL) {
+		priv->have_source = g_timeout_source_new (interval);
+		g_source_set_callback (priv->have_source, bt_torrent_have_source, torrent, NULL);
+		g_source_attach (priv->have_source, bt_reactor_get_context (bt_reactor_get_current ()));
+	}
+}
+
+/**
+ * bt_torrent_add_transferred:
+ * @torrent: the torrent
+ * @downloaded: bytes of piece data received from a peer
+ * @uploaded: bytes of piece data sent to a peer
+ *
+ * Counts piece data that went through one of the torrent's peers, which is
+ * what the trackers are told. This can be called from any thread.
+ */
+void
+bt_torrent_add_transferred (BtTorrent *torrent, guint64 downloaded, guint64 uploaded)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_if_fail (BT_IS_TORRENT (torrent));
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	g_static_mutex_lock (&priv->transfer_lock);
+	priv->downloaded += downloaded;
+	priv->uploaded += uploaded;
+	g_static_mutex_unlock (&priv->transfer_lock);
+}
+
+/**
+ * bt_torrent_unpick_piece:
+ * @torrent: the torrent
+ * @piece: a piece from bt_torrent_pick_piece()
+ *
+ * Gives back a piece that won't be completed, like when the peer it was
+ * being downloaded from goes away, so that it can be picked again.
+ */
+void
+bt_torrent_unpick_piece (BtTorrent *torrent, guint piece)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_if_fail (BT_IS_TORRENT (torrent));
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	g_return_if_fail (piece < priv->num_pieces);
+
+	if (!bt_bitfield_get (priv->bitfield, piece))
+		bt_bitfield_clear (priv->claimed, piece);
+}
+
+/**
+ * bt_torrent_get_num_blocks:
+ * @torrent: the torrent
+ *
+ * Get the number of blocks for the torrent.
+ *
+ * Returns: the number of blocks for the torrent as a guint.
+ */
+guint
+bt_torrent_get_num_blocks (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	return priv->num_blocks;
+}
+
+/**
+ * bt_torrent_get_block_size:
+ * @torrent: the torrent
+ *
+ * Get the block size for the torrent.
+ *
+ * Returns: the block size for the torrent as a guint.
+ */
+guint
+bt_torrent_get_block_size (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	return priv->block_size;
+}
+
+/**
+ * bt_torrent_get_block_size_extended:
+ * @torrent: the torrent
+ * @block: the block index
+ *
+ * Get the block size for the block index.
+ *
+ * Returns: the block size for the block index as a guint.
+ * Always the same as @bt_torrent_get_block_size except for the last block,
+ * which might be slighty less.
+ */
+guint
+bt_torrent_get_block_size_extended (BtTorrent *torrent, guint block)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	if (block == (priv->num_blocks - 1))
+		return priv->size - ((priv->num_blocks - 1) * priv->block_size);
+	else
+		return priv->block_size;
+}
+
+/**
+ * bt_torrent_get_file:
+ * @torrent: the torrent
+ * @index: the file index
+ *
+ * Get a file by index.
+ *
+ * Returns: the file specified by @index.
+ */
+const BtTorrentFile *
+bt_torrent_get_file (BtTorrent *torrent, guint index)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), NULL);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	g_return_val_if_fail (index < priv->files->len, NULL);
+
+	return &g_array_index (priv->files, BtTorrentFile, index);
+}
+
+/**
+ * bt_torrent_get_num_files:
+ * @torrent: the torrent
+ *
+ * Get the number of files for the torrent.
+ *
+ * Returns: the number of files for the torrent as a guint.
+ */
+guint
+bt_torrent_get_num_files (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	return priv->files->len;
+}
+
+/**
+ * bt_torrent_get_filename:
+ * @torrent: the torrent
+ *
+ * Get the path of the .torrent file this torrent was created from.
+ *
+ * Returns: the filename, which is a pointer to an internal string and should
+ *   not be modified or freed, or NULL for a torrent from a magnet link.
+ */
+const gchar *
+bt_torrent_get_filename (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), NULL);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	return priv->filename;
+}
+
+/**
+ * bt_torrent_is_loaded:
+ * @torrent: the torrent
+ *
+ * Checks whether the full metainfo of this torrent has been loaded. Until then
+ * only its name, size and infohash are known.
+ *
+ * Returns: TRUE if the torrent is loaded.
+ */
+gboolean
+bt_torrent_is_loaded (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), FALSE);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	return g_atomic_int_get (&priv->loaded);
+}
+
+/* restores the pieces from the resume data, now that we know how many there are */
+static void
+bt_torrent_apply_resume_data (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
+	gsize len;
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	if (priv->resume_bitfield == NULL)
+		return;
+
+	len = (priv->num_pieces + 7) / 8;
+
+	if (priv->resume_bitfield_len != len) {
+		g_warning ("ignoring resume data for %s: wrong number of pieces", priv->infohash_string);
+	} else {
+		memcpy (priv->bitfield, priv->resume_bitfield, len);
+		bt_bitfield_clear_spare (priv->bitfield, priv->num_pieces);
+		memcpy (priv->claimed, priv->bitfield, len);
+
+		priv->num_have = bt_bitfield_count (priv->bitfield, priv->num_pieces);
+		priv->completion = priv->num_pieces ? 100.0 * priv->num_have / priv->num_pieces : 100.0;
+	}
+
+	g_free (priv->resume_bitfield);
+	priv->resume_bitfield = NULL;
+	priv->resume_bitfield_len = 0;
+}
+
+/**
+ * bt_torrent_set_resume_data:
+ * @torrent: the torrent
+ * @bitfield: the pieces we have, in the same format as a bitfield message
+ * @len: the length of @bitfield in bytes
+ *
+ * Marks the pieces we had in an earlier session, like after a restart. If the
+ * torrent is dormant the bitfield is kept until it is loaded, and ignored then
+ * if it doesn't match the number of pieces.
+ */
+void
+bt_torrent_set_resume_data (BtTorrent *torrent, const gchar *bitfield, gsize len)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_if_fail (BT_IS_TORRENT (torrent));
+	g_return_if_fail (bitfield != NULL || len == 0);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	g_free (priv->resume_bitfield);
+	priv->resume_bitfield = g_memdup (bitfield, len);
+	priv->resume_bitfield_len = len;
+
+	if (priv->loaded)
+		bt_torrent_apply_resume_data (torrent);
+}
+
+/**
+ * bt_torrent_get_bitfield:
+ * @torrent: the torrent
+ * @len: return location for the length of the bitfield in bytes
+ *
+ * Gets the pieces we have, to be saved as resume data. For a dormant torrent
+ * this is whatever resume data it was given.
+ *
+ * Returns: the bitfield, which is a pointer to an internal string and should
+ *   not be modified or freed, or NULL if there is none.
+ */
+const gchar *
+bt_torrent_get_bitfield (BtTorrent *torrent, gsize *len)
+{
+	BtTorrentPrivate *priv;
+
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), NULL);
+	g_return_val_if_fail (len != NULL, NULL);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	if (!priv->loaded) {
+		*len = priv->resume_bitfield_len;
+		return priv->resume_bitfield;
+	}
+
+	*len = (priv->num_pieces + 7) / 8;
+
+	return priv->bitfield;
+}
+
+/* creates the tables of peers, which dormant torrents go without since they
+ * can't have any */
+static void
+bt_torrent_create_peer_tables (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
 
-			/* initialize the new tier */
-			list = NULL;
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-			j = bt_bencode_slitem (i);
-			if (j->type != BT_BENCODE_TYPE_LIST)
-				goto cleanup;
+	if (priv->peers != NULL)
+		return;
 
-			for (k = j->list; k != NULL; k = k->next) {
-				BtBencode *l;
+	priv->peers = g_hash_table_new_full (bt_address_hash, bt_address_equal, NULL, g_object_unref);
+	priv->candidates = g_hash_table_new_full (bt_address_hash, bt_address_equal, NULL, bt_torrent_candidate_free);
+}
 
-				l = bt_bencode_slitem (k);
-				if (l->type != BT_BENCODE_TYPE_STRING)
-					goto cleanup;
+/* sets up what a torrent needs to run once it knows its pieces */
+static void
+bt_torrent_finish_load (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
 
-				/* add it to this tier */
-				g_debug ("announce: %s", l->string->str);
-				list = g_slist_prepend (list, g_strdup (l->string->str));
-			}
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-			/* add the tier to the announce list */
-			list = g_slist_reverse (list);
-			priv->announce_list = g_slist_prepend (priv->announce_list, list);
-		}
+	bt_torrent_create_peer_tables (torrent);
 
-		priv->announce_list = g_slist_reverse (priv->announce_list);
-	}
+	bt_torrent_apply_resume_data (torrent);
 
-	/* get and check other keys in the info dict */
-	length = bt_bencode_lookup (info, "length");
-	files = bt_bencode_lookup (info, "files");
-	piece_length = bt_bencode_lookup (info, "piece length");
-	pieces = bt_bencode_lookup (info, "pieces");
+	torrent->io = g_object_new (BT_TYPE_IO, "torrent", torrent, NULL);
 
-	if (!pieces || pieces->type != BT_BENCODE_TYPE_STRING
-		|| (pieces->string->len % 20) != 0)
-		goto cleanup;
-	if ((length && files) || (!length && !files))
-		goto cleanup;
-	if (!piece_length || piece_length->type != BT_BENCODE_TYPE_INT)
-		goto cleanup;
-	if ((length && length->type != BT_BENCODE_TYPE_INT)
-		|| (files && files->type != BT_BENCODE_TYPE_LIST))
-		goto cleanup;
+	/* peers on the shard's thread only look at what was set up above once
+	 * they see this */
+	g_atomic_int_set (&priv->loaded, TRUE);
+}
 
-	priv->piece_length = (guint32) piece_length->value;
+/**
+ * bt_torrent_load:
+ * @torrent: the torrent
+ * @error: a return location for errors
+ *
+ * Reads the piece hashes, file list and trackers from the metainfo file and
+ * sets up the torrent's #BtIO. New torrents are dormant and only keep their
+ * name, size and infohash around; this is done when they're first started.
+ *
+ * Returns: TRUE if the torrent is loaded.
+ */
+gboolean
+bt_torrent_load (BtTorrent *torrent, GError **error)
+{
+	BtTorrentPrivate *priv;
 
-	if (length) {
-		/* this torrent is one single file */
-		BtTorrentFile file = {g_strdup (priv->name), length->value, 0, 0};
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), FALSE);
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-		priv->size = length->value;
+	if (priv->loaded)
+		return TRUE;
 
-		g_array_append_val (priv->files, file);
+	if (priv->filename == NULL) {
+		g_set_error (error, BT_ERROR, BT_ERROR_INVALID_TORRENT, "the metadata hasn't been fetched yet");
+		return FALSE;
 	}
 
-	if (files) {
-		/* we have multiple files in the torrent, so loop through them */
-		GSList *i;
+	if (!bt_torrent_parse_file (torrent, error))
+		return FALSE;
 
-		priv->size = 0;
+	bt_torrent_finish_load (torrent);
 
-		for (i = files->list; i != NULL; i = i->next) {
-			BtBencode *entry, *length, *path;
-			GSList *j;
-			gchar **path_strv;
-			gchar *full_path;
-			BtTorrentFile file = {NULL, 0, 0, 0};
-			gsize k = 0;
+	return TRUE;
+}
 
-			entry = bt_bencode_slitem (i);
-			if (entry->type != BT_BENCODE_TYPE_DICT)
-				goto cleanup;
+/**
+ * bt_torrent_needs_metadata:
+ * @torrent: the torrent
+ *
+ * Checks whether this torrent was started from just its infohash, and is still
+ * waiting for peers to send the info dict.
+ *
+ * Returns: TRUE if the metadata has to be fetched
+ */
+gboolean
+bt_torrent_needs_metadata (BtTorrent *torrent)
+{
+	BtTorrentPrivate *priv;
 
-			length = bt_bencode_lookup (entry, "length");
-			path = bt_bencode_lookup (entry, "path");
-			if (!length || length->type != BT_BENCODE_TYPE_INT || !path || path->type != BT_BENCODE_TYPE_LIST)
-				goto cleanup;
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), FALSE);
 
-			path_strv = g_malloc0 ((g_slist_length (path->list) + 1) * sizeof (gpointer));
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-			for (j = path->list; j != NULL; j = j->next) {
-				if (bt_bencode_slitem (j)->type != BT_BENCODE_TYPE_STRING) {
-					g_free (path_strv);
-					goto cleanup;
-				}
+	return !g_atomic_int_get (&priv->loaded) && priv->filename == NULL;
+}
 
-				path_strv[k++] = bt_bencode_slitem (j)->string->str;
-			}
+/**
+ * bt_torrent_get_metadata:
+ * @torrent: the torrent
+ * @len: return location for the length of the metadata in bytes
+ *
+ * Gets the bencoded info dict of a loaded torrent, exactly as it hashes to the
+ * infohash, to be sent to peers that don't have it.
+ *
+ * Returns: the metadata, which is a pointer to an internal string and should
+ *   not be modified or freed, or NULL if the torrent isn't loaded.
+ */
+const gchar *
+bt_torrent_get_metadata (BtTorrent *torrent, gsize *len)
+{
+	BtTorrentPrivate *priv;
 
-			priv->size += length->value;
-			full_path = g_build_filenamev (path_strv);
-			g_free (path_strv);
-			g_debug ("%s", full_path);
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), NULL);
+	g_return_val_if_fail (len != NULL, NULL);
 
-			file.size = length->value;
-			file.name = full_path;
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-			g_array_append_val (priv->files, file);
+	*len = priv->metadata_len;
 
-			file.offset += file.size;
-		}
-	}
+	return priv->metadata;
+}
 
-	priv->num_pieces = (priv->size + priv->piece_length - 1) / priv->piece_length;
+static void
+bt_torrent_catch_up_peer (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data G_GNUC_UNUSED)
+{
+	bt_peer_catch_up (BT_PEER (value));
+}
+
+/* runs on the shard's thread once the torrent is loaded, and handles what its
+ * peers said about their pieces in the meantime */
+static void
+bt_torrent_catch_up_peers (gpointer data)
+{
+	BtTorrent *torrent = BT_TORRENT (data);
+	BtTorrentPrivate *priv;
 
-	priv->pieces = g_memdup (pieces->string->str, pieces->string->len);
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-	priv->bitfield = g_malloc0 ((priv->num_pieces + 7) /  8);
+	if (priv->peers != NULL)
+		g_hash_table_foreach (priv->peers, bt_torrent_catch_up_peer, NULL);
 
-	priv->block_size = MIN (priv->piece_length, 16384);
+	g_object_unref (torrent);
+}
 
-	priv->num_blocks = (priv->size + priv->block_size - 1) / priv->block_size;
+typedef struct {
+	BtTorrent *torrent;
+	gchar     *metadata;
+	gsize      len;
+} BtTorrentMetadataJob;
+
+/* loads the torrent from metadata that matched its infohash */
+static gboolean
+bt_torrent_load_info (BtTorrent *torrent, const gchar *metadata, gsize len, GError **error)
+{
+	BtTorrentPrivate *priv;
+	BtBencodeArena *arena;
+	BtBencode *info;
+	guint64 size;
+
+	priv = BT_TORRENT_GET_PRIVATE (torrent);
+
+	arena = bt_bencode_arena_new (len);
+
+	if (!(info = bt_bencode_decode_arena (arena, metadata, len, error))) {
+		bt_bencode_arena_free (arena);
+		return FALSE;
+	}
+
+	if (info->type != BT_BENCODE_TYPE_DICT || !bt_torrent_check_info (info, &size)
+	    || !bt_torrent_parse_info (torrent, info, size)) {
+		g_set_error (error, BT_ERROR, BT_ERROR_INVALID_TORRENT, "invalid metadata");
+		bt_bencode_arena_free (arena);
+		return FALSE;
+	}
+
+	bt_bencode_arena_free (arena);
+
+	bt_torrent_finish_load (torrent);
+
+	if (priv->shard == NULL)
+		bt_torrent_catch_up_peers (g_object_ref (torrent));
+	else
+		bt_shard_invoke (priv->shard, bt_torrent_catch_up_peers, g_object_ref (torrent));
 
-	bt_bencode_destroy (metainfo);
 	return TRUE;
+}
+
+/* runs bt_torrent_load_info() on the main thread, which reads what it sets up
+ * without locking */
+static gboolean
+bt_torrent_load_info_source (gpointer data)
+{
+	BtTorrentMetadataJob *job = (BtTorrentMetadataJob *) data;
+	GError *error = NULL;
+
+	/* it matches the infohash, so if it doesn't make sense no peer will send
+	 * anything better */
+	if (!bt_torrent_is_loaded (job->torrent) && !bt_torrent_load_info (job->torrent, job->metadata, job->len, &error)) {
+		g_warning ("could not load metadata for %s: %s", bt_torrent_get_infohash_string (job->torrent), error->message);
+		g_clear_error (&error);
+	}
+
+	g_object_unref (job->torrent);
+	g_free (job->metadata);
+	g_slice_free (BtTorrentMetadataJob, job);
 
-cleanup:
-	g_set_error (error, BT_ERROR, BT_ERROR_INVALID_TORRENT, "invalid torrent file");
-	bt_bencode_destroy (metainfo);
 	return FALSE;
 }
 
 /**
- * bt_torrent_get_infohash:
+ * bt_torrent_set_metadata:
  * @torrent: the torrent
+ * @metadata: the bencoded info dict
+ * @len: the length of @metadata in bytes
+ * @error: a return location for errors
  *
- * Get the infohash of this torrent as a 20-byte array.
+ * Loads a torrent that was started from its infohash, with the info dict that
+ * was fetched from its peers. It's checked against the infohash right away,
+ * and the torrent is loaded from it on the main thread afterwards. The peers
+ * that are already connected carry on, and whatever they said about their
+ * pieces in the meantime is handled once it's loaded. This has to be called
+ * from the torrent's shard thread.
  *
- * Returns: the infohash of the torrent, which is a pointer to an internal string and should
- *   not be modified or freed.
+ * Returns: TRUE if the metadata matches the infohash
  */
-const gchar *
-bt_torrent_get_infohash (BtTorrent *torrent)
+gboolean
+bt_torrent_set_metadata (BtTorrent *torrent, const gchar *metadata, gsize len, GError **error)
 {
 	BtTorrentPrivate *priv;
+	BtTorrentMetadataJob *job;
+	SHA1Context sha;
+	gchar hash[20];
 
-	g_return_val_if_fail (BT_IS_TORRENT (torrent), NULL);
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), FALSE);
+	g_return_val_if_fail (metadata != NULL, FALSE);
 
 	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-	return priv->infohash;
+	sha1_init (&sha);
+	sha1_update (&sha, metadata, len);
+	sha1_finish (&sha, hash);
+
+	if (memcmp (hash, priv->infohash, 20) != 0) {
+		g_set_error (error, BT_ERROR, BT_ERROR_INVALID_TORRENT, "metadata doesn't match the infohash");
+		return FALSE;
+	}
+
+	job = g_slice_new (BtTorrentMetadataJob);
+	job->torrent = g_object_ref (torrent);
+	job->metadata = g_memdup (metadata, len);
+	job->len = len;
+
+	g_idle_add (bt_torrent_load_info_source, job);
+
+	return TRUE;
 }
 
 /**
- * bt_torrent_get_infohash_string:
+ * bt_torrent_start:
  * @torrent: the torrent
  *
- * Get the infohash of this torrent as a 40-byte string.
- *
- * Returns: the infohash of the torrent as a string, which is a pointer to an internal
- *   string and should not be modified or freed.
+ * Start running this torrent, loading it first if needed.
  */
-const gchar *
-bt_torrent_get_infohash_string (BtTorrent *torrent)
+void
+bt_torrent_start (BtTorrent *torrent)
 {
 	BtTorrentPrivate *priv;
+	GError *error = NULL;
 
-	g_return_val_if_fail (BT_IS_TORRENT (torrent), NULL);
+	g_return_if_fail (BT_IS_TORRENT (torrent));
 
 	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-	return priv->infohash_string;
+	/* torrents from magnet links are loaded once their peers send the metadata */
+	if (!bt_torrent_needs_metadata (torrent) && !bt_torrent_load (torrent, &error)) {
+		g_warning ("could not load torrent: %s", error->message);
+		g_clear_error (&error);
+		return;
+	}
+
+	/* the trackers count from here */
+	g_static_mutex_lock (&priv->transfer_lock);
+	priv->downloaded = 0;
+	priv->uploaded = 0;
+	g_static_mutex_unlock (&priv->transfer_lock);
+
+	priv->tracker_started = FALSE;
+	
+	bt_torrent_tracker_announce (torrent);
+	bt_torrent_start_dht (torrent);
 }
 
 /**
- * bt_torrent_get_name:
+ * bt_torrent_stop:
  * @torrent: the torrent
  *
- * Get the name of this torrent.
- *
- * Returns: the name of the torrent, which is a pointer to an internal string and should
- *   not be modified or freed.
+ * Stop this torrent, disconnecting all of its peers.
  */
-const gchar *
-bt_torrent_get_name (BtTorrent *torrent)
+void
+bt_torrent_stop (BtTorrent *torrent)
 {
 	BtTorrentPrivate *priv;
 
-	g_return_val_if_fail (BT_IS_TORRENT (torrent), NULL);
+	g_return_if_fail (BT_IS_TORRENT (torrent));
 
 	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-	return priv->name;
+	bt_torrent_stop_dht (torrent);
+
+	if (priv->shard == NULL)
+		bt_torrent_drop_peers (torrent);
+	else
+		bt_shard_invoke (priv->shard, bt_torrent_drop_peers_job, g_object_ref (torrent));
 }
 
 /**
- * bt_torrent_get_size:
+ * bt_torrent_pause:
  * @torrent: the torrent
  *
- * Get the size of this torrent in bytes.
+ * Pause this torrent. Peers will stay connected, but no data will
+ * be sent.
+ */
+void
+bt_torrent_pause (BtTorrent *torrent)
+{
+	g_return_if_fail (BT_IS_TORRENT (torrent));
+}
+
+/**
+ * bt_torrent_get_shard:
+ * @torrent: the torrent
  *
- * Returns: the size of the torrent in bytes as a guint64.
+ * Gets the network thread that runs this torrent's peers. Anything that
+ * touches them has to be done there, through bt_shard_invoke().
+ *
+ * Returns: the shard, or NULL if the peers run from the main thread
  */
-guint64
-bt_torrent_get_size (BtTorrent *torrent)
+BtShard *
+bt_torrent_get_shard (BtTorrent *torrent)
 {
-	BtTorrentPrivate *priv;
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), NULL);
+
+	return BT_TORRENT_GET_PRIVATE (torrent)->shard;
+}
 
+/**
+ * bt_torrent_get_num_peers:
+ * @torrent: the torrent
+ *
+ * Gets the number of peers of the torrent, counting those still connecting.
+ * This can be called from any thread.
+ *
+ * Returns: the number of peers
+ */
+guint
+bt_torrent_get_num_peers (BtTorrent *torrent)
+{
 	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
 
-	priv = BT_TORRENT_GET_PRIVATE (torrent);
+	return g_atomic_int_get (&BT_TORRENT_GET_PRIVATE (torrent)->num_peers);
+}
 
-	return priv->size;
+/**
+ * bt_torrent_foreach_peer:
+ * @torrent: the torrent
+ * @func: the function to call with the address and the #BtPeer
+ * @data: user data for @func
+ *
+ * Calls @func for each of the torrent's peers, which must not be added or
+ * removed meanwhile. If the torrent has a shard, this has to be called from
+ * its thread.
+ */
+void
+bt_torrent_foreach_peer (BtTorrent *torrent, GHFunc func, gpointer data)
+{
+	g_return_if_fail (BT_IS_TORRENT (torrent));
+	g_return_if_fail (func != NULL);
+
+	g_hash_table_foreach (BT_TORRENT_GET_PRIVATE (torrent)->peers, func, data);
 }
 
 /**
- * bt_torrent_get_num_pieces:
+ * bt_torrent_is_private:
  * @torrent: the torrent
  *
- * Get the number of pieces for the torrent.
+ * Returns: whether the torrent is private, so that peers must only be found
+ *   through its trackers
+ */
+gboolean
+bt_torrent_is_private (BtTorrent *torrent)
+{
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), FALSE);
+
+	return BT_TORRENT_GET_PRIVATE (torrent)->is_private;
+}
+
+/**
+ * bt_torrent_get_max_peers:
+ * @torrent: the torrent
  *
- * Returns: the number of pieces for the torrent as a guint.
+ * Returns: the most peers the torrent connects to at once
  */
 guint
-bt_torrent_get_num_pieces (BtTorrent *torrent)
+bt_torrent_get_max_peers (BtTorrent *torrent)
 {
-	BtTorrentPrivate *priv;
-
 	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
 
-	priv = BT_TORRENT_GET_PRIVATE (torrent);
+	return BT_TORRENT_GET_PRIVATE (torrent)->max_peers;
+}
+
+/**
+ * bt_torrent_set_max_peers:
+ * @torrent: the torrent
+ * @max_peers: the most peers to connect to at once
+ *
+ * Sets how many peers the torrent connects to at once. Lowering it doesn't
+ * disconnect anyone, it only stops new connections until enough have closed.
+ */
+void
+bt_torrent_set_max_peers (BtTorrent *torrent, guint max_peers)
+{
+	g_return_if_fail (BT_IS_TORRENT (torrent));
+	g_return_if_fail (max_peers > 0);
+
+	BT_TORRENT_GET_PRIVATE (torrent)->max_peers = max_peers;
 
-	return priv->num_pieces;
+	g_object_notify (G_OBJECT (torrent), "max-peers");
 }
 
 /**
- * bt_torrent_get_piece_length:
+ * bt_torrent_add_peer:
  * @torrent: the torrent
+ * @peer: the peer
  *
- * Get the piece length for the torrent.
+ * Add a peer to this torrent, unless there already is one with the same
+ * address. If the torrent has a shard, this has to be called from its thread.
  *
- * Returns: the piece length for the torrent as a guint32.
+ * Returns: TRUE if the peer was added
  */
-guint32
-bt_torrent_get_piece_length (BtTorrent *torrent)
+gboolean
+bt_torrent_add_peer (BtTorrent *torrent, BtPeer *peer)
 {
-	BtTorrentPrivate *priv;
+	BtTorrentPrivate* priv;
+	const BtAddress *address;
 
-	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
+	g_return_val_if_fail (BT_IS_TORRENT (torrent), FALSE);
+	g_return_val_if_fail (BT_IS_PEER (peer), FALSE);
 
 	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-	return priv->piece_length;
+	address = bt_peer_get_address (peer);
+
+	if (g_hash_table_lookup (priv->peers, address) != NULL)
+		return FALSE;
+
+	/* the key is part of the peer, which the table holds a reference to */
+	g_hash_table_insert (priv->peers, (gpointer) address, g_object_ref (peer));
+
+	g_atomic_int_inc (&priv->num_peers);
+
+	return TRUE;
 }
 
 /**
- * bt_torrent_get_piece_length_extended:
+ * bt_torrent_remove_peer:
  * @torrent: the torrent
- * @piece: the piece index
- *
- * Get the piece length for the piece index.
+ * @peer: the peer
  *
- * Returns: the piece length for the piece index as a guint32.
- * Always the same as @bt_torrent_get_piece_length except for the last piece,
- * which might be slighty less.
+ * Removes a peer that was disconnected from this torrent, remembers how it
+ * did for the next time we connect to it, and connects to another peer in
+ * its place. If the torrent has a shard, this has to be called from its
+ * thread.
  */
-guint32
-bt_torrent_get_piece_length_extended (BtTorrent *torrent, guint piece)
+void
+bt_torrent_remove_peer (BtTorrent *torrent, BtPeer *peer)
 {
 	BtTorrentPrivate *priv;
+	BtTorrentCandidate *candidate;
+	const BtAddress *address;
 
-	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
+	g_return_if_fail (BT_IS_TORRENT (torrent));
+	g_return_if_fail (BT_IS_PEER (peer));
 
 	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-	if (piece == (priv->num_pieces - 1))
-		return priv->size - ((priv->num_pieces - 1) * priv->piece_length);
-	else
-		return priv->piece_length;
+	address = bt_peer_get_address (peer);
+
+	/* it may have lost out to another peer with the same address */
+	if (g_hash_table_lookup (priv->peers, address) != peer)
+		return;
+
+	/* incoming peers aren't candidates, they connect from a random port */
+	candidate = g_hash_table_lookup (priv->candidates, address);
+
+	if (candidate != NULL) {
+		GTimeVal now;
+
+		candidate->connected = FALSE;
+		candidate->downloaded += bt_peer_get_downloaded (peer) / 1024;
+
+		if (bt_peer_is_established (peer))
+			candidate->failures = 0;
+		else
+			candidate->failures++;
+
+		g_get_current_time (&now);
+		candidate->next_attempt = now.tv_sec + (BT_TORRENT_RECONNECT_DELAY << candidate->failures);
+
+		if (candidate->failures >= BT_TORRENT_MAX_CANDIDATE_FAILURES)
+			g_hash_table_remove (priv->candidates, candidate);
+	}
+
+	/* drops the table's reference, after which address may be gone */
+	g_hash_table_remove (priv->peers, address);
+
+	g_atomic_int_add (&priv->num_peers, -1);
+
+	bt_torrent_connect_candidates (torrent);
+}
+
+/* the bytes given to each peer bitfield, rounded up so that the pool stays
+ * aligned and a free one has room for the free list */
+static gsize
+bt_torrent_peer_bitfield_stride (BtTorrentPrivate *priv)
+{
+	gsize size = (priv->num_pieces + 7) / 8;
+
+	size = (size + sizeof (gpointer) - 1) & ~(sizeof (gpointer) - 1);
+
+	return MAX (size, sizeof (GTrashStack));
 }
 
 /**
- * bt_torrent_get_piece_hash:
+ * bt_torrent_alloc_bitfield:
  * @torrent: the torrent
- * @piece: the piece index
  *
- * Get the infohash of the piece as a 20-byte array.
+ * Gets room for a peer's bitfield, with all bits clear, from a pool the torrent
+ * keeps so that peers don't each make a heap allocation of their own. It has
+ * to be given back with bt_torrent_free_bitfield(). If the torrent has a
+ * shard, this has to be called from its thread.
  *
- * Returns: the 20-byte infohash of the piece, 
- * which is a pointer to an internal string and should not be modified or freed.
+ * Returns: a bitfield of one bit per piece, owned by the torrent
  */
-const gchar *
-bt_torrent_get_piece_hash (BtTorrent* torrent, guint piece)
+gchar *
+bt_torrent_alloc_bitfield (BtTorrent *torrent)
 {
 	BtTorrentPrivate *priv;
+	gchar *bitfield;
+	gsize stride;
 
 	g_return_val_if_fail (BT_IS_TORRENT (torrent), NULL);
 
 	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-	g_return_val_if_fail (piece < priv->num_pieces, NULL);
+	g_return_val_if_fail (priv->num_pieces > 0, NULL);
 
-	return &priv->pieces[20 * piece];
-}
+	stride = bt_torrent_peer_bitfield_stride (priv);
+	bitfield = g_trash_stack_pop (&priv->peer_bitfield_free);
 
-/**
- * bt_torrent_get_num_blocks:
- * @torrent: the torrent
- *
- * Get the number of blocks for the torrent.
- *
- * Returns: the number of blocks for the torrent as a guint.
- */
-guint
-bt_torrent_get_num_blocks (BtTorrent *torrent)
-{
-	BtTorrentPrivate *priv;
+	if (bitfield == NULL) {
+		if (priv->peer_bitfield_blocks == NULL || priv->peer_bitfield_block_used == BT_TORRENT_BITFIELD_BLOCK) {
+			priv->peer_bitfield_blocks = g_slist_prepend (priv->peer_bitfield_blocks, g_malloc (stride * BT_TORRENT_BITFIELD_BLOCK));
+			priv->peer_bitfield_block_used = 0;
+		}
 
-	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
+		bitfield = (gchar *) priv->peer_bitfield_blocks->data + stride * priv->peer_bitfield_block_used++;
+	}
 
-	priv = BT_TORRENT_GET_PRIVATE (torrent);
+	memset (bitfield, 0, stride);
 
-	return priv->num_blocks;
+	return bitfield;
 }
 
 /**
- * bt_torrent_get_block_size:
+ * bt_torrent_free_bitfield:
  * @torrent: the torrent
+ * @bitfield: a bitfield from bt_torrent_alloc_bitfield()
  *
- * Get the block size for the torrent.
- *
- * Returns: the block size for the torrent as a guint.
+ * Gives a peer's bitfield back to the torrent's pool.
  */
-guint
-bt_torrent_get_block_size (BtTorrent *torrent)
+void
+bt_torrent_free_bitfield (BtTorrent *torrent, gchar *bitfield)
 {
 	BtTorrentPrivate *priv;
 
-	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
+	g_return_if_fail (BT_IS_TORRENT (torrent));
+	g_return_if_fail (bitfield != NULL);
 
 	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-	return priv->block_size;
+	g_trash_stack_push (&priv->peer_bitfield_free, bitfield);
 }
 
 /**
- * bt_torrent_get_block_size_extended:
- * @torrent: the torrent
- * @block: the block index
+ * bt_torrent_new:
+ * @manager: the manager
+ * @filename: the .torrent file
+ * @error: a return location for errors
  *
- * Get the block size for the block index.
+ * Creates a torrent from a metainfo file. The file is checked, but only the
+ * torrent's name, size and infohash are kept until it is started.
  *
- * Returns: the block size for the block index as a guint.
- * Always the same as @bt_torrent_get_block_size except for the last block,
- * which might be slighty less.
+ * Returns: the new torrent, or NULL if the file is not a valid torrent
  */
-guint
-bt_torrent_get_block_size_extended (BtTorrent *torrent, guint block)
+BtTorrent *
+bt_torrent_new (BtManager *manager, gchar *filename, GError **error)
 {
-	BtTorrentPrivate *priv;
-
-	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
+	BtTorrent *torrent;
+	gchar *name, *infohash;
+	guint64 size;
+	
+	g_return_val_if_fail (BT_IS_MANAGER (manager), NULL);
+	g_return_val_if_fail (filename != NULL, NULL);
+	
+	if (!bt_torrent_read_summary (filename, &name, &size, &infohash, error))
+		return NULL;
 
-	priv = BT_TORRENT_GET_PRIVATE (torrent);
+	torrent = bt_torrent_new_dormant (manager, filename, name, size, infohash);
 
-	if (block == (priv->num_blocks - 1))
-		return priv->size - ((priv->num_blocks - 1) * priv->block_size);
-	else
-		return priv->block_size;
+	g_free (name);
+	g_free (infohash);
+	
+	return torrent;
 }
 
 /**
- * bt_torrent_get_file:
- * @torrent: the torrent
- * @index: the file index
+ * bt_torrent_new_dormant:
+ * @manager: the manager
+ * @filename: the .torrent file
+ * @name: the name of the torrent
+ * @size: the size of the torrent in bytes
+ * @infohash: the 20-byte infohash of the torrent
  *
- * Get a file by index.
+ * Creates a torrent from information that was saved earlier, like in the
+ * manager's index, without reading the metainfo file at all. The file is read
+ * when the torrent is started.
  *
- * Returns: the file specified by @index.
+ * Returns: the new torrent
  */
-const BtTorrentFile *
-bt_torrent_get_file (BtTorrent *torrent, guint index)
+BtTorrent *
+bt_torrent_new_dormant (BtManager *manager, const gchar *filename, const gchar *name, guint64 size, const gchar *infohash)
 {
 	BtTorrentPrivate *priv;
+	GObject *torrent;
 
-	g_return_val_if_fail (BT_IS_TORRENT (torrent), NULL);
+	g_return_val_if_fail (BT_IS_MANAGER (manager), NULL);
+	g_return_val_if_fail (filename != NULL, NULL);
+	g_return_val_if_fail (name != NULL, NULL);
+	g_return_val_if_fail (infohash != NULL, NULL);
+
+	torrent = g_object_new (BT_TYPE_TORRENT, "manager", manager, NULL);
 
 	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-	g_return_val_if_fail (index < priv->files->len, NULL);
+	priv->filename = g_strdup (filename);
+	priv->name = g_strdup (name);
+	priv->size = size;
+	priv->infohash = g_memdup (infohash, 20);
+	priv->infohash_string = bt_hash_to_string (priv->infohash);
+	priv->shard = bt_manager_get_shard (manager, priv->infohash);
 
-	return &g_array_index (priv->files, BtTorrentFile, index);
+	return BT_TORRENT (torrent);
 }
 
 /**
- * bt_torrent_get_num_files:
- * @torrent: the torrent
+ * bt_torrent_new_from_infohash:
+ * @manager: the manager
+ * @infohash: the 20-byte infohash of the torrent
+ * @name: a name to show until the metadata comes in, or NULL
+ * @announce: the tracker to announce to, or NULL
  *
- * Get the number of files for the torrent.
+ * Creates a torrent that only knows its infohash. Its metadata is fetched from
+ * the peers it finds once it is started, and it is loaded from that.
  *
- * Returns: the number of files for the torrent as a guint.
+ * Returns: the new torrent
  */
-guint
-bt_torrent_get_num_files (BtTorrent *torrent)
+BtTorrent *
+bt_torrent_new_from_infohash (BtManager *manager, const gchar *infohash, const gchar *name, const gchar *announce)
 {
 	BtTorrentPrivate *priv;
+	GObject *torrent;
 
-	g_return_val_if_fail (BT_IS_TORRENT (torrent), 0);
+	g_return_val_if_fail (BT_IS_MANAGER (manager), NULL);
+	g_return_val_if_fail (infohash != NULL, NULL);
+
+	torrent = g_object_new (BT_TYPE_TORRENT, "manager", manager, NULL);
 
 	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-	return priv->files->len;
-}
+	priv->infohash = g_memdup (infohash, 20);
+	priv->infohash_string = bt_hash_to_string (priv->infohash);
+	priv->name = g_strdup (name != NULL ? name : priv->infohash_string);
+	priv->announce = g_strdup (announce);
+	priv->shard = bt_manager_get_shard (manager, priv->infohash);
 
-/**
- * bt_torrent_start:
- * @torrent: the torrent
- *
- * Start running this torrent.
- */
-void
-bt_torrent_start (BtTorrent *torrent)
-{
-	g_return_if_fail (BT_IS_TORRENT (torrent));
-	
-	bt_torrent_tracker_announce (torrent);
-}
+	/* it takes peers right away, to get the metadata from them */
+	bt_torrent_create_peer_tables (BT_TORRENT (torrent));
 
-/**
- * bt_torrent_stop:
- * @torrent: the torrent
- *
- * Stop this torrent.
- */
-void
-bt_torrent_stop (BtTorrent *torrent)
-{
-	g_return_if_fail (BT_IS_TORRENT (torrent));
+	return BT_TORRENT (torrent);
 }
 
-/**
- * bt_torrent_pause:
- * @torrent: the torrent
- *
- * Pause this torrent. Peers will stay connected, but no data will
- * be sent.
- */
-void
-bt_torrent_pause (BtTorrent *torrent)
+/* reads the infohash of a magnet link, which is either 40 hex digits or 32
+ * base32 ones */
+static gchar *
+bt_torrent_parse_btih (const gchar *string)
 {
-	g_return_if_fail (BT_IS_TORRENT (torrent));
+	gchar *hash;
+	guint i, j, bits, acc;
+	gsize len;
+
+	len = strlen (string);
+	hash = g_malloc (20);
+
+	if (len == 40) {
+		for (i = 0; i < 20; i++) {
+			if (!g_ascii_isxdigit (string[i * 2]) || !g_ascii_isxdigit (string[i * 2 + 1]))
+				goto fail;
+
+			hash[i] = (g_ascii_xdigit_value (string[i * 2]) << 4) | g_ascii_xdigit_value (string[i * 2 + 1]);
+		}
+
+		return hash;
+	}
+
+	if (len == 32) {
+		bits = acc = j = 0;
+
+		for (i = 0; i < 32; i++) {
+			gchar c = g_ascii_toupper (string[i]);
+
+			if (c >= 'A' && c <= 'Z')
+				acc = (acc << 5) | (c - 'A');
+			else if (c >= '2' && c <= '7')
+				acc = (acc << 5) | (c - '2' + 26);
+			else
+				goto fail;
+
+			bits += 5;
+
+			if (bits >= 8) {
+				bits -= 8;
+				hash[j++] = (acc >> bits) & 0xFF;
+			}
+		}
+
+		return hash;
+	}
+
+fail:
+	g_free (hash);
+	return NULL;
 }
 
 /**
- * bt_torrent_add_peer:
- * @torrent: the torrent
- * @peer: the peer
+ * bt_torrent_new_from_magnet:
+ * @manager: the manager
+ * @uri: the magnet link
+ * @error: a return location for errors
  *
- * Add a peer to this torrent.
+ * Creates a torrent from a magnet link with a BitTorrent infohash, which can
+ * also give it a name and trackers. Like bt_torrent_new_from_infohash(), the
+ * torrent is loaded once its metadata has been fetched from its peers.
+ *
+ * Returns: the new torrent, or NULL if the link has no infohash
  */
-void
-bt_torrent_add_peer (BtTorrent *torrent, BtPeer *peer)
+BtTorrent *
+bt_torrent_new_from_magnet (BtManager *manager, const gchar *uri, GError **error)
 {
-	BtTorrentPrivate* priv;
+	BtTorrent *torrent;
+	BtTorrentPrivate *priv;
+	GSList *trackers;
+	gchar **params, *infohash, *name;
+	guint i;
 
-	g_return_if_fail (BT_IS_TORRENT (torrent));
-	g_return_if_fail (BT_IS_PEER (peer));
+	g_return_val_if_fail (BT_IS_MANAGER (manager), NULL);
+	g_return_val_if_fail (uri != NULL, NULL);
+
+	if (g_ascii_strncasecmp (uri, "magnet:?", 8) != 0) {
+		g_set_error (error, BT_ERROR, BT_ERROR_INVALID_MAGNET, "not a magnet link");
+		return NULL;
+	}
+
+	infohash = name = NULL;
+	trackers = NULL;
+
+	params = g_strsplit (uri + 8, "&", 0);
+
+	for (i = 0; params[i] != NULL; i++) {
+		gchar *value, *decoded;
+
+		if (!(value = strchr (params[i], '=')))
+			continue;
+
+		*value++ = '\0';
+
+		if (strcmp (params[i], "xt") == 0 && infohash == NULL) {
+			decoded = bt_url_decode (value, strlen (value));
+
+			if (g_ascii_strncasecmp (decoded, "urn:btih:", 9) == 0)
+				infohash = bt_torrent_parse_btih (decoded + 9);
+
+			g_free (decoded);
+		} else if (strcmp (params[i], "dn") == 0 && name == NULL) {
+			/* names often come with spaces as '+', like in a form */
+			g_strdelimit (value, "+", ' ');
+			name = bt_url_decode (value, strlen (value));
+		} else if (strcmp (params[i], "tr") == 0 || g_str_has_prefix (params[i], "tr.")) {
+			trackers = g_slist_prepend (trackers, bt_url_decode (value, strlen (value)));
+		}
+	}
+
+	g_strfreev (params);
+
+	if (infohash == NULL) {
+		g_set_error (error, BT_ERROR, BT_ERROR_INVALID_MAGNET, "magnet link has no BitTorrent infohash");
+		g_free (name);
+		g_slist_foreach (trackers, (GFunc) g_free, NULL);
+		g_slist_free (trackers);
+		return NULL;
+	}
+
+	trackers = g_slist_reverse (trackers);
 
+	torrent = bt_torrent_new_from_infohash (manager, infohash, name, trackers ? trackers->data : NULL);
+
+	/* the trackers are all in one tier, as if it was an announce-list */
 	priv = BT_TORRENT_GET_PRIVATE (torrent);
 
-	g_return_if_fail (!g_list_find (priv->peers, peer));
+	if (trackers != NULL)
+		priv->announce_list = g_slist_prepend (NULL, trackers);
 
-	priv->peers = g_list_append (priv->peers, g_object_ref (peer));
-}
+	g_free (infohash);
+	g_free (name);
 
-BtTorrent *
-bt_torrent_new (BtManager *manager, gchar *filename, GError **error)
-{
-	GObject *torrent;
-	
-	g_return_val_if_fail (BT_IS_MANAGER (manager), NULL);
-	
-	torrent = g_object_new (BT_TYPE_TORRENT, "manager", manager, NULL);
-	
-	bt_torrent_parse_file (BT_TORRENT (torrent), filename, error);
-	
-	return BT_TORRENT (torrent);
+	return torrent;
 }
 
 static void
@@ -930,7 +2890,15 @@ bt_torrent_dispose (GObject *object)
 	if (priv->name == NULL)
 		return;
 
+	/* peers on a network thread may be in the middle of a handler, so they
+	 * are let go of there, and waited for, before anything they use goes */
+	if (priv->shard != NULL)
+		bt_shard_invoke_and_wait (priv->shard, bt_torrent_drop_peers_func, torrent);
+	else
+		bt_torrent_drop_peers (torrent);
+
 	g_free (priv->name);
+	g_free (priv->filename);
 
 	g_free (priv->infohash);
 	g_free (priv->infohash_string);
@@ -938,25 +2906,32 @@ bt_torrent_dispose (GObject *object)
 	// FIXME: free contents of announce_list
 	g_slist_free (priv->announce_list);
 	g_free (priv->bitfield);
+	g_free (priv->claimed);
+	g_free (priv->resume_bitfield);
 	g_free (priv->pieces);
+	g_free (priv->metadata);
 	g_array_free (priv->files, TRUE);
 
-	if (priv->peers != NULL)
-	{
-		GList *i = NULL;
-		for (i = priv->peers; i != NULL; i = i->next) {
-			g_object_unref (G_OBJECT (i->data));
-		}
-		g_list_free (priv->peers);
+	if (priv->peers != NULL) {
+		g_hash_table_destroy (priv->peers);
+		g_hash_table_destroy (priv->candidates);
 	}
 
+	g_slist_foreach (priv->peer_bitfield_blocks, (GFunc) g_free, NULL);
+	g_slist_free (priv->peer_bitfield_blocks);
+	priv->peer_bitfield_blocks = NULL;
+	priv->peer_bitfield_free = NULL;
+
 	if (priv->tracker_id != NULL)
 		g_free (priv->tracker_id);
 
 	// delete tracker_connection
 	bt_torrent_tracker_stop_announce (torrent);
 
-	g_object_unref (torrent->io);
+	bt_torrent_stop_dht (torrent);
+
+	if (torrent->io != NULL)
+		g_object_unref (torrent->io);
 
 	G_OBJECT_CLASS (bt_torrent_parent_class)->dispose (object);
 	
@@ -966,6 +2941,8 @@ bt_torrent_dispose (GObject *object)
 static void
 bt_torrent_finalize (GObject *object)
 {
+	g_static_mutex_free (&BT_TORRENT_GET_PRIVATE (BT_TORRENT (object))->transfer_lock);
+
 	G_OBJECT_CLASS (bt_torrent_parent_class)->finalize (object);
 	
 	return;
@@ -988,6 +2965,10 @@ bt_torrent_set_property (GObject *object, guint property, const GValue *value, G
 		priv->manager = BT_MANAGER (g_value_get_pointer (value));
 		bt_add_weak_pointer (G_OBJECT (priv->manager), (gpointer)&priv->manager);
 		break;
+
+	case BT_TORRENT_PROPERTY_MAX_PEERS:
+		priv->max_peers = g_value_get_uint (value);
+		break;
 	
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property, pspec);
@@ -1016,6 +2997,10 @@ bt_torrent_get_property (GObject *object, guint property, GValue *value, GParamS
 		// FIXME: this might leave a dangling pointer in value
 		g_value_set_pointer (value, priv->manager);
 		break;
+
+	case BT_TORRENT_PROPERTY_MAX_PEERS:
+		g_value_set_uint (value, priv->max_peers);
+		break;
 	
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property, pspec);
@@ -1033,9 +3018,26 @@ bt_torrent_init (BtTorrent *torrent)
 
 	priv->files = g_array_new (FALSE, TRUE, sizeof (BtTorrentFile));
 	priv->peers = NULL;
+	priv->num_peers = 0;
+	priv->candidates = NULL;
+	priv->peer_bitfield_blocks = NULL;
+	priv->peer_bitfield_block_used = 0;
+	priv->peer_bitfield_free = NULL;
+	priv->candidate_seq = 0;
+	priv->refill_source = NULL;
+	priv->have_source = NULL;
+	priv->dht_source = NULL;
+	priv->shard = NULL;
 	priv->pieces = NULL;
+	priv->is_private = FALSE;
+	priv->downloaded = 0;
+	priv->uploaded = 0;
+	priv->tracker_started = FALSE;
 
-	torrent->io = g_object_new (BT_TYPE_IO, "torrent", torrent, NULL);
+	g_static_mutex_init (&priv->transfer_lock);
+
+	/* created when the torrent is loaded */
+	torrent->io = NULL;
 
 	return;
 }
@@ -1092,6 +3094,22 @@ bt_torrent_class_init (BtTorrentClass *torrent_class)
 	                             G_PARAM_READWRITE | G_PARAM_STATIC_NAME | G_PARAM_STATIC_BLURB | G_PARAM_STATIC_NICK | G_PARAM_CONSTRUCT_ONLY);
 	
 	g_object_class_install_property (object_class, BT_TORRENT_PROPERTY_MANAGER, pspec);
+
+	/**
+	 * BtTorrent:max-peers:
+	 *
+	 * The most peers this torrent connects to at once. Addresses from the
+	 * tracker past that are kept and connected to as others drop out.
+	 */
+	pspec = g_param_spec_uint ("max-peers",
+	                           "maximum peers",
+	                           "The maximum number of peers to be connected to at once",
+	                           1,
+	                           G_MAXUINT16,
+	                           BT_TORRENT_DEFAULT_MAX_PEERS,
+	                           G_PARAM_READWRITE | G_PARAM_STATIC_NAME | G_PARAM_STATIC_BLURB | G_PARAM_STATIC_NICK | G_PARAM_CONSTRUCT);
+
+	g_object_class_install_property (object_class, BT_TORRENT_PROPERTY_MAX_PEERS, pspec);
 	
 	/**
 	 * BtTorrent::tracker-updated:
@@ -32,13 +32,14 @@ typedef struct _BtTorrentClass   BtTorrentClass;
 
 #include "bt-manager.h"
 #include "bt-peer.h"
+#include "bt-shard.h"
 #include "bt-torrent-file.h"
 #include "bt-io.h"
 
 struct _BtTorrent {
 	GObject    parent;
 
-	/* the io object for this torrent */
+	/* the io object for this torrent, NULL until it is loaded */
 	BtIO *io;
 };
 
@@ -50,6 +51,30 @@ GType      bt_torrent_get_type ();
 
 BtTorrent *bt_torrent_new (BtManager *manager, gchar *filename, GError **error);
 
+BtTorrent *bt_torrent_new_dormant (BtManager *manager, const gchar *filename, const gchar *name, guint64 size, const gchar *infohash);
+
+BtTorrent *bt_torrent_new_from_infohash (BtManager *manager, const gchar *infohash, const gchar *name, const gchar *announce);
+
+BtTorrent *bt_torrent_new_from_magnet (BtManager *manager, const gchar *uri, GError **error);
+
+gboolean   bt_torrent_read_summary (const gchar *filename, gchar **name, guint64 *size, gchar **infohash, GError **error);
+
+const gchar          *bt_torrent_get_filename (BtTorrent *torrent);
+
+gboolean              bt_torrent_is_loaded (BtTorrent *torrent);
+
+gboolean              bt_torrent_load (BtTorrent *torrent, GError **error);
+
+gboolean              bt_torrent_needs_metadata (BtTorrent *torrent);
+
+const gchar          *bt_torrent_get_metadata (BtTorrent *torrent, gsize *len);
+
+gboolean              bt_torrent_set_metadata (BtTorrent *torrent, const gchar *metadata, gsize len, GError **error);
+
+void                  bt_torrent_set_resume_data (BtTorrent *torrent, const gchar *bitfield, gsize len);
+
+const gchar          *bt_torrent_get_bitfield (BtTorrent *torrent, gsize *len);
+
 const gchar          *bt_torrent_get_infohash (BtTorrent *torrent);
 
 const gchar          *bt_torrent_get_infohash_string (BtTorrent *torrent);
@@ -66,6 +91,22 @@ guint32               bt_torrent_get_piece_length_extended (BtTorrent *torrent,
 
 const gchar          *bt_torrent_get_piece_hash (BtTorrent* torrent, guint piece);
 
+gboolean              bt_torrent_has_piece (BtTorrent *torrent, guint piece);
+
+guint                 bt_torrent_count_missing (BtTorrent *torrent, const gchar *bitfield);
+
+guint                 bt_torrent_get_num_have (BtTorrent *torrent);
+
+gint                  bt_torrent_pick_piece (BtTorrent *torrent, const gchar *bitfield);
+
+gboolean              bt_torrent_claim_piece (BtTorrent *torrent, guint piece);
+
+void                  bt_torrent_unpick_piece (BtTorrent *torrent, guint piece);
+
+void                  bt_torrent_complete_piece (BtTorrent *torrent, guint piece);
+
+void                  bt_torrent_add_transferred (BtTorrent *torrent, guint64 downloaded, guint64 uploaded);
+
 guint                 bt_torrent_get_num_blocks (BtTorrent *torrent);
 
 guint                 bt_torrent_get_block_size (BtTorrent *torrent);
@@ -82,7 +123,29 @@ void                  bt_torrent_stop (BtTorrent *torrent);
 
 void                  bt_torrent_pause (BtTorrent *torrent);
 
-void                  bt_torrent_add_peer (BtTorrent *torrent, BtPeer *peer);
+BtShard              *bt_torrent_get_shard (BtTorrent *torrent);
+
+gboolean              bt_torrent_is_private (BtTorrent *torrent);
+
+guint                 bt_torrent_get_num_peers (BtTorrent *torrent);
+
+guint                 bt_torrent_get_max_peers (BtTorrent *torrent);
+
+void                  bt_torrent_set_max_peers (BtTorrent *torrent, guint max_peers);
+
+gboolean              bt_torrent_add_peer (BtTorrent *torrent, BtPeer *peer);
+
+void                  bt_torrent_remove_peer (BtTorrent *torrent, BtPeer *peer);
+
+void                  bt_torrent_foreach_peer (BtTorrent *torrent, GHFunc func, gpointer data);
+
+void                  bt_torrent_add_candidates (BtTorrent *torrent, GArray *addresses);
+
+void                  bt_torrent_connect_candidates (BtTorrent *torrent);
+
+gchar                *bt_torrent_alloc_bitfield (BtTorrent *torrent);
+
+void                  bt_torrent_free_bitfield (BtTorrent *torrent, gchar *bitfield);
 
 void                  bt_torrent_tracker_announce (BtTorrent *torrent);
 
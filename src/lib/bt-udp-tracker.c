@@ -0,0 +1,933 @@
+/**
+ * bt-udp-tracker.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bt-udp-tracker.h"
+#include "bt-udp.h"
+#include "bt-resolver.h"
+#include "bt-utils.h"
+
+/* the magic number every connect request starts with */
+#define BT_UDP_TRACKER_PROTOCOL_ID G_GINT64_CONSTANT (0x41727101980)
+
+#define BT_UDP_TRACKER_ACTION_CONNECT 0
+#define BT_UDP_TRACKER_ACTION_ANNOUNCE 1
+#define BT_UDP_TRACKER_ACTION_ERROR 3
+
+#define BT_UDP_TRACKER_CONNECT_LENGTH 16
+#define BT_UDP_TRACKER_ANNOUNCE_LENGTH 98
+
+/* milliseconds before the first retransmission; each one after that waits
+ * twice as long as the one before */
+#define BT_UDP_TRACKER_DEFAULT_TIMEOUT (15 * 1000)
+
+/* sends of a request before giving up. BEP 15 goes on to 9, which takes over
+ * two hours; by then the next announce is due anyway */
+#define BT_UDP_TRACKER_MAX_ATTEMPTS 4
+
+/* milliseconds a connection id can be used for after we get it */
+#define BT_UDP_TRACKER_CONNECTION_TTL (60 * 1000)
+
+/* milliseconds a tracker's address is kept, and before trying again to look
+ * up one that couldn't be found */
+#define BT_UDP_TRACKER_RESOLVE_TTL (60 * 60 * 1000)
+#define BT_UDP_TRACKER_RESOLVE_RETRY (5 * 60 * 1000)
+
+/* announces sent per tick, so that thousands of torrents on one tracker go
+ * out over a few seconds instead of overflowing the socket's buffer */
+#define BT_UDP_TRACKER_TICK 250
+#define BT_UDP_TRACKER_BURST 128
+
+typedef enum {
+	BT_UDP_TRACKER_HOST_RESOLVING,
+	BT_UDP_TRACKER_HOST_RESOLVED,
+	BT_UDP_TRACKER_HOST_UNRESOLVED
+} BtUdpTrackerHostState;
+
+typedef struct _BtUdpTrackerHost BtUdpTrackerHost;
+
+typedef struct {
+	BtUdpTrackerHost *host;
+	guint32           transaction_id;
+	guint8            action;
+
+	/* times it was sent, and when it's given up on if it isn't answered, in
+	 * milliseconds */
+	guint8            attempts;
+	gint64            deadline;
+
+	BtUdpTrackerAnnounce announce;
+
+	/* NULL once the request is cancelled, which leaves it to be dropped
+	 * wherever it is */
+	BtUdpTrackerFunc  func;
+	gpointer          data;
+} BtUdpTrackerRequest;
+
+/* a tracker, which any number of torrents announce to */
+struct _BtUdpTrackerHost {
+	gint              ref_count;
+	BtUdpTracker     *tracker;
+
+	/* "host:port", the key in the table of hosts */
+	gchar            *key;
+	gchar            *hostname;
+	guint16           port;
+
+	BtUdpTrackerHostState state;
+	BtAddress         address;
+	gint64            resolved;
+
+	/* the connection id, and when it was given to us; 0 if there is none */
+	guint64           connection_id;
+	gint64            connected;
+
+	/* the connect request that's out, if any */
+	BtUdpTrackerRequest *connect;
+
+	/* announces waiting for the address or a connection id */
+	GQueue           *waiting;
+};
+
+struct _BtUdpTracker {
+	BtUdpSocket  *socket;
+	GMainContext *context;
+	GSource      *tick_source;
+
+	/* BtUdpTrackerHost by key */
+	GHashTable   *hosts;
+
+	/* requests that were sent, by transaction id */
+	GHashTable   *pending;
+
+	/* announces that are ready to go out as soon as there's room in the
+	 * burst */
+	GQueue       *outgoing;
+	guint         budget;
+
+	/* lists of the announces made with each user data, for cancelling */
+	GHashTable   *by_data;
+
+	guint         timeout;
+
+	BtUdpTrackerStats stats;
+};
+
+static void bt_udp_tracker_send_announce (BtUdpTracker *tracker, BtUdpTrackerRequest *request);
+static void bt_udp_tracker_send_connect (BtUdpTracker *tracker, BtUdpTrackerHost *host);
+
+static gint64
+bt_udp_tracker_now ()
+{
+	GTimeVal now;
+
+	g_get_current_time (&now);
+
+	return (gint64) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+static void
+bt_udp_tracker_put32 (gchar *buf, guint32 value)
+{
+	value = g_htonl (value);
+	memcpy (buf, &value, 4);
+}
+
+static void
+bt_udp_tracker_put64 (gchar *buf, guint64 value)
+{
+	bt_udp_tracker_put32 (buf, value >> 32);
+	bt_udp_tracker_put32 (buf + 4, value & G_GINT64_CONSTANT (0xffffffff));
+}
+
+static guint32
+bt_udp_tracker_get32 (const gchar *buf)
+{
+	guint32 value;
+
+	memcpy (&value, buf, 4);
+
+	return g_ntohl (value);
+}
+
+static guint64
+bt_udp_tracker_get64 (const gchar *buf)
+{
+	return (guint64) bt_udp_tracker_get32 (buf) << 32 | bt_udp_tracker_get32 (buf + 4);
+}
+
+static BtUdpTrackerHost *
+bt_udp_tracker_host_ref (BtUdpTrackerHost *host)
+{
+	host->ref_count++;
+
+	return host;
+}
+
+static void
+bt_udp_tracker_host_unref (gpointer data)
+{
+	BtUdpTrackerHost *host = (BtUdpTrackerHost *) data;
+
+	if (--host->ref_count > 0)
+		return;
+
+	g_queue_free (host->waiting);
+	g_free (host->key);
+	g_free (host->hostname);
+	g_slice_free (BtUdpTrackerHost, host);
+}
+
+static void
+bt_udp_tracker_request_free (BtUdpTrackerRequest *request)
+{
+	bt_udp_tracker_host_unref (request->host);
+	g_slice_free (BtUdpTrackerRequest, request);
+}
+
+/* a request that won't be needed anymore, whether or not it's cancelled */
+static void
+bt_udp_tracker_forget (BtUdpTracker *tracker, BtUdpTrackerRequest *request)
+{
+	GList *list, *l;
+
+	if (request->func == NULL)
+		return;
+
+	list = g_hash_table_lookup (tracker->by_data, request->data);
+
+	if ((l = g_list_find (list, request)) == NULL)
+		return;
+
+	list = g_list_delete_link (list, l);
+
+	if (list == NULL)
+		g_hash_table_remove (tracker->by_data, request->data);
+	else
+		g_hash_table_insert (tracker->by_data, request->data, list);
+
+	tracker->stats.requests--;
+}
+
+/* ends an announce with a response or an error, and frees it */
+static void
+bt_udp_tracker_finish (BtUdpTracker *tracker, BtUdpTrackerRequest *request, BtUdpTrackerResponse *response, const GError *error)
+{
+	BtUdpTrackerFunc func = request->func;
+
+	bt_udp_tracker_forget (tracker, request);
+
+	if (error != NULL)
+		tracker->stats.errors++;
+
+	if (func != NULL)
+		func (tracker, response, error, request->data);
+	else if (response != NULL)
+		g_array_free (response->peers, TRUE);
+
+	bt_udp_tracker_request_free (request);
+}
+
+static void
+bt_udp_tracker_fail (BtUdpTracker *tracker, BtUdpTrackerRequest *request, const gchar *format, ...) G_GNUC_PRINTF (3, 4);
+
+static void
+bt_udp_tracker_fail (BtUdpTracker *tracker, BtUdpTrackerRequest *request, const gchar *format, ...)
+{
+	GError *error;
+	va_list args;
+	gchar *message;
+
+	va_start (args, format);
+	message = g_strdup_vprintf (format, args);
+	va_end (args);
+
+	error = g_error_new (BT_ERROR, BT_ERROR_TRACKER, "%s: %s", request->host->key, message);
+
+	bt_udp_tracker_finish (tracker, request, NULL, error);
+
+	g_error_free (error);
+	g_free (message);
+}
+
+/* fails every announce that was waiting on a host */
+static void
+bt_udp_tracker_fail_waiting (BtUdpTracker *tracker, BtUdpTrackerHost *host, const gchar *message)
+{
+	BtUdpTrackerRequest *request;
+
+	while ((request = g_queue_pop_head (host->waiting)) != NULL)
+		bt_udp_tracker_fail (tracker, request, "%s", message);
+}
+
+static guint32
+bt_udp_tracker_new_transaction (BtUdpTracker *tracker)
+{
+	guint32 transaction_id;
+
+	do {
+		transaction_id = g_random_int ();
+	} while (g_hash_table_lookup (tracker->pending, GUINT_TO_POINTER (transaction_id)) != NULL);
+
+	return transaction_id;
+}
+
+/* sends a request, and waits twice as long for an answer as last time */
+static void
+bt_udp_tracker_send (BtUdpTracker *tracker, BtUdpTrackerRequest *request, const gchar *buf, gsize len)
+{
+	if (request->attempts > 0)
+		tracker->stats.retransmits++;
+
+	request->deadline = bt_udp_tracker_now () + ((gint64) tracker->timeout << request->attempts);
+	request->attempts++;
+
+	g_hash_table_insert (tracker->pending, GUINT_TO_POINTER (request->transaction_id), request);
+
+	bt_udp_socket_send (tracker->socket, &request->host->address, buf, len);
+}
+
+static void
+bt_udp_tracker_send_connect (BtUdpTracker *tracker, BtUdpTrackerHost *host)
+{
+	BtUdpTrackerRequest *request;
+	gchar buf[BT_UDP_TRACKER_CONNECT_LENGTH];
+
+	if ((request = host->connect) == NULL) {
+		request = g_slice_new0 (BtUdpTrackerRequest);
+		request->host = bt_udp_tracker_host_ref (host);
+		request->action = BT_UDP_TRACKER_ACTION_CONNECT;
+		request->transaction_id = bt_udp_tracker_new_transaction (tracker);
+
+		host->connect = request;
+	}
+
+	bt_udp_tracker_put64 (buf, BT_UDP_TRACKER_PROTOCOL_ID);
+	bt_udp_tracker_put32 (buf + 8, BT_UDP_TRACKER_ACTION_CONNECT);
+	bt_udp_tracker_put32 (buf + 12, request->transaction_id);
+
+	tracker->stats.connects_sent++;
+
+	bt_udp_tracker_send (tracker, request, buf, sizeof (buf));
+}
+
+/* gets an announce going again for its host, connecting first if the
+ * connection id is missing or too old */
+static void
+bt_udp_tracker_dispatch (BtUdpTracker *tracker, BtUdpTrackerRequest *request)
+{
+	BtUdpTrackerHost *host = request->host;
+
+	if (request->func == NULL) {
+		bt_udp_tracker_request_free (request);
+		return;
+	}
+
+	if (host->state == BT_UDP_TRACKER_HOST_RESOLVING) {
+		g_queue_push_tail (host->waiting, request);
+		return;
+	}
+
+	if (host->state == BT_UDP_TRACKER_HOST_UNRESOLVED) {
+		bt_udp_tracker_fail (tracker, request, "could not resolve %s", host->hostname);
+		return;
+	}
+
+	if (host->connected == 0 || bt_udp_tracker_now () - host->connected >= BT_UDP_TRACKER_CONNECTION_TTL) {
+		host->connected = 0;
+		g_queue_push_tail (host->waiting, request);
+
+		if (host->connect == NULL)
+			bt_udp_tracker_send_connect (tracker, host);
+
+		return;
+	}
+
+	if (tracker->budget == 0) {
+		g_queue_push_tail (tracker->outgoing, request);
+		return;
+	}
+
+	tracker->budget--;
+	bt_udp_tracker_send_announce (tracker, request);
+}
+
+static void
+bt_udp_tracker_send_announce (BtUdpTracker *tracker, BtUdpTrackerRequest *request)
+{
+	BtUdpTrackerAnnounce *announce = &request->announce;
+	gchar buf[BT_UDP_TRACKER_ANNOUNCE_LENGTH];
+
+	/* a new transaction id every time, since the old one was free for others
+	 * to take while this waited */
+	request->transaction_id = bt_udp_tracker_new_transaction (tracker);
+
+	bt_udp_tracker_put64 (buf, request->host->connection_id);
+	bt_udp_tracker_put32 (buf + 8, BT_UDP_TRACKER_ACTION_ANNOUNCE);
+	bt_udp_tracker_put32 (buf + 12, request->transaction_id);
+	memcpy (buf + 16, announce->infohash, 20);
+	memcpy (buf + 36, announce->peer_id, 20);
+	bt_udp_tracker_put64 (buf + 56, announce->downloaded);
+	bt_udp_tracker_put64 (buf + 64, announce->left);
+	bt_udp_tracker_put64 (buf + 72, announce->uploaded);
+	bt_udp_tracker_put32 (buf + 80, announce->event);
+
+	/* the tracker takes the address the request comes from */
+	bt_udp_tracker_put32 (buf + 84, 0);
+	bt_udp_tracker_put32 (buf + 88, announce->key);
+	bt_udp_tracker_put32 (buf + 92, (guint32) announce->num_want);
+	buf[96] = announce->port >> 8;
+	buf[97] = announce->port & 0xff;
+
+	tracker->stats.announces_sent++;
+
+	bt_udp_tracker_send (tracker, request, buf, sizeof (buf));
+}
+
+/* sends the announces that were held back, as far as the burst goes */
+static void
+bt_udp_tracker_flush (BtUdpTracker *tracker)
+{
+	BtUdpTrackerRequest *request;
+
+	while (tracker->budget > 0 && (request = g_queue_pop_head (tracker->outgoing)) != NULL)
+		bt_udp_tracker_dispatch (tracker, request);
+}
+
+static void
+bt_udp_tracker_on_connect (BtUdpTracker *tracker, BtUdpTrackerRequest *request, const gchar *buf, gsize len)
+{
+	BtUdpTrackerHost *host = request->host;
+	GQueue *waiting;
+	BtUdpTrackerRequest *announce;
+
+	if (len < BT_UDP_TRACKER_CONNECT_LENGTH)
+		return;
+
+	g_hash_table_remove (tracker->pending, GUINT_TO_POINTER (request->transaction_id));
+
+	host->connect = NULL;
+	host->connection_id = bt_udp_tracker_get64 (buf + 8);
+	host->connected = bt_udp_tracker_now ();
+
+	bt_udp_tracker_request_free (request);
+
+	/* everything that was waiting goes out together, as far as the burst
+	 * allows */
+	waiting = host->waiting;
+	host->waiting = g_queue_new ();
+
+	while ((announce = g_queue_pop_head (waiting)) != NULL)
+		bt_udp_tracker_dispatch (tracker, announce);
+
+	g_queue_free (waiting);
+}
+
+static void
+bt_udp_tracker_on_announce (BtUdpTracker *tracker, BtUdpTrackerRequest *request, const gchar *buf, gsize len)
+{
+	BtUdpTrackerResponse response;
+	guint i, num;
+
+	if (len < 20)
+		return;
+
+	g_hash_table_remove (tracker->pending, GUINT_TO_POINTER (request->transaction_id));
+
+	tracker->stats.responses++;
+
+	response.interval = bt_udp_tracker_get32 (buf + 8);
+	response.leechers = bt_udp_tracker_get32 (buf + 12);
+	response.seeders = bt_udp_tracker_get32 (buf + 16);
+
+	/* IPv4 peers, since the request went over IPv4 */
+	num = (len - 20) / 6;
+
+	response.peers = g_array_sized_new (FALSE, FALSE, sizeof (BtAddress), num);
+	g_array_set_size (response.peers, num);
+
+	for (i = 0; i < num; i++) {
+		const gchar *entry = buf + 20 + i * 6;
+
+		bt_address_set_bytes (&g_array_index (response.peers, BtAddress, i), entry, 4,
+		                      (guint8) entry[4] << 8 | (guint8) entry[5]);
+	}
+
+	bt_udp_tracker_finish (tracker, request, &response, NULL);
+}
+
+static void
+bt_udp_tracker_on_error (BtUdpTracker *tracker, BtUdpTrackerRequest *request, const gchar *buf, gsize len)
+{
+	BtUdpTrackerHost *host = request->host;
+	gchar *message;
+
+	g_hash_table_remove (tracker->pending, GUINT_TO_POINTER (request->transaction_id));
+
+	message = g_strndup (buf + 8, len - 8);
+
+	if (request->action == BT_UDP_TRACKER_ACTION_CONNECT) {
+		host->connect = NULL;
+		bt_udp_tracker_fail_waiting (tracker, host, message);
+		bt_udp_tracker_request_free (request);
+	} else {
+		bt_udp_tracker_fail (tracker, request, "%s", message);
+	}
+
+	g_free (message);
+}
+
+static void
+bt_udp_tracker_on_datagram (BtUdpSocket *socket G_GNUC_UNUSED, const BtAddress *from, const gchar *buf, gsize len, gpointer data)
+{
+	BtUdpTracker *tracker = (BtUdpTracker *) data;
+	BtUdpTrackerRequest *request;
+	guint32 action;
+
+	if (len < 8)
+		return;
+
+	action = bt_udp_tracker_get32 (buf);
+	request = g_hash_table_lookup (tracker->pending, GUINT_TO_POINTER (bt_udp_tracker_get32 (buf + 4)));
+
+	/* answers from anyone but the tracker we asked are ignored */
+	if (request == NULL || !bt_address_equal (&request->host->address, from))
+		return;
+
+	if (action == BT_UDP_TRACKER_ACTION_ERROR)
+		bt_udp_tracker_on_error (tracker, request, buf, len);
+	else if (action != request->action)
+		return;
+	else if (action == BT_UDP_TRACKER_ACTION_CONNECT)
+		bt_udp_tracker_on_connect (tracker, request, buf, len);
+	else
+		bt_udp_tracker_on_announce (tracker, request, buf, len);
+
+	bt_udp_tracker_flush (tracker);
+}
+
+static gboolean
+bt_udp_tracker_collect_expired (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data)
+{
+	BtUdpTrackerRequest *request = (BtUdpTrackerRequest *) value;
+	gpointer *expired = (gpointer *) data;
+
+	if (request->deadline > *(gint64 *) expired[1])
+		return FALSE;
+
+	expired[0] = g_slist_prepend (expired[0], request);
+
+	return TRUE;
+}
+
+/* sends again whatever went unanswered, or gives up on it */
+static void
+bt_udp_tracker_expire (BtUdpTracker *tracker, BtUdpTrackerRequest *request)
+{
+	BtUdpTrackerHost *host = request->host;
+
+	if (request->action == BT_UDP_TRACKER_ACTION_CONNECT) {
+		if (request->attempts < BT_UDP_TRACKER_MAX_ATTEMPTS) {
+			bt_udp_tracker_send_connect (tracker, host);
+			return;
+		}
+
+		host->connect = NULL;
+		bt_udp_tracker_fail_waiting (tracker, host, "tracker did not respond");
+		bt_udp_tracker_request_free (request);
+		return;
+	}
+
+	if (request->func == NULL) {
+		bt_udp_tracker_request_free (request);
+		return;
+	}
+
+	if (request->attempts >= BT_UDP_TRACKER_MAX_ATTEMPTS) {
+		bt_udp_tracker_fail (tracker, request, "tracker did not respond");
+		return;
+	}
+
+	/* the connection id may have run out in the meantime */
+	bt_udp_tracker_dispatch (tracker, request);
+}
+
+static gboolean
+bt_udp_tracker_tick (gpointer data)
+{
+	BtUdpTracker *tracker = (BtUdpTracker *) data;
+	gint64 now = bt_udp_tracker_now ();
+	gpointer expired[2] = {NULL, &now};
+	GSList *l;
+
+	tracker->budget = BT_UDP_TRACKER_BURST;
+
+	g_hash_table_foreach_steal (tracker->pending, bt_udp_tracker_collect_expired, expired);
+
+	/* oldest first, so they keep their place in line */
+	expired[0] = g_slist_reverse (expired[0]);
+
+	for (l = expired[0]; l != NULL; l = l->next)
+		bt_udp_tracker_expire (tracker, (BtUdpTrackerRequest *) l->data);
+
+	g_slist_free (expired[0]);
+
+	bt_udp_tracker_flush (tracker);
+
+	return TRUE;
+}
+
+static void
+bt_udp_tracker_resolved (const gchar *hostname G_GNUC_UNUSED, const BtAddress *address, gpointer data)
+{
+	BtUdpTrackerHost *host = (BtUdpTrackerHost *) data;
+	BtUdpTracker *tracker = host->tracker;
+	BtUdpTrackerRequest *request;
+	GQueue *waiting;
+
+	/* the client went away while the name was looked up */
+	if (tracker == NULL) {
+		bt_udp_tracker_host_unref (host);
+		return;
+	}
+
+	host->resolved = bt_udp_tracker_now ();
+
+	if (address != NULL && address->length == 4) {
+		host->address = *address;
+		host->state = BT_UDP_TRACKER_HOST_RESOLVED;
+	} else {
+		host->state = BT_UDP_TRACKER_HOST_UNRESOLVED;
+	}
+
+	waiting = host->waiting;
+	host->waiting = g_queue_new ();
+
+	while ((request = g_queue_pop_head (waiting)) != NULL)
+		bt_udp_tracker_dispatch (tracker, request);
+
+	g_queue_free (waiting);
+
+	bt_udp_tracker_host_unref (host);
+}
+
+/* splits a udp:// url into its host and port */
+static gboolean
+bt_udp_tracker_parse_url (const gchar *url, gchar **hostname, guint16 *port)
+{
+	const gchar *start, *end, *colon;
+	gchar *endptr;
+	gulong value;
+
+	if (g_ascii_strncasecmp (url, "udp://", 6) != 0)
+		return FALSE;
+
+	start = url + 6;
+
+	for (end = start; *end != '\0' && *end != '/' && *end != '?'; end++)
+		;
+
+	if (*start == '[') {
+		/* an IPv6 literal */
+		if (!(colon = memchr (start, ']', end - start)))
+			return FALSE;
+
+		*hostname = g_strndup (start + 1, colon - start - 1);
+		colon++;
+	} else {
+		if (!(colon = memchr (start, ':', end - start)))
+			return FALSE;
+
+		*hostname = g_strndup (start, colon - start);
+	}
+
+	value = colon < end && *colon == ':' ? strtoul (colon + 1, &endptr, 10) : 0;
+
+	if (**hostname == '\0' || value == 0 || value > 65535 || endptr != end) {
+		g_free (*hostname);
+		return FALSE;
+	}
+
+	*port = value;
+
+	return TRUE;
+}
+
+static BtUdpTrackerHost *
+bt_udp_tracker_get_host (BtUdpTracker *tracker, const gchar *hostname, guint16 port)
+{
+	BtUdpTrackerHost *host;
+	gchar *key, *name;
+	gint64 now;
+
+	name = g_ascii_strdown (hostname, -1);
+	key = g_strdup_printf ("%s:%u", name, port);
+	g_free (name);
+
+	if (!(host = g_hash_table_lookup (tracker->hosts, key))) {
+		host = g_slice_new0 (BtUdpTrackerHost);
+		host->ref_count = 1;
+		host->tracker = tracker;
+		host->key = key;
+		host->hostname = g_strdup (hostname);
+		host->port = port;
+		host->state = BT_UDP_TRACKER_HOST_UNRESOLVED;
+		host->waiting = g_queue_new ();
+
+		g_hash_table_insert (tracker->hosts, host->key, host);
+	} else {
+		g_free (key);
+	}
+
+	now = bt_udp_tracker_now ();
+
+	/* names are looked up again once in a while, in case they move */
+	if ((host->state == BT_UDP_TRACKER_HOST_UNRESOLVED && (host->resolved == 0 || now - host->resolved >= BT_UDP_TRACKER_RESOLVE_RETRY))
+		|| (host->state == BT_UDP_TRACKER_HOST_RESOLVED && now - host->resolved >= BT_UDP_TRACKER_RESOLVE_TTL)) {
+		host->state = BT_UDP_TRACKER_HOST_RESOLVING;
+		host->connected = 0;
+		bt_resolver_lookup_name (host->hostname, host->port, tracker->context, bt_udp_tracker_resolved, bt_udp_tracker_host_ref (host));
+	}
+
+	return host;
+}
+
+/**
+ * bt_udp_tracker_new:
+ * @context: the main context to run in, or NULL for the default one
+ * @error: a return location for errors
+ *
+ * Creates a client for trackers that speak the UDP protocol of BEP 15. All
+ * announces go through one socket. Each tracker's connection id is shared by
+ * all of the torrents that announce to it, so a tracker with thousands of
+ * torrents costs one connect a minute rather than one for each announce, and
+ * announces that are waiting for a connection id go out together once it
+ * comes. Everything has to be called from the thread running @context.
+ *
+ * Returns: the new client, to be freed with bt_udp_tracker_free(), or NULL
+ *   if there's no socket to be had
+ */
+BtUdpTracker *
+bt_udp_tracker_new (GMainContext *context, GError **error)
+{
+	BtUdpTracker *tracker;
+
+	tracker = g_slice_new0 (BtUdpTracker);
+
+	if (!(tracker->socket = bt_udp_socket_new (context, 0, bt_udp_tracker_on_datagram, tracker, error))) {
+		g_slice_free (BtUdpTracker, tracker);
+		return NULL;
+	}
+
+	tracker->context = context;
+	tracker->hosts = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, bt_udp_tracker_host_unref);
+	tracker->pending = g_hash_table_new (g_direct_hash, g_direct_equal);
+	tracker->outgoing = g_queue_new ();
+	tracker->by_data = g_hash_table_new (g_direct_hash, g_direct_equal);
+	tracker->timeout = BT_UDP_TRACKER_DEFAULT_TIMEOUT;
+	tracker->budget = BT_UDP_TRACKER_BURST;
+
+	tracker->tick_source = g_timeout_source_new (BT_UDP_TRACKER_TICK);
+	g_source_set_callback (tracker->tick_source, bt_udp_tracker_tick, tracker, NULL);
+	g_source_attach (tracker->tick_source, context);
+
+	return tracker;
+}
+
+/**
+ * bt_udp_tracker_announce:
+ * @tracker: the client
+ * @url: the udp:// url of the tracker
+ * @announce: what to announce
+ * @func: the function to call once the announce is done
+ * @data: user data for @func, which is also how the announce is cancelled
+ * @error: a return location for errors
+ *
+ * Announces a torrent to a tracker, sending the request again with growing
+ * timeouts while it goes unanswered. @func is always called from the main
+ * loop, never from here, unless the announce is cancelled first.
+ *
+ * Returns: FALSE if @url isn't a udp:// url that can be announced to, with
+ *   @error set
+ */
+gboolean
+bt_udp_tracker_announce (BtUdpTracker *tracker, const gchar *url, const BtUdpTrackerAnnounce *announce,
+                         BtUdpTrackerFunc func, gpointer data, GError **error)
+{
+	BtUdpTrackerRequest *request;
+	gchar *hostname;
+	guint16 port;
+
+	g_return_val_if_fail (tracker != NULL, FALSE);
+	g_return_val_if_fail (url != NULL, FALSE);
+	g_return_val_if_fail (announce != NULL, FALSE);
+	g_return_val_if_fail (func != NULL, FALSE);
+
+	if (!bt_udp_tracker_parse_url (url, &hostname, &port)) {
+		g_set_error (error, BT_ERROR, BT_ERROR_TRACKER, "not a UDP tracker url: %s", url);
+		return FALSE;
+	}
+
+	request = g_slice_new0 (BtUdpTrackerRequest);
+	request->host = bt_udp_tracker_host_ref (bt_udp_tracker_get_host (tracker, hostname, port));
+	request->action = BT_UDP_TRACKER_ACTION_ANNOUNCE;
+	request->announce = *announce;
+	request->func = func;
+	request->data = data;
+
+	g_free (hostname);
+
+	g_hash_table_insert (tracker->by_data, data, g_list_prepend (g_hash_table_lookup (tracker->by_data, data), request));
+	tracker->stats.requests++;
+
+	/* the answer comes from the main loop even if it's known right away */
+	g_queue_push_tail (tracker->outgoing, request);
+
+	return TRUE;
+}
+
+/**
+ * bt_udp_tracker_cancel:
+ * @tracker: the client
+ * @data: the user data the announces were made with
+ *
+ * Cancels the announces made with @data, whose functions won't be called.
+ */
+void
+bt_udp_tracker_cancel (BtUdpTracker *tracker, gpointer data)
+{
+	GList *list, *l;
+
+	g_return_if_fail (tracker != NULL);
+
+	list = g_hash_table_lookup (tracker->by_data, data);
+
+	if (list == NULL)
+		return;
+
+	g_hash_table_remove (tracker->by_data, data);
+
+	/* they're dropped when they next come up */
+	for (l = list; l != NULL; l = l->next) {
+		((BtUdpTrackerRequest *) l->data)->func = NULL;
+		tracker->stats.requests--;
+	}
+
+	g_list_free (list);
+}
+
+/**
+ * bt_udp_tracker_set_timeout:
+ * @tracker: the client
+ * @timeout: milliseconds to wait for the first response
+ *
+ * Sets how long a request is waited for before it's sent again, which
+ * doubles with each try. BEP 15 says 15 seconds, which is the default.
+ */
+void
+bt_udp_tracker_set_timeout (BtUdpTracker *tracker, guint timeout)
+{
+	g_return_if_fail (tracker != NULL);
+	g_return_if_fail (timeout > 0);
+
+	tracker->timeout = timeout;
+}
+
+/**
+ * bt_udp_tracker_get_stats:
+ * @tracker: the client
+ * @stats: the counters to fill in
+ *
+ * Gets the counters for the client.
+ */
+void
+bt_udp_tracker_get_stats (BtUdpTracker *tracker, BtUdpTrackerStats *stats)
+{
+	g_return_if_fail (tracker != NULL);
+	g_return_if_fail (stats != NULL);
+
+	*stats = tracker->stats;
+	stats->hosts = g_hash_table_size (tracker->hosts);
+}
+
+static gboolean
+bt_udp_tracker_free_pending (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data G_GNUC_UNUSED)
+{
+	bt_udp_tracker_request_free ((BtUdpTrackerRequest *) value);
+
+	return TRUE;
+}
+
+static void
+bt_udp_tracker_free_waiting (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data G_GNUC_UNUSED)
+{
+	BtUdpTrackerHost *host = (BtUdpTrackerHost *) value;
+	BtUdpTrackerRequest *request;
+
+	while ((request = g_queue_pop_head (host->waiting)) != NULL)
+		bt_udp_tracker_request_free (request);
+
+	/* a lookup that's still running finds out when it's done */
+	host->tracker = NULL;
+	host->connect = NULL;
+}
+
+static void
+bt_udp_tracker_free_by_data (gpointer key G_GNUC_UNUSED, gpointer value, gpointer data G_GNUC_UNUSED)
+{
+	g_list_free ((GList *) value);
+}
+
+/**
+ * bt_udp_tracker_free:
+ * @tracker: the client
+ *
+ * Frees the client. Announces that haven't been answered are dropped without
+ * calling their functions.
+ */
+void
+bt_udp_tracker_free (BtUdpTracker *tracker)
+{
+	BtUdpTrackerRequest *request;
+
+	g_return_if_fail (tracker != NULL);
+
+	bt_udp_socket_free (tracker->socket);
+
+	g_source_destroy (tracker->tick_source);
+	g_source_unref (tracker->tick_source);
+
+	g_hash_table_foreach_remove (tracker->pending, bt_udp_tracker_free_pending, NULL);
+	g_hash_table_foreach (tracker->hosts, bt_udp_tracker_free_waiting, NULL);
+
+	while ((request = g_queue_pop_head (tracker->outgoing)) != NULL)
+		bt_udp_tracker_request_free (request);
+
+	g_hash_table_foreach (tracker->by_data, bt_udp_tracker_free_by_data, NULL);
+
+	g_hash_table_destroy (tracker->pending);
+	g_hash_table_destroy (tracker->hosts);
+	g_hash_table_destroy (tracker->by_data);
+	g_queue_free (tracker->outgoing);
+
+	g_slice_free (BtUdpTracker, tracker);
+}
@@ -0,0 +1,140 @@
+/**
+ * bt-udp-tracker.h
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __BT_UDP_TRACKER_H__
+#define __BT_UDP_TRACKER_H__
+
+#include <glib.h>
+
+#include "bt-address.h"
+
+G_BEGIN_DECLS
+
+typedef struct _BtUdpTracker BtUdpTracker;
+
+/**
+ * BtUdpTrackerEvent:
+ * @BT_UDP_TRACKER_EVENT_NONE: a regular announce
+ * @BT_UDP_TRACKER_EVENT_COMPLETED: the download just finished
+ * @BT_UDP_TRACKER_EVENT_STARTED: the torrent was just started
+ * @BT_UDP_TRACKER_EVENT_STOPPED: the torrent is being stopped
+ *
+ * The events of an announce, with their values on the wire.
+ */
+typedef enum {
+	BT_UDP_TRACKER_EVENT_NONE = 0,
+	BT_UDP_TRACKER_EVENT_COMPLETED = 1,
+	BT_UDP_TRACKER_EVENT_STARTED = 2,
+	BT_UDP_TRACKER_EVENT_STOPPED = 3
+} BtUdpTrackerEvent;
+
+/**
+ * BtUdpTrackerAnnounce:
+ * @infohash: the 20-byte infohash of the torrent
+ * @peer_id: our 20-byte peer id
+ * @downloaded: bytes downloaded in this session
+ * @left: bytes left to download
+ * @uploaded: bytes uploaded in this session
+ * @event: the event being announced
+ * @key: a number that stays the same for the session, so the tracker knows us
+ *   if our address changes
+ * @num_want: the number of peers wanted, or -1 for the tracker's default
+ * @port: the port we listen on for peers
+ *
+ * What an announce tells the tracker.
+ */
+typedef struct {
+	gchar             infohash[20];
+	gchar             peer_id[20];
+	guint64           downloaded;
+	guint64           left;
+	guint64           uploaded;
+	BtUdpTrackerEvent event;
+	guint32           key;
+	gint32            num_want;
+	guint16           port;
+} BtUdpTrackerAnnounce;
+
+/**
+ * BtUdpTrackerResponse:
+ * @interval: seconds until the next regular announce
+ * @leechers: peers the tracker knows of that are still downloading
+ * @seeders: peers the tracker knows of that have the whole torrent
+ * @peers: a #GArray of #BtAddress with the peers the tracker gave, which the
+ *   function it's given to owns
+ *
+ * What a tracker answered to an announce.
+ */
+typedef struct {
+	guint32  interval;
+	guint32  leechers;
+	guint32  seeders;
+	GArray  *peers;
+} BtUdpTrackerResponse;
+
+/**
+ * BtUdpTrackerStats:
+ * @hosts: trackers we know the address of or are looking up
+ * @requests: announces that haven't been answered
+ * @connects_sent: connect requests sent, retransmissions included
+ * @announces_sent: announce requests sent, retransmissions included
+ * @retransmits: requests sent again after going unanswered
+ * @responses: responses received to announces
+ * @errors: announces that failed, with an error from the tracker or after
+ *   running out of retransmissions
+ *
+ * Counters describing the UDP tracker client.
+ */
+typedef struct {
+	guint   hosts;
+	guint   requests;
+	guint64 connects_sent;
+	guint64 announces_sent;
+	guint64 retransmits;
+	guint64 responses;
+	guint64 errors;
+} BtUdpTrackerStats;
+
+/**
+ * BtUdpTrackerFunc:
+ * @tracker: the client
+ * @response: what the tracker answered, or NULL if the announce failed
+ * @error: why the announce failed, or NULL
+ * @data: user data given to bt_udp_tracker_announce()
+ *
+ * Called once an announce is done, one way or the other.
+ */
+typedef void (*BtUdpTrackerFunc) (BtUdpTracker *tracker, BtUdpTrackerResponse *response, const GError *error, gpointer data);
+
+BtUdpTracker *bt_udp_tracker_new (GMainContext *context, GError **error);
+
+gboolean      bt_udp_tracker_announce (BtUdpTracker *tracker, const gchar *url, const BtUdpTrackerAnnounce *announce, BtUdpTrackerFunc func, gpointer data, GError **error);
+
+void          bt_udp_tracker_cancel (BtUdpTracker *tracker, gpointer data);
+
+void          bt_udp_tracker_set_timeout (BtUdpTracker *tracker, guint timeout);
+
+void          bt_udp_tracker_get_stats (BtUdpTracker *tracker, BtUdpTrackerStats *stats);
+
+void          bt_udp_tracker_free (BtUdpTracker *tracker);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,267 @@
+/**
+ * bt-udp.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "bt-udp.h"
+#include "bt-utils.h"
+
+/* the largest datagram taken; anything longer is dropped, which none of the
+ * protocols we speak over UDP come near */
+#define BT_UDP_MAX_DATAGRAM 4096
+
+/* datagrams read per wakeup, so a flood can't keep the main loop to itself */
+#define BT_UDP_READ_BUDGET 256
+
+struct _BtUdpSocket {
+	GSource     source;
+
+	GPollFD     poll;
+	guint16     port;
+
+	BtUdpFunc   func;
+	gpointer    data;
+
+	BtUdpStats  stats;
+
+	gchar       buf[BT_UDP_MAX_DATAGRAM];
+};
+
+static gboolean
+bt_udp_socket_prepare (GSource *source G_GNUC_UNUSED, gint *timeout)
+{
+	*timeout = -1;
+
+	return FALSE;
+}
+
+static gboolean
+bt_udp_socket_check (GSource *source)
+{
+	return ((BtUdpSocket *) source)->poll.revents != 0;
+}
+
+static gboolean
+bt_udp_socket_dispatch (GSource *source, GSourceFunc callback G_GNUC_UNUSED, gpointer data G_GNUC_UNUSED)
+{
+	BtUdpSocket *socket = (BtUdpSocket *) source;
+	struct sockaddr_storage sa;
+	socklen_t sa_len;
+	BtAddress from;
+	gssize len;
+	guint i;
+
+	socket->poll.revents = 0;
+
+	/* poll is level-triggered, so whatever is left wakes us up again */
+	for (i = 0; i < BT_UDP_READ_BUDGET; i++) {
+		sa_len = sizeof (sa);
+		len = recvfrom (socket->poll.fd, socket->buf, sizeof (socket->buf), MSG_TRUNC, (struct sockaddr *) &sa, &sa_len);
+
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				g_debug ("error receiving datagram: %s", g_strerror (errno));
+			break;
+		}
+
+		socket->stats.received++;
+		socket->stats.bytes_received += len;
+
+		if ((gsize) len > sizeof (socket->buf) || !bt_address_set_sockaddr (&from, &sa))
+			continue;
+
+		socket->func (socket, &from, socket->buf, len, socket->data);
+
+		if (g_source_is_destroyed (source))
+			break;
+	}
+
+	return TRUE;
+}
+
+static void
+bt_udp_socket_finalize (GSource *source)
+{
+	close (((BtUdpSocket *) source)->poll.fd);
+}
+
+static GSourceFuncs bt_udp_socket_funcs = {
+	bt_udp_socket_prepare,
+	bt_udp_socket_check,
+	bt_udp_socket_dispatch,
+	bt_udp_socket_finalize,
+	NULL,
+	NULL
+};
+
+/**
+ * bt_udp_socket_new:
+ * @context: the main context to run in, or NULL for the default one
+ * @port: the port to bind to, or 0 for any
+ * @func: the function to call with each datagram received
+ * @data: user data for @func
+ * @error: a return location for errors
+ *
+ * Creates an IPv4 UDP socket bound to @port on all interfaces. Received
+ * datagrams are passed to @func from @context, a batch of them per wakeup.
+ *
+ * Returns: the new socket, to be freed with bt_udp_socket_free(), or NULL if
+ *   it couldn't be bound
+ */
+BtUdpSocket *
+bt_udp_socket_new (GMainContext *context, guint16 port, BtUdpFunc func, gpointer data, GError **error)
+{
+	BtUdpSocket *udp;
+	struct sockaddr_in sin;
+	socklen_t sin_len;
+	gint fd;
+
+	g_return_val_if_fail (func != NULL, NULL);
+
+	fd = socket (AF_INET, SOCK_DGRAM, 0);
+
+	if (fd < 0) {
+		g_set_error (error, BT_ERROR, BT_ERROR_NETWORK, "could not create UDP socket: %s", g_strerror (errno));
+		return NULL;
+	}
+
+	memset (&sin, 0, sizeof (sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = g_htonl (INADDR_ANY);
+	sin.sin_port = g_htons (port);
+
+	sin_len = sizeof (sin);
+
+	if (bind (fd, (struct sockaddr *) &sin, sizeof (sin)) != 0
+		|| getsockname (fd, (struct sockaddr *) &sin, &sin_len) != 0) {
+		g_set_error (error, BT_ERROR, BT_ERROR_NETWORK, "could not bind UDP port %u: %s", port, g_strerror (errno));
+		close (fd);
+		return NULL;
+	}
+
+	fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+	fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+	udp = (BtUdpSocket *) g_source_new (&bt_udp_socket_funcs, sizeof (BtUdpSocket));
+
+	udp->poll.fd = fd;
+	udp->poll.events = G_IO_IN | G_IO_ERR;
+	udp->poll.revents = 0;
+	udp->port = g_ntohs (sin.sin_port);
+	udp->func = func;
+	udp->data = data;
+	memset (&udp->stats, 0, sizeof (BtUdpStats));
+
+	g_source_add_poll ((GSource *) udp, &udp->poll);
+	g_source_set_can_recurse ((GSource *) udp, FALSE);
+	g_source_attach ((GSource *) udp, context);
+
+	return udp;
+}
+
+/**
+ * bt_udp_socket_send:
+ * @socket: the socket
+ * @to: the address to send to, which has to be IPv4
+ * @buf: the datagram
+ * @len: the length of @buf
+ *
+ * Sends a datagram right away. Datagrams that can't be sent are dropped, like
+ * they could be anywhere on the way.
+ *
+ * Returns: TRUE if the datagram was sent
+ */
+gboolean
+bt_udp_socket_send (BtUdpSocket *socket, const BtAddress *to, const gchar *buf, gsize len)
+{
+	struct sockaddr_storage sa;
+	gsize sa_len;
+
+	g_return_val_if_fail (socket != NULL, FALSE);
+	g_return_val_if_fail (to != NULL, FALSE);
+
+	if (to->length != 4)
+		return FALSE;
+
+	sa_len = bt_address_to_sockaddr (to, &sa);
+
+	if (sendto (socket->poll.fd, buf, len, 0, (struct sockaddr *) &sa, sa_len) < 0) {
+		g_debug ("error sending datagram: %s", g_strerror (errno));
+		return FALSE;
+	}
+
+	socket->stats.sent++;
+	socket->stats.bytes_sent += len;
+
+	return TRUE;
+}
+
+/**
+ * bt_udp_socket_get_port:
+ * @socket: the socket
+ *
+ * Returns: the port the socket is bound to, which is the one it was given
+ *   unless that was 0
+ */
+guint16
+bt_udp_socket_get_port (BtUdpSocket *socket)
+{
+	g_return_val_if_fail (socket != NULL, 0);
+
+	return socket->port;
+}
+
+/**
+ * bt_udp_socket_get_stats:
+ * @socket: the socket
+ * @stats: the counters to fill in
+ *
+ * Gets the counters for the socket.
+ */
+void
+bt_udp_socket_get_stats (BtUdpSocket *socket, BtUdpStats *stats)
+{
+	g_return_if_fail (socket != NULL);
+	g_return_if_fail (stats != NULL);
+
+	*stats = socket->stats;
+}
+
+/**
+ * bt_udp_socket_free:
+ * @socket: the socket
+ *
+ * Closes the socket. Its function isn't called again, so it is safe to free
+ * it from there.
+ */
+void
+bt_udp_socket_free (BtUdpSocket *socket)
+{
+	g_return_if_fail (socket != NULL);
+
+	g_source_destroy ((GSource *) socket);
+	g_source_unref ((GSource *) socket);
+}
@@ -0,0 +1,72 @@
+/**
+ * bt-udp.h
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __BT_UDP_H__
+#define __BT_UDP_H__
+
+#include <glib.h>
+
+#include "bt-address.h"
+
+G_BEGIN_DECLS
+
+typedef struct _BtUdpSocket BtUdpSocket;
+
+/**
+ * BtUdpFunc:
+ * @socket: the socket
+ * @from: where the datagram came from
+ * @buf: the datagram, only valid during the call
+ * @len: the length of @buf
+ * @data: user data given when the socket was created
+ *
+ * Called for each datagram received on a #BtUdpSocket.
+ */
+typedef void (*BtUdpFunc) (BtUdpSocket *socket, const BtAddress *from, const gchar *buf, gsize len, gpointer data);
+
+/**
+ * BtUdpStats:
+ * @sent: datagrams sent
+ * @received: datagrams received
+ * @bytes_sent: bytes sent, without IP and UDP headers
+ * @bytes_received: bytes received, without IP and UDP headers
+ *
+ * Counters describing the traffic on a #BtUdpSocket.
+ */
+typedef struct {
+	guint64 sent;
+	guint64 received;
+	guint64 bytes_sent;
+	guint64 bytes_received;
+} BtUdpStats;
+
+BtUdpSocket *bt_udp_socket_new (GMainContext *context, guint16 port, BtUdpFunc func, gpointer data, GError **error);
+
+gboolean     bt_udp_socket_send (BtUdpSocket *socket, const BtAddress *to, const gchar *buf, gsize len);
+
+guint16      bt_udp_socket_get_port (BtUdpSocket *socket);
+
+void         bt_udp_socket_get_stats (BtUdpSocket *socket, BtUdpStats *stats);
+
+void         bt_udp_socket_free (BtUdpSocket *socket);
+
+G_END_DECLS
+
+#endif
@@ -107,16 +107,22 @@ bt_get_infohash (BtBencode *info)
 	GString     *string;
 
 	g_return_val_if_fail (info != NULL, NULL);
+	g_return_val_if_fail (info->type == BT_BENCODE_TYPE_DICT, NULL);
 
 	hash = g_malloc (20);
 
-	string = bt_bencode_encode (info);
-
 	sha1_init (&sha);
-	sha1_update (&sha, string->str, string->len);
-	sha1_finish (&sha, hash);
 
-	g_string_free (string, TRUE);
+	if (info->dict.raw.str != NULL) {
+		/* hash the dict exactly as it appears in the metainfo, without re-encoding it */
+		sha1_update (&sha, info->dict.raw.str, info->dict.raw.len);
+	} else {
+		string = bt_bencode_encode (info);
+		sha1_update (&sha, string->str, string->len);
+		g_string_free (string, TRUE);
+	}
+
+	sha1_finish (&sha, hash);
 
 	return hash;
 }
@@ -174,6 +180,32 @@ bt_url_encode (const gchar *string, gsize size)
 	return ret;
 }
 
+gchar *
+bt_url_decode (const gchar *string, gsize size)
+{
+	gchar *ret;
+	gsize len, i;
+
+	g_return_val_if_fail (string != NULL, NULL);
+
+	len = 0;
+	ret = g_malloc (size + 1);
+
+	for (i = 0; i < size; i++) {
+		/* a stray '%' is kept as it is */
+		if (string[i] == '%' && i + 2 < size
+			&& g_ascii_isxdigit (string[i + 1]) && g_ascii_isxdigit (string[i + 2])) {
+			ret[len++] = (g_ascii_xdigit_value (string[i + 1]) << 4) | g_ascii_xdigit_value (string[i + 2]);
+			i += 2;
+		} else {
+			ret[len++] = string[i];
+		}
+	}
+
+	ret[len] = '\0';
+	return ret;
+}
+
 gchar *
 bt_hash_to_string (const gchar *hash)
 {
@@ -194,6 +226,24 @@ bt_hash_to_string (const gchar *hash)
 	return string;
 }
 
+/* hash function for tables keyed by raw 20-byte infohashes; those are SHA-1
+ * digests, so the first 8 bytes are already as random as the whole thing */
+guint
+bt_infohash_hash (gconstpointer infohash)
+{
+	guint64 head;
+
+	memcpy (&head, infohash, sizeof (head));
+
+	return (guint) (head ^ (head >> 32));
+}
+
+gboolean
+bt_infohash_equal (gconstpointer a, gconstpointer b)
+{
+	return memcmp (a, b, 20) == 0;
+}
+
 /**
  * bt_client_name_from_id:
  * @id: the peer id
@@ -266,6 +316,10 @@ bt_size_to_string (guint64 size)
 	return g_strdup_printf ("%.2f GB", ((gdouble) (size / (1048576))) / 1024);
 }
 
+/* the list of weak references on an object isn't locked by GObject, and peers
+ * on network threads take them on torrents that are shared between threads */
+G_LOCK_DEFINE_STATIC (bt_weak_pointer);
+
 /* workaround for -fstrict-aliasing */
 void
 bt_add_weak_pointer (GObject* obj, gpointer pointer_to_weak_pointer)
@@ -273,7 +327,9 @@ bt_add_weak_pointer (GObject* obj, gpointer pointer_to_weak_pointer)
 	if (obj == NULL)
 		return;
 
+	G_LOCK (bt_weak_pointer);
 	g_object_add_weak_pointer (obj, (gpointer*)pointer_to_weak_pointer);
+	G_UNLOCK (bt_weak_pointer);
 }
 
 /* workaround for -fstrict-aliasing */
@@ -283,6 +339,8 @@ bt_remove_weak_pointer (GObject* obj, gpointer pointer_to_weak_pointer)
 	if (obj == NULL)
 		return;
 
+	G_LOCK (bt_weak_pointer);
 	g_object_remove_weak_pointer (obj, (gpointer*)pointer_to_weak_pointer);
+	G_UNLOCK (bt_weak_pointer);
 }
 
@@ -38,6 +38,9 @@
 typedef enum {
 	BT_ERROR_NETWORK,
 	BT_ERROR_INVALID_TORRENT,
+	BT_ERROR_INVALID_INDEX,
+	BT_ERROR_INVALID_MAGNET,
+	BT_ERROR_TRACKER,
 } BtError;
 
 GQuark   bt_error_quark ();
@@ -52,8 +55,14 @@ gchar   *bt_create_peer_id ();
 
 gchar   *bt_url_encode (const gchar *string, gsize size);
 
+gchar   *bt_url_decode (const gchar *string, gsize size);
+
 gchar   *bt_hash_to_string (const gchar *hash);
 
+guint    bt_infohash_hash (gconstpointer infohash);
+
+gboolean bt_infohash_equal (gconstpointer a, gconstpointer b);
+
 gchar   *bt_client_name_from_id (const gchar *id);
 
 gchar   *bt_size_to_string (guint64 size);
@@ -0,0 +1,54 @@
+/**
+ * bench-allocs.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "bench-allocs.h"
+
+gsize bench_allocs = 0;
+
+#ifdef __GLIBC__
+
+/* count every allocation in the process by interposing the allocator, which
+ * catches g_malloc as well as anything glib does behind our back */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n, size_t size);
+extern void *__libc_realloc (void *mem, size_t size);
+
+void *
+malloc (size_t size)
+{
+	bench_allocs++;
+	return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n, size_t size)
+{
+	bench_allocs++;
+	return __libc_calloc (n, size);
+}
+
+void *
+realloc (void *mem, size_t size)
+{
+	bench_allocs++;
+	return __libc_realloc (mem, size);
+}
+
+#endif
@@ -0,0 +1,38 @@
+/**
+ * bench-allocs.h
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Counting of allocations for the benchmarks, which link bench-allocs.c. */
+
+#ifndef __BENCH_ALLOCS_H__
+#define __BENCH_ALLOCS_H__
+
+#include <glib.h>
+
+/* allocations made by the whole process so far, which stays 0 where the
+ * allocator can't be interposed */
+extern gsize bench_allocs;
+
+#ifdef __GLIBC__
+#define BENCH_COUNTS_ALLOCS TRUE
+#else
+#define BENCH_COUNTS_ALLOCS FALSE
+#endif
+
+#endif
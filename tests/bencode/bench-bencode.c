@@ -0,0 +1,376 @@
+/**
+ * bench-bencode.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Throughput benchmark for the bencode decoder and encoder.
+ *
+ * Every input in the corpus (.torrent files from the directories given on the
+ * command line plus synthetic metainfo, tracker responses and extension
+ * messages) is decoded in one piece, decoded in network-sized chunks, encoded,
+ * written out through bt_bencode_write() and searched with bt_bencode_lookup().
+ * For each of those the throughput, the number of allocations per MB of input
+ * and the peak resident set size of the process so far are reported. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <glib.h>
+
+#include "bt-bencode.h"
+
+#include "bench-allocs.h"
+
+/* each benchmark runs until it has processed this many bytes */
+#define BENCH_BYTES (64 * 1024 * 1024)
+
+/* size of the chunks for the incremental decoder, about one TCP segment */
+#define BENCH_CHUNK_SIZE 1400
+
+typedef struct {
+	gchar *name;
+	gchar *data;
+	gsize  len;
+} BenchInput;
+
+/* runs one iteration of a benchmark and returns the number of bytes processed */
+typedef gsize (*BenchFunc) (BenchInput *input);
+
+static glong
+bench_peak_rss ()
+{
+	struct rusage usage;
+
+	if (getrusage (RUSAGE_SELF, &usage) != 0)
+		return 0;
+
+	/* in kilobytes on Linux */
+	return usage.ru_maxrss;
+}
+
+static BenchInput *
+bench_input_new (const gchar *name, GString *data)
+{
+	BenchInput *input = g_new0 (BenchInput, 1);
+
+	input->name = g_strdup (name);
+	input->len = data->len;
+	input->data = g_string_free (data, FALSE);
+
+	return input;
+}
+
+/* a multi-file torrent with lots of files and pieces */
+static BenchInput *
+bench_synthetic_metainfo (guint num_files, guint num_pieces)
+{
+	GString *s = g_string_new (NULL);
+	BenchInput *input;
+	gchar *name;
+	guint i;
+
+	g_string_append (s, "d8:announce35:http://tracker.example.com/announce");
+	g_string_append (s, "13:announce-listll35:http://tracker.example.com/announceel37:udp://tracker.example.com:80/announceee");
+	g_string_append (s, "7:comment17:synthetic torrent10:created by13:bench-bencode13:creation datei1190000000e");
+	g_string_append (s, "4:infod5:filesl");
+
+	for (i = 0; i < num_files; i++)
+		g_string_append_printf (s, "d6:lengthi%ue4:pathl9:directory7:sub-%03u14:file-%05u.datee", 1024 * (i + 1), i % 1000, i % 100000);
+
+	g_string_append_printf (s, "e4:name9:synthetic12:piece lengthi262144e6:pieces%u:", num_pieces * 20);
+
+	for (i = 0; i < num_pieces * 20; i++)
+		g_string_append_c (s, (gchar) (i * 7919));
+
+	g_string_append (s, "ee");
+
+	name = g_strdup_printf ("synthetic metainfo, %u files", num_files);
+	input = bench_input_new (name, s);
+	g_free (name);
+
+	return input;
+}
+
+/* a tracker response with compact or dictionary peers */
+static BenchInput *
+bench_synthetic_tracker_response (gboolean compact, guint num_peers)
+{
+	GString *s = g_string_new (NULL);
+	guint i;
+
+	g_string_append (s, "d8:completei120e10:incompletei47e8:intervali1800e12:min intervali900e5:peers");
+
+	if (compact) {
+		g_string_append_printf (s, "%u:", num_peers * 6);
+
+		for (i = 0; i < num_peers; i++) {
+			guint8 peer[6] = {10, (guint8) (i >> 16), (guint8) (i >> 8), (guint8) i, 0x1a, 0xe1};
+
+			g_string_append_len (s, (gchar *) peer, 6);
+		}
+	} else {
+		g_string_append_c (s, 'l');
+
+		for (i = 0; i < num_peers; i++) {
+			gchar *ip = g_strdup_printf ("10.%u.%u.%u", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+
+			g_string_append_printf (s, "d2:ip%u:%s7:peer id20:-BT0001-%012u4:porti6881ee", (guint) strlen (ip), ip, i);
+			g_free (ip);
+		}
+
+		g_string_append_c (s, 'e');
+	}
+
+	g_string_append_c (s, 'e');
+
+	return bench_input_new (compact ? "tracker response, compact" : "tracker response, dicts", s);
+}
+
+/* the kind of small dicts that extension messages carry */
+static BenchInput *
+bench_synthetic_extension_messages ()
+{
+	static const gchar pex[] =
+		"d5:added12:" "\x0a\x00\x00\x01\x1a\xe1" "\x0a\x00\x00\x02\x1a\xe1"
+		"7:added.f2:" "\x01\x02"
+		"7:dropped6:" "\x0a\x00\x00\x03\x1a\xe1" "e";
+	GString *s = g_string_new ("l");
+	guint i;
+
+	for (i = 0; i < 64; i++) {
+		g_string_append_printf (s, "d1:md11:ut_metadatai1e6:ut_pexi2ee13:metadata_sizei%ue1:pi6881e4:reqqi250e1:v15:BitTorque 0.1.0e", 31235 + i);
+		g_string_append_len (s, pex, sizeof (pex) - 1);
+		g_string_append_printf (s, "d8:msg_typei1e5:piecei%ue10:total_sizei31235ee", i);
+	}
+
+	g_string_append_c (s, 'e');
+
+	return bench_input_new ("extension messages", s);
+}
+
+static void
+bench_load_directory (GPtrArray *corpus, const gchar *path)
+{
+	const gchar *entry;
+	GDir *dir;
+
+	if (!(dir = g_dir_open (path, 0, NULL))) {
+		g_warning ("could not open %s", path);
+		return;
+	}
+
+	while ((entry = g_dir_read_name (dir))) {
+		gchar *filename, *contents;
+		gsize len;
+
+		if (!g_str_has_suffix (entry, ".torrent"))
+			continue;
+
+		filename = g_build_filename (path, entry, NULL);
+
+		if (g_file_get_contents (filename, &contents, &len, NULL)) {
+			BenchInput *input = g_new0 (BenchInput, 1);
+
+			input->name = g_strdup (entry);
+			input->data = contents;
+			input->len = len;
+
+			g_ptr_array_add (corpus, input);
+		}
+
+		g_free (filename);
+	}
+
+	g_dir_close (dir);
+}
+
+static gsize
+bench_decode (BenchInput *input)
+{
+	BtBencodeArena *arena = bt_bencode_arena_new (input->len);
+
+	if (!bt_bencode_decode_arena (arena, input->data, input->len, NULL))
+		g_error ("could not decode %s", input->name);
+
+	bt_bencode_arena_free (arena);
+
+	return input->len;
+}
+
+static gsize
+bench_decode_chunked (BenchInput *input)
+{
+	BtBencodeArena *arena = bt_bencode_arena_new (input->len);
+	BtBencodeDecoder *decoder = bt_bencode_decoder_new (arena, 0, 0);
+	gsize pos;
+
+	for (pos = 0; pos < input->len; pos += BENCH_CHUNK_SIZE)
+		bt_bencode_decoder_feed (decoder, input->data + pos, MIN (BENCH_CHUNK_SIZE, input->len - pos), NULL, NULL);
+
+	if (!bt_bencode_decoder_finish (decoder, NULL))
+		g_error ("could not decode %s in chunks", input->name);
+
+	bt_bencode_decoder_free (decoder);
+	bt_bencode_arena_free (arena);
+
+	return input->len;
+}
+
+/* the decoded form of the input being benchmarked, for the benchmarks that need one */
+static BtBencode *bench_decoded = NULL;
+
+static gsize
+bench_encode (BenchInput *input)
+{
+	GString *string = bt_bencode_encode (bench_decoded);
+	gsize len = string->len;
+
+	g_string_free (string, TRUE);
+
+	return len;
+}
+
+static gboolean
+bench_null_sink (const gchar *buf, gsize len, gpointer data, GError **error)
+{
+	*((gsize *) data) += len;
+	return TRUE;
+}
+
+static gsize
+bench_write (BenchInput *input)
+{
+	gsize len = 0;
+
+	bt_bencode_write (bench_decoded, bench_null_sink, &len, NULL);
+
+	return len;
+}
+
+/* looks up every key of every dict in the structure once */
+static guint
+bench_lookup_all (BtBencode *bencode)
+{
+	guint i, found = 0;
+
+	if (bencode->type == BT_BENCODE_TYPE_DICT) {
+		for (i = 0; i < bencode->dict.len; i++) {
+			BtBencodeString *key = &bencode->dict.entries[i].key;
+			gchar buf[64];
+
+			/* bt_bencode_lookup takes nul-terminated keys */
+			if (key->len >= sizeof (buf) || memchr (key->str, '\0', key->len))
+				continue;
+
+			memcpy (buf, key->str, key->len);
+			buf[key->len] = '\0';
+
+			if (bt_bencode_lookup (bencode, buf))
+				found++;
+
+			found += bench_lookup_all (&bencode->dict.entries[i].value);
+		}
+	} else if (bencode->type == BT_BENCODE_TYPE_LIST) {
+		for (i = 0; i < bencode->list.len; i++)
+			found += bench_lookup_all (bt_bencode_list_index (bencode, i));
+	}
+
+	return found;
+}
+
+static gsize
+bench_lookup (BenchInput *input)
+{
+	bench_lookup_all (bench_decoded);
+
+	return input->len;
+}
+
+static void
+bench_run (const gchar *name, BenchFunc func, BenchInput *input)
+{
+	GTimer *timer;
+	gsize bytes = 0, allocs;
+	gdouble elapsed, mb;
+
+	/* warm up */
+	func (input);
+
+	timer = g_timer_new ();
+	allocs = bench_allocs;
+
+	while (bytes < BENCH_BYTES)
+		bytes += func (input);
+
+	allocs = bench_allocs - allocs;
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+
+	mb = bytes / (1024.0 * 1024.0);
+
+	if (BENCH_COUNTS_ALLOCS)
+		g_print ("  %-14s %10.1f MB/s %12.1f allocs/MB %8ld KB peak RSS\n", name, mb / elapsed, allocs / mb, bench_peak_rss ());
+	else
+		g_print ("  %-14s %10.1f MB/s %12s allocs/MB %8ld KB peak RSS\n", name, mb / elapsed, "n/a", bench_peak_rss ());
+}
+
+int
+main (int argc, char **argv)
+{
+	GPtrArray *corpus;
+	guint i;
+
+	/* make g_slice go through malloc so its allocations are counted too */
+	g_setenv ("G_SLICE", "always-malloc", TRUE);
+
+	corpus = g_ptr_array_new ();
+
+	for (i = 1; i < (guint) argc; i++)
+		bench_load_directory (corpus, argv[i]);
+
+	g_ptr_array_add (corpus, bench_synthetic_metainfo (20, 2000));
+	g_ptr_array_add (corpus, bench_synthetic_metainfo (20000, 40000));
+	g_ptr_array_add (corpus, bench_synthetic_tracker_response (TRUE, 200));
+	g_ptr_array_add (corpus, bench_synthetic_tracker_response (FALSE, 200));
+	g_ptr_array_add (corpus, bench_synthetic_extension_messages ());
+
+	for (i = 0; i < corpus->len; i++) {
+		BenchInput *input = g_ptr_array_index (corpus, i);
+		GError *error = NULL;
+
+		g_print ("%s (%" G_GSIZE_FORMAT " bytes)\n", input->name, input->len);
+
+		if (!(bench_decoded = bt_bencode_decode (input->data, input->len, &error))) {
+			g_print ("  skipped: %s\n", error->message);
+			g_clear_error (&error);
+			continue;
+		}
+
+		bench_run ("decode", bench_decode, input);
+		bench_run ("decode chunks", bench_decode_chunked, input);
+		bench_run ("encode", bench_encode, input);
+		bench_run ("write", bench_write, input);
+		bench_run ("lookup", bench_lookup, input);
+
+		bt_bencode_destroy (bench_decoded);
+	}
+
+	return 0;
+}
@@ -0,0 +1,204 @@
+/**
+ * fuzz-bencode.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Fuzzing harness for the bencode decoder.
+ *
+ * Built with BT_FUZZ_LIBFUZZER defined this is a libFuzzer target; otherwise it
+ * reads one input from stdin, which is what AFL expects, or each of the files
+ * and directories given on the command line, which replays a corpus. The
+ * inputs in corpus/ are the seeds for both fuzzers and are replayed by
+ * "scons test". Besides looking for crashes it checks that:
+ *
+ *  - decoding in one piece and in small chunks agree
+ *  - whatever decodes also encodes, and the encoding decodes to the same thing
+ *  - the raw span of the root covers exactly the input */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "bt-bencode.h"
+
+/* keep the size limit small so the fuzzer finds it; the depth is left at the
+ * default, which is all bt_bencode_decode_arena() allows, so that both
+ * decodes reject the same inputs */
+#define FUZZ_MAX_DEPTH 0
+#define FUZZ_MAX_SIZE  (1024 * 1024)
+
+static void
+fuzz_check (gboolean condition, const gchar *what)
+{
+	if (!condition) {
+		fprintf (stderr, "check failed: %s\n", what);
+		abort ();
+	}
+}
+
+static BtBencode *
+fuzz_decode_chunked (BtBencodeArena *arena, const gchar *data, gsize len, gsize chunk)
+{
+	BtBencodeDecoder *decoder = bt_bencode_decoder_new (arena, FUZZ_MAX_DEPTH, FUZZ_MAX_SIZE);
+	BtBencode *bencode = NULL;
+	gboolean ok = TRUE;
+	gsize pos;
+
+	for (pos = 0; pos < len && ok; pos += chunk)
+		ok = bt_bencode_decoder_feed (decoder, data + pos, MIN (chunk, len - pos), NULL, NULL);
+
+	if (ok)
+		bencode = bt_bencode_decoder_finish (decoder, NULL);
+
+	bt_bencode_decoder_free (decoder);
+
+	return bencode;
+}
+
+static void
+fuzz_one (const gchar *data, gsize len)
+{
+	BtBencodeArena *arena;
+	BtBencode *whole, *chunked, *again;
+	GString *encoded, *reencoded;
+
+	arena = bt_bencode_arena_new (len);
+
+	whole = bt_bencode_decode_arena (arena, data, len, NULL);
+
+	/* chunk size depends on the input so different splits get exercised */
+	chunked = fuzz_decode_chunked (arena, data, len, 1 + (len > 0 ? (guint8) data[0] % 7 : 0));
+
+	fuzz_check ((whole == NULL) == (chunked == NULL) || len > FUZZ_MAX_SIZE, "chunked decoding agrees");
+
+	if (whole == NULL) {
+		bt_bencode_arena_free (arena);
+		return;
+	}
+
+	if (whole->type == BT_BENCODE_TYPE_DICT)
+		fuzz_check (whole->dict.raw.str == data && whole->dict.raw.len == len, "raw span of dict");
+	else if (whole->type == BT_BENCODE_TYPE_LIST)
+		fuzz_check (whole->list.raw.str == data && whole->list.raw.len == len, "raw span of list");
+
+	encoded = bt_bencode_encode (whole);
+	fuzz_check (encoded->len == bt_bencode_encoded_size (whole), "encoded size");
+
+	if (chunked) {
+		GString *tmp = bt_bencode_encode (chunked);
+
+		fuzz_check (tmp->len == encoded->len && memcmp (tmp->str, encoded->str, tmp->len) == 0, "chunked decoding gives the same structure");
+		g_string_free (tmp, TRUE);
+	}
+
+	/* the encoding is canonical, so it has to survive another round trip unchanged */
+	again = bt_bencode_decode_arena (arena, encoded->str, encoded->len, NULL);
+	fuzz_check (again != NULL, "encoding decodes");
+
+	reencoded = bt_bencode_encode (again);
+	fuzz_check (reencoded->len == encoded->len && memcmp (reencoded->str, encoded->str, encoded->len) == 0, "encoding is stable");
+
+	g_string_free (reencoded, TRUE);
+	g_string_free (encoded, TRUE);
+
+	bt_bencode_arena_free (arena);
+}
+
+#ifdef BT_FUZZ_LIBFUZZER
+
+int
+LLVMFuzzerTestOneInput (const guint8 *data, size_t len)
+{
+	fuzz_one ((const gchar *) data, len);
+
+	return 0;
+}
+
+#else
+
+static gboolean
+fuzz_file (const gchar *path)
+{
+	const gchar *entry;
+	gchar *contents;
+	gsize len;
+	GDir *dir;
+
+	if (!g_file_test (path, G_FILE_TEST_IS_DIR)) {
+		if (!g_file_get_contents (path, &contents, &len, NULL)) {
+			fprintf (stderr, "could not read %s\n", path);
+			return FALSE;
+		}
+
+		fuzz_one (contents, len);
+		g_free (contents);
+
+		printf ("%s ok\n", path);
+
+		return TRUE;
+	}
+
+	if (!(dir = g_dir_open (path, 0, NULL))) {
+		fprintf (stderr, "could not open %s\n", path);
+		return FALSE;
+	}
+
+	while ((entry = g_dir_read_name (dir))) {
+		gchar *filename = g_build_filename (path, entry, NULL);
+
+		if (!g_file_test (filename, G_FILE_TEST_IS_DIR))
+			fuzz_file (filename);
+
+		g_free (filename);
+	}
+
+	g_dir_close (dir);
+
+	return TRUE;
+}
+
+int
+main (int argc, char **argv)
+{
+	GString *input;
+	gchar buf[4096];
+	gsize n;
+	gint i;
+
+	if (argc > 1) {
+		for (i = 1; i < argc; i++)
+			if (!fuzz_file (argv[i]))
+				return 1;
+
+		return 0;
+	}
+
+	input = g_string_new (NULL);
+
+	while ((n = fread (buf, 1, sizeof (buf), stdin)) > 0)
+		g_string_append_len (input, buf, n);
+
+	fuzz_one (input->str, input->len);
+
+	g_string_free (input, TRUE);
+
+	return 0;
+}
+
+#endif
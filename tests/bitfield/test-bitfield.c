@@ -0,0 +1,126 @@
+/**
+ * test-bitfield.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Test of the bitfield functions against a bit at a time.
+ *
+ * The bitfields are random, of every length up to a few kilobits so that the
+ * whole-vector loops and the tails after them are both covered, and of
+ * different densities so that searches end early as well as late. The
+ * kernels are picked on first use, so the test is run twice, once with
+ * BT_BITFIELD_NO_SIMD set, which compares the word kernels and the SIMD ones
+ * with the same reference. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+
+#include "bt-bitfield.h"
+
+/* bitfields up to this many bits, which is several 32-byte vectors */
+#define TEST_MAX_BITS 2100
+
+/* random pairs of bitfields for each length */
+#define TEST_ROUNDS 4
+
+static gboolean test_failed = FALSE;
+
+static void
+test_check (gboolean condition, const gchar *what, guint num_bits)
+{
+	if (!condition && !test_failed) {
+		fprintf (stderr, "%s is wrong for %u bits\n", what, num_bits);
+		test_failed = TRUE;
+	}
+}
+
+/* a bitfield that has each bit set with the given chance in 256, in a buffer
+ * of exactly its size so that reading past it is caught by memory checkers */
+static gchar *
+test_make_bitfield (GRand *rand, guint num_bits, guint chance)
+{
+	gchar *bitfield;
+	guint i;
+
+	bitfield = g_malloc0 ((num_bits + 7) / 8 + (num_bits == 0 ? 1 : 0));
+
+	for (i = 0; i < num_bits; i++)
+		if ((guint) g_rand_int_range (rand, 0, 256) < chance)
+			bt_bitfield_set (bitfield, i);
+
+	return bitfield;
+}
+
+static void
+test_bitfields (const gchar *a, const gchar *b, guint num_bits)
+{
+	guint count = 0, count_and_not = 0, i;
+	gint next = -1;
+
+	for (i = 0; i < num_bits; i++) {
+		count += bt_bitfield_get (a, i);
+		count_and_not += bt_bitfield_get (a, i) && !bt_bitfield_get (b, i);
+	}
+
+	test_check (bt_bitfield_count (a, num_bits) == count, "bt_bitfield_count", num_bits);
+	test_check (bt_bitfield_count_and_not (a, b, num_bits) == count_and_not, "bt_bitfield_count_and_not", num_bits);
+	test_check (bt_bitfield_any_and_not (a, b, num_bits) == (count_and_not > 0), "bt_bitfield_any_and_not", num_bits);
+
+	/* from every start, going backwards so that the next bit is known */
+	for (i = num_bits; i-- > 0; ) {
+		if (bt_bitfield_get (a, i) && !bt_bitfield_get (b, i))
+			next = i;
+
+		test_check (bt_bitfield_find_and_not (a, b, num_bits, i) == next, "bt_bitfield_find_and_not", num_bits);
+	}
+
+	test_check (bt_bitfield_find_and_not (a, b, num_bits, num_bits) == -1, "bt_bitfield_find_and_not past the end", num_bits);
+}
+
+int
+main (int argc G_GNUC_UNUSED, char **argv G_GNUC_UNUSED)
+{
+	/* chances of a bit being set in the first and second bitfield */
+	static const guint chances[][2] = {{128, 128}, {255, 250}, {8, 0}, {256, 256}, {0, 0}};
+	GRand *rand;
+	guint num_bits, round;
+
+	rand = g_rand_new_with_seed (1);
+
+	for (num_bits = 0; num_bits <= TEST_MAX_BITS && !test_failed; num_bits++) {
+		for (round = 0; round < TEST_ROUNDS * G_N_ELEMENTS (chances); round++) {
+			gchar *a, *b;
+
+			a = test_make_bitfield (rand, num_bits, chances[round % G_N_ELEMENTS (chances)][0]);
+			b = test_make_bitfield (rand, num_bits, chances[round % G_N_ELEMENTS (chances)][1]);
+
+			test_bitfields (a, b, num_bits);
+
+			g_free (a);
+			g_free (b);
+		}
+	}
+
+	g_rand_free (rand);
+
+	printf ("bitfields of up to %u bits %s with the %s kernels\n", TEST_MAX_BITS, test_failed ? "failed" : "passed",
+	        g_getenv ("BT_BITFIELD_NO_SIMD") ? "word" : "fastest");
+
+	return test_failed ? 1 : 0;
+}
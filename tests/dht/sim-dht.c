@@ -0,0 +1,286 @@
+/**
+ * sim-dht.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Simulation of a small DHT on loopback.
+ *
+ * A few dozen nodes are started in one process and bootstrap off the first
+ * one, like clients do off a router. Once their routing tables have filled up
+ * some of them announce themselves for a torrent under different ports, and
+ * then every node looks the torrent up at once, which has to find all of the
+ * announced peers. The first node also looks up a pile of other torrents at
+ * the same time, and the number of queries it has out has to stay within
+ * bounds while they wait their turn. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "bt-dht.h"
+#include "bt-address.h"
+
+#define SIM_DEFAULT_NODES 32
+
+#define SIM_ANNOUNCERS 4
+
+#define SIM_FIRST_PORT 16881
+
+/* nodes each routing table needs before the lookups start */
+#define SIM_MIN_NODES 8
+
+/* tenths of a second without a query before the network is settled */
+#define SIM_QUIET 20
+
+/* lookups for other torrents the first node does along with its own */
+#define SIM_EXTRA_LOOKUPS 64
+
+/* the most queries one node should have out */
+#define SIM_MAX_QUERIES 64
+
+/* seconds the whole simulation may take */
+#define SIM_TIMEOUT 120
+
+typedef struct {
+	BtDht     **nodes;
+	guint       num_nodes;
+
+	GMainLoop  *loop;
+	gchar       infohash[20];
+
+	/* lookups that haven't called back yet */
+	guint       running;
+
+	/* lookups that found every announcer */
+	guint       complete;
+
+	guint       max_queries;
+	gboolean    failed;
+
+	/* queries sent by all nodes, and checks since that last changed */
+	gulong      sent;
+	guint       quiet;
+} Sim;
+
+static void
+sim_on_announced (BtDht *dht G_GNUC_UNUSED, const gchar *infohash G_GNUC_UNUSED, GArray *peers, gpointer data)
+{
+	Sim *sim = (Sim *) data;
+
+	g_array_free (peers, TRUE);
+
+	if (--sim->running == 0)
+		g_main_loop_quit (sim->loop);
+}
+
+static void
+sim_on_peers (BtDht *dht G_GNUC_UNUSED, const gchar *infohash, GArray *peers, gpointer data)
+{
+	Sim *sim = (Sim *) data;
+	guint i, j, found = 0;
+
+	if (memcmp (infohash, sim->infohash, 20) != 0)
+		sim->failed = TRUE;
+
+	for (i = 0; i < SIM_ANNOUNCERS; i++) {
+		for (j = 0; j < peers->len; j++) {
+			if (g_array_index (peers, BtAddress, j).port == SIM_FIRST_PORT + i) {
+				found++;
+				break;
+			}
+		}
+	}
+
+	if (found == SIM_ANNOUNCERS)
+		sim->complete++;
+
+	g_array_free (peers, TRUE);
+
+	if (--sim->running == 0)
+		g_main_loop_quit (sim->loop);
+}
+
+/* keeps track of the most queries any node had out at once */
+static gboolean
+sim_check (gpointer data)
+{
+	Sim *sim = (Sim *) data;
+	BtDhtStats stats;
+	guint i;
+
+	for (i = 0; i < sim->num_nodes; i++) {
+		bt_dht_get_stats (sim->nodes[i], &stats);
+		sim->max_queries = MAX (sim->max_queries, stats.queries);
+	}
+
+	return TRUE;
+}
+
+/* waits for every node to have found a few others, and for the lookups
+ * that fill in the rest of the routing tables to die down */
+static gboolean
+sim_bootstrapped (gpointer data)
+{
+	Sim *sim = (Sim *) data;
+	BtDhtStats stats;
+	gulong sent = 0;
+	guint i;
+
+	for (i = 0; i < sim->num_nodes; i++) {
+		bt_dht_get_stats (sim->nodes[i], &stats);
+
+		if (stats.nodes < MIN (sim->num_nodes - 1, SIM_MIN_NODES))
+			return TRUE;
+
+		sent += stats.queries_sent;
+	}
+
+	if (sent != sim->sent) {
+		sim->sent = sent;
+		sim->quiet = 0;
+		return TRUE;
+	}
+
+	if (++sim->quiet < SIM_QUIET)
+		return TRUE;
+
+	g_main_loop_quit (sim->loop);
+
+	return FALSE;
+}
+
+static gboolean
+sim_timeout (gpointer data)
+{
+	Sim *sim = (Sim *) data;
+
+	g_printerr ("timed out\n");
+	sim->failed = TRUE;
+	g_main_loop_quit (sim->loop);
+
+	return FALSE;
+}
+
+int
+main (int argc, char **argv)
+{
+	Sim sim;
+	BtDhtStats stats;
+	BtAddress address;
+	GTimer *timer;
+	guint i;
+	gulong sent = 0, timeouts = 0;
+
+	memset (&sim, 0, sizeof (sim));
+
+	sim.num_nodes = argc > 1 ? (guint) atoi (argv[1]) : SIM_DEFAULT_NODES;
+
+	if (sim.num_nodes < SIM_ANNOUNCERS + 2) {
+		g_printerr ("usage: %s [number of nodes, at least %u]\n", argv[0], SIM_ANNOUNCERS + 2);
+		return 1;
+	}
+
+	sim.loop = g_main_loop_new (NULL, FALSE);
+	sim.nodes = g_new0 (BtDht *, sim.num_nodes);
+
+	for (i = 0; i < 20; i++)
+		sim.infohash[i] = g_random_int_range (0, 256);
+
+	for (i = 0; i < sim.num_nodes; i++) {
+		GError *error = NULL;
+
+		if (!(sim.nodes[i] = bt_dht_new (NULL, 0, NULL, &error))) {
+			g_printerr ("could not start node %u: %s\n", i, error->message);
+			return 1;
+		}
+	}
+
+	/* everyone knows the first node, and it knows the second */
+	for (i = 0; i < sim.num_nodes; i++) {
+		bt_address_set_bytes (&address, "\x7f\x00\x00\x01", 4, bt_dht_get_port (sim.nodes[i == 0 ? 1 : 0]));
+		bt_dht_add_node (sim.nodes[i], &address);
+	}
+
+	g_timeout_add (SIM_TIMEOUT * 1000, sim_timeout, &sim);
+	g_timeout_add (10, sim_check, &sim);
+
+	timer = g_timer_new ();
+
+	g_timeout_add (100, sim_bootstrapped, &sim);
+	g_main_loop_run (sim.loop);
+
+	g_print ("bootstrapped %u nodes in %.1f s\n", sim.num_nodes, g_timer_elapsed (timer, NULL));
+
+	/* the announcers go from the end, away from the first node */
+	g_timer_start (timer);
+
+	for (i = 0; i < SIM_ANNOUNCERS && !sim.failed; i++) {
+		sim.running++;
+		bt_dht_get_peers (sim.nodes[sim.num_nodes - 1 - i], sim.infohash, SIM_FIRST_PORT + i, sim_on_announced, &sim);
+	}
+
+	if (!sim.failed)
+		g_main_loop_run (sim.loop);
+
+	g_print ("announced %u peers in %.1f s\n", SIM_ANNOUNCERS, g_timer_elapsed (timer, NULL));
+
+	/* the announces are fire-and-forget, give them a moment to land */
+	g_timeout_add (500, (GSourceFunc) g_main_loop_quit, sim.loop);
+	g_main_loop_run (sim.loop);
+
+	g_timer_start (timer);
+
+	for (i = 0; i < SIM_EXTRA_LOOKUPS && !sim.failed; i++) {
+		gchar infohash[20];
+		guint j;
+
+		for (j = 0; j < 20; j++)
+			infohash[j] = g_random_int_range (0, 256);
+
+		sim.running++;
+		bt_dht_get_peers (sim.nodes[0], infohash, 0, sim_on_announced, &sim);
+	}
+
+	for (i = 0; i < sim.num_nodes && !sim.failed; i++) {
+		sim.running++;
+		bt_dht_get_peers (sim.nodes[i], sim.infohash, 0, sim_on_peers, &sim);
+	}
+
+	if (!sim.failed)
+		g_main_loop_run (sim.loop);
+
+	g_print ("%u of %u lookups found every peer in %.1f s\n", sim.complete, sim.num_nodes, g_timer_elapsed (timer, NULL));
+
+	for (i = 0; i < sim.num_nodes; i++) {
+		bt_dht_get_stats (sim.nodes[i], &stats);
+		sent += stats.queries_sent;
+		timeouts += stats.timeouts;
+	}
+
+	g_print ("%lu queries sent, %lu timed out, at most %u out on one node\n", sent, timeouts, sim.max_queries);
+
+	for (i = 0; i < sim.num_nodes; i++)
+		bt_dht_free (sim.nodes[i]);
+
+	g_free (sim.nodes);
+	g_timer_destroy (timer);
+	g_main_loop_unref (sim.loop);
+
+	return !sim.failed && sim.complete == sim.num_nodes && sim.max_queries <= SIM_MAX_QUERIES ? 0 : 1;
+}
@@ -0,0 +1,178 @@
+/**
+ * bench-lookup.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Benchmark for looking up torrents by infohash, which every incoming
+ * handshake does.
+ *
+ * A manager is filled with dormant torrents and then asked for a mix of
+ * infohashes it has and infohashes it doesn't, as random peers would send.
+ * For comparison the same lookups are done the way the manager used to, with
+ * a table keyed by hex strings and a conversion for every lookup. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <glib-object.h>
+
+#include "bt-manager.h"
+#include "bt-torrent.h"
+#include "bt-utils.h"
+
+#include "bench-allocs.h"
+
+#define BENCH_DEFAULT_TORRENTS 100000
+
+#define BENCH_LOOKUPS (10 * 1000 * 1000)
+
+/* the lookup keys repeat after this many, so they stay in cache like a busy
+ * set of swarms would, without the benchmark measuring its own key generation */
+#define BENCH_KEYS 65536
+
+/* looks up one key and returns whether it was found */
+typedef gboolean (*BenchFunc) (gpointer table, const gchar *infohash);
+
+static gboolean
+bench_lookup_hex (gpointer table, const gchar *infohash)
+{
+	gchar *string;
+	gpointer found;
+
+	string = bt_hash_to_string (infohash);
+	found = g_hash_table_lookup ((GHashTable *) table, string);
+	g_free (string);
+
+	return found != NULL;
+}
+
+static gboolean
+bench_lookup_binary (gpointer manager, const gchar *infohash)
+{
+	return bt_manager_get_torrent (BT_MANAGER (manager), infohash) != NULL;
+}
+
+static void
+bench_random_hash (GRand *rand, gchar *hash)
+{
+	guint i;
+
+	for (i = 0; i < 20; i += 4) {
+		guint32 r = g_rand_int (rand);
+
+		memcpy (hash + i, &r, 4);
+	}
+}
+
+static gdouble
+bench_run (const gchar *name, BenchFunc func, gpointer table, const gchar *keys, guint expected)
+{
+	GTimer *timer;
+	gsize allocs;
+	gdouble elapsed;
+	guint i, found = 0;
+
+	/* warm up */
+	for (i = 0; i < BENCH_KEYS; i++)
+		func (table, keys + 20 * i);
+
+	timer = g_timer_new ();
+	allocs = bench_allocs;
+
+	for (i = 0; i < BENCH_LOOKUPS; i++)
+		found += func (table, keys + 20 * (i % BENCH_KEYS));
+
+	allocs = bench_allocs - allocs;
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+
+	if (found != expected)
+		g_printerr ("%s: found %u torrents, expected %u\n", name, found, expected);
+
+	if (BENCH_COUNTS_ALLOCS)
+		g_print ("  %-20s %8.1f ns/lookup %8.2f allocs/lookup\n", name, elapsed * 1e9 / BENCH_LOOKUPS, (gdouble) allocs / BENCH_LOOKUPS);
+	else
+		g_print ("  %-20s %8.1f ns/lookup %8s allocs/lookup\n", name, elapsed * 1e9 / BENCH_LOOKUPS, "n/a");
+
+	return elapsed;
+}
+
+int
+main (int argc, char **argv)
+{
+	BtManager *manager;
+	GHashTable *hex;
+	GRand *rand;
+	gchar *hashes, *keys;
+	guint num_torrents, i, expected = 0;
+	gdouble before, after;
+
+	g_type_init ();
+
+	num_torrents = argc > 1 ? (guint) atoi (argv[1]) : BENCH_DEFAULT_TORRENTS;
+
+	if (num_torrents == 0) {
+		g_printerr ("usage: %s [number of torrents]\n", argv[0]);
+		return 1;
+	}
+
+	rand = g_rand_new_with_seed (6881);
+
+	manager = g_object_new (BT_TYPE_MANAGER, NULL);
+	hex = g_hash_table_new (g_str_hash, g_str_equal);
+	hashes = g_malloc (20 * num_torrents);
+
+	for (i = 0; i < num_torrents; i++) {
+		gchar *hash = hashes + 20 * i;
+		BtTorrent *torrent;
+		gchar name[32];
+
+		bench_random_hash (rand, hash);
+		g_snprintf (name, sizeof (name), "torrent-%u", i);
+
+		torrent = bt_torrent_new_dormant (manager, "bench.torrent", name, 0, hash);
+		bt_manager_add_torrent (manager, torrent);
+		g_hash_table_insert (hex, bt_hash_to_string (hash), torrent);
+		g_object_unref (torrent);
+	}
+
+	/* half of the handshakes are for torrents we have, the rest are random */
+	keys = g_malloc (20 * BENCH_KEYS);
+
+	for (i = 0; i < BENCH_KEYS; i++) {
+		if (i % 2 == 0) {
+			memcpy (keys + 20 * i, hashes + 20 * g_rand_int_range (rand, 0, num_torrents), 20);
+			expected++;
+		} else {
+			bench_random_hash (rand, keys + 20 * i);
+		}
+	}
+
+	expected = expected * (BENCH_LOOKUPS / BENCH_KEYS) + (BENCH_LOOKUPS % BENCH_KEYS + 1) / 2;
+
+	g_print ("%u torrents, %u lookups\n", num_torrents, BENCH_LOOKUPS);
+
+	before = bench_run ("hex string keys", bench_lookup_hex, hex, keys, expected);
+	after = bench_run ("binary keys", bench_lookup_binary, manager, keys, expected);
+
+	g_print ("  %-20s %8.2fx\n", "speedup", before / after);
+
+	/* the process is about to exit, so don't bother tearing down 100k torrents */
+	return 0;
+}
@@ -0,0 +1,532 @@
+/**
+ * test-peer.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Test of downloading a torrent from a stub seed on loopback.
+ *
+ * The torrent is made up on the spot and the stub seed serves it over the
+ * manager's listening port, with the fast extension. The client has to get
+ * interested in the seed, ask it for every block once it's unchoked, and get
+ * uninterested as soon as the last piece completes. A second stub peer has
+ * none of the pieces; the have messages for the pieces that complete within
+ * one have interval have to come to it together, and none have to go to the
+ * seed, which has them all already. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "bt-manager.h"
+#include "bt-torrent.h"
+#include "sha1.h"
+
+#define TEST_PIECES 8
+#define TEST_PIECE_LENGTH 32768
+
+/* the last piece is shorter, so that its last block is too */
+#define TEST_SIZE (TEST_PIECES * TEST_PIECE_LENGTH - 1000)
+
+#define TEST_NAME "bittorque-test-peer"
+
+#define TEST_PORT 16881
+
+/* milliseconds over which have messages are gathered */
+#define TEST_HAVE_INTERVAL 1000
+
+/* seconds the whole test may take */
+#define TEST_TIMEOUT 30
+
+typedef enum {
+	MSG_CHOKE,
+	MSG_UNCHOKE,
+	MSG_INTERESTED,
+	MSG_UNINTERESTED,
+	MSG_HAVE,
+	MSG_BITFIELD,
+	MSG_REQUEST,
+	MSG_PIECE,
+	MSG_HAVE_ALL = 14,
+	MSG_HAVE_NONE
+} Msg;
+
+typedef struct {
+	GMainLoop   *loop;
+	GTimer      *timer;
+
+	gchar       *content;
+
+	/* when the seed sent the first block */
+	gdouble      first_block;
+
+	gboolean     failed;
+} Test;
+
+/* the stub end of a connection to the client */
+typedef struct {
+	Test        *test;
+	gint         fd;
+	GIOChannel  *channel;
+	GString     *buffer;
+
+	/* whether this is the seed, which has every piece */
+	gboolean     seed;
+
+	gboolean     handshaken;
+
+	/* what the client said last, and when it said it's not interested */
+	gboolean     interested;
+	gdouble      uninterested_at;
+
+	guint        blocks;
+	guint        bad_requests;
+
+	/* the have messages that came, and when the first and last did */
+	guint        haves;
+	gdouble      first_have;
+	gdouble      last_have;
+} TestPeer;
+
+static void
+put32 (gchar *buf, guint32 value)
+{
+	value = g_htonl (value);
+	memcpy (buf, &value, 4);
+}
+
+static guint32
+get32 (const gchar *buf)
+{
+	guint32 value;
+
+	memcpy (&value, buf, 4);
+
+	return g_ntohl (value);
+}
+
+/* writes a metainfo file for the test's content, and returns its name */
+static gchar *
+test_write_torrent (Test *test)
+{
+	GString *metainfo;
+	GError *error = NULL;
+	gchar *filename;
+	guint i;
+
+	metainfo = g_string_new (NULL);
+
+	g_string_append_printf (metainfo, "d8:announce27:http://127.0.0.1:1/announce4:infod6:lengthi%ue4:name%u:%s12:piece lengthi%ue6:pieces%u:",
+	                        TEST_SIZE, (guint) strlen (TEST_NAME), TEST_NAME, TEST_PIECE_LENGTH, TEST_PIECES * 20);
+
+	for (i = 0; i < TEST_PIECES; i++) {
+		SHA1Context sha;
+		gchar hash[20];
+
+		sha1_init (&sha);
+		sha1_update (&sha, test->content + i * TEST_PIECE_LENGTH, MIN (TEST_PIECE_LENGTH, TEST_SIZE - i * TEST_PIECE_LENGTH));
+		sha1_finish (&sha, hash);
+
+		g_string_append_len (metainfo, hash, 20);
+	}
+
+	g_string_append (metainfo, "ee");
+
+	filename = g_build_filename (g_get_tmp_dir (), TEST_NAME ".torrent", NULL);
+
+	if (!g_file_set_contents (filename, metainfo->str, metainfo->len, &error)) {
+		g_printerr ("could not write %s: %s\n", filename, error->message);
+		exit (1);
+	}
+
+	g_string_free (metainfo, TRUE);
+
+	return filename;
+}
+
+static void
+test_peer_write (TestPeer *peer, const gchar *buf, gsize len)
+{
+	while (len > 0) {
+		gssize written = write (peer->fd, buf, len);
+
+		if (written < 0) {
+			g_printerr ("could not write to the client\n");
+			peer->test->failed = TRUE;
+			g_main_loop_quit (peer->test->loop);
+			return;
+		}
+
+		buf += written;
+		len -= written;
+	}
+}
+
+static void
+test_peer_send (TestPeer *peer, Msg type)
+{
+	gchar buf[5];
+
+	put32 (buf, 1);
+	buf[4] = type;
+
+	test_peer_write (peer, buf, 5);
+}
+
+static void
+test_peer_on_request (TestPeer *peer, const gchar *msg)
+{
+	Test *test = peer->test;
+	guint32 piece, begin, length;
+	gchar header[13];
+
+	piece = get32 (msg + 5);
+	begin = get32 (msg + 9);
+	length = get32 (msg + 13);
+
+	if (!peer->seed || piece >= TEST_PIECES || length == 0 || length > 16384
+	    || (guint64) piece * TEST_PIECE_LENGTH + begin + length > TEST_SIZE) {
+		peer->bad_requests++;
+		return;
+	}
+
+	if (peer->blocks++ == 0)
+		test->first_block = g_timer_elapsed (test->timer, NULL);
+
+	put32 (header, length + 9);
+	header[4] = MSG_PIECE;
+	put32 (header + 5, piece);
+	put32 (header + 9, begin);
+
+	test_peer_write (peer, header, 13);
+	test_peer_write (peer, test->content + piece * TEST_PIECE_LENGTH + begin, length);
+}
+
+static void
+test_peer_on_msg (TestPeer *peer, const gchar *msg, guint32 len)
+{
+	gdouble now = g_timer_elapsed (peer->test->timer, NULL);
+
+	if (len == 0)
+		return;
+
+	switch (msg[4]) {
+	case MSG_INTERESTED:
+		peer->interested = TRUE;
+
+		if (peer->seed)
+			test_peer_send (peer, MSG_UNCHOKE);
+		break;
+
+	case MSG_UNINTERESTED:
+		peer->interested = FALSE;
+		peer->uninterested_at = now;
+		break;
+
+	case MSG_HAVE:
+		if (peer->haves++ == 0)
+			peer->first_have = now;
+
+		peer->last_have = now;
+		break;
+
+	case MSG_REQUEST:
+		if (len == 13)
+			test_peer_on_request (peer, msg);
+		else
+			peer->bad_requests++;
+		break;
+
+	default:
+		break;
+	}
+}
+
+static gboolean
+test_peer_on_read (GIOChannel *channel G_GNUC_UNUSED, GIOCondition condition G_GNUC_UNUSED, gpointer data)
+{
+	TestPeer *peer = (TestPeer *) data;
+	gchar buf[4096];
+	gssize len;
+
+	len = read (peer->fd, buf, sizeof (buf));
+
+	if (len <= 0) {
+		g_printerr ("the client closed the connection to the %s\n", peer->seed ? "seed" : "other peer");
+		peer->test->failed = TRUE;
+		g_main_loop_quit (peer->test->loop);
+		return FALSE;
+	}
+
+	g_string_append_len (peer->buffer, buf, len);
+
+	/* the handshake has the same infohash, and we don't check the peer id */
+	if (!peer->handshaken) {
+		if (peer->buffer->len < 68)
+			return TRUE;
+
+		g_string_erase (peer->buffer, 0, 68);
+		peer->handshaken = TRUE;
+
+		test_peer_send (peer, peer->seed ? MSG_HAVE_ALL : MSG_HAVE_NONE);
+	}
+
+	while (peer->buffer->len >= 4 && peer->buffer->len >= 4 + get32 (peer->buffer->str)) {
+		guint32 msg_len = get32 (peer->buffer->str);
+
+		test_peer_on_msg (peer, peer->buffer->str, msg_len);
+		g_string_erase (peer->buffer, 0, 4 + msg_len);
+	}
+
+	return TRUE;
+}
+
+static TestPeer *
+test_peer_new (Test *test, BtTorrent *torrent, gboolean seed)
+{
+	TestPeer *peer;
+	struct sockaddr_in address;
+	gchar handshake[68];
+	guint i;
+
+	peer = g_new0 (TestPeer, 1);
+	peer->test = test;
+	peer->seed = seed;
+	peer->buffer = g_string_new (NULL);
+	peer->uninterested_at = -1;
+
+	peer->fd = socket (AF_INET, SOCK_STREAM, 0);
+
+	memset (&address, 0, sizeof (address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons (TEST_PORT);
+	address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+	if (peer->fd < 0 || connect (peer->fd, (struct sockaddr *) &address, sizeof (address)) < 0) {
+		g_printerr ("could not connect to the client\n");
+		exit (1);
+	}
+
+	/* with the fast extension, to tell the client which pieces it has with
+	 * have all and have none */
+	handshake[0] = 19;
+	memcpy (handshake + 1, "BitTorrent protocol", 19);
+	memset (handshake + 20, 0, 8);
+	handshake[27] |= 0x04;
+	memcpy (handshake + 28, bt_torrent_get_infohash (torrent), 20);
+	memcpy (handshake + 48, seed ? "-TS0001-seed" : "-TS0001-peer", 12);
+
+	for (i = 60; i < 68; i++)
+		handshake[i] = g_random_int_range ('a', 'z' + 1);
+
+	test_peer_write (peer, handshake, 68);
+
+	peer->channel = g_io_channel_unix_new (peer->fd);
+	g_io_add_watch (peer->channel, G_IO_IN | G_IO_HUP | G_IO_ERR, test_peer_on_read, peer);
+
+	return peer;
+}
+
+static void
+test_peer_free (TestPeer *peer)
+{
+	g_io_channel_unref (peer->channel);
+	close (peer->fd);
+	g_string_free (peer->buffer, TRUE);
+	g_free (peer);
+}
+
+static gboolean
+test_quit (gpointer data)
+{
+	Test *test = (Test *) data;
+
+	g_main_loop_quit (test->loop);
+
+	return FALSE;
+}
+
+/* once every have message is in, waits a little longer to see that no more
+ * come */
+static gboolean
+test_check_done (gpointer data)
+{
+	TestPeer *other = (TestPeer *) data;
+
+	if (other->haves < TEST_PIECES)
+		return TRUE;
+
+	g_timeout_add (TEST_HAVE_INTERVAL * 2, test_quit, other->test);
+
+	return FALSE;
+}
+
+static gboolean
+test_timeout (gpointer data)
+{
+	Test *test = (Test *) data;
+
+	g_printerr ("timed out\n");
+	test->failed = TRUE;
+	g_main_loop_quit (test->loop);
+
+	return FALSE;
+}
+
+int
+main (int argc G_GNUC_UNUSED, char **argv G_GNUC_UNUSED)
+{
+	Test test;
+	TestPeer *seed, *other;
+	BtManager *manager;
+	BtTorrent *torrent;
+	GError *error = NULL;
+	gchar *filename, *path;
+	guint i;
+
+	if (!g_thread_supported ())
+		g_thread_init (NULL);
+
+	g_type_init ();
+
+	memset (&test, 0, sizeof (test));
+
+	test.loop = g_main_loop_new (NULL, FALSE);
+	test.timer = g_timer_new ();
+	test.content = g_malloc (TEST_SIZE);
+
+	for (i = 0; i < TEST_SIZE; i++)
+		test.content[i] = g_random_int_range (0, 256);
+
+	filename = test_write_torrent (&test);
+
+	/* the download goes where the torrent's io puts it */
+	path = g_build_filename ("/tmp", TEST_NAME, NULL);
+	g_unlink (path);
+
+	manager = bt_manager_new ();
+	g_object_set (manager, "have-interval", TEST_HAVE_INTERVAL, "lazy-have", TRUE, NULL);
+	bt_manager_set_port (manager, TEST_PORT);
+
+	if (!bt_manager_start_accepting (manager, &error)) {
+		g_printerr ("could not listen on port %u: %s\n", TEST_PORT, error->message);
+		return 1;
+	}
+
+	if (!(torrent = bt_torrent_new (manager, filename, &error))) {
+		g_printerr ("could not load the torrent: %s\n", error->message);
+		return 1;
+	}
+
+	if (!bt_torrent_is_loaded (torrent) && !bt_torrent_load (torrent, &error)) {
+		g_printerr ("could not load the torrent: %s\n", error->message);
+		return 1;
+	}
+
+	bt_manager_add_torrent (manager, torrent);
+
+	other = test_peer_new (&test, torrent, FALSE);
+	seed = test_peer_new (&test, torrent, TRUE);
+
+	g_timeout_add (100, test_check_done, other);
+	g_timeout_add (TEST_TIMEOUT * 1000, test_timeout, &test);
+
+	g_main_loop_run (test.loop);
+
+	g_print ("%u of %u pieces downloaded in %u blocks\n", bt_torrent_get_num_have (torrent), TEST_PIECES, seed->blocks);
+	g_print ("have messages: %u to the seed, %u to the other peer over %.3f s\n",
+	         seed->haves, other->haves, other->last_have - other->first_have);
+
+	if (bt_torrent_get_num_have (torrent) != TEST_PIECES) {
+		g_printerr ("not every piece completed\n");
+		test.failed = TRUE;
+	}
+
+	if (seed->bad_requests > 0 || other->bad_requests > 0) {
+		g_printerr ("%u requests were wrong\n", seed->bad_requests + other->bad_requests);
+		test.failed = TRUE;
+	}
+
+	/* every block is asked for once */
+	if (seed->blocks != (TEST_SIZE + 16383) / 16384) {
+		g_printerr ("%u blocks were asked for, not %u\n", seed->blocks, (TEST_SIZE + 16383) / 16384);
+		test.failed = TRUE;
+	}
+
+	if (seed->interested || seed->uninterested_at < 0) {
+		g_printerr ("the client is still interested in the seed\n");
+		test.failed = TRUE;
+	}
+
+	if (other->interested) {
+		g_printerr ("the client got interested in a peer with nothing\n");
+		test.failed = TRUE;
+	}
+
+	/* the seed has every piece, so with lazy haves it isn't told about any */
+	if (seed->haves != 0) {
+		g_printerr ("the seed was sent %u have messages\n", seed->haves);
+		test.failed = TRUE;
+	}
+
+	if (other->haves != TEST_PIECES) {
+		g_printerr ("the other peer was sent %u have messages\n", other->haves);
+		test.failed = TRUE;
+	}
+
+	/* the pieces complete well within one interval on loopback, so their
+	 * haves are held back until it's over, and then sent all at once; the
+	 * seed hears that we're done with it right away */
+	if (other->first_have - test.first_block < TEST_HAVE_INTERVAL / 1000.0 * 0.9) {
+		g_printerr ("have messages were sent before the interval was over\n");
+		test.failed = TRUE;
+	}
+
+	if (other->last_have - other->first_have > TEST_HAVE_INTERVAL / 1000.0 / 2) {
+		g_printerr ("have messages weren't sent together\n");
+		test.failed = TRUE;
+	}
+
+	if (seed->uninterested_at > other->first_have) {
+		g_printerr ("the client wasn't uninterested as soon as it was done\n");
+		test.failed = TRUE;
+	}
+
+	test_peer_free (seed);
+	test_peer_free (other);
+
+	g_object_unref (torrent);
+	g_object_unref (manager);
+
+	g_unlink (path);
+	g_unlink (filename);
+
+	g_free (path);
+	g_free (filename);
+	g_free (test.content);
+	g_timer_destroy (test.timer);
+	g_main_loop_unref (test.loop);
+
+	return test.failed ? 1 : 0;
+}
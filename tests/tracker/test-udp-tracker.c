@@ -0,0 +1,415 @@
+/**
+ * test-udp-tracker.c
+ *
+ * Copyright 2007 Samuel Cormier-Iijima <sciyoshi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Test of the UDP tracker client against stub trackers on loopback.
+ *
+ * A couple of thousand torrents announce to one stub tracker at once, which
+ * drops every tenth request it gets so that the client has to retransmit. All
+ * of them have to share a single connection id, get the answer meant for
+ * them, and not go out faster than the client paces them. Some are cancelled
+ * right away and must never be answered. On the side, announces go to the
+ * same tracker by name, to one that only sends errors and to one that never
+ * answers, which have to fail. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "bt-udp-tracker.h"
+#include "bt-udp.h"
+#include "bt-address.h"
+
+#define TEST_DEFAULT_TORRENTS 2000
+
+/* the stub drops one in this many requests */
+#define TEST_DROP 10
+
+/* every this many torrents, one is cancelled as soon as it's announced */
+#define TEST_CANCEL 40
+
+#define TEST_FIRST_PORT 10000
+
+/* milliseconds before the client's first retransmission */
+#define TEST_RETRANSMIT 100
+
+/* seconds the whole test may take */
+#define TEST_TIMEOUT 120
+
+/* connects the stub answers before it stops telling ids apart */
+#define STUB_MAX_CONNECTS 16
+
+typedef enum {
+	STUB_ANSWER,
+	STUB_ERROR,
+	STUB_SILENT
+} StubMode;
+
+typedef struct {
+	BtUdpSocket *socket;
+	StubMode     mode;
+
+	/* the connection ids given out, and how many */
+	guint64      connection_ids[STUB_MAX_CONNECTS];
+
+	guint        received;
+	guint        connects;
+	guint        announces;
+
+	/* announces with a connection id that wasn't the one we gave out */
+	guint        bad_connection;
+} Stub;
+
+typedef struct {
+	GMainLoop   *loop;
+	guint        num_torrents;
+
+	/* callbacks that are still expected */
+	guint        running;
+
+	guint        answered;
+	guint        errors;
+	gboolean     failed;
+} Test;
+
+/* the user data of each announce */
+typedef struct {
+	Test        *test;
+	guint16      port;
+	gboolean     cancelled;
+
+	/* whether the announce has to fail */
+	gboolean     fails;
+} TestTorrent;
+
+static void
+put32 (gchar *buf, guint32 value)
+{
+	value = g_htonl (value);
+	memcpy (buf, &value, 4);
+}
+
+static guint32
+get32 (const gchar *buf)
+{
+	guint32 value;
+
+	memcpy (&value, buf, 4);
+
+	return g_ntohl (value);
+}
+
+static guint64
+get64 (const gchar *buf)
+{
+	return (guint64) get32 (buf) << 32 | get32 (buf + 4);
+}
+
+static void
+stub_on_datagram (BtUdpSocket *socket, const BtAddress *from, const gchar *buf, gsize len, gpointer data)
+{
+	Stub *stub = (Stub *) data;
+	gchar reply[26];
+	guint32 action;
+
+	if (stub->mode == STUB_SILENT || len < 16 || ++stub->received % TEST_DROP == 0)
+		return;
+
+	action = get32 (buf + 8);
+
+	/* the transaction id goes back as it came */
+	memcpy (reply + 4, buf + 12, 4);
+
+	if (stub->mode == STUB_ERROR) {
+		put32 (reply, 3);
+		memcpy (reply + 8, "go away", 7);
+		bt_udp_socket_send (socket, from, reply, 15);
+		return;
+	}
+
+	if (action == 0 && get64 (buf) == G_GINT64_CONSTANT (0x41727101980)) {
+		guint64 connection_id = (guint64) g_random_int () << 32 | g_random_int ();
+
+		if (stub->connects < STUB_MAX_CONNECTS)
+			stub->connection_ids[stub->connects] = connection_id;
+
+		stub->connects++;
+
+		put32 (reply, 0);
+		put32 (reply + 8, connection_id >> 32);
+		put32 (reply + 12, connection_id & 0xffffffff);
+		bt_udp_socket_send (socket, from, reply, 16);
+	} else if (action == 1 && len >= 98) {
+		guint i;
+
+		stub->announces++;
+
+		for (i = 0; i < MIN (stub->connects, STUB_MAX_CONNECTS); i++)
+			if (get64 (buf) == stub->connection_ids[i])
+				break;
+
+		if (i == MIN (stub->connects, STUB_MAX_CONNECTS))
+			stub->bad_connection++;
+
+		/* one peer, with the port that was announced */
+		put32 (reply, 1);
+		put32 (reply + 8, 1800);
+		put32 (reply + 12, 1);
+		put32 (reply + 16, 0);
+		memcpy (reply + 20, "\x7f\x00\x00\x01", 4);
+		memcpy (reply + 24, buf + 96, 2);
+		bt_udp_socket_send (socket, from, reply, 26);
+	}
+}
+
+static Stub *
+stub_new (StubMode mode)
+{
+	Stub *stub;
+	GError *error = NULL;
+
+	stub = g_new0 (Stub, 1);
+	stub->mode = mode;
+
+	if (!(stub->socket = bt_udp_socket_new (NULL, 0, stub_on_datagram, stub, &error))) {
+		g_printerr ("could not start stub tracker: %s\n", error->message);
+		exit (1);
+	}
+
+	return stub;
+}
+
+static void
+stub_free (Stub *stub)
+{
+	bt_udp_socket_free (stub->socket);
+	g_free (stub);
+}
+
+static void
+test_on_announce (BtUdpTracker *tracker G_GNUC_UNUSED, BtUdpTrackerResponse *response, const GError *error, gpointer data)
+{
+	TestTorrent *torrent = (TestTorrent *) data;
+	Test *test = torrent->test;
+
+	if (torrent->cancelled) {
+		g_printerr ("cancelled announce was answered\n");
+		test->failed = TRUE;
+	} else if (error != NULL) {
+		if (!torrent->fails) {
+			g_printerr ("announce failed: %s\n", error->message);
+			test->failed = TRUE;
+		}
+
+		test->errors++;
+	} else if (torrent->fails) {
+		g_printerr ("announce should have failed\n");
+		test->failed = TRUE;
+	} else if (response->peers->len != 1 || g_array_index (response->peers, BtAddress, 0).port != torrent->port) {
+		g_printerr ("announce for port %u got the wrong answer\n", torrent->port);
+		test->failed = TRUE;
+	} else {
+		test->answered++;
+	}
+
+	if (response != NULL)
+		g_array_free (response->peers, TRUE);
+
+	if (--test->running == 0)
+		g_main_loop_quit (test->loop);
+}
+
+static void
+test_announce (Test *test, BtUdpTracker *tracker, const gchar *url, TestTorrent *torrent)
+{
+	BtUdpTrackerAnnounce announce;
+	GError *error = NULL;
+	guint i;
+
+	memset (&announce, 0, sizeof (announce));
+
+	for (i = 0; i < 20; i++)
+		announce.infohash[i] = announce.peer_id[i] = g_random_int_range (0, 256);
+
+	announce.left = 1 << 20;
+	announce.event = BT_UDP_TRACKER_EVENT_STARTED;
+	announce.num_want = 30;
+	announce.port = torrent->port;
+
+	torrent->test = test;
+
+	if (!bt_udp_tracker_announce (tracker, url, &announce, test_on_announce, torrent, &error)) {
+		g_printerr ("could not announce to %s: %s\n", url, error->message);
+		exit (1);
+	}
+
+	test->running++;
+}
+
+static gboolean
+test_timeout (gpointer data)
+{
+	Test *test = (Test *) data;
+
+	g_printerr ("timed out with %u announces left\n", test->running);
+	test->failed = TRUE;
+	g_main_loop_quit (test->loop);
+
+	return FALSE;
+}
+
+int
+main (int argc, char **argv)
+{
+	Test test;
+	Stub *stub, *error_stub, *silent_stub;
+	BtUdpTracker *tracker;
+	BtUdpTrackerStats stats;
+	BtUdpTrackerAnnounce announce;
+	TestTorrent *torrents, side[3];
+	GError *error = NULL;
+	GTimer *timer;
+	gchar *url, *name_url, *error_url, *silent_url;
+	guint i, cancelled = 0;
+	gdouble elapsed, least;
+
+	if (!g_thread_supported ())
+		g_thread_init (NULL);
+
+	memset (&test, 0, sizeof (test));
+
+	test.num_torrents = argc > 1 ? (guint) atoi (argv[1]) : TEST_DEFAULT_TORRENTS;
+
+	if (test.num_torrents == 0 || test.num_torrents > 50000) {
+		g_printerr ("usage: %s [number of torrents, at most 50000]\n", argv[0]);
+		return 1;
+	}
+
+	test.loop = g_main_loop_new (NULL, FALSE);
+
+	stub = stub_new (STUB_ANSWER);
+	error_stub = stub_new (STUB_ERROR);
+	silent_stub = stub_new (STUB_SILENT);
+
+	if (!(tracker = bt_udp_tracker_new (NULL, &error))) {
+		g_printerr ("could not start client: %s\n", error->message);
+		return 1;
+	}
+
+	bt_udp_tracker_set_timeout (tracker, TEST_RETRANSMIT);
+
+	url = g_strdup_printf ("udp://127.0.0.1:%u/announce", bt_udp_socket_get_port (stub->socket));
+	name_url = g_strdup_printf ("udp://localhost:%u", bt_udp_socket_get_port (stub->socket));
+	error_url = g_strdup_printf ("udp://127.0.0.1:%u/announce", bt_udp_socket_get_port (error_stub->socket));
+	silent_url = g_strdup_printf ("udp://127.0.0.1:%u/announce", bt_udp_socket_get_port (silent_stub->socket));
+
+	memset (&announce, 0, sizeof (announce));
+
+	if (bt_udp_tracker_announce (tracker, "http://127.0.0.1:6969/announce", &announce, test_on_announce, NULL, NULL)) {
+		g_printerr ("announced to an http url\n");
+		return 1;
+	}
+
+	torrents = g_new0 (TestTorrent, test.num_torrents);
+
+	for (i = 0; i < test.num_torrents; i++) {
+		torrents[i].port = TEST_FIRST_PORT + i;
+		test_announce (&test, tracker, url, &torrents[i]);
+
+		if (i % TEST_CANCEL == 0) {
+			bt_udp_tracker_cancel (tracker, &torrents[i]);
+			torrents[i].cancelled = TRUE;
+			test.running--;
+			cancelled++;
+		}
+	}
+
+	memset (side, 0, sizeof (side));
+
+	side[0].port = 1;
+	test_announce (&test, tracker, name_url, &side[0]);
+
+	side[1].port = 2;
+	side[1].fails = TRUE;
+	test_announce (&test, tracker, error_url, &side[1]);
+
+	side[2].port = 3;
+	side[2].fails = TRUE;
+	test_announce (&test, tracker, silent_url, &side[2]);
+
+	g_timeout_add (TEST_TIMEOUT * 1000, test_timeout, &test);
+
+	timer = g_timer_new ();
+	g_main_loop_run (test.loop);
+	elapsed = g_timer_elapsed (timer, NULL);
+
+	bt_udp_tracker_get_stats (tracker, &stats);
+
+	g_print ("%u of %u announces answered in %.1f s, %u cancelled, %u failed\n",
+	         test.answered, test.num_torrents + 1 - cancelled, elapsed, cancelled, test.errors);
+	g_print ("%lu connects and %lu announces sent to %u trackers, %lu retransmitted\n",
+	         (gulong) stats.connects_sent, (gulong) stats.announces_sent, stats.hosts, (gulong) stats.retransmits);
+	g_print ("stub tracker answered %u connects and %u announces\n", stub->connects, stub->announces);
+
+	/* by address and by name, each with its own connection */
+	if (stub->connects != 2) {
+		g_printerr ("expected one connect for each name of the tracker\n");
+		test.failed = TRUE;
+	}
+
+	if (stub->bad_connection > 0) {
+		g_printerr ("%u announces used the wrong connection id\n", stub->bad_connection);
+		test.failed = TRUE;
+	}
+
+	if (stats.retransmits == 0) {
+		g_printerr ("nothing was retransmitted\n");
+		test.failed = TRUE;
+	}
+
+	/* the announces can't all go out at once; 128 every quarter second */
+	least = (gdouble) (test.num_torrents - cancelled) / 512 - 1;
+
+	if (elapsed < least) {
+		g_printerr ("announces went out faster than they're paced\n");
+		test.failed = TRUE;
+	}
+
+	if (stats.requests != 0) {
+		g_printerr ("%u announces still counted as running\n", stats.requests);
+		test.failed = TRUE;
+	}
+
+	bt_udp_tracker_free (tracker);
+
+	stub_free (stub);
+	stub_free (error_stub);
+	stub_free (silent_stub);
+
+	g_free (url);
+	g_free (name_url);
+	g_free (error_url);
+	g_free (silent_url);
+	g_free (torrents);
+	g_timer_destroy (timer);
+	g_main_loop_unref (test.loop);
+
+	return !test.failed && test.answered == test.num_torrents + 1 - cancelled && test.errors == 2 ? 0 : 1;
+}